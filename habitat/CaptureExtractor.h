@@ -0,0 +1,126 @@
+/* Copyright 2012 (C) Daniel Richman. License: GNU GPL 3; see LICENSE. */
+
+#ifndef HABITAT_CAPTURE_EXTRACTOR_H
+#define HABITAT_CAPTURE_EXTRACTOR_H
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <memory>
+#include <utility>
+#include "jsoncpp.h"
+#include "habitat/EZ.h"
+#include "habitat/UploaderThread.h"
+#include "habitat/Extractor.h"
+#include "habitat/UKHASExtractor.h"
+
+using namespace std;
+
+namespace habitat {
+
+class CaptureExtractor;
+
+/* Everything one chunk of a capture produced, held back so that it can be
+ * given to the CaptureExtractor's callbacks in file order. */
+class CaptureChunk : public ExtractorManager, public EZ::Task
+{
+    struct Event
+    {
+        enum { UPLOAD, STATUS, DATA, RECORD } type;
+        /* The sentence or status message */
+        string text;
+        Json::Value doc;
+        /* A copy of a record's fields, pointing into text */
+        vector<TelemetryField> fields;
+        TelemetryRecord record;
+    };
+
+    CaptureExtractor &parent;
+    UKHASExtractor extractor;
+
+    const char *bytes;
+    size_t length;
+    enum push_flags flags;
+
+    /* A deque, so that the records' pointers into text stay valid */
+    deque<Event> events;
+    bool done;
+    string error;
+
+    Event &add_event();
+    void run();
+
+    friend class CaptureExtractor;
+
+public:
+    CaptureChunk(CaptureExtractor &p);
+    ~CaptureChunk() {};
+
+    void upload(const string &sentence);
+    void status(const string &msg);
+    void data(const Json::Value &d);
+    void record(const TelemetryRecord &r);
+};
+
+/*
+ * Runs a UKHASExtractor over a whole capture (e.g., a raw fldigi log) at
+ * once, using an EZ::ThreadPool. The capture is split into chunks of
+ * roughly chunk_size bytes, each of which ends just after a line ending:
+ * since a line ending always resets the UKHASExtractor, every chunk can be
+ * extracted independently, and a sentence that crosses a nominal boundary
+ * is wholly in one chunk and recovered exactly once.
+ *
+ * The results are exactly those of pushing the capture byte by byte, and
+ * upload(), status(), data() and record() are called in file order from
+ * the thread that called extract(). Only a few chunks are held at once.
+ */
+class CaptureExtractor
+{
+    EZ::ThreadPool pool;
+    const size_t chunk_size;
+
+    EZ::ConditionVariable condvar;
+    shared_ptr<const Json::Value> current_payload;
+    shared_ptr<const PayloadRegistry> current_payloads;
+    int outputs;
+
+    void emit(CaptureChunk &chunk);
+
+    friend class CaptureChunk;
+
+    CaptureExtractor(const CaptureExtractor &other);
+    CaptureExtractor &operator=(const CaptureExtractor &other);
+
+public:
+    UploaderThread &uthr;
+
+    CaptureExtractor(UploaderThread &u, int threads,
+                     size_t chunk_size=4 * 1024 * 1024);
+    virtual ~CaptureExtractor();
+
+    /* As in ExtractorManager; these must not change during extract() */
+    void payload(shared_ptr<const Json::Value> set)
+        { current_payload = std::move(set); };
+    void payload(const Json::Value *set) { current_payload = not_owned(set); };
+    void payloads(shared_ptr<const PayloadRegistry> set)
+        { current_payloads = std::move(set); };
+    void payloads(const PayloadRegistry *set)
+        { current_payloads = not_owned(set); };
+    void output(int flags) { outputs = flags; };
+
+    void extract(const char *data, size_t length,
+                 enum push_flags flags=PUSH_NONE);
+    /* Memory maps the file, and extracts that */
+    void extract(const string &filename, enum push_flags flags=PUSH_NONE);
+
+    /* Each sentence is handed over to be kept, or moved on to uthr */
+    virtual void upload(string sentence)
+        { uthr.payload_telemetry(std::move(sentence)); };
+    virtual void status(const string &msg) = 0;
+    virtual void data(const Json::Value &d) = 0;
+    virtual void record(const TelemetryRecord &r) {};
+};
+
+} /* namespace habitat */
+
+#endif /* HABITAT_CAPTURE_EXTRACTOR_H */
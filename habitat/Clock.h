@@ -0,0 +1,66 @@
+/* Copyright 2012 (C) Daniel Richman. License: GNU GPL 3; see LICENSE. */
+
+#ifndef HABITAT_CLOCK_H
+#define HABITAT_CLOCK_H
+
+#include <pthread.h>
+
+namespace Clock {
+
+/*
+ * Where the Uploader and RFC3339::now_* get the time from, in seconds
+ * since the epoch. Call set_source before starting any threads that might
+ * use it; sources must be thread safe.
+ */
+class Source
+{
+public:
+    virtual ~Source() {};
+    virtual long long int now() = 0;
+};
+
+/* time(NULL) */
+class System : public Source
+{
+public:
+    long long int now();
+};
+
+/* CLOCK_REALTIME_COARSE where it exists (no syscall, and a few ms of
+ * resolution is plenty when we only want seconds), otherwise time(NULL) */
+class Coarse : public Source
+{
+public:
+    long long int now();
+};
+
+/* A clock that only moves when told to: advances by step after each call
+ * to now(), and by set() and advance(). For tests and benchmarks. */
+class Simulated : public Source
+{
+    pthread_mutex_t mutex;
+    long long int current;
+    long long int step;
+
+    Simulated(const Simulated &other);
+    Simulated &operator=(const Simulated &other);
+
+public:
+    Simulated(long long int start, long long int step=0);
+    ~Simulated();
+
+    long long int now();
+    void set(long long int value);
+    void advance(long long int amount);
+};
+
+/* The source in use: Coarse, unless set_source has been called. NULL
+ * restores the default. The source is not owned. */
+Source &source();
+void set_source(Source *source);
+
+inline long long int now() { return source().now(); }
+
+} /* namespace Clock */
+
+#endif /* HABITAT_CLOCK_H */
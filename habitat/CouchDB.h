@@ -6,6 +6,10 @@
 #include <string>
 #include <iostream>
 #include <deque>
+#include <list>
+#include <map>
+#include <vector>
+#include <memory>
 #include <stdexcept>
 #include <curl/curl.h>
 #include "jsoncpp.h"
@@ -17,6 +21,7 @@ using namespace std;
 namespace CouchDB {
 
 class Server;
+class ViewRange;
 
 class Database
 {
@@ -24,8 +29,11 @@ class Database
     Server &server;
     string url;
     friend class Server;
+    friend class ViewRange;
 
     string make_doc_url(const string &doc_id) const;
+    string make_view_url(const string &design_doc,
+                         const string &view_name) const;
 
 public:
     Database(Server &server, const string &db);
@@ -33,9 +41,36 @@ public:
 
     void save_doc(Json::Value &doc);
     Json::Value *get_doc(const string &doc_id);
+    /* The docs with these ids, in one POST to _all_docs, as an array in
+     * the same order; null where a doc doesn't exist or was deleted */
+    Json::Value *get_docs(const vector<string> &doc_ids);
     Json::Value *operator[](const string &doc_id);
+    /* cache=false for views that are large, or change every time they're
+     * asked for, which the ResponseCache would only copy around */
     Json::Value *view(const string &design_doc, const string &view_name,
-                      const map<string,string> &options=view_default_options);
+                      const map<string,string> &options=view_default_options,
+                      bool cache=true);
+    /* The view's rows from startkeys[0] on, in view order, as {"rows":
+     * [...]}. Each key range [startkeys[i], startkeys[i + 1]) is fetched
+     * on its own thread and connection, in pages of at most page_size
+     * rows, and each page is parsed as it arrives: into an arena of the
+     * thread's own if the caller has a current Json::Arena, which then
+     * adopts it. options must not set startkey, endkey, limit or skip. */
+    Json::Value *view_paged(const string &design_doc,
+                            const string &view_name,
+                            const vector<Json::Value> &startkeys,
+                            size_t page_size,
+                            const map<string,string> &options=
+                                view_default_options);
+    /* The database's info (db_name, update_seq, ...) */
+    Json::Value *info();
+    /* One (normal, not continuous) response from the _changes feed;
+     * never cached */
+    Json::Value *changes(const map<string,string> &options);
+    /* The same, for these docs only (filter=_doc_ids, POSTed, so that the
+     * list may be long) */
+    Json::Value *changes(const map<string,string> &options,
+                         const vector<string> &doc_ids);
     string update_put(const string &design_doc, const string &update_name,
                       const string &doc_id, const Json::Value &payload);
     string update_put(const string &design_doc, const string &update_name,
@@ -43,22 +78,141 @@ public:
     static string json_query_value(Json::Value &value);
 };
 
+/*
+ * Parsed responses to GETs that came with an ETag, by URL. They are always
+ * revalidated (with If-None-Match), but on a 304 the cached value is
+ * copied rather than the response downloaded and parsed again.
+ *
+ * Bounded by the total length of the responses, which the parsed values
+ * are roughly proportional to; the least recently used go first. Thread
+ * safe.
+ */
+class ResponseCache
+{
+    struct Entry
+    {
+        string url;
+        string etag;
+        Json::Value value;
+        size_t size;
+    };
+
+    EZ::FastMutex mutex;
+    /* Most recently used first */
+    list<Entry> entries;
+    map<string,list<Entry>::iterator> index;
+    const size_t max_size;
+    size_t size;
+    unsigned long hit_count, miss_count;
+
+    ResponseCache(const ResponseCache &other);
+    ResponseCache &operator=(const ResponseCache &other);
+
+public:
+    ResponseCache(size_t max_size)
+        : mutex("CouchDB::ResponseCache"), max_size(max_size), size(0),
+          hit_count(0), miss_count(0) {};
+    ~ResponseCache() {};
+
+    /* Empty if url isn't cached */
+    string etag(const string &url);
+    /* A copy of the value cached for url, or NULL if it has been evicted
+     * or replaced since etag() */
+    Json::Value *hit(const string &url, const string &etag);
+    /* Caches value, if it came with an etag and isn't too big */
+    void miss(const string &url, const string &etag,
+              const Json::Value &value, size_t size);
+
+    unsigned long hits();
+    unsigned long misses();
+};
+
+/*
+ * Stops requests being sent to a server that seems to be down. After
+ * threshold failures in a row (errors from curl, and 5xx responses) the
+ * circuit opens, and requests fail straight away with CircuitOpen. Once
+ * cooldown seconds have passed one request is let through as a probe: if
+ * it succeeds the circuit closes again, otherwise it stays open for
+ * another cooldown. Other responses (404, 409, ...) show that the server
+ * is up, so count as successes. A threshold of 0 disables it. Thread
+ * safe.
+ */
+class CircuitBreaker
+{
+    EZ::FastMutex mutex;
+    unsigned int threshold;
+    long long int cooldown;
+    unsigned int failures;
+    bool open, probing;
+    long long int retry_at;
+
+public:
+    CircuitBreaker(unsigned int threshold, long long int cooldown)
+        : mutex("CouchDB::CircuitBreaker"),
+          threshold(threshold), cooldown(cooldown), failures(0),
+          open(false), probing(false), retry_at(0) {};
+    ~CircuitBreaker() {};
+
+    void configure(unsigned int threshold, long long int cooldown);
+    bool is_open();
+
+    /* Around every request: before() throws CircuitOpen if it must not
+     * be sent, and exactly one of succeeded() or failed() follows it */
+    void before(const string &url);
+    void succeeded();
+    void failed();
+};
+
 class Server
 {
     const string url;
     deque<string> uuid_cache;
-    EZ::Mutex uuid_cache_mutex;
+    EZ::FastMutex uuid_cache_mutex;
     EZ::cURL curl;
+    ResponseCache response_cache;
+    CircuitBreaker breaker;
+    /* More handles, for Database::view_paged()'s concurrent requests; kept
+     * between calls, so that their connections are too */
+    EZ::FastMutex spare_curls_mutex;
+    vector< unique_ptr<EZ::cURL> > spare_curls;
 
     string next_uuid();
+    void fill_uuid_cache();
+    unique_ptr<EZ::cURL> borrow_curl();
+    void return_curl(unique_ptr<EZ::cURL> handle);
     friend class Database;
+    friend class ViewRange;
+
+    /* Every request goes through these, and so through the breaker */
+    string get(EZ::cURL &with, const string &get_url);
+    bool get(EZ::cURL &with, const string &get_url, string &etag,
+             string &response);
+    string put(const string &put_url, const string &data);
+    string post(const string &post_url, const string &data,
+                const string &content_type);
 
-    Json::Value *get_json(const string &get_url);
+    Json::Value *get_json(const string &get_url, bool cache=true)
+        { return get_json(curl, get_url, cache); };
+    Json::Value *get_json(EZ::cURL &with, const string &get_url,
+                          bool cache=true);
 
 public:
-    Server(const string &url);
+    Server(const string &url, size_t cache_size=8 * 1024 * 1024);
     ~Server() {};
+
+    /* Connects (DNS, TCP, TLS) and fills the UUID cache, so that the first
+     * save_doc waits for neither */
+    void warm_up();
+
+    /* GETs answered from the cache after a 304, and those that weren't */
+    unsigned long cache_hits() { return response_cache.hits(); };
+    unsigned long cache_misses() { return response_cache.misses(); };
     Database operator[](const string &n) { return Database(*this, n); }
+
+    /* See CircuitBreaker; the default is 5 failures and 30 seconds */
+    void circuit_breaker(unsigned int threshold, long long int cooldown)
+        { breaker.configure(threshold, cooldown); };
+    bool circuit_open() { return breaker.is_open(); };
 };
 
 class Conflict : public runtime_error
@@ -73,6 +227,18 @@ public:
     ~Conflict() throw() {};
 };
 
+class CircuitOpen : public runtime_error
+{
+    CircuitOpen(const string &url)
+        : runtime_error("CouchDB::CircuitOpen: " + url), url(url) {};
+
+    friend class CircuitBreaker;
+
+public:
+    const string url;
+    ~CircuitOpen() throw() {};
+};
+
 } /* namespace CouchDB */
 
 #endif /* HABITAT_COUCHDB_H */
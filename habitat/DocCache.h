@@ -0,0 +1,46 @@
+/* Copyright 2012 (C) Daniel Richman. License: GNU GPL 3; see LICENSE. */
+
+#ifndef HABITAT_DOC_CACHE_H
+#define HABITAT_DOC_CACHE_H
+
+#include <string>
+#include <vector>
+#include "jsoncpp.h"
+
+using namespace std;
+
+namespace habitat {
+
+/*
+ * The last known flight and payload_configuration docs (as returned by
+ * Uploader::flights() and payloads()), kept in a file so that they can be
+ * had straight after a restart, before the database has been reached.
+ *
+ * The file is one compact JSON object, {"flights": [...], "payloads":
+ * [...]}. load() maps it and parses it in place; save() writes a temporary
+ * file and renames it over the old one, so that a crash never leaves half
+ * a cache behind.
+ *
+ * UploaderThread::cache() uses one of these; to fill a PayloadRegistry for
+ * an ExtractorManager before any thread is running, load() one directly.
+ */
+class DocCache
+{
+    const string filename;
+
+public:
+    vector<Json::Value> flights;
+    vector<Json::Value> payloads;
+
+    DocCache(const string &filename) : filename(filename) {};
+    ~DocCache() {};
+
+    /* Returns false, leaving flights and payloads alone, if there is no
+     * file yet. Throws runtime_error if it can't be read or is corrupt. */
+    bool load();
+    void save() const;
+};
+
+} /* namespace habitat */
+
+#endif /* HABITAT_DOC_CACHE_H */
@@ -8,6 +8,10 @@
 #include <stdexcept>
 #include <map>
 #include <deque>
+#include <vector>
+#include <utility>
+#include <atomic>
+#include <ctime>
 #include <curl/curl.h>
 #include <pthread.h>
 
@@ -15,33 +19,74 @@ using namespace std;
 
 namespace EZ {
 
+class LockCounters;
+
+/*
+ * A recursive pthread mutex. Given a name, and with lock_profiling() on,
+ * every MutexLock on it counts how long it waited for the mutex and how
+ * long it then held it, under that name (shared by all the mutexes that
+ * have it; see lock_stats()).
+ */
 class Mutex
 {
 protected:
     pthread_mutex_t mutex;
+    LockCounters *counters;
+    /* Only used by the thread holding the mutex, while profiling */
+    unsigned int depth;
+    struct timespec acquired;
+
+    Mutex(const char *name, bool recursive);
 
     friend class MutexLock;
 
 public:
-    Mutex();
+    Mutex(const char *name=NULL);
     ~Mutex();
 };
 
+/* Not recursive, which makes it cheaper: for mutexes that are never
+ * locked again by the thread holding them */
+class FastMutex : public Mutex
+{
+public:
+    FastMutex(const char *name=NULL) : Mutex(name, false) {};
+};
+
 class MutexLock
 {
     Mutex &m;
+    bool profiled;
 
 public:
     MutexLock(Mutex &_m);
     ~MutexLock();
 };
 
+/* What the named mutexes have done since profiling was turned on (or the
+ * stats reset). Waits are only timed when the mutex was already held;
+ * hold times are from the outermost lock to its unlock, not counting
+ * time spent in ConditionVariable::wait. */
+struct LockStats
+{
+    string name;
+    unsigned long acquisitions, contentions;
+    double wait_seconds, max_wait_seconds;
+    double hold_seconds, max_hold_seconds;
+};
+
+/* Off by default; it costs two clock reads per lock when on */
+void lock_profiling(bool enable);
+/* By name */
+vector<LockStats> lock_stats();
+void reset_lock_stats();
+
 class ConditionVariable : public Mutex
 {
     pthread_cond_t condvar;
 
 public:
-    ConditionVariable();
+    ConditionVariable(const char *name=NULL);
     ~ConditionVariable();
 
     /* You *need* to have the mutex to do this!
@@ -59,18 +104,31 @@ class Queue
     deque<item> item_deque;
 
 public:
-    void put(item &x);
+    Queue() : condvar("EZ::Queue") {};
+
+    void put(const item &x);
+    /* Moves x into the queue, and get() moves it out again, so items may
+     * be move-only (e.g., unique_ptr) */
+    void put(item &&x);
     item get();
 };
 
 template <typename item> 
-void Queue<item>::put(item &x)
+void Queue<item>::put(const item &x)
 {
     MutexLock lock(condvar);
     item_deque.push_back(x);
     condvar.signal();
 }
 
+template <typename item> 
+void Queue<item>::put(item &&x)
+{
+    MutexLock lock(condvar);
+    item_deque.push_back(std::move(x));
+    condvar.signal();
+}
+
 template <typename item>
 item Queue<item>::get()
 {
@@ -79,11 +137,59 @@ item Queue<item>::get()
     while (!item_deque.size())
         condvar.wait();
 
-    item x = item_deque.front();
+    item x = std::move(item_deque.front());
     item_deque.pop_front();
     return x;
 }
 
+/* A bounded queue for exactly one producer thread and one consumer
+ * thread. Neither ever waits: put() returns false if it is full, and
+ * get() false if it is empty. put() only moves from x if it succeeds. */
+template <typename item>
+class RingBuffer
+{
+    vector<item> slots;
+    /* The next slot to get() from, and to put() into */
+    atomic<size_t> head, tail;
+
+    RingBuffer(const RingBuffer &other);
+    RingBuffer &operator=(const RingBuffer &other);
+
+public:
+    RingBuffer(size_t capacity) : slots(capacity + 1), head(0), tail(0) {};
+    ~RingBuffer() {};
+
+    bool put(item &&x);
+    bool get(item &x);
+};
+
+template <typename item>
+bool RingBuffer<item>::put(item &&x)
+{
+    const size_t t = tail.load(memory_order_relaxed);
+    const size_t next = (t + 1) % slots.size();
+
+    if (next == head.load())
+        return false;
+
+    slots[t] = std::move(x);
+    tail.store(next);
+    return true;
+}
+
+template <typename item>
+bool RingBuffer<item>::get(item &x)
+{
+    const size_t h = head.load(memory_order_relaxed);
+
+    if (h == tail.load())
+        return false;
+
+    x = std::move(slots[h]);
+    head.store((h + 1) % slots.size());
+    return true;
+}
+
 class SimpleThread
 {
 protected:
@@ -104,14 +210,94 @@ public:
     void *join();
 };
 
+class Task
+{
+public:
+    virtual ~Task() {};
+    virtual void run() = 0;
+};
+
+/*
+ * A fixed number of threads, each with its own deque of tasks. Workers
+ * run their own tasks oldest first, and steal the oldest task from another
+ * worker when they run out, so a task that resubmits itself waits behind
+ * those already queued. Tasks are not owned by the pool, and a task may be
+ * resubmitted (even from its own run()) once run() has been called.
+ */
+class ThreadPool
+{
+    class Worker : public SimpleThread
+    {
+        ThreadPool &pool;
+        const size_t index;
+
+    public:
+        Worker(ThreadPool &p, size_t i) : pool(p), index(i) {};
+        void *run();
+    };
+
+    struct WorkerQueue
+    {
+        Mutex mutex;
+        deque<Task *> tasks;
+    };
+
+    /* Protects queued, outstanding and stopping */
+    ConditionVariable condvar;
+    size_t queued, outstanding, next_queue;
+    bool stopping;
+    vector<WorkerQueue *> queues;
+    vector<Worker *> workers;
+
+    Task *take(size_t index);
+    void work(size_t index);
+
+    ThreadPool(const ThreadPool &other);
+    ThreadPool &operator=(const ThreadPool &other);
+
+public:
+    ThreadPool(size_t threads);
+    ~ThreadPool();
+
+    size_t size() const { return workers.size(); };
+    void submit(Task *task);
+    /* Waits until every submitted task has finished running */
+    void wait();
+};
+
+/*
+ * A whole file, memory mapped read only, and unmapped (and closed) on
+ * destruction. The mapping is advised to be read front to back. Throws
+ * runtime_error if the file can't be opened or mapped; an empty file has
+ * data() NULL.
+ */
+class MappedFile
+{
+    int fd;
+    void *mapping;
+    size_t mapped_length;
+
+    MappedFile(const MappedFile &other);
+    MappedFile &operator=(const MappedFile &other);
+
+public:
+    MappedFile(const string &filename);
+    ~MappedFile();
+
+    const char *data() const
+        { return length() ? static_cast<const char *>(mapping) : NULL; };
+    size_t length() const { return mapped_length; };
+};
+
 class cURL
 {
     Mutex mutex;
     CURL *curl;
 
-    /* You need to hold the mutex to use these four functions */
+    /* You need to hold the mutex to use these functions */
     void reset();
     string perform(const string &url);
+    long perform(const string &url, string &response);
     template<typename T> void setopt(CURLoption option, T paramater);
     void setopt(CURLoption option, void *paramater);
     void setopt(CURLoption option, long parameter);
@@ -123,7 +309,13 @@ public:
     static string query_string(const map<string,string> &options,
                                bool add_questionmark=false);
     string get(const string &url);
-    string post(const string &url, const string &data);
+    /* If etag isn't empty it is sent as If-None-Match, and a 304 Not
+     * Modified returns false. Otherwise response is set, etag is set to the
+     * response's ETag (or cleared), and true is returned. */
+    bool get(const string &url, string &etag, string &response);
+    /* content_type, if given, is sent as the Content-Type header */
+    string post(const string &url, const string &data,
+                const string &content_type="");
     string put(const string &url, const string &data);
 };
 
@@ -4,9 +4,13 @@
 #define HABITAT_EXTRACTOR_H
 
 #include <vector>
+#include <string>
+#include <memory>
 #include "jsoncpp.h"
 #include "habitat/UploaderThread.h"
 #include "habitat/EZ.h"
+#include "habitat/PayloadRegistry.h"
+#include "habitat/TelemetryRecord.h"
 
 using namespace std;
 
@@ -18,28 +22,83 @@ enum push_flags
     PUSH_BAUDOT_HACK = 0x01
 };
 
+enum output_flags
+{
+    OUTPUT_JSON = 0x01,
+    OUTPUT_RECORDS = 0x02
+};
+
+enum extractor_status
+{
+    UKHAS_START_DELIMITER,
+    UKHAS_EXTRACTED,
+    UKHAS_GIVING_UP,
+    UKHAS_GIVING_UP_SILENCE,
+    UKHAS_CRUDE_PARSE_FAILED,   /* detail: the reason */
+    UKHAS_FULL_PARSE_FAILED,
+    UKHAS_FULL_PARSE_ERROR      /* detail: why one configuration failed */
+};
+
 class Extractor;
 
+/* Points at something it doesn't own, and so won't free: configuration
+ * that the caller keeps alive itself */
+template <typename T>
+shared_ptr<const T> not_owned(const T *p)
+{
+    return shared_ptr<const T>(shared_ptr<const T>(), p);
+}
+
 class ExtractorManager
 {
     EZ::Mutex mutex;
     vector<Extractor *> extractors;
-    const Json::Value *current_payload;
+    /* Never modified, only replaced whole: they are read and swapped with
+     * atomic_load and atomic_store rather than under mutex, so changing
+     * them doesn't wait for push() to finish, or hold it up. */
+    shared_ptr<const Json::Value> current_payload;
+    shared_ptr<const PayloadRegistry> current_payloads;
+    int outputs;
 
 public:
     UploaderThread &uthr;
 
-    ExtractorManager(UploaderThread &u) : current_payload(NULL), uthr(u) {};
+    ExtractorManager(UploaderThread &u)
+        : mutex("habitat::ExtractorManager"), outputs(OUTPUT_JSON),
+          uthr(u) {};
     virtual ~ExtractorManager() {};
 
     void add(Extractor &e);
     void skipped(int n);
     void push(char b, enum push_flags flags=PUSH_NONE);
-    void payload(const Json::Value *set);
-    const Json::Value *payload();
+    /* A configuration given as a shared_ptr is freed once it has been
+     * replaced and no extractor is still using it. One given as a plain
+     * pointer must be kept alive by the caller until then: until it has
+     * been replaced and any push() underway has returned. */
+    void payload(shared_ptr<const Json::Value> set);
+    void payload(const Json::Value *set) { payload(not_owned(set)); };
+    shared_ptr<const Json::Value> payload();
+    /* Sentences whose callsign is in the registry are parsed using it;
+     * other sentences fall back to the current payload. */
+    void payloads(shared_ptr<const PayloadRegistry> set);
+    void payloads(const PayloadRegistry *set) { payloads(not_owned(set)); };
+    shared_ptr<const PayloadRegistry> payloads();
+    /* Which of data() and record() parsed sentences are given to, as
+     * output_flags; the JSON doc is only built if OUTPUT_JSON is set. */
+    void output(int flags);
+    int output();
 
+    /* Extractors report their progress with status_code. By default it
+     * builds a message and calls status(); override it to avoid that. */
+    virtual void status_code(enum extractor_status code,
+                             const char *detail=NULL);
+    /* Extractors hand sentences to the uploader via upload(); override it
+     * to hold them back or reorder them. */
+    virtual void upload(const string &sentence)
+        { uthr.payload_telemetry(sentence); };
     virtual void status(const string &msg) = 0;
     virtual void data(const Json::Value &d) = 0;
+    virtual void record(const TelemetryRecord &r) {};
 };
 
 class Extractor
@@ -0,0 +1,113 @@
+/* Copyright 2012 (C) Daniel Richman. License: GNU GPL 3; see LICENSE. */
+
+#ifndef HABITAT_MULTI_CHANNEL_EXTRACTOR_H
+#define HABITAT_MULTI_CHANNEL_EXTRACTOR_H
+
+#include <vector>
+#include <string>
+#include "jsoncpp.h"
+#include "habitat/EZ.h"
+#include "habitat/UploaderThread.h"
+#include "habitat/Extractor.h"
+#include "habitat/UKHASExtractor.h"
+
+using namespace std;
+
+namespace habitat {
+
+class MultiChannelExtractorManager;
+
+/* One demodulator channel: an ExtractorManager with its own UKHASExtractor
+ * and a queue of bytes waiting to be processed by the pool. */
+class ExtractorChannel : public ExtractorManager, public EZ::Task
+{
+    struct Event
+    {
+        enum { PUSH, SKIPPED } type;
+        char b;
+        enum push_flags flags;
+        int skipped;
+    };
+
+    MultiChannelExtractorManager &parent;
+    const int index;
+    UKHASExtractor extractor;
+
+    EZ::Mutex pending_mutex;
+    vector<Event> pending, working;
+    bool scheduled;
+
+    void enqueue(const Event &e);
+    void apply(const Event &e);
+    void run();
+
+    friend class MultiChannelExtractorManager;
+
+public:
+    ExtractorChannel(MultiChannelExtractorManager &p, int i);
+    ~ExtractorChannel() {};
+
+    void status(const string &msg);
+    void data(const Json::Value &d);
+    void record(const TelemetryRecord &r);
+};
+
+/*
+ * Runs a UKHASExtractor for each of many channels (e.g., the outputs of an
+ * SDR channelizer) on a work stealing EZ::ThreadPool. Bytes pushed to one
+ * channel are processed in order, and the callbacks for one channel are
+ * never called concurrently, but different channels run in parallel. All
+ * channels upload via the same UploaderThread.
+ *
+ * An exception thrown while processing a channel's bytes (by a callback,
+ * say, or the UploaderThread) can't reach the caller of push(), which has
+ * long since returned; it is reported with status() instead, and the
+ * channel carries on with the next byte.
+ *
+ * Subclasses should call flush() in their destructor, since the callbacks
+ * cannot be called once it has finished.
+ */
+class MultiChannelExtractorManager
+{
+    EZ::ThreadPool pool;
+    vector<ExtractorChannel *> channel_list;
+
+    ExtractorChannel &channel(int index);
+
+    friend class ExtractorChannel;
+
+    MultiChannelExtractorManager(const MultiChannelExtractorManager &o);
+    MultiChannelExtractorManager &operator=(
+            const MultiChannelExtractorManager &o);
+
+public:
+    UploaderThread &uthr;
+
+    MultiChannelExtractorManager(UploaderThread &u, int channels,
+                                 int threads);
+    virtual ~MultiChannelExtractorManager();
+
+    int channels() const { return channel_list.size(); };
+    void skipped(int channel, int n);
+    void push(int channel, char b, enum push_flags flags=PUSH_NONE);
+    void push(int channel, const char *data, size_t length,
+              enum push_flags flags=PUSH_NONE);
+    /* Waits until everything pushed so far has been processed */
+    void flush();
+
+    /* These apply to every channel; see ExtractorManager */
+    void payload(shared_ptr<const Json::Value> set);
+    void payload(const Json::Value *set) { payload(not_owned(set)); };
+    void payloads(shared_ptr<const PayloadRegistry> set);
+    void payloads(const PayloadRegistry *set) { payloads(not_owned(set)); };
+    void output(int flags);
+
+    /* Called from the pool's threads; see above. */
+    virtual void status(int channel, const string &msg) = 0;
+    virtual void data(int channel, const Json::Value &d) = 0;
+    virtual void record(int channel, const TelemetryRecord &r) {};
+};
+
+} /* namespace habitat */
+
+#endif /* HABITAT_MULTI_CHANNEL_EXTRACTOR_H */
@@ -0,0 +1,52 @@
+/* Copyright 2012 (C) Daniel Richman. License: GNU GPL 3; see LICENSE. */
+
+#ifndef HABITAT_PAYLOAD_REGISTRY_H
+#define HABITAT_PAYLOAD_REGISTRY_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include "jsoncpp.h"
+
+using namespace std;
+
+namespace habitat {
+
+/*
+ * Holds many payload_configuration docs (e.g., everything returned by
+ * Uploader::payloads()) and indexes their sentences by callsign, so that
+ * an extractor can pick candidate configurations from the first field of a
+ * sentence instead of relying on a single, manually selected payload.
+ *
+ * Candidates for a callsign are ordered most recently added doc first;
+ * sentences within a doc keep their order. Sentences that are not objects
+ * or have no string callsign are not indexed. A registry must not be
+ * modified while an ExtractorManager is using it.
+ */
+class PayloadRegistry
+{
+    deque<Json::Value> docs;
+    map<string, vector<const Json::Value *> > index;
+
+    /* index holds pointers into docs */
+    PayloadRegistry(const PayloadRegistry &other);
+    PayloadRegistry &operator=(const PayloadRegistry &other);
+
+public:
+    PayloadRegistry() {};
+    PayloadRegistry(const vector<Json::Value> &payload_configurations);
+    ~PayloadRegistry() {};
+
+    void add(const Json::Value &payload_configuration);
+    void add(const vector<Json::Value> &payload_configurations);
+    void clear();
+    size_t size() const { return docs.size(); };
+
+    /* Returns NULL if no sentence has this callsign */
+    const vector<const Json::Value *> *find(const string &callsign) const;
+};
+
+} /* namespace habitat */
+
+#endif /* HABITAT_PAYLOAD_REGISTRY_H */
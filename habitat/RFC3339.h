@@ -1,6 +1,7 @@
 /* Copyright 2012 (C) Daniel Richman. License: GNU GPL 3; see LICENSE. */
 
 #ifndef HABITAT_RFC3339_H
+#define HABITAT_RFC3339_H
 
 #include <string>
 #include <ctime>
@@ -23,7 +24,7 @@ public:
  * like they can in python)
  *
  * You should call tzset() before using either _localoffset function, since it
- * calls localtime_r().
+ * calls localtime_r(). The now_ functions get the time from Clock::now().
  */
 
 bool validate_rfc3339(const string &rfc3339);
@@ -33,6 +34,41 @@ string timestamp_to_rfc3339_localoffset(long long int timestamp);
 string now_to_rfc3339_utcoffset();
 string now_to_rfc3339_localoffset();
 
+/*
+ * Produces exactly what timestamp_to_rfc3339_localoffset would, for
+ * callers that format many timestamps close together (e.g., the current
+ * time). The UTC offset is cached for the minute it was found for, since
+ * offsets only change on whole minutes, and the whole string is cached for
+ * the second; in between, the local time is worked out arithmetically,
+ * without localtime_r.
+ *
+ * Not thread safe: give each thread (or each mutex) its own.
+ */
+class LocalOffsetFormatter
+{
+public:
+    enum { BUFFER_SIZE = 32 };
+
+private:
+    bool have_last;
+    long long int last_timestamp;
+    char last[BUFFER_SIZE];
+    size_t last_length;
+
+    bool have_offset;
+    long long int offset_minute;
+    int offset;
+
+public:
+    LocalOffsetFormatter() : have_last(false), have_offset(false) {};
+    ~LocalOffsetFormatter() {};
+
+    /* buffer must have space for BUFFER_SIZE chars; the result is null
+     * terminated and its length returned */
+    size_t format(long long int timestamp, char *buffer);
+    size_t format_now(char *buffer);
+};
+
 } /* namespace RFC3339 */
 
 #endif /* HABITAT_RFC3339_H */
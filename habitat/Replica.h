@@ -0,0 +1,77 @@
+/* Copyright 2012 (C) Daniel Richman. License: GNU GPL 3; see LICENSE. */
+
+#ifndef HABITAT_REPLICA_H
+#define HABITAT_REPLICA_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include "jsoncpp.h"
+#include "habitat/EZ.h"
+#include "habitat/CouchDB.h"
+
+using namespace std;
+
+namespace habitat {
+
+/*
+ * A local copy of the database's flight and payload_configuration docs.
+ *
+ * bootstrap() downloads them once, via the same views that
+ * Uploader::flights() and payloads() use, having first noted the
+ * database's update_seq. update() then follows the _changes feed from
+ * there, filtered by the server so that telemetry never comes down it:
+ *
+ *  - filter=_view, for each of the two views: docs that are new to them,
+ *    or edited but still in them;
+ *  - filter=_doc_ids, for the docs we already have: those deleted, or
+ *    edited so that they left a view (which _view can't tell us).
+ *
+ * Each is fetched page_size changes at a time. flights() and payloads()
+ * are answered from memory, and don't wait for an update()'s requests.
+ *
+ * Thread safe.
+ */
+class Replica
+{
+    typedef vector< pair<string,Json::Value> > Changes;
+
+    /* Protects the docs; never held during a request */
+    EZ::Mutex mutex;
+    /* Protects the sinces, so that updates don't overlap */
+    EZ::FastMutex update_mutex;
+    CouchDB::Database &database;
+    const size_t page_size;
+    /* By _id */
+    map<string,Json::Value> flight_docs;
+    map<string,Json::Value> payload_docs;
+    /* The since= for each feed's next update() */
+    string flights_since, payloads_since, held_since;
+    bool bootstrapped;
+
+    void apply(const string &id, const Json::Value &doc);
+    string fetch_changes(map<string,string> options, const string &since,
+                         const vector<string> *doc_ids, Changes &out);
+
+    Replica(const Replica &other);
+    Replica &operator=(const Replica &other);
+
+public:
+    Replica(CouchDB::Database &database, size_t page_size=100)
+        : mutex("habitat::Replica"), update_mutex("habitat::Replica::update"),
+          database(database), page_size(page_size), bootstrapped(false) {};
+    ~Replica() {};
+
+    void bootstrap();
+    /* Returns the number of changes fetched, from all three feeds */
+    size_t update();
+
+    /* As Uploader::flights() and payloads() would return, at time now;
+     * the caller owns the result */
+    vector<Json::Value> *flights(long long int now);
+    vector<Json::Value> *payloads();
+};
+
+} /* namespace habitat */
+
+#endif /* HABITAT_REPLICA_H */
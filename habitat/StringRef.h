@@ -0,0 +1,33 @@
+/* Copyright 2012 (C) Daniel Richman. License: GNU GPL 3; see LICENSE. */
+
+#ifndef HABITAT_STRINGREF_H
+#define HABITAT_STRINGREF_H
+
+#include <string>
+#include <cstring>
+
+using namespace std;
+
+namespace habitat {
+
+/* A pointer and length into someone else's buffer, so that tokenising
+ * doesn't need to copy. */
+struct StringRef
+{
+    const char *data;
+    size_t length;
+
+    StringRef() : data(NULL), length(0) {};
+    StringRef(const char *d, size_t l) : data(d), length(l) {};
+
+    bool operator==(const char *s) const
+    {
+        return strlen(s) == length && (!length || !memcmp(data, s, length));
+    };
+    bool operator!=(const char *s) const { return !(*this == s); };
+    string str() const { return string(data, length); };
+};
+
+} /* namespace habitat */
+
+#endif /* HABITAT_STRINGREF_H */
@@ -0,0 +1,105 @@
+/* Copyright 2012 (C) Daniel Richman. License: GNU GPL 3; see LICENSE. */
+
+#ifndef HABITAT_TELEMETRY_RECORD_H
+#define HABITAT_TELEMETRY_RECORD_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include "jsoncpp.h"
+#include "habitat/StringRef.h"
+
+using namespace std;
+
+namespace habitat {
+
+enum telemetry_state
+{
+    TELEMETRY_UNPARSED,     /* not even the checksum could be checked */
+    TELEMETRY_BASIC,        /* callsign only; no configuration matched */
+    TELEMETRY_PARSED
+};
+
+enum telemetry_checksum
+{
+    CHECKSUM_NONE,
+    CHECKSUM_XOR,
+    CHECKSUM_CRC16_CCITT
+};
+
+enum telemetry_field_type
+{
+    FIELD_EMPTY,
+    FIELD_STRING,
+    FIELD_NUMERIC,
+    FIELD_COORDINATE        /* value is decimal degrees */
+};
+
+struct TelemetryField
+{
+    const char *name;
+    enum telemetry_field_type type;
+    double value;
+    /* The field as it appeared in the sentence; empty for the results of
+     * post filters */
+    StringRef text;
+};
+
+/*
+ * A compact, typed alternative to the Json::Value given to
+ * ExtractorManager::data. A field's id is its index in fields: the fields
+ * of the sentence configuration in order, followed by the results of any
+ * post filters. Everything points into the extractor's buffer and
+ * configuration, so a record is only valid during
+ * ExtractorManager::record; use json() or a TelemetryBatch to keep it.
+ */
+class TelemetryRecord
+{
+public:
+    enum telemetry_state state;
+    StringRef sentence;
+    StringRef callsign;
+    enum telemetry_checksum checksum;
+    size_t field_count;
+    const TelemetryField *fields;
+
+    TelemetryRecord()
+        : state(TELEMETRY_UNPARSED), checksum(CHECKSUM_NONE),
+          field_count(0), fields(NULL) {};
+
+    /* The same doc ExtractorManager::data would receive */
+    Json::Value json() const;
+};
+
+/*
+ * Collects records into columns. Every column has one entry per record
+ * added: NaN (or an empty string) where a record had no such field.
+ * Coordinates are stored as numbers.
+ */
+class TelemetryBatch
+{
+    size_t rows;
+    vector<string> callsign_column;
+    map<string, vector<double> > numeric_columns;
+    map<string, vector<string> > string_columns;
+
+    void pad();
+
+public:
+    TelemetryBatch() : rows(0) {};
+    ~TelemetryBatch() {};
+
+    void add(const TelemetryRecord &record);
+    void clear();
+    size_t size() const { return rows; };
+
+    const vector<string> &callsigns() const { return callsign_column; };
+    const map<string, vector<double> > &numeric() const
+        { return numeric_columns; };
+    const map<string, vector<string> > &strings() const
+        { return string_columns; };
+};
+
+} /* namespace habitat */
+
+#endif /* HABITAT_TELEMETRY_RECORD_H */
@@ -7,22 +7,81 @@
 
 namespace habitat {
 
+/*
+ * The result of the first stage of parsing a sentence, which does not
+ * allocate: StringRefs point into the parsed buffer, names and configs
+ * point into the payload configuration. record() presents it as a
+ * TelemetryRecord.
+ */
+class UKHASSentence
+{
+public:
+    enum { MAX_FIELDS = 128, MAX_DERIVED = 16, MAX_ERRORS = 16 };
+
+    StringRef raw;
+    /* If set, the sentence could not be checked and split at all */
+    const char *crude_error;
+    enum telemetry_checksum checksum;
+    StringRef callsign;
+
+    /* False if there were no configurations to try */
+    bool configured;
+    /* The sentence configuration that matched, or NULL */
+    const Json::Value *config;
+
+    /* Excluding the callsign; may exceed MAX_FIELDS */
+    size_t field_count;
+    /* Results of post filters, in the order they were applied, follow
+     * the fields */
+    size_t derived_count;
+    TelemetryField fields[MAX_FIELDS + MAX_DERIVED];
+
+    /* Why each configuration failed; may exceed MAX_ERRORS */
+    size_t error_count;
+    const char *errors[MAX_ERRORS];
+
+    char crude_error_buffer[64];
+
+    void clear();
+    void error(const char *e);
+    TelemetryRecord record() const;
+};
+
 class UKHASExtractor : public Extractor
 {
+public:
+    enum { BUFFER_SIZE = 1024, MAX_LENGTH = 1000 };
+
+private:
     int extracting;
     char last;
-    string buffer;
+    char buffer[BUFFER_SIZE];
+    size_t buffer_length;
+    /* Reused to hand sentences to the uploader */
+    string sentence;
+    string callsign_key;
     int skipped_count;
     int garbage_count;
+    UKHASSentence parsed;
+    /* The configuration parsed was parsed with; held until the next
+     * sentence, since parsed points into it */
+    shared_ptr<const Json::Value> settings;
+    shared_ptr<const PayloadRegistry> registry;
 
     void reset_buffer();
-    Json::Value crude_parse();
+    void report(const TelemetryRecord &record);
 
 public:
-    UKHASExtractor() : extracting(false), last('\0'), garbage_count(0) {};
+    UKHASExtractor()
+        : extracting(false), last('\0'), buffer_length(0), garbage_count(0)
+        {};
     ~UKHASExtractor() {};
     void skipped(int n);
     void push(char b, enum push_flags flags);
+
+    /* The allocation free first stage of parsing, using the manager's
+     * payload configuration. Valid until the next call or sentence. */
+    const UKHASSentence &parse(const char *line, size_t length);
 };
 
 } /* namespace habitat */
@@ -4,12 +4,15 @@
 #define HABITAT_UPLOADER_H
 
 #include <iostream>
+#include <memory>
 #include <string>
 #include <vector>
 #include <stdexcept>
 #include "jsoncpp.h"
 #include "habitat/EZ.h"
 #include "habitat/CouchDB.h"
+#include "habitat/RFC3339.h"
+#include "habitat/Replica.h"
 
 using namespace std;
 
@@ -25,13 +28,37 @@ public:
 class Uploader
 {
     EZ::Mutex mutex;
-    const string callsign;
-    CouchDB::Server server;
-    CouchDB::Database database;
-    const int max_merge_attempts;
+    string callsign;
+    /* As given, to tell what reconfigure() must replace */
+    string couch_uri, couch_db;
+    unique_ptr<CouchDB::Server> server;
+    unique_ptr<CouchDB::Database> database;
+    int max_merge_attempts;
     string latest_listener_information;
     string latest_listener_telemetry;
+    RFC3339::LocalOffsetFormatter time_formatter;
+    /* Docs built while holding the mutex live here, and are freed in one go
+     * when the action finishes */
+    Json::Arena arena;
 
+    /* add_listener bodies are written straight into body, which is kept
+     * between uploads so that its capacity is reused. receiver_prefix and
+     * listener_members are serialized once, and the latter again only when
+     * a listener doc is uploaded. */
+    string body;
+    string receiver_prefix;
+    string listener_members;
+
+    /* Set by replicate() */
+    unique_ptr<Replica> replica;
+
+    /* Set by page_flights() */
+    size_t flights_page_size;
+    vector<long long int> flights_end_splits;
+
+    void set_receiver_prefix();
+    void set_time(Json::Value &thing, long long int time_created);
+    void update_listener_members();
     string listener_doc(const char *type, const Json::Value &data,
                         long long int time_created);
 
@@ -41,6 +68,17 @@ public:
              const string &couch_db="habitat",
              int max_merge_attempts=20);
     ~Uploader() {};
+
+    /* Changes the settings given to the constructor, replacing only what
+     * they affect: the connection, UUID cache and response cache are kept
+     * if couch_uri is unchanged, and the replica too if couch_db is. The
+     * latest listener docs are only still used if neither the callsign
+     * nor the database changed. Nothing else may be using the Uploader
+     * meanwhile. */
+    void reconfigure(const string &callsign,
+                     const string &couch_uri="http://habitat.habhub.org",
+                     const string &couch_db="habitat",
+                     int max_merge_attempts=20);
     string payload_telemetry(const string &data,
                              const Json::Value &metadata=Json::Value::null,
                              long long int time_created=-1);
@@ -49,8 +87,27 @@ public:
                               long long int time_created=-1);
     string listener_information(const Json::Value &data,
                                 long long int time_created=-1);
+    /* See CouchDB::Server::warm_up */
+    void warm_up();
+    /* Once replicate() has been called, flights() and payloads() fetch
+     * only what changed since the last call, and answer from the replica */
+    void replicate();
+    /* flights() then fetches its view in pages of at most page_size rows
+     * (0, the default, fetches it in one go), using
+     * CouchDB::Database::view_paged. The ranges of flight end time split
+     * at each of end_splits seconds from now are fetched at once. */
+    void page_flights(size_t page_size,
+                      const vector<long long int> &end_splits=
+                          vector<long long int>());
     vector<Json::Value> *flights();
     vector<Json::Value> *payloads();
+    /* Only the payload_configurations with a sentence for one of
+     * callsigns: their ids come from one small query of the
+     * callsign_time_created_index view per callsign, and the docs from a
+     * single Database::get_docs. Each replaces the doc in cache with the
+     * same _id, or is appended to it; the rest of cache is left alone. */
+    void payloads(const vector<string> &callsigns,
+                  vector<Json::Value> &cache);
 };
 
 } /* namespace habitat */
@@ -4,9 +4,11 @@
 #define HABITAT_UPLOADERTHREAD_H
 
 #include <memory>
+#include <utility>
 #include "jsoncpp.h"
 #include "habitat/EZ.h"
 #include "habitat/Uploader.h"
+#include "habitat/DocCache.h"
 
 using namespace std;
 
@@ -21,6 +23,16 @@ public:
 
 class UploaderThread;
 
+/* What settings() does before calling initialised() */
+enum warm_up_flags
+{
+    WARM_UP_NONE = 0x00,
+    /* Connect, and prefetch UUIDs (see CouchDB::Server::warm_up) */
+    WARM_UP_CONNECTION = 0x01,
+    /* Fetch payloads(), and give them to got_payloads() */
+    WARM_UP_PAYLOADS = 0x02
+};
+
 class UploaderAction
 {
 protected:
@@ -34,17 +46,26 @@ private:
 public:
     virtual ~UploaderAction() {};
     virtual string describe() = 0;
+
+    /* One action is made per sentence, on the extracting thread, and freed
+     * on the uploader's; they are recycled through a pool rather than each
+     * going to malloc. */
+    static void *operator new(size_t size);
+    static void operator delete(void *action, size_t size);
 };
 
 class UploaderSettings : public UploaderAction
 {
     const string callsign, couch_uri, couch_db;
     const int max_merge_attempts;
+    const int warm_up;
+    /* Uploader::reconfigure the existing Uploader, if there is one */
+    const bool in_place;
 
     UploaderSettings(const string &ca, const string &co_u,
-                     const string &co_db, int mx)
+                     const string &co_db, int mx, int wu, bool ip)
         : callsign(ca), couch_uri(co_u), couch_db(co_db),
-          max_merge_attempts(mx)
+          max_merge_attempts(mx), warm_up(wu), in_place(ip)
         {};
     ~UploaderSettings() {};
 
@@ -75,9 +96,8 @@ class UploaderPayloadTelemetry : public UploaderAction
     const Json::Value metadata;
     const int time_created;
 
-    UploaderPayloadTelemetry(const string &da, const Json::Value &mda,
-                             const int tc)
-        : data(da), metadata(mda), time_created(tc) {};
+    UploaderPayloadTelemetry(string da, Json::Value mda, const int tc)
+        : data(std::move(da)), metadata(std::move(mda)), time_created(tc) {};
     ~UploaderPayloadTelemetry() {};
 
     void apply(UploaderThread &uthr);
@@ -93,8 +113,8 @@ class UploaderListenerTelemetry : public UploaderAction
     const Json::Value data;
     const int time_created;
 
-    UploaderListenerTelemetry(const Json::Value &da, int tc)
-        : data(da), time_created(tc) {};
+    UploaderListenerTelemetry(Json::Value da, int tc)
+        : data(std::move(da)), time_created(tc) {};
     ~UploaderListenerTelemetry() {};
 
     void apply(UploaderThread &uthr);
@@ -110,8 +130,8 @@ class UploaderListenerInfo : public UploaderAction
     const Json::Value data;
     const int time_created;
 
-    UploaderListenerInfo(const Json::Value &da, int tc)
-        : data(da), time_created(tc) {};
+    UploaderListenerInfo(Json::Value da, int tc)
+        : data(std::move(da)), time_created(tc) {};
     ~UploaderListenerInfo() {};
 
     void apply(UploaderThread &uthr);
@@ -140,6 +160,62 @@ public:
     string describe();
 };
 
+class UploaderCallsignPayloads : public UploaderAction
+{
+    const vector<string> callsigns;
+
+    UploaderCallsignPayloads(const vector<string> &c) : callsigns(c) {};
+    ~UploaderCallsignPayloads() {};
+
+    void apply(UploaderThread &uthr);
+
+    friend class UploaderThread;
+
+public:
+    string describe();
+};
+
+class UploaderReplicate : public UploaderAction
+{
+    void apply(UploaderThread &uthr);
+    friend class UploaderThread;
+
+public:
+    string describe();
+};
+
+class UploaderPageFlights : public UploaderAction
+{
+    const size_t page_size;
+    const vector<long long int> end_splits;
+
+    UploaderPageFlights(size_t ps, const vector<long long int> &es)
+        : page_size(ps), end_splits(es) {};
+    ~UploaderPageFlights() {};
+
+    void apply(UploaderThread &uthr);
+
+    friend class UploaderThread;
+
+public:
+    string describe();
+};
+
+class UploaderCache : public UploaderAction
+{
+    const string filename;
+
+    UploaderCache(const string &fn) : filename(fn) {};
+    ~UploaderCache() {};
+
+    void apply(UploaderThread &uthr);
+
+    friend class UploaderThread;
+
+public:
+    string describe();
+};
+
 class UploaderShutdown : public UploaderAction
 {
     void apply(UploaderThread &uthr);
@@ -149,14 +225,57 @@ public:
     string describe();
 };
 
+/* A call to one of UploaderThread's hooks, made on the uploader thread
+ * and delivered later; see UploaderThread::dispatch_callbacks */
+struct UploaderEvent
+{
+    enum Hook
+    {
+        NONE, LOG, WARNING, SAVED_ID, INITIALISED, WARMED_UP, RESET_DONE,
+        REPLICATED, NOT_INITIALISED, RUNTIME_ERROR, INVALID_ARGUMENT,
+        GOT_FLIGHTS, GOT_PAYLOADS,
+        /* No hook: tells the dispatching thread to exit */
+        STOP
+    };
+
+    Hook hook;
+    /* The message, type and id, or what() */
+    string text, detail;
+    double seconds;
+    vector<Json::Value> docs;
+
+    UploaderEvent(Hook h=NONE, const string &t=string(),
+                  const string &d=string())
+        : hook(h), text(t), detail(d), seconds(0) {};
+};
+
 class UploaderThread : public EZ::SimpleThread
 {
-    EZ::Queue<UploaderAction *> queue;
-    auto_ptr<habitat::Uploader> uploader;
+    class Dispatcher;
+
+    EZ::Queue< unique_ptr<UploaderAction> > queue;
+    unique_ptr<habitat::Uploader> uploader;
+    unique_ptr<DocCache> doc_cache;
+    /* Whether each half of doc_cache has been fetched since it was loaded;
+     * fetching it for any reason (warming up, say) refreshes it */
+    bool flights_stale, payloads_stale;
+    /* What payloads(callsigns) has fetched, refreshed in place */
+    vector<Json::Value> callsign_payloads;
 
     bool queued_shutdown;
+    /* NULL unless dispatch_callbacks() has been called */
+    unique_ptr<Dispatcher> dispatcher;
 
     void queue_action(UploaderAction *ac);
+    /* Call a hook, from the uploader thread: now, or via the dispatcher.
+     * docs is copied if keep is set, and otherwise may be moved from. */
+    void emit(UploaderEvent &&event);
+    void emit_docs(UploaderEvent::Hook hook, vector<Json::Value> &docs,
+                   bool keep);
+    void deliver(UploaderEvent &event);
+    void fetch_flights();
+    void fetch_payloads();
+    void refresh_cache();
 
     friend class UploaderAction;
     friend class UploaderSettings;
@@ -166,28 +285,77 @@ class UploaderThread : public EZ::SimpleThread
     friend class UploaderListenerInfo;
     friend class UploaderFlights;
     friend class UploaderPayloads;
+    friend class UploaderCallsignPayloads;
+    friend class UploaderReplicate;
+    friend class UploaderPageFlights;
+    friend class UploaderCache;
 
 public:
     UploaderThread();
     virtual ~UploaderThread();
 
+    /* warm_up is some warm_up_flags. Warming up happens on the uploader
+     * thread, before initialised(); if it fails, warning() is called and
+     * the Uploader is used cold. */
     void settings(const string &callsign,
                   const string &couch_uri="http://habitat.habhub.org",
                   const string &couch_db="habitat",
-                  int max_merge_attempts=20);
+                  int max_merge_attempts=20,
+                  int warm_up=WARM_UP_NONE);
+    /* As settings(), but keeps what it can of the current Uploader (see
+     * Uploader::reconfigure) rather than starting from scratch */
+    void reconfigure(const string &callsign,
+                     const string &couch_uri="http://habitat.habhub.org",
+                     const string &couch_db="habitat",
+                     int max_merge_attempts=20,
+                     int warm_up=WARM_UP_NONE);
     void reset();
 
     /* virtual, so that the ExtractorManager can be given a UploaderThread
-     * reference */
-    virtual void payload_telemetry(const string &data,
-                                   const Json::Value &metadata=Json::Value::null,
+     * reference.
+     * data and metadata are taken by value and moved into the queued
+     * action, so that callers can std::move them in rather than have them
+     * copied. */
+    virtual void payload_telemetry(string data,
+                                   Json::Value metadata=Json::Value::null,
                                    int time_created=-1);
-    void listener_telemetry(const Json::Value &data, int time_created=-1);
-    void listener_information(const Json::Value &data, int time_created=-1);
+    void listener_telemetry(Json::Value data, int time_created=-1);
+    void listener_information(Json::Value data, int time_created=-1);
     void flights();
     void payloads();
+    /* See Uploader::payloads(callsigns, cache). The cache is kept here,
+     * across calls, and got_payloads() is given all of it. */
+    void payloads(const vector<string> &callsigns);
+    /* See Uploader::replicate; must follow settings() */
+    void replicate();
+    /* See Uploader::page_flights; must follow settings() */
+    void page_flights(size_t page_size,
+                      const vector<long long int> &end_splits=
+                          vector<long long int>());
+    /* Keeps the latest flights() and payloads() in filename (see
+     * DocCache). What it holds now is given to got_flights() and
+     * got_payloads() straight away, without waiting for settings(); then,
+     * once there is an Uploader, both are fetched again (bar the payloads,
+     * if settings() warmed up with them). */
+    void cache(const string &filename);
     void shutdown();
 
+    /* Normally the hooks below are called on the uploader thread, so a
+     * slow one holds up the uploads behind it. After this, the calls that
+     * the uploader thread makes are instead queued (without it ever
+     * waiting) and made later: by a thread of their own if own_thread is
+     * set, otherwise whenever the application calls dispatch(), say from
+     * its event loop. Call it once, before start(). The docs given to
+     * got_flights() and got_payloads() are moved rather than copied where
+     * possible; caught_exception() is given a copy of the exception's
+     * what(), as a plain runtime_error (or invalid_argument). With
+     * own_thread, join() also waits for every hook to have been called. */
+    void dispatch_callbacks(bool own_thread);
+    /* Calls the queued hooks, until there are none left, on this thread;
+     * returns how many. Only for dispatch_callbacks(false), and from one
+     * thread at a time. */
+    size_t dispatch();
+
     void *run();
     void detach();
 
@@ -196,7 +364,10 @@ public:
     virtual void warning(const string &message);
     virtual void saved_id(const string &type, const string &id);
     virtual void initialised();
+    /* How long warming up took, if it succeeded */
+    virtual void warmed_up(double seconds);
     virtual void reset_done();
+    virtual void replicated();
     virtual void caught_exception(const NotInitialisedError &error);
     virtual void caught_exception(const runtime_error &error);
     virtual void caught_exception(const invalid_argument &error);
@@ -203,6 +203,9 @@ uintToString( LargestUInt value,
 #include <cassert>
 #include <cstring>
 #include <stdexcept>
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
 
 #if _MSC_VER >= 1400 // VC++ 8.0
 #pragma warning( disable : 4996 )   // disable warning about strdup being deprecated.
@@ -264,6 +267,77 @@ containsNewLine( Reader::Location begin,
 }
 
 
+// Scanning helpers for the tokenizer. With SSE2 these look at 16 bytes at
+// a time; they never read at or beyond end, so the document need not be
+// null terminated or padded.
+#if defined(__SSE2__)  &&  defined(__GNUC__)
+# define JSON_READER_SSE2 1
+#endif
+
+static inline bool 
+isSpace( Reader::Char c )
+{
+   return c == ' '  ||  c == '\t'  ||  c == '\r'  ||  c == '\n';
+}
+
+
+/// Returns the first character in [begin, end) that is not whitespace.
+static inline Reader::Location 
+skipWhitespace( Reader::Location current, 
+                Reader::Location end )
+{
+   // Most tokens are preceded by no whitespace or a single space.
+   if ( current == end  ||  !isSpace( *current ) )
+      return current;
+   ++current;
+#if defined(JSON_READER_SSE2)
+   const __m128i space = _mm_set1_epi8( ' ' );
+   const __m128i tab = _mm_set1_epi8( '\t' );
+   const __m128i cr = _mm_set1_epi8( '\r' );
+   const __m128i lf = _mm_set1_epi8( '\n' );
+   while ( end - current >= 16 )
+   {
+      __m128i chunk = _mm_loadu_si128( reinterpret_cast<const __m128i *>( current ) );
+      __m128i spaces = _mm_or_si128( _mm_or_si128( _mm_cmpeq_epi8( chunk, space ),
+                                                   _mm_cmpeq_epi8( chunk, tab ) ),
+                                     _mm_or_si128( _mm_cmpeq_epi8( chunk, cr ),
+                                                   _mm_cmpeq_epi8( chunk, lf ) ) );
+      int mask = _mm_movemask_epi8( spaces );
+      if ( mask != 0xffff )
+         return current + __builtin_ctz( ~mask );
+      current += 16;
+   }
+#endif
+   while ( current != end  &&  isSpace( *current ) )
+      ++current;
+   return current;
+}
+
+
+/// Returns the first '"' or '\\' in [begin, end), or end.
+static inline Reader::Location 
+findQuoteOrEscape( Reader::Location current, 
+                   Reader::Location end )
+{
+#if defined(JSON_READER_SSE2)
+   const __m128i quote = _mm_set1_epi8( '"' );
+   const __m128i backslash = _mm_set1_epi8( '\\' );
+   while ( end - current >= 16 )
+   {
+      __m128i chunk = _mm_loadu_si128( reinterpret_cast<const __m128i *>( current ) );
+      int mask = _mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8( chunk, quote ),
+                                                  _mm_cmpeq_epi8( chunk, backslash ) ) );
+      if ( mask )
+         return current + __builtin_ctz( mask );
+      current += 16;
+   }
+#endif
+   while ( current != end  &&  *current != '"'  &&  *current != '\\' )
+      ++current;
+   return current;
+}
+
+
 // Class Reader
 // //////////////////////////////////////////////////////////////////
 
@@ -527,14 +601,7 @@ Reader::readToken( Token &token )
 void 
 Reader::skipSpaces()
 {
-   while ( current_ != end_ )
-   {
-      Char c = *current_;
-      if ( c == ' '  ||  c == '\t'  ||  c == '\r'  ||  c == '\n' )
-         ++current_;
-      else
-         break;
-   }
+   current_ = skipWhitespace( current_, end_ );
 }
 
 
@@ -642,16 +709,18 @@ Reader::readNumber()
 bool
 Reader::readString()
 {
-   Char c = 0;
-   while ( current_ != end_ )
+   for (;;)
    {
-      c = getNextChar();
-      if ( c == '\\' )
-         getNextChar();
-      else if ( c == '"' )
-         break;
+      current_ = findQuoteOrEscape( current_, end_ );
+      if ( current_ == end_ )
+         return false;
+      if ( *current_++ == '"' )
+         return true;
+      // Skip the escaped character; decodeString() checks it.
+      if ( current_ == end_ )
+         return false;
+      ++current_;
    }
-   return c == '"';
 }
 
 
@@ -854,6 +923,15 @@ Reader::decodeDouble( Token &token )
 bool 
 Reader::decodeString( Token &token )
 {
+   Location begin = token.start_ + 1; // skip '"'
+   Location end = token.end_ - 1;     // do not include '"'
+   // Strings without escapes (nearly all of them) go straight from the
+   // document into the value.
+   if ( findQuoteOrEscape( begin, end ) == end )
+   {
+      currentValue() = Value( begin, end );
+      return true;
+   }
    std::string decoded;
    if ( !decodeString( token, decoded ) )
       return false;
@@ -865,9 +943,17 @@ Reader::decodeString( Token &token )
 bool 
 Reader::decodeString( Token &token, std::string &decoded )
 {
-   decoded.reserve( token.end_ - token.start_ - 2 );
    Location current = token.start_ + 1; // skip '"'
    Location end = token.end_ - 1;      // do not include '"'
+   Location plain = findQuoteOrEscape( current, end );
+   if ( plain == end )
+   {
+      decoded.assign( current, end );
+      return true;
+   }
+   decoded.reserve( end - current );
+   decoded.append( current, plain );
+   current = plain;
    while ( current != end )
    {
       Char c = *current++;
@@ -1356,7 +1442,7 @@ ValueIteratorBase::difference_type
 ValueIteratorBase::computeDistance( const SelfType &other ) const
 {
 #ifndef JSON_VALUE_USE_INTERNAL_MAP
-# ifdef JSON_USE_CPPTL_SMALLMAP
+# if defined(JSON_USE_CPPTL_SMALLMAP)  ||  defined(JSON_USE_FLAT_MAP)
    return current_ - other.current_;
 # else
    // Iterator for null value are initialized using the default
@@ -1411,6 +1497,7 @@ ValueIteratorBase::copy( const SelfType &other )
 {
 #ifndef JSON_VALUE_USE_INTERNAL_MAP
    current_ = other.current_;
+   isNull_ = other.isNull_;
 #else
    if ( isArray_ )
       iterator_.array_ = other.iterator_.array_;
@@ -1589,6 +1676,7 @@ ValueIterator::operator =( const SelfType &other )
 #include <math.h>
 #include <sstream>
 #include <utility>
+#include <algorithm>
 #include <stdexcept>
 #include <cstring>
 #include <cassert>
@@ -1596,6 +1684,8 @@ ValueIterator::operator =( const SelfType &other )
 # include <cpptl/conststring.h>
 #endif
 #include <cstddef>    // size_t
+#include <cstdlib>
+#include <new>
 
 #define JSON_ASSERT_UNREACHABLE assert( false )
 
@@ -1646,6 +1736,219 @@ static inline bool InRange(double d, T min, U max) {
 #endif // if !defined(JSON_USE_INT64_DOUBLE_CONVERSION)
 
 
+// Every allocateMemory() block starts with the Arena it came from (or 0
+// for the heap), padded to keep what follows suitably aligned. Only
+// whether it is 0 matters: after Arena::adopt(), it names the wrong one.
+union AllocationHeader
+{
+   Arena *arena_;
+   double alignDouble_;
+   void *alignPointer_[2];
+};
+
+#if defined(__GNUC__)
+static __thread Arena *currentArena = 0;
+#else
+// No portable thread local storage here: only use arenas from one thread.
+static Arena *currentArena = 0;
+#endif
+
+Arena::Scope::Scope( Arena *arena )
+   : previous_( currentArena )
+{
+   currentArena = arena;
+}
+
+
+Arena::Scope::~Scope()
+{
+   currentArena = previous_;
+}
+
+
+Arena::Arena( size_t blockSize )
+   : blocks_( 0 )
+   , position_( 0 )
+   , end_( 0 )
+   , blockSize_( blockSize )
+   , used_( 0 )
+{
+}
+
+
+Arena::~Arena()
+{
+   while ( blocks_ )
+   {
+      Block *next = blocks_->next_;
+      free( blocks_ );
+      blocks_ = next;
+   }
+}
+
+
+void *
+Arena::allocate( size_t size )
+{
+   // Keep everything aligned as the header is
+   const size_t align = sizeof(AllocationHeader);
+   size = (size + align - 1) / align * align;
+
+   if ( size > size_t(end_ - position_) )
+   {
+      // Large requests get a block to themselves, so that they don't
+      // waste the rest of the current one.
+      size_t dataSize = size > blockSize_ / 4 ? size : blockSize_;
+      size_t headerSize = (sizeof(Block) + align - 1) / align * align;
+      Block *block = static_cast<Block *>( malloc( headerSize + dataSize ) );
+      JSON_ASSERT_MESSAGE( block != 0, "Failed to allocate arena block" );
+      block->size_ = dataSize;
+
+      char *data = reinterpret_cast<char *>( block ) + headerSize;
+
+      if ( dataSize == blockSize_ || !blocks_ )
+      {
+         block->next_ = blocks_;
+         blocks_ = block;
+         position_ = data;
+         end_ = data + dataSize;
+      }
+      else
+      {
+         // Keep allocating from the current block afterwards
+         block->next_ = blocks_->next_;
+         blocks_->next_ = block;
+         used_ += size;
+         return data;
+      }
+   }
+
+   void *result = position_;
+   position_ += size;
+   used_ += size;
+   return result;
+}
+
+
+void
+Arena::reset()
+{
+   // Keep the newest block, if it's a normal one, to save a malloc for
+   // the next user.
+   Block *keep = 0;
+
+   if ( blocks_ && blocks_->size_ == blockSize_ )
+   {
+      keep = blocks_;
+      blocks_ = blocks_->next_;
+      keep->next_ = 0;
+   }
+
+   while ( blocks_ )
+   {
+      Block *next = blocks_->next_;
+      free( blocks_ );
+      blocks_ = next;
+   }
+
+   blocks_ = keep;
+   used_ = 0;
+
+   if ( keep )
+   {
+      const size_t align = sizeof(AllocationHeader);
+      size_t headerSize = (sizeof(Block) + align - 1) / align * align;
+      position_ = reinterpret_cast<char *>( keep ) + headerSize;
+      end_ = position_ + keep->size_;
+   }
+   else
+   {
+      position_ = end_ = 0;
+   }
+}
+
+
+void
+Arena::adopt( Arena &other )
+{
+   if ( !other.blocks_ )
+      return;
+
+   Block *last = other.blocks_;
+   while ( last->next_ )
+      last = last->next_;
+
+   // Behind our newest block, so that we keep allocating from it
+   if ( blocks_ )
+   {
+      last->next_ = blocks_->next_;
+      blocks_->next_ = other.blocks_;
+   }
+   else
+   {
+      blocks_ = other.blocks_;
+   }
+
+   used_ += other.used_;
+
+   other.blocks_ = 0;
+   other.position_ = other.end_ = 0;
+   other.used_ = 0;
+}
+
+
+size_t
+Arena::used() const
+{
+   return used_;
+}
+
+
+Arena *
+Arena::current()
+{
+   return currentArena;
+}
+
+
+void *
+allocateMemory( size_t size )
+{
+   Arena *arena = currentArena;
+   AllocationHeader *header;
+
+   if ( arena )
+   {
+      header = static_cast<AllocationHeader *>(
+                  arena->allocate( sizeof(AllocationHeader) + size ) );
+   }
+   else
+   {
+      header = static_cast<AllocationHeader *>(
+                  malloc( sizeof(AllocationHeader) + size ) );
+      if ( !header )
+         throw std::bad_alloc();
+   }
+
+   header->arena_ = arena;
+   return header + 1;
+}
+
+
+void
+releaseMemory( void *memory )
+{
+   if ( !memory )
+      return;
+
+   AllocationHeader *header = static_cast<AllocationHeader *>( memory ) - 1;
+
+   // Arena memory is freed by Arena::reset()
+   if ( !header->arena_ )
+      free( header );
+}
+
+
 /** Duplicates the specified string value.
  * @param value Pointer to the string to duplicate. Must be zero-terminated if
  *              length is "unknown".
@@ -1665,7 +1968,7 @@ duplicateStringValue( const char *value,
    if (length >= (unsigned)Value::maxInt)
       length = Value::maxInt - 1;
 
-   char *newString = static_cast<char *>( malloc( length + 1 ) );
+   char *newString = static_cast<char *>( allocateMemory( length + 1 ) );
    JSON_ASSERT_MESSAGE( newString != 0, "Failed to allocate string value buffer" );
    memcpy( newString, value, length );
    newString[length] = 0;
@@ -1678,8 +1981,121 @@ duplicateStringValue( const char *value,
 static inline void 
 releaseStringValue( char *value )
 {
-   if ( value )
-      free( value );
+   releaseMemory( value );
+}
+
+
+// Interned member names
+// //////////////////////////////////////////////////////////////////
+//
+// An open addressing hash table of fixed size, read without locks: a slot
+// only ever changes once, from 0 to a string that is never freed.
+
+enum
+{
+   internTableSize = 1024,     // a power of two
+   internTableLimit = 768
+};
+
+static const char *internTable[internTableSize];
+static unsigned int internCount = 0;
+
+
+static inline unsigned int 
+hashKey( const char *key )
+{
+   unsigned int hash = 2166136261u;   // FNV-1a
+   for ( ; *key; ++key )
+      hash = ( hash ^ (unsigned char)*key ) * 16777619u;
+   return hash;
+}
+
+
+#if defined(__GNUC__)
+static inline const char *
+loadInterned( unsigned int slot )
+{
+   return __atomic_load_n( &internTable[slot], __ATOMIC_ACQUIRE );
+}
+#endif
+
+
+const char *
+findInternedKey( const char *name )
+{
+#if defined(__GNUC__)
+   if ( !__atomic_load_n( &internCount, __ATOMIC_RELAXED ) )
+      return 0;
+   for ( unsigned int slot = hashKey( name ); ; ++slot )
+   {
+      const char *interned = loadInterned( slot % internTableSize );
+      if ( !interned  ||  interned == name  ||  strcmp( interned, name ) == 0 )
+         return interned;
+   }
+#else
+   // No portable atomics here, so no table.
+   return 0;
+#endif
+}
+
+
+const char *
+internKey( const char *name )
+{
+#if defined(__GNUC__)
+   const char *interned = findInternedKey( name );
+   if ( interned )
+      return interned;
+   if ( __atomic_load_n( &internCount, __ATOMIC_RELAXED ) >= internTableLimit )
+      return 0;
+
+   // Not duplicateStringValue(): it must not be in an Arena.
+   size_t length = strlen( name );
+   char *copy = static_cast<char *>( malloc( length + 1 ) );
+   JSON_ASSERT_MESSAGE( copy != 0, "Failed to allocate interned key" );
+   memcpy( copy, name, length + 1 );
+
+   for ( unsigned int slot = hashKey( name ); ; ++slot )
+   {
+      const char *expected = 0;
+      if ( __atomic_compare_exchange_n( &internTable[slot % internTableSize],
+                                        &expected, copy, false, 
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
+      {
+         __atomic_add_fetch( &internCount, 1, __ATOMIC_RELAXED );
+         return copy;
+      }
+      // Another thread may have just added the same name.
+      if ( strcmp( expected, name ) == 0 )
+      {
+         free( copy );
+         return expected;
+      }
+   }
+#else
+   return 0;
+#endif
+}
+
+
+static const char *
+internOrLeak( const char *name )
+{
+   const char *interned = internKey( name );
+   if ( interned )
+      return interned;
+   // The table is full; a handle's string must still outlive every Value.
+   size_t length = strlen( name );
+   char *copy = static_cast<char *>( malloc( length + 1 ) );
+   JSON_ASSERT_MESSAGE( copy != 0, "Failed to allocate interned key" );
+   memcpy( copy, name, length + 1 );
+   return copy;
+}
+
+
+InternedKey::InternedKey( const char *name )
+   : StaticString( internOrLeak( name ) )
+{
 }
 
 } // namespace Json
@@ -1794,8 +2210,9 @@ Value::CZString::operator =( const CZString &other )
 bool 
 Value::CZString::operator<( const CZString &other ) const 
 {
+   // Interned names are often the same pointer.
    if ( cstr_ )
-      return strcmp( cstr_, other.cstr_ ) < 0;
+      return cstr_ != other.cstr_  &&  strcmp( cstr_, other.cstr_ ) < 0;
    return index_ < other.index_;
 }
 
@@ -1803,7 +2220,7 @@ bool
 Value::CZString::operator==( const CZString &other ) const 
 {
    if ( cstr_ )
-      return strcmp( cstr_, other.cstr_ ) == 0;
+      return cstr_ == other.cstr_  ||  strcmp( cstr_, other.cstr_ ) == 0;
    return index_ == other.index_;
 }
 
@@ -1827,6 +2244,261 @@ Value::CZString::isStaticString() const
    return index_ == noDuplication;
 }
 
+
+# if defined(JSON_USE_FLAT_MAP)
+
+// class Value::ObjectValues
+// //////////////////////////////////////////////////////////////////
+
+// Members are constructed in chunks, each starting with this header
+// (padded as AllocationHeader is). Erased members are destroyed and their
+// storage kept on a free list, linked through it, until clear().
+struct Value::ObjectValues::Chunk
+{
+   Chunk *next_;
+   size_type used_;
+   size_type capacity_;
+
+   static size_t headerSize()
+   {
+      return ( sizeof(Chunk) + sizeof(AllocationHeader) - 1 ) 
+             / sizeof(AllocationHeader) * sizeof(AllocationHeader);
+   }
+};
+
+
+Value::ObjectValues::ObjectValues()
+   : index_( 0 )
+   , size_( 0 )
+   , capacity_( 0 )
+   , chunks_( 0 )
+   , free_( 0 )
+{
+}
+
+
+Value::ObjectValues::ObjectValues( const ObjectValues &other )
+   : index_( 0 )
+   , size_( 0 )
+   , capacity_( 0 )
+   , chunks_( 0 )
+   , free_( 0 )
+{
+   reserve( other.size_ );
+   for ( ; size_ < other.size_; ++size_ )
+   {
+      index_[size_] = new ( allocateNode( other.size_ ) ) 
+         value_type( *other.index_[size_] );
+   }
+}
+
+
+Value::ObjectValues::~ObjectValues()
+{
+   releaseNodes();
+   releaseMemory( index_ );
+}
+
+
+Value::ObjectValues &
+Value::ObjectValues::operator =( const ObjectValues &other )
+{
+   ObjectValues temp( other );
+   swap( temp );
+   return *this;
+}
+
+
+struct Value::ObjectValues::KeyLess
+{
+   bool operator()( const value_type *member, const CZString &key ) const
+   {
+      return member->first < key;
+   }
+};
+
+
+Value::ObjectValues::iterator 
+Value::ObjectValues::lower_bound( const CZString &key )
+{
+   return std::lower_bound( index_, index_ + size_, key, KeyLess() );
+}
+
+
+Value::ObjectValues::const_iterator 
+Value::ObjectValues::lower_bound( const CZString &key ) const
+{
+   return std::lower_bound( index_, index_ + size_, key, KeyLess() );
+}
+
+
+Value::ObjectValues::iterator 
+Value::ObjectValues::find( const CZString &key )
+{
+   iterator it = lower_bound( key );
+   if ( it != end()  &&  it->first == key )
+      return it;
+   return end();
+}
+
+
+Value::ObjectValues::const_iterator 
+Value::ObjectValues::find( const CZString &key ) const
+{
+   const_iterator it = lower_bound( key );
+   if ( it != end()  &&  it->first == key )
+      return it;
+   return end();
+}
+
+
+Value::ObjectValues::iterator 
+Value::ObjectValues::insert( iterator position, const value_type &value )
+{
+   size_type index = position.node_ - index_;
+   if ( size_ == capacity_ )
+      reserve( capacity_ ? capacity_ * 2 : 4 );
+   value_type *node = new ( allocateNode( chunks_ ? chunks_->capacity_ * 2
+                                                  : 4 ) ) value_type( value );
+   memmove( index_ + index + 1, index_ + index, 
+            ( size_ - index ) * sizeof(value_type *) );
+   index_[index] = node;
+   ++size_;
+   return index_ + index;
+}
+
+
+void 
+Value::ObjectValues::erase( iterator position )
+{
+   size_type index = position.node_ - index_;
+   value_type *node = index_[index];
+   memmove( index_ + index, index_ + index + 1, 
+            ( size_ - index - 1 ) * sizeof(value_type *) );
+   --size_;
+   node->~value_type();
+   *reinterpret_cast<value_type **>( node ) = free_;
+   free_ = node;
+}
+
+
+Value::ObjectValues::size_type 
+Value::ObjectValues::erase( const CZString &key )
+{
+   iterator it = find( key );
+   if ( it == end() )
+      return 0;
+   erase( it );
+   return 1;
+}
+
+
+void 
+Value::ObjectValues::clear()
+{
+   releaseNodes();
+   size_ = 0;
+}
+
+
+void 
+Value::ObjectValues::swap( ObjectValues &other )
+{
+   std::swap( index_, other.index_ );
+   std::swap( size_, other.size_ );
+   std::swap( capacity_, other.capacity_ );
+   std::swap( chunks_, other.chunks_ );
+   std::swap( free_, other.free_ );
+}
+
+
+bool 
+Value::ObjectValues::operator <( const ObjectValues &other ) const
+{
+   for ( size_type index = 0; index < size_; ++index )
+   {
+      if ( index == other.size_  ||  *other.index_[index] < *index_[index] )
+         return false;
+      if ( *index_[index] < *other.index_[index] )
+         return true;
+   }
+   return size_ < other.size_;
+}
+
+
+bool 
+Value::ObjectValues::operator ==( const ObjectValues &other ) const
+{
+   if ( size_ != other.size_ )
+      return false;
+   for ( size_type index = 0; index < size_; ++index )
+   {
+      if ( !( *index_[index] == *other.index_[index] ) )
+         return false;
+   }
+   return true;
+}
+
+
+void 
+Value::ObjectValues::reserve( size_type capacity )
+{
+   if ( capacity <= capacity_ )
+      return;
+   value_type **index = static_cast<value_type **>( 
+      allocateMemory( capacity * sizeof(value_type *) ) );
+   JSON_ASSERT_MESSAGE( index != 0, "Failed to allocate object members" );
+   if ( size_ )
+      memcpy( index, index_, size_ * sizeof(value_type *) );
+   releaseMemory( index_ );
+   index_ = index;
+   capacity_ = capacity;
+}
+
+
+// Storage for one member, reused or from the newest chunk if it has room,
+// otherwise from a new chunk of chunkCapacity members.
+Value::ObjectValues::value_type *
+Value::ObjectValues::allocateNode( size_type chunkCapacity )
+{
+   if ( free_ )
+   {
+      value_type *node = free_;
+      free_ = *reinterpret_cast<value_type **>( node );
+      return node;
+   }
+   if ( !chunks_  ||  chunks_->used_ == chunks_->capacity_ )
+   {
+      Chunk *chunk = static_cast<Chunk *>( allocateMemory( 
+         Chunk::headerSize() + chunkCapacity * sizeof(value_type) ) );
+      JSON_ASSERT_MESSAGE( chunk != 0, "Failed to allocate object members" );
+      chunk->next_ = chunks_;
+      chunk->used_ = 0;
+      chunk->capacity_ = chunkCapacity;
+      chunks_ = chunk;
+   }
+   value_type *nodes = reinterpret_cast<value_type *>( 
+      reinterpret_cast<char *>( chunks_ ) + Chunk::headerSize() );
+   return nodes + chunks_->used_++;
+}
+
+
+void 
+Value::ObjectValues::releaseNodes()
+{
+   for ( size_type index = 0; index < size_; ++index )
+      index_[index]->~value_type();
+   while ( chunks_ )
+   {
+      Chunk *next = chunks_->next_;
+      releaseMemory( chunks_ );
+      chunks_ = next;
+   }
+   free_ = 0;
+}
+
+# endif // if defined(JSON_USE_FLAT_MAP)
+
 #endif // ifndef JSON_VALUE_USE_INTERNAL_MAP
 
 
@@ -1867,7 +2539,8 @@ Value::Value( ValueType type )
 #ifndef JSON_VALUE_USE_INTERNAL_MAP
    case arrayValue:
    case objectValue:
-      value_.map_ = new ObjectValues();
+      value_.map_ = new ( allocateMemory( sizeof(ObjectValues) ) )
+                       ObjectValues();
       break;
 #else
    case arrayValue:
@@ -2050,7 +2723,8 @@ Value::Value( const Value &other )
 #ifndef JSON_VALUE_USE_INTERNAL_MAP
    case arrayValue:
    case objectValue:
-      value_.map_ = new ObjectValues( *other.value_.map_ );
+      value_.map_ = new ( allocateMemory( sizeof(ObjectValues) ) )
+                       ObjectValues( *other.value_.map_ );
       break;
 #else
    case arrayValue:
@@ -2093,7 +2767,8 @@ Value::~Value()
 #ifndef JSON_VALUE_USE_INTERNAL_MAP
    case arrayValue:
    case objectValue:
-      delete value_.map_;
+      value_.map_->~ObjectValues();
+      releaseMemory( value_.map_ );
       break;
 #else
    case arrayValue:
@@ -2119,6 +2794,33 @@ Value::operator=( const Value &other )
    return *this;
 }
 
+#ifdef JSON_HAS_RVALUE_REFERENCES
+
+Value::Value( Value &&other )
+   : type_( nullValue )
+   , allocated_( false )
+# ifdef JSON_VALUE_USE_INTERNAL_MAP
+   , itemIsUsed_( 0 )
+#endif
+   , comments_( other.comments_ )
+{
+   value_.int_ = 0;
+   other.comments_ = 0;
+   swap( other );
+}
+
+
+Value &
+Value::operator=( Value &&other )
+{
+   // Keeps this Value's comments, as copy assignment does
+   Value temp( std::move( other ) );
+   swap( temp );
+   return *this;
+}
+
+#endif // JSON_HAS_RVALUE_REFERENCES
+
 void 
 Value::swap( Value &other )
 {
@@ -2717,6 +3419,13 @@ Value::resolveReference( const char *key,
    if ( type_ == nullValue )
       *this = Value( objectValue );
 #ifndef JSON_VALUE_USE_INTERNAL_MAP
+   // Share the interned copy of the name, if there is one.
+   const char *interned = isStatic ? 0 : findInternedKey( key );
+   if ( interned )
+   {
+      key = interned;
+      isStatic = true;
+   }
    CZString actualKey( key, isStatic ? CZString::noDuplication 
                                      : CZString::duplicateOnCopy );
    ObjectValues::iterator it = value_.map_->lower_bound( actualKey );
@@ -3580,43 +4289,382 @@ std::string valueToString( UInt value )
 #endif // # if defined(JSON_HAS_INT64)
 
 
-std::string valueToString( double value )
+// Double to string conversion
+// ////////////////////////////
+//
+// Florian Loitsch's Grisu2, from "Printing Floating-Point Numbers Quickly
+// and Accurately with Integers" (PLDI 2010). The digits always read back
+// as exactly the same double, and are the shortest that do in all but a
+// tiny fraction of cases, where there is one digit too many.
+
+// A floating point number f * 2^e, with a 64 bit significand.
+struct DiyFp
 {
-   char buffer[32];
-#if defined(_MSC_VER) && defined(__STDC_SECURE_LIB__) // Use secure version with visual studio 2005 to avoid warning. 
-   sprintf_s(buffer, sizeof(buffer), "%#.16g", value); 
-#else	
-   sprintf(buffer, "%#.16g", value); 
-#endif
-   char* ch = buffer + strlen(buffer) - 1;
-   if (*ch != '0') return buffer; // nothing to truncate, so save time
-   while(ch > buffer && *ch == '0'){
-     --ch;
+   DiyFp() : f( 0 ), e( 0 ) {}
+   DiyFp( UInt64 significand, int exponent ) : f( significand ), e( exponent ) {}
+
+   UInt64 f;
+   int e;
+};
+
+static const UInt64 doubleHiddenBit = UInt64(1) << 52;
+static const UInt64 diyFpTopBit = UInt64(1) << 63;
+
+static const unsigned int powersOf10[] = {
+   1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+// 10^decimalExponent, rounded to high * 2^32 + low times 2^binaryExponent,
+// for every eighth power from 10^-348 to 10^340.
+struct CachedPower
+{
+   unsigned int high;
+   unsigned int low;
+   short binaryExponent;
+   short decimalExponent;
+};
+
+static const CachedPower cachedPowers[] = {
+      { 0xfa8fd5a0, 0x081c0288, -1220, -348 },
+      { 0xbaaee17f, 0xa23ebf76, -1193, -340 },
+      { 0x8b16fb20, 0x3055ac76, -1166, -332 },
+      { 0xcf42894a, 0x5dce35ea, -1140, -324 },
+      { 0x9a6bb0aa, 0x55653b2d, -1113, -316 },
+      { 0xe61acf03, 0x3d1a45df, -1087, -308 },
+      { 0xab70fe17, 0xc79ac6ca, -1060, -300 },
+      { 0xff77b1fc, 0xbebcdc4f, -1034, -292 },
+      { 0xbe5691ef, 0x416bd60c, -1007, -284 },
+      { 0x8dd01fad, 0x907ffc3c,  -980, -276 },
+      { 0xd3515c28, 0x31559a83,  -954, -268 },
+      { 0x9d71ac8f, 0xada6c9b5,  -927, -260 },
+      { 0xea9c2277, 0x23ee8bcb,  -901, -252 },
+      { 0xaecc4991, 0x4078536d,  -874, -244 },
+      { 0x823c1279, 0x5db6ce57,  -847, -236 },
+      { 0xc2109436, 0x4dfb5637,  -821, -228 },
+      { 0x9096ea6f, 0x3848984f,  -794, -220 },
+      { 0xd77485cb, 0x25823ac7,  -768, -212 },
+      { 0xa086cfcd, 0x97bf97f4,  -741, -204 },
+      { 0xef340a98, 0x172aace5,  -715, -196 },
+      { 0xb23867fb, 0x2a35b28e,  -688, -188 },
+      { 0x84c8d4df, 0xd2c63f3b,  -661, -180 },
+      { 0xc5dd4427, 0x1ad3cdba,  -635, -172 },
+      { 0x936b9fce, 0xbb25c996,  -608, -164 },
+      { 0xdbac6c24, 0x7d62a584,  -582, -156 },
+      { 0xa3ab6658, 0x0d5fdaf6,  -555, -148 },
+      { 0xf3e2f893, 0xdec3f126,  -529, -140 },
+      { 0xb5b5ada8, 0xaaff80b8,  -502, -132 },
+      { 0x87625f05, 0x6c7c4a8b,  -475, -124 },
+      { 0xc9bcff60, 0x34c13053,  -449, -116 },
+      { 0x964e858c, 0x91ba2655,  -422, -108 },
+      { 0xdff97724, 0x70297ebd,  -396, -100 },
+      { 0xa6dfbd9f, 0xb8e5b88f,  -369,  -92 },
+      { 0xf8a95fcf, 0x88747d94,  -343,  -84 },
+      { 0xb9447093, 0x8fa89bcf,  -316,  -76 },
+      { 0x8a08f0f8, 0xbf0f156b,  -289,  -68 },
+      { 0xcdb02555, 0x653131b6,  -263,  -60 },
+      { 0x993fe2c6, 0xd07b7fac,  -236,  -52 },
+      { 0xe45c10c4, 0x2a2b3b06,  -210,  -44 },
+      { 0xaa242499, 0x697392d3,  -183,  -36 },
+      { 0xfd87b5f2, 0x8300ca0e,  -157,  -28 },
+      { 0xbce50864, 0x92111aeb,  -130,  -20 },
+      { 0x8cbccc09, 0x6f5088cc,  -103,  -12 },
+      { 0xd1b71758, 0xe219652c,   -77,   -4 },
+      { 0x9c400000, 0x00000000,   -50,    4 },
+      { 0xe8d4a510, 0x00000000,   -24,   12 },
+      { 0xad78ebc5, 0xac620000,     3,   20 },
+      { 0x813f3978, 0xf8940984,    30,   28 },
+      { 0xc097ce7b, 0xc90715b3,    56,   36 },
+      { 0x8f7e32ce, 0x7bea5c70,    83,   44 },
+      { 0xd5d238a4, 0xabe98068,   109,   52 },
+      { 0x9f4f2726, 0x179a2245,   136,   60 },
+      { 0xed63a231, 0xd4c4fb27,   162,   68 },
+      { 0xb0de6538, 0x8cc8ada8,   189,   76 },
+      { 0x83c7088e, 0x1aab65db,   216,   84 },
+      { 0xc45d1df9, 0x42711d9a,   242,   92 },
+      { 0x924d692c, 0xa61be758,   269,  100 },
+      { 0xda01ee64, 0x1a708dea,   295,  108 },
+      { 0xa26da399, 0x9aef774a,   322,  116 },
+      { 0xf209787b, 0xb47d6b85,   348,  124 },
+      { 0xb454e4a1, 0x79dd1877,   375,  132 },
+      { 0x865b8692, 0x5b9bc5c2,   402,  140 },
+      { 0xc83553c5, 0xc8965d3d,   428,  148 },
+      { 0x952ab45c, 0xfa97a0b3,   455,  156 },
+      { 0xde469fbd, 0x99a05fe3,   481,  164 },
+      { 0xa59bc234, 0xdb398c25,   508,  172 },
+      { 0xf6c69a72, 0xa3989f5c,   534,  180 },
+      { 0xb7dcbf53, 0x54e9bece,   561,  188 },
+      { 0x88fcf317, 0xf22241e2,   588,  196 },
+      { 0xcc20ce9b, 0xd35c78a5,   614,  204 },
+      { 0x98165af3, 0x7b2153df,   641,  212 },
+      { 0xe2a0b5dc, 0x971f303a,   667,  220 },
+      { 0xa8d9d153, 0x5ce3b396,   694,  228 },
+      { 0xfb9b7cd9, 0xa4a7443c,   720,  236 },
+      { 0xbb764c4c, 0xa7a44410,   747,  244 },
+      { 0x8bab8eef, 0xb6409c1a,   774,  252 },
+      { 0xd01fef10, 0xa657842c,   800,  260 },
+      { 0x9b10a4e5, 0xe9913129,   827,  268 },
+      { 0xe7109bfb, 0xa19c0c9d,   853,  276 },
+      { 0xac2820d9, 0x623bf429,   880,  284 },
+      { 0x80444b5e, 0x7aa7cf85,   907,  292 },
+      { 0xbf21e440, 0x03acdd2d,   933,  300 },
+      { 0x8e679c2f, 0x5e44ff8f,   960,  308 },
+      { 0xd433179d, 0x9c8cb841,   986,  316 },
+      { 0x9e19db92, 0xb4e31ba9,  1013,  324 },
+      { 0xeb96bf6e, 0xbadf77d9,  1039,  332 },
+      { 0xaf87023b, 0x9bf0ee6b,  1066,  340 }
+};
+
+
+static inline DiyFp 
+doubleToDiyFp( double value )
+{
+   UInt64 bits;
+   memcpy( &bits, &value, sizeof(bits) );
+   int biasedExponent = int( ( bits >> 52 ) & 0x7ff );
+   UInt64 significand = bits & ( doubleHiddenBit - 1 );
+   if ( biasedExponent )
+      return DiyFp( significand + doubleHiddenBit, biasedExponent - 1075 );
+   return DiyFp( significand, -1074 );
+}
+
+
+static inline DiyFp 
+normalize( DiyFp x )
+{
+   while ( !( x.f & diyFpTopBit ) )
+   {
+      x.f <<= 1;
+      --x.e;
+   }
+   return x;
+}
+
+
+// The upper 64 bits of the product, rounded.
+static inline DiyFp 
+multiply( const DiyFp &x, const DiyFp &y )
+{
+   const UInt64 mask = 0xffffffffu;
+   UInt64 a = x.f >> 32;
+   UInt64 b = x.f & mask;
+   UInt64 c = y.f >> 32;
+   UInt64 d = y.f & mask;
+   UInt64 ac = a * c;
+   UInt64 bc = b * c;
+   UInt64 ad = a * d;
+   UInt64 bd = b * d;
+   UInt64 middle = ( bd >> 32 ) + ( ad & mask ) + ( bc & mask ) + ( UInt64(1) << 31 );
+   return DiyFp( ac + ( ad >> 32 ) + ( bc >> 32 ) + ( middle >> 32 ), x.e + y.e + 64 );
+}
+
+
+// The midpoints between v and its neighbours, with the same exponent.
+static inline void 
+normalizedBoundaries( const DiyFp &v, DiyFp &minus, DiyFp &plus )
+{
+   plus = normalize( DiyFp( ( v.f << 1 ) + 1, v.e - 1 ) );
+   // Below a power of two the neighbour is half as far away.
+   if ( v.f == doubleHiddenBit )
+      minus = DiyFp( ( v.f << 2 ) - 1, v.e - 2 );
+   else
+      minus = DiyFp( ( v.f << 1 ) - 1, v.e - 1 );
+   minus.f <<= minus.e - plus.e;
+   minus.e = plus.e;
+}
+
+
+// A power of ten 10^-k that brings a number with binary exponent e into
+// the range where the digits can be generated with 64 bit integers.
+static inline DiyFp 
+cachedPower( int e, int &k )
+{
+   double dk = ( -61 - e ) * 0.30102999566398114 + 347;
+   int ik = int( dk );
+   if ( dk - ik > 0.0 )
+      ++ik;
+   const CachedPower &power = cachedPowers[ ( ik >> 3 ) + 1 ];
+   k = -power.decimalExponent;
+   return DiyFp( ( UInt64( power.high ) << 32 ) | power.low, power.binaryExponent );
+}
+
+
+static inline int 
+countDecimalDigits( unsigned int n )
+{
+   int digits = 1;
+   while ( digits < 10  &&  n >= powersOf10[digits] )
+      ++digits;
+   return digits;
+}
+
+
+// Moves the last digit towards w while that stays within the interval.
+static inline void 
+roundWeed( char *digits, int length, UInt64 delta, UInt64 rest, 
+           UInt64 tenKappa, UInt64 distance )
+{
+   while ( rest < distance  &&  delta - rest >= tenKappa  &&
+           ( rest + tenKappa < distance  ||
+             distance - rest > rest + tenKappa - distance ) )
+   {
+      --digits[length - 1];
+      rest += tenKappa;
    }
-   char* last_nonzero = ch;
-   while(ch >= buffer){
-     switch(*ch){
-     case '0':
-     case '1':
-     case '2':
-     case '3':
-     case '4':
-     case '5':
-     case '6':
-     case '7':
-     case '8':
-     case '9':
-       --ch;
-       continue;
-     case '.':
-       // Truncate zeroes to save bytes in output, but keep one.
-       *(last_nonzero+2) = '\0';
-       return buffer;
-     default:
-       return buffer;
-     }
+}
+
+
+static int 
+generateDigits( const DiyFp &w, const DiyFp &upper, UInt64 delta, 
+                char *digits, int &k )
+{
+   const int shift = -upper.e;
+   const UInt64 one = UInt64(1) << shift;
+   const UInt64 distance = upper.f - w.f;
+   unsigned int integral = (unsigned int)( upper.f >> shift );
+   UInt64 fractional = upper.f & ( one - 1 );
+   int kappa = countDecimalDigits( integral );
+   int length = 0;
+
+   while ( kappa > 0 )
+   {
+      unsigned int digit = integral / powersOf10[kappa - 1];
+      integral %= powersOf10[kappa - 1];
+      if ( digit  ||  length )
+         digits[length++] = char( '0' + digit );
+      --kappa;
+      UInt64 rest = ( UInt64( integral ) << shift ) + fractional;
+      if ( rest <= delta )
+      {
+         k += kappa;
+         roundWeed( digits, length, delta, rest, 
+                    UInt64( powersOf10[kappa] ) << shift, distance );
+         return length;
+      }
    }
-   return buffer;
+
+   for (;;)
+   {
+      fractional *= 10;
+      delta *= 10;
+      char digit = char( fractional >> shift );
+      if ( digit  ||  length )
+         digits[length++] = char( '0' + digit );
+      fractional &= one - 1;
+      --kappa;
+      if ( fractional < delta )
+      {
+         k += kappa;
+         int index = -kappa;
+         UInt64 scale = index < 10 ? powersOf10[index]
+                                   : UInt64( powersOf10[9] ) * powersOf10[index - 9];
+         roundWeed( digits, length, delta, fractional, one, distance * scale );
+         return length;
+      }
+   }
+}
+
+
+// Writes the digits of a positive, finite value; it is digits * 10^k.
+static int 
+grisu2( double value, char *digits, int &k )
+{
+   const DiyFp v = doubleToDiyFp( value );
+   DiyFp minus, plus;
+   normalizedBoundaries( v, minus, plus );
+
+   const DiyFp c = cachedPower( plus.e, k );
+   const DiyFp w = multiply( normalize( v ), c );
+   DiyFp upper = multiply( plus, c );
+   DiyFp lower = multiply( minus, c );
+   // Allow for the error in the multiplications.
+   ++lower.f;
+   --upper.f;
+   return generateDigits( w, upper, upper.f - lower.f, digits, k );
+}
+
+
+static inline char *
+copyChars( char *out, const char *text, int length )
+{
+   memcpy( out, text, length );
+   return out + length;
+}
+
+
+char *valueToChars( double value, char *buffer )
+{
+   char *out = buffer;
+   UInt64 bits;
+   memcpy( &bits, &value, sizeof(bits) );
+   if ( bits >> 63 )
+      *out++ = '-';
+
+   // Spelt as printf does.
+   if ( ( ( bits >> 52 ) & 0x7ff ) == 0x7ff )
+   {
+      if ( bits & ( doubleHiddenBit - 1 ) )
+         return copyChars( out, "nan", 3 );
+      return copyChars( out, "inf", 3 );
+   }
+
+   if ( value == 0 )
+      return copyChars( out, "0.0", 3 );
+
+   char digits[20];
+   int k;
+   int length = grisu2( value < 0 ? -value : value, digits, k );
+   int point = length + k;    // the value is 0.digits * 10^point
+   int exponent = point - 1;
+
+   // Switch to an exponent where "%.16g" used to.
+   if ( exponent < -4  ||  exponent >= 16 )
+   {
+      *out++ = digits[0];
+      if ( length > 1 )
+      {
+         *out++ = '.';
+         out = copyChars( out, digits + 1, length - 1 );
+      }
+      *out++ = 'e';
+      *out++ = exponent < 0 ? '-' : '+';
+      if ( exponent < 0 )
+         exponent = -exponent;
+      if ( exponent >= 100 )
+      {
+         *out++ = char( '0' + exponent / 100 );
+         exponent %= 100;
+      }
+      *out++ = char( '0' + exponent / 10 );
+      *out++ = char( '0' + exponent % 10 );
+   }
+   else if ( point <= 0 )
+   {
+      out = copyChars( out, "0.0000", 2 - point );
+      out = copyChars( out, digits, length );
+   }
+   else if ( point >= length )
+   {
+      // Keep a ".0", so that the value reads back as a double.
+      out = copyChars( out, digits, length );
+      for ( int zeros = point - length; zeros > 0; --zeros )
+         *out++ = '0';
+      out = copyChars( out, ".0", 2 );
+   }
+   else
+   {
+      out = copyChars( out, digits, point );
+      *out++ = '.';
+      out = copyChars( out, digits + point, length - point );
+   }
+
+   return out;
+}
+
+
+std::string valueToString( double value )
+{
+   char buffer[doubleToCharsBufferSize];
+   return std::string( buffer, valueToChars( value, buffer ) );
 }
 
 
@@ -3627,42 +4675,54 @@ std::string valueToString( bool value )
 
 std::string valueToQuotedString( const char *value )
 {
+   std::string result;
    if (value == NULL)
-      return "";
+      return result;
+   valueToQuotedString( value, result );
+   return result;
+}
+
+
+void valueToQuotedString( const char *value, std::string &out )
+{
+   if (value == NULL)
+      return;
    // Not sure how to handle unicode...
    if (strpbrk(value, "\"\\\b\f\n\r\t") == NULL && !containsControlCharacter( value ))
-      return std::string("\"") + value + "\"";
+   {
+      out += '\"';
+      out += value;
+      out += '\"';
+      return;
+   }
    // We have to walk value and escape any special characters.
-   // Appending to std::string is not efficient, but this should be rare.
    // (Note: forward slashes are *not* rare, but I am not escaping them.)
-   std::string::size_type maxsize = strlen(value)*2 + 3; // allescaped+quotes+NULL
-   std::string result;
-   result.reserve(maxsize); // to avoid lots of mallocs
-   result += "\"";
+   out.reserve(out.size() + strlen(value)*2 + 3); // allescaped+quotes+NULL
+   out += "\"";
    for (const char* c=value; *c != 0; ++c)
    {
       switch(*c)
       {
          case '\"':
-            result += "\\\"";
+            out += "\\\"";
             break;
          case '\\':
-            result += "\\\\";
+            out += "\\\\";
             break;
          case '\b':
-            result += "\\b";
+            out += "\\b";
             break;
          case '\f':
-            result += "\\f";
+            out += "\\f";
             break;
          case '\n':
-            result += "\\n";
+            out += "\\n";
             break;
          case '\r':
-            result += "\\r";
+            out += "\\r";
             break;
          case '\t':
-            result += "\\t";
+            out += "\\t";
             break;
          //case '/':
             // Even though \/ is considered a legal escape in JSON, a bare
@@ -3677,17 +4737,16 @@ std::string valueToQuotedString( const char *value )
             {
                std::ostringstream oss;
                oss << "\\u" << std::hex << std::uppercase << std::setfill('0') << std::setw(4) << static_cast<int>(*c);
-               result += oss.str();
+               out += oss.str();
             }
             else
             {
-               result += *c;
+               out += *c;
             }
             break;
       }
    }
-   result += "\"";
-   return result;
+   out += "\"";
 }
 
 // Class Writer
@@ -3724,66 +4783,76 @@ FastWriter::dropNullPlaceholders()
 std::string 
 FastWriter::write( const Value &root )
 {
-   document_ = "";
-   writeValue( root );
+   document_.clear();
+   writeValue( root, document_ );
    document_ += "\n";
    return document_;
 }
 
 
 void 
-FastWriter::writeValue( const Value &value )
+FastWriter::write( const Value &root, std::string &out )
+{
+   writeValue( root, out );
+}
+
+
+void 
+FastWriter::writeValue( const Value &value, std::string &document )
 {
    switch ( value.type() )
    {
    case nullValue:
-      if (!dropNullPlaceholders_) document_ += "null";
+      if (!dropNullPlaceholders_) document += "null";
       break;
    case intValue:
-      document_ += valueToString( value.asLargestInt() );
+      document += valueToString( value.asLargestInt() );
       break;
    case uintValue:
-      document_ += valueToString( value.asLargestUInt() );
+      document += valueToString( value.asLargestUInt() );
       break;
    case realValue:
-      document_ += valueToString( value.asDouble() );
+      {
+         char buffer[doubleToCharsBufferSize];
+         document.append( buffer, valueToChars( value.asDouble(), buffer ) );
+      }
       break;
    case stringValue:
-      document_ += valueToQuotedString( value.asCString() );
+      valueToQuotedString( value.asCString(), document );
       break;
    case booleanValue:
-      document_ += valueToString( value.asBool() );
+      document += value.asBool() ? "true" : "false";
       break;
    case arrayValue:
       {
-         document_ += "[";
+         document += '[';
          int size = value.size();
          for ( int index =0; index < size; ++index )
          {
             if ( index > 0 )
-               document_ += ",";
-            writeValue( value[index] );
+               document += ',';
+            writeValue( value[index], document );
          }
-         document_ += "]";
+         document += ']';
       }
       break;
    case objectValue:
       {
-         Value::Members members( value.getMemberNames() );
-         document_ += "{";
-         for ( Value::Members::iterator it = members.begin(); 
-               it != members.end(); 
+         // Walk the members in place, rather than copying out their names
+         // and looking each one up again.
+         document += '{';
+         for ( Value::const_iterator it = value.begin(); 
+               it != value.end(); 
                ++it )
          {
-            const std::string &name = *it;
-            if ( it != members.begin() )
-               document_ += ",";
-            document_ += valueToQuotedString( name.c_str() );
-            document_ += yamlCompatiblityEnabled_ ? ": " 
-                                                  : ":";
-            writeValue( value[name] );
+            if ( it != value.begin() )
+               document += ',';
+            valueToQuotedString( it.memberName(), document );
+            document += yamlCompatiblityEnabled_ ? ": " 
+                                                 : ":";
+            writeValue( *it, document );
          }
-         document_ += "}";
+         document += '}';
       }
       break;
    }
@@ -107,6 +107,14 @@ license you like.
 /// as if it was a POD) that may cause some validation tool to report errors.
 /// Only has effects if JSON_VALUE_USE_INTERNAL_MAP is defined.
 //#  define JSON_USE_SIMPLE_INTERNAL_ALLOCATOR 1
+/// If defined, objects and arrays keep their members in a std::map, rather
+/// than in nodes found through one sorted block of pointers
+/// (Value::ObjectValues). It changes the layout of Value: define it for
+/// everything that includes this header, or nothing.
+//# define JSON_NO_FLAT_MAP 1
+# if !defined(JSON_NO_FLAT_MAP)  &&  !defined(JSON_USE_CPPTL_SMALLMAP)
+#  define JSON_USE_FLAT_MAP 1
+# endif
 
 // If non-zero, the library uses exceptions to report bad input instead of C
 // assertion macros. The default is to use exceptions.
@@ -114,6 +122,12 @@ license you like.
 # define JSON_USE_EXCEPTION 1
 # endif
 
+/// If defined, Value has a move constructor and move assignment, which take
+/// the other Value's storage and leave it null.
+# if __cplusplus >= 201103L  ||  ( defined(_MSC_VER)  &&  _MSC_VER >= 1600 )
+#  define JSON_HAS_RVALUE_REFERENCES 1
+# endif
+
 /// If defined, indicates that the source file is amalgated
 /// to prevent private header inclusion.
 /// Remarks: it is automatically defined in the generated amalgated header.
@@ -328,6 +342,8 @@ namespace Json {
 #endif // if !defined(JSON_IS_AMALGAMATION)
 # include <string>
 # include <vector>
+# include <new>
+# include <cstddef>
 
 # ifndef JSON_USE_CPPTL_SMALLMAP
 #  include <map>
@@ -405,6 +421,168 @@ namespace Json {
       const char *str_;
    };
 
+   /** \brief A StaticString for a member name in the interned key table.
+    *
+    * Values share the table's copy of an interned name, rather than each
+    * duplicating it, whenever it is used as a member name: by operator[],
+    * by the Reader, and by these handles. Handles also let lookups
+    * compare pointers before strings. Make them once, for the names a
+    * program uses over and over:
+    * \code
+    * static const Json::InternedKey key_id( "_id" );
+    * doc[key_id] = id;
+    * \endcode
+    */
+   class JSON_API InternedKey : public StaticString
+   {
+   public:
+      explicit InternedKey( const char *name );
+   };
+
+   /// Adds name to the process-wide table of member names, returning the
+   /// table's copy, or 0 if the table is full. Safe from any thread; the
+   /// table's strings are never freed.
+   JSON_API const char *internKey( const char *name );
+   /// The table's copy of name, or 0 if it has not been interned.
+   JSON_API const char *findInternedKey( const char *name );
+
+   /** \brief Bump allocator for the memory behind Values.
+    *
+    * While an Arena::Scope is in effect on a thread, everything allocated
+    * for Values on that thread (strings, member names, object and array
+    * nodes) is taken from the arena rather than the heap, including members
+    * added to Values that were created outside the scope. Interned member
+    * names are never in an arena. Releasing it does
+    * nothing; reset() frees everything at once. Values using an arena must
+    * have been destroyed (or deliberately abandoned) before it is reset or
+    * destroyed; copy a Value in Scope(0) to keep it.
+    *
+    * An Arena may only be used by one thread at a time.
+    *
+    * \code
+    * Json::Arena arena;
+    * {
+    *    Json::Arena::Scope scope( &arena );
+    *    Json::Value doc;
+    *    reader.parse( text, doc );
+    *    ...
+    * }
+    * arena.reset();
+    * \endcode
+    */
+   class JSON_API Arena
+   {
+   public:
+      /// Makes arena (or the heap, if 0) the current thread's allocator
+      /// until destroyed.
+      class JSON_API Scope
+      {
+      public:
+         explicit Scope( Arena *arena );
+         ~Scope();
+
+      private:
+         Scope( const Scope & );
+         void operator =( const Scope & );
+
+         Arena *previous_;
+      };
+
+      explicit Arena( size_t blockSize = 64 * 1024 );
+      ~Arena();
+
+      void *allocate( size_t size );
+      /// Frees everything allocated, keeping one block for reuse.
+      void reset();
+      /// Takes over everything other has allocated, which is then freed
+      /// with this arena's, leaving other empty. Values parsed into
+      /// other (e.g., on another thread) may then be moved into ones
+      /// allocated here.
+      void adopt( Arena &other );
+      /// Bytes allocated since the last reset.
+      size_t used() const;
+
+      /// The current thread's arena, or 0.
+      static Arena *current();
+
+   private:
+      Arena( const Arena & );
+      void operator =( const Arena & );
+
+      struct Block
+      {
+         Block *next_;
+         size_t size_;
+      };
+
+      Block *blocks_;
+      char *position_;
+      char *end_;
+      size_t blockSize_;
+      size_t used_;
+   };
+
+   /// Allocates from the current thread's Arena, or the heap if it has
+   /// none; releaseMemory() knows which.
+   JSON_API void *allocateMemory( size_t size );
+   JSON_API void releaseMemory( void *memory );
+
+   /// A standard allocator using allocateMemory(), for Value's containers.
+   template <typename T>
+   class ArenaAllocator
+   {
+   public:
+      typedef T value_type;
+      typedef T *pointer;
+      typedef const T *const_pointer;
+      typedef T &reference;
+      typedef const T &const_reference;
+      typedef size_t size_type;
+      typedef ptrdiff_t difference_type;
+
+      template <typename U>
+      struct rebind
+      {
+         typedef ArenaAllocator<U> other;
+      };
+
+      ArenaAllocator() {}
+      ArenaAllocator( const ArenaAllocator & ) {}
+      template <typename U>
+      ArenaAllocator( const ArenaAllocator<U> & ) {}
+
+      pointer address( reference x ) const { return &x; }
+      const_pointer address( const_reference x ) const { return &x; }
+
+      pointer allocate( size_type n, const void * = 0 )
+      {
+         return static_cast<pointer>( allocateMemory( n * sizeof(T) ) );
+      }
+
+      void deallocate( pointer p, size_type )
+      {
+         releaseMemory( p );
+      }
+
+      size_type max_size() const
+      {
+         return size_t(-1) / sizeof(T);
+      }
+
+      void construct( pointer p, const T &value )
+      {
+         new ( static_cast<void *>( p ) ) T( value );
+      }
+
+      void destroy( pointer p )
+      {
+         p->~T();
+      }
+
+      bool operator ==( const ArenaAllocator & ) const { return true; }
+      bool operator !=( const ArenaAllocator & ) const { return false; }
+   };
+
    /** \brief Represents a <a HREF="http://www.json.org">JSON</a> value.
     *
     * This class is a discriminated union wrapper that can represents a:
@@ -506,8 +684,96 @@ namespace Json {
       };
 
    public:
-#  ifndef JSON_USE_CPPTL_SMALLMAP
-      typedef std::map<CZString, Value> ObjectValues;
+#  if defined(JSON_USE_FLAT_MAP)
+      /** \brief The members of an object or array: a block of pointers to
+       * them, sorted by key, with the members themselves constructed in
+       * chunks that are never moved. Both are allocated with
+       * allocateMemory().
+       *
+       * Has the parts of std::map's interface that Value uses; insert()
+       * must be given the lower_bound() of the new key. As with std::map,
+       * references to members stay valid until the member is erased, but
+       * adding or removing a member invalidates iterators.
+       */
+      class ObjectValues
+      {
+      public:
+         typedef std::pair<CZString, Value> value_type;
+         typedef size_t size_type;
+
+         template <typename Member>
+         class Iterator
+         {
+         public:
+            Iterator( value_type *const *node = 0 ) : node_( node ) {}
+            Iterator( const Iterator<value_type> &other )
+               : node_( other.node_ ) {}
+
+            Member &operator *() const { return **node_; }
+            Member *operator ->() const { return *node_; }
+            Iterator &operator ++() { ++node_; return *this; }
+            Iterator &operator --() { --node_; return *this; }
+            std::ptrdiff_t operator -( const Iterator &other ) const
+            {
+               return node_ - other.node_;
+            }
+            bool operator ==( const Iterator &other ) const
+            {
+               return node_ == other.node_;
+            }
+            bool operator !=( const Iterator &other ) const
+            {
+               return node_ != other.node_;
+            }
+
+            value_type *const *node_;
+         };
+         typedef Iterator<value_type> iterator;
+         typedef Iterator<const value_type> const_iterator;
+
+         ObjectValues();
+         ObjectValues( const ObjectValues &other );
+         ~ObjectValues();
+         ObjectValues &operator =( const ObjectValues &other );
+
+         iterator begin() { return index_; }
+         iterator end() { return index_ + size_; }
+         const_iterator begin() const { return index_; }
+         const_iterator end() const { return index_ + size_; }
+         size_type size() const { return size_; }
+         bool empty() const { return size_ == 0; }
+
+         iterator lower_bound( const CZString &key );
+         const_iterator lower_bound( const CZString &key ) const;
+         iterator find( const CZString &key );
+         const_iterator find( const CZString &key ) const;
+         iterator insert( iterator position, const value_type &value );
+         void erase( iterator position );
+         size_type erase( const CZString &key );
+         void clear();
+         void swap( ObjectValues &other );
+
+         bool operator <( const ObjectValues &other ) const;
+         bool operator ==( const ObjectValues &other ) const;
+
+      private:
+         struct Chunk;
+         struct KeyLess;
+
+         void reserve( size_type capacity );
+         value_type *allocateNode( size_type chunkCapacity );
+         void releaseNodes();
+
+         value_type **index_;
+         size_type size_;
+         size_type capacity_;
+         Chunk *chunks_;
+         value_type *free_;
+      };
+#  elif !defined(JSON_USE_CPPTL_SMALLMAP)
+      typedef std::map<CZString, Value, std::less<CZString>,
+                       ArenaAllocator<std::pair<const CZString, Value> > >
+         ObjectValues;
 #  else
       typedef CppTL::SmallMap<CZString, Value> ObjectValues;
 #  endif // ifndef JSON_USE_CPPTL_SMALLMAP
@@ -557,9 +823,15 @@ namespace Json {
 # endif
       Value( bool value );
       Value( const Value &other );
+# ifdef JSON_HAS_RVALUE_REFERENCES
+      Value( Value &&other );
+# endif
       ~Value();
 
       Value &operator=( const Value &other );
+# ifdef JSON_HAS_RVALUE_REFERENCES
+      Value &operator=( Value &&other );
+# endif
       /// Swap values.
       /// \note Currently, comments are intentionally not swapped, for
       /// both logic and efficiency.
@@ -1717,8 +1989,16 @@ namespace Json {
    public: // overridden from Writer
       virtual std::string write( const Value &root );
 
+   public:
+      /** \brief Appends root to out, without the newline that write() adds.
+       *
+       * Nothing is allocated beyond what out grows by, so a buffer that is
+       * kept and cleared between documents is written into without copies.
+       */
+      void write( const Value &root, std::string &out );
+
    private:
-      void writeValue( const Value &value );
+      void writeValue( const Value &value, std::string &document );
 
       std::string document_;
       bool yamlCompatiblityEnabled_;
@@ -1847,6 +2127,20 @@ namespace Json {
    std::string JSON_API valueToString( double value );
    std::string JSON_API valueToString( bool value );
    std::string JSON_API valueToQuotedString( const char *value );
+   /// Appends value to out as valueToQuotedString() would return it.
+   void JSON_API valueToQuotedString( const char *value, std::string &out );
+
+   /// Size of the buffer that must be passed to valueToChars().
+   enum { doubleToCharsBufferSize = 32 };
+
+   /** \brief Writes value into buffer as valueToString() does, without
+    * allocating or depending on the locale.
+    *
+    * The digits are the shortest (or very nearly so) that read back as
+    * exactly value. buffer must hold doubleToCharsBufferSize chars.
+    * \return the end of the text, which is not null terminated.
+    */
+   char * JSON_API valueToChars( double value, char *buffer );
 
    /// \brief Output using the StyledStreamWriter.
    /// \see Json::operator>>()
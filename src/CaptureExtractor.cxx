@@ -0,0 +1,236 @@
+/* Copyright 2012 (C) Daniel Richman. License: GNU GPL 3; see LICENSE. */
+
+#include "habitat/CaptureExtractor.h"
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include "habitat/EZ.h"
+
+using namespace std;
+
+namespace habitat {
+
+CaptureChunk::CaptureChunk(CaptureExtractor &p)
+    : ExtractorManager(p.uthr), parent(p), bytes(NULL), length(0),
+      flags(PUSH_NONE), done(false)
+{
+    add(extractor);
+}
+
+CaptureChunk::Event &CaptureChunk::add_event()
+{
+    events.push_back(Event());
+    return events.back();
+}
+
+void CaptureChunk::run()
+{
+    try
+    {
+        /* Skip ExtractorManager::push and its lock, since nobody else
+         * can get at this chunk's extractor. */
+        for (size_t i = 0; i < length; i++)
+            extractor.push(bytes[i], flags);
+    }
+    catch (exception &e)
+    {
+        error = e.what();
+    }
+
+    EZ::MutexLock lock(parent.condvar);
+    done = true;
+    parent.condvar.broadcast();
+}
+
+void CaptureChunk::upload(const string &sentence)
+{
+    Event &e = add_event();
+    e.type = Event::UPLOAD;
+    e.text = sentence;
+}
+
+void CaptureChunk::status(const string &msg)
+{
+    Event &e = add_event();
+    e.type = Event::STATUS;
+    e.text = msg;
+}
+
+void CaptureChunk::data(const Json::Value &d)
+{
+    Event &e = add_event();
+    e.type = Event::DATA;
+    e.doc = d;
+}
+
+static StringRef rebase(const StringRef &ref, const char *from,
+                        const char *to)
+{
+    if (!ref.data)
+        return ref;
+
+    return StringRef(to + (ref.data - from), ref.length);
+}
+
+void CaptureChunk::record(const TelemetryRecord &r)
+{
+    Event &e = add_event();
+    e.type = Event::RECORD;
+
+    /* r points into the extractor's buffer, which will be reused, so
+     * copy the sentence and point the copied record into that. */
+    e.text.assign(r.sentence.data, r.sentence.length);
+    e.fields.assign(r.fields, r.fields + r.field_count);
+
+    const char *from = r.sentence.data;
+    const char *to = e.text.data();
+
+    vector<TelemetryField>::iterator it;
+    for (it = e.fields.begin(); it != e.fields.end(); it++)
+        (*it).text = rebase((*it).text, from, to);
+
+    e.record = r;
+    e.record.sentence = StringRef(to, e.text.length());
+    e.record.callsign = rebase(r.callsign, from, to);
+    e.record.fields = e.fields.size() ? &e.fields[0] : NULL;
+}
+
+/* Owns the chunks for one extract() */
+class CaptureChunks
+{
+public:
+    vector<CaptureChunk *> list;
+
+    ~CaptureChunks()
+    {
+        vector<CaptureChunk *>::iterator it;
+        for (it = list.begin(); it != list.end(); it++)
+            delete *it;
+    }
+};
+
+CaptureExtractor::CaptureExtractor(UploaderThread &u, int threads,
+                                   size_t cs)
+    : pool(threads), chunk_size(cs), outputs(OUTPUT_JSON), uthr(u)
+{
+    if (!chunk_size)
+        throw invalid_argument("chunk_size must be positive");
+}
+
+CaptureExtractor::~CaptureExtractor()
+{
+    pool.wait();
+}
+
+/* The end of the chunk starting at start: roughly chunk_size bytes, and
+ * just after a line ending (or at the end of the capture). */
+static size_t chunk_end(const char *data, size_t length, size_t start,
+                        size_t chunk_size)
+{
+    if (length - start <= chunk_size)
+        return length;
+
+    size_t end = start + chunk_size;
+
+    while (end < length && data[end - 1] != '\n' && data[end - 1] != '\r')
+        end++;
+
+    return end;
+}
+
+void CaptureExtractor::extract(const char *data, size_t length,
+                               enum push_flags flags)
+{
+    /* Enough chunks to keep the pool busy while the oldest is emitted */
+    CaptureChunks chunks;
+    for (size_t i = 0; i < pool.size() * 2; i++)
+        chunks.list.push_back(new CaptureChunk(*this));
+
+    const size_t window = chunks.list.size();
+    size_t start = 0, submitted = 0, emitted = 0;
+
+    try
+    {
+        for (;;)
+        {
+            while (start < length && submitted - emitted < window)
+            {
+                CaptureChunk &c = *(chunks.list[submitted % window]);
+                size_t end = chunk_end(data, length, start, chunk_size);
+
+                c.bytes = data + start;
+                c.length = end - start;
+                c.flags = flags;
+                c.done = false;
+                c.payload(current_payload);
+                c.payloads(current_payloads);
+                c.output(outputs);
+
+                pool.submit(&c);
+                start = end;
+                submitted++;
+            }
+
+            if (emitted == submitted)
+                break;
+
+            CaptureChunk &c = *(chunks.list[emitted % window]);
+
+            {
+                EZ::MutexLock lock(condvar);
+
+                while (!c.done)
+                    condvar.wait();
+            }
+
+            if (c.error.size())
+                throw runtime_error(c.error);
+
+            emit(c);
+            emitted++;
+        }
+    }
+    catch (...)
+    {
+        /* The chunks (and maybe data) must outlive any running tasks */
+        pool.wait();
+        throw;
+    }
+}
+
+void CaptureExtractor::extract(const string &filename,
+                               enum push_flags flags)
+{
+    EZ::MappedFile file(filename);
+
+    if (file.length())
+        extract(file.data(), file.length(), flags);
+}
+
+void CaptureExtractor::emit(CaptureChunk &chunk)
+{
+    deque<CaptureChunk::Event>::iterator it;
+    for (it = chunk.events.begin(); it != chunk.events.end(); it++)
+    {
+        switch ((*it).type)
+        {
+            case CaptureChunk::Event::UPLOAD:
+                /* The events are cleared below, so give the text away */
+                upload(std::move((*it).text));
+                break;
+            case CaptureChunk::Event::STATUS:
+                status((*it).text);
+                break;
+            case CaptureChunk::Event::DATA:
+                data((*it).doc);
+                break;
+            case CaptureChunk::Event::RECORD:
+                record((*it).record);
+                break;
+        }
+    }
+
+    chunk.events.clear();
+}
+
+} /* namespace habitat */
@@ -0,0 +1,87 @@
+/* Copyright 2012 (C) Daniel Richman. License: GNU GPL 3; see LICENSE. */
+
+#include "habitat/Clock.h"
+#include <ctime>
+#include <stdexcept>
+#include <pthread.h>
+
+using namespace std;
+
+namespace Clock {
+
+long long int System::now()
+{
+    return time(NULL);
+}
+
+long long int Coarse::now()
+{
+#ifdef CLOCK_REALTIME_COARSE
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_REALTIME_COARSE, &ts) == 0)
+        return ts.tv_sec;
+#endif
+
+    return time(NULL);
+}
+
+/* Simulated uses a bare pthread mutex, rather than EZ::Mutex, so that
+ * RFC3339 doesn't drag in EZ (and cURL) */
+class SimulatedLock
+{
+    pthread_mutex_t &mutex;
+
+public:
+    SimulatedLock(pthread_mutex_t &m) : mutex(m)
+        { pthread_mutex_lock(&mutex); };
+    ~SimulatedLock() { pthread_mutex_unlock(&mutex); };
+};
+
+Simulated::Simulated(long long int start, long long int s)
+    : current(start), step(s)
+{
+    if (pthread_mutex_init(&mutex, NULL) != 0)
+        throw runtime_error("Failed to create mutex");
+}
+
+Simulated::~Simulated()
+{
+    pthread_mutex_destroy(&mutex);
+}
+
+long long int Simulated::now()
+{
+    SimulatedLock lock(mutex);
+
+    long long int value = current;
+    current += step;
+    return value;
+}
+
+void Simulated::set(long long int value)
+{
+    SimulatedLock lock(mutex);
+    current = value;
+}
+
+void Simulated::advance(long long int amount)
+{
+    SimulatedLock lock(mutex);
+    current += amount;
+}
+
+static Coarse default_source;
+static Source *current_source = &default_source;
+
+Source &source()
+{
+    return *current_source;
+}
+
+void set_source(Source *source)
+{
+    current_source = source ? source : &default_source;
+}
+
+} /* namespace Clock */
@@ -3,9 +3,13 @@
 #include "habitat/CouchDB.h"
 #include <curl/curl.h>
 #include <string>
+#include <vector>
 #include <memory>
+#include <utility>
+#include <sstream>
 #include <stdexcept>
 #include "habitat/EZ.h"
+#include "habitat/Clock.h"
 
 using namespace std;
 
@@ -40,8 +44,10 @@ static string database_url(const string &server_url, const string &db)
     return url;
 }
 
-Server::Server(const string &url)
-    : url(server_url(url)) {}
+Server::Server(const string &url, size_t cache_size)
+    : url(server_url(url)), uuid_cache_mutex("CouchDB::Server::uuid_cache"),
+      response_cache(cache_size), breaker(5, 30),
+      spare_curls_mutex("CouchDB::Server::spare_curls") {}
 
 Database::Database(Server &server, const string &db)
     : server(server), url(database_url(server.url, db)) {}
@@ -49,51 +55,329 @@ Database::Database(Server &server, const string &db)
 string Server::next_uuid()
 {
     EZ::MutexLock lock(uuid_cache_mutex);
-    string uuid;
 
-    if (uuid_cache.size())
+    if (!uuid_cache.size())
+        fill_uuid_cache();
+
+    string uuid = uuid_cache.front();
+    uuid_cache.pop_front();
+    return uuid;
+}
+
+void Server::warm_up()
+{
+    EZ::MutexLock lock(uuid_cache_mutex);
+
+    /* Fetching UUIDs opens the connection, which curl then keeps */
+    if (!uuid_cache.size())
+        fill_uuid_cache();
+}
+
+/* You need to hold uuid_cache_mutex */
+void Server::fill_uuid_cache()
+{
+    string uuid_url(url);
+    uuid_url.append("_uuids?count=100");
+
+    /* Every response is different */
+    Json::Value *root = get_json(uuid_url, false);
+    unique_ptr<Json::Value> value_destroyer(root);
+
+    const Json::Value &uuids = (*root)["uuids"];
+    if (!uuids.isArray() || !uuids.size())
+        throw runtime_error("Invalid UUIDs response");
+
+    for (Json::UInt index = 0; index < uuids.size(); index++)
+        uuid_cache.push_back(uuids[index].asString());
+}
+
+unique_ptr<EZ::cURL> Server::borrow_curl()
+{
+    EZ::MutexLock lock(spare_curls_mutex);
+
+    if (!spare_curls.size())
+        return unique_ptr<EZ::cURL>(new EZ::cURL());
+
+    unique_ptr<EZ::cURL> handle(std::move(spare_curls.back()));
+    spare_curls.pop_back();
+    return handle;
+}
+
+void Server::return_curl(unique_ptr<EZ::cURL> handle)
+{
+    EZ::MutexLock lock(spare_curls_mutex);
+    spare_curls.push_back(std::move(handle));
+}
+
+void CircuitBreaker::configure(unsigned int new_threshold,
+                               long long int new_cooldown)
+{
+    EZ::MutexLock lock(mutex);
+    threshold = new_threshold;
+    cooldown = new_cooldown;
+
+    if (!threshold)
+        open = probing = false;
+}
+
+bool CircuitBreaker::is_open()
+{
+    EZ::MutexLock lock(mutex);
+    return open;
+}
+
+void CircuitBreaker::before(const string &url)
+{
+    EZ::MutexLock lock(mutex);
+
+    if (!open)
+        return;
+
+    /* Only the time is asked for here, so that while the server is up the
+     * breaker costs a lock and nothing more */
+    if (probing || Clock::now() < retry_at)
+        throw CircuitOpen(url);
+
+    probing = true;
+}
+
+void CircuitBreaker::succeeded()
+{
+    EZ::MutexLock lock(mutex);
+    failures = 0;
+    open = probing = false;
+}
+
+void CircuitBreaker::failed()
+{
+    EZ::MutexLock lock(mutex);
+
+    if (failures < threshold)
+        failures++;
+
+    if (probing || (threshold && !open && failures >= threshold))
     {
-        uuid = uuid_cache.front();
-        uuid_cache.pop_front();
-        return uuid;
+        open = true;
+        probing = false;
+        retry_at = Clock::now() + cooldown;
     }
-    else
+}
+
+/* Tells the breaker how a request went. Leaving the scope without
+ * settle() (a cURLError, say) is a failure. */
+class BreakerRequest
+{
+    CircuitBreaker &breaker;
+    bool settled;
+
+public:
+    BreakerRequest(CircuitBreaker &b, const string &url)
+        : breaker(b), settled(false) { breaker.before(url); };
+    ~BreakerRequest() { if (!settled) breaker.failed(); };
+
+    void settle(bool success)
     {
-        string uuid_url(url);
-        uuid_url.append("_uuids?count=100");
+        settled = true;
+        if (success)
+            breaker.succeeded();
+        else
+            breaker.failed();
+    }
 
-        Json::Value *root = get_json(uuid_url);
-        auto_ptr<Json::Value> value_destroyer(root);
+    void settle(const EZ::HTTPResponse &e) { settle(e.response_code < 500); }
+};
 
-        const Json::Value &uuids = (*root)["uuids"];
-        if (!uuids.isArray() || !uuids.size())
-            throw runtime_error("Invalid UUIDs response");
+string Server::get(EZ::cURL &with, const string &get_url)
+{
+    BreakerRequest request(breaker, get_url);
 
-        uuid = uuids[Json::UInt(0)].asString();
+    try
+    {
+        string response = with.get(get_url);
+        request.settle(true);
+        return response;
+    }
+    catch (EZ::HTTPResponse &e)
+    {
+        request.settle(e);
+        throw;
+    }
+}
 
-        for (Json::UInt index = 1; index < uuids.size(); index++)
-            uuid_cache.push_back(uuids[index].asString());
+bool Server::get(EZ::cURL &with, const string &get_url, string &etag,
+                 string &response)
+{
+    BreakerRequest request(breaker, get_url);
+
+    try
+    {
+        bool modified = with.get(get_url, etag, response);
+        request.settle(true);
+        return modified;
     }
+    catch (EZ::HTTPResponse &e)
+    {
+        request.settle(e);
+        throw;
+    }
+}
 
-    return uuid;
+string Server::put(const string &put_url, const string &data)
+{
+    BreakerRequest request(breaker, put_url);
+
+    try
+    {
+        string response = curl.put(put_url, data);
+        request.settle(true);
+        return response;
+    }
+    catch (EZ::HTTPResponse &e)
+    {
+        request.settle(e);
+        throw;
+    }
+}
+
+string Server::post(const string &post_url, const string &data,
+                    const string &content_type)
+{
+    BreakerRequest request(breaker, post_url);
+
+    try
+    {
+        string response = curl.post(post_url, data, content_type);
+        request.settle(true);
+        return response;
+    }
+    catch (EZ::HTTPResponse &e)
+    {
+        request.settle(e);
+        throw;
+    }
 }
 
-Json::Value *Server::get_json(const string &get_url)
+Json::Value *Server::get_json(EZ::cURL &with, const string &get_url,
+                              bool cache)
 {
+    string response;
+    string etag;
+
+    if (!cache)
+    {
+        response = get(with, get_url);
+    }
+    else
+    {
+        etag = response_cache.etag(get_url);
+
+        if (!get(with, get_url, etag, response))
+        {
+            Json::Value *cached = response_cache.hit(get_url, etag);
+            if (cached)
+                return cached;
+
+            /* Evicted while we were asking; fetch it properly */
+            etag.clear();
+            get(with, get_url, etag, response);
+        }
+    }
+
     Json::Reader reader;
     Json::Value *doc = new Json::Value;
-    auto_ptr<Json::Value> value_destroyer(doc);
+    unique_ptr<Json::Value> value_destroyer(doc);
 
-    string response = curl.get(get_url);
+    const char *begin = response.data();
 
-    if (!reader.parse(response, *doc, false))
+    /* Parse in place, rather than have the reader copy the response */
+    if (!reader.parse(begin, begin + response.size(), *doc, false))
         throw runtime_error("JSON Parsing error");
 
+    if (cache)
+        response_cache.miss(get_url, etag, *doc, response.size());
+
     value_destroyer.release();
 
     return doc;
 }
 
+string ResponseCache::etag(const string &url)
+{
+    EZ::MutexLock lock(mutex);
+
+    map<string,list<Entry>::iterator>::iterator it = index.find(url);
+    if (it == index.end())
+        return "";
+
+    return (*(*it).second).etag;
+}
+
+Json::Value *ResponseCache::hit(const string &url, const string &etag)
+{
+    EZ::MutexLock lock(mutex);
+
+    map<string,list<Entry>::iterator>::iterator it = index.find(url);
+    if (it == index.end() || (*(*it).second).etag != etag)
+        return NULL;
+
+    entries.splice(entries.begin(), entries, (*it).second);
+    hit_count++;
+
+    /* Copied into the caller's arena, if it has one */
+    return new Json::Value((*(*it).second).value);
+}
+
+void ResponseCache::miss(const string &url, const string &etag,
+                         const Json::Value &value, size_t value_size)
+{
+    EZ::MutexLock lock(mutex);
+
+    miss_count++;
+
+    map<string,list<Entry>::iterator>::iterator it = index.find(url);
+    if (it != index.end())
+    {
+        size -= (*(*it).second).size;
+        entries.erase((*it).second);
+        index.erase(it);
+    }
+
+    if (!etag.size() || value_size > max_size)
+        return;
+
+    while (entries.size() && size + value_size > max_size)
+    {
+        size -= entries.back().size;
+        index.erase(entries.back().url);
+        entries.pop_back();
+    }
+
+    entries.push_front(Entry());
+    Entry &entry = entries.front();
+    entry.url = url;
+    entry.etag = etag;
+    entry.size = value_size;
+    index[url] = entries.begin();
+    size += value_size;
+
+    /* value may be in the caller's arena; the cache's copy must outlive
+     * it */
+    Json::Arena::Scope heap(0);
+    entry.value = value;
+}
+
+unsigned long ResponseCache::hits()
+{
+    EZ::MutexLock lock(mutex);
+    return hit_count;
+}
+
+unsigned long ResponseCache::misses()
+{
+    EZ::MutexLock lock(mutex);
+    return miss_count;
+}
+
 string Database::make_doc_url(const string &doc_id) const
 {
     string doc_url(url);
@@ -132,7 +416,7 @@ void Database::save_doc(Json::Value &doc)
 
     try
     {
-        response = server.curl.put(doc_url, json_doc);
+        response = server.put(doc_url, json_doc);
     }
     catch (EZ::HTTPResponse &e)
     {
@@ -147,7 +431,9 @@ void Database::save_doc(Json::Value &doc)
     Json::Reader reader;
     Json::Value info;
 
-    if (!reader.parse(response, info, false))
+    const char *begin = response.data();
+
+    if (!reader.parse(begin, begin + response.size(), info, false))
         throw runtime_error("JSON Parsing error");
 
     const Json::Value &new_id = info["id"];
@@ -167,8 +453,60 @@ Json::Value *Database::get_doc(const string &doc_id)
     return server.get_json(make_doc_url(doc_id));
 }
 
-Json::Value *Database::view(const string &design_doc, const string &view_name,
-                            const map<string,string> &options)
+Json::Value *Database::get_docs(const vector<string> &doc_ids)
+{
+    Json::Value keys(Json::objectValue);
+    Json::Value &keys_list = keys["keys"];
+    keys_list = Json::Value(Json::arrayValue);
+
+    for (size_t i = 0; i < doc_ids.size(); i++)
+        keys_list.append(doc_ids[i]);
+
+    Json::FastWriter writer;
+    string all_docs_url(url);
+    all_docs_url.append("_all_docs?include_docs=true");
+
+    string response = server.post(all_docs_url, writer.write(keys),
+                                  "application/json");
+
+    Json::Reader reader;
+    Json::Value root;
+    const char *begin = response.data();
+
+    if (!reader.parse(begin, begin + response.size(), root, false))
+        throw runtime_error("JSON Parsing error");
+
+    if (!root.isObject())
+        throw runtime_error("Invalid response: was not an object");
+
+    Json::Value &rows = root["rows"];
+
+    if (!rows.isArray() || rows.size() != doc_ids.size())
+        throw runtime_error("Invalid response: bad rows");
+
+    Json::Value *docs = new Json::Value(Json::arrayValue);
+    unique_ptr<Json::Value> docs_destroyer(docs);
+    docs->resize(rows.size());
+
+    for (Json::ArrayIndex i = 0; i < rows.size(); i++)
+    {
+        Json::Value &row = rows[i];
+
+        if (!row.isObject())
+            throw runtime_error("Invalid response: row was not an object");
+
+        /* Missing docs have an error, deleted ones a null doc */
+        Json::Value &doc = row["doc"];
+        if (doc.isObject())
+            (*docs)[i] = std::move(doc);
+    }
+
+    docs_destroyer.release();
+    return docs;
+}
+
+string Database::make_view_url(const string &design_doc,
+                               const string &view_name) const
 {
     string view_url(url);
 
@@ -180,13 +518,282 @@ Json::Value *Database::view(const string &design_doc, const string &view_name,
     }
 
     view_url.append(EZ::cURL::escape(view_name));
+    return view_url;
+}
+
+Json::Value *Database::view(const string &design_doc, const string &view_name,
+                            const map<string,string> &options, bool cache)
+{
+    string view_url = make_view_url(design_doc, view_name);
 
     if (options.size())
     {
         view_url.append(EZ::cURL::query_string(options, true));
     }
 
-    return server.get_json(view_url);
+    return server.get_json(view_url, cache);
+}
+
+static string count_string(size_t count)
+{
+    ostringstream temp;
+    temp << count;
+    return temp.str();
+}
+
+/*
+ * One key range of a view_paged(), fetched a page at a time. Each page
+ * asks for one row more than it keeps: that row, if it comes, is where the
+ * next page starts. (key, id) does not identify a row (a flight's
+ * payload_configuration rows all share one), so the next page also skips
+ * as many rows with that (key, id) as have been kept already.
+ */
+class ViewRange : public EZ::Task
+{
+    Database &database;
+    const string &view_url;
+    map<string,string> options;
+    const Json::Value startkey;
+    const size_t page_size;
+    const bool use_arena;
+
+    void fetch(EZ::cURL &curl);
+
+public:
+    /* If use_arena, rows are parsed into arena, which the caller must
+     * adopt before they outlive this */
+    Json::Arena arena;
+    vector<Json::Value> rows;
+    string error;
+
+    ViewRange(Database &d, const string &u, const map<string,string> &o,
+              const Json::Value &s, const Json::Value *endkey, size_t p,
+              bool a);
+    void run();
+};
+
+ViewRange::ViewRange(Database &d, const string &u,
+                     const map<string,string> &o, const Json::Value &s,
+                     const Json::Value *endkey, size_t p, bool a)
+    : database(d), view_url(u), options(o), startkey(s), page_size(p),
+      use_arena(a)
+{
+    options["limit"] = count_string(page_size + 1);
+
+    if (endkey)
+    {
+        Json::Value copy(*endkey);
+        options["endkey"] = Database::json_query_value(copy);
+        options["inclusive_end"] = "false";
+    }
+}
+
+void ViewRange::run()
+{
+    Json::Arena::Scope arena_scope(use_arena ? &arena : NULL);
+
+    try
+    {
+        unique_ptr<EZ::cURL> curl(database.server.borrow_curl());
+        fetch(*curl);
+        database.server.return_curl(std::move(curl));
+    }
+    catch (exception &e)
+    {
+        error = e.what();
+    }
+}
+
+static bool row_is(const Json::Value &row, const Json::Value &key,
+                   const string &id)
+{
+    const Json::Value &row_id = row["id"];
+    return row_id.isString() && row_id.asString() == id && row["key"] == key;
+}
+
+void ViewRange::fetch(EZ::cURL &curl)
+{
+    Json::Value page_startkey(startkey);
+    string page_startkey_docid;
+    size_t skip = 0;
+
+    for (;;)
+    {
+        map<string,string> page_options(options);
+        page_options["startkey"] = Database::json_query_value(page_startkey);
+
+        if (page_startkey_docid.size())
+            page_options["startkey_docid"] = page_startkey_docid;
+        if (skip)
+            page_options["skip"] = count_string(skip);
+
+        string page_url(view_url);
+        page_url.append(EZ::cURL::query_string(page_options, true));
+
+        /* Not cached: a page is only wanted once, and the cache would copy
+         * it out of this thread's arena onto the heap */
+        unique_ptr<Json::Value> page(database.server.get_json(curl,
+                                                              page_url,
+                                                              false));
+
+        if (!page->isObject())
+            throw runtime_error("Invalid response: was not an object");
+
+        Json::Value &page_rows = (*page)["rows"];
+
+        if (!page_rows.isArray())
+            throw runtime_error("Invalid response: rows was not an array");
+
+        const size_t count = page_rows.size();
+        const size_t keep = count > page_size ? page_size : count;
+
+        for (Json::ArrayIndex i = 0; i < keep; i++)
+            rows.push_back(std::move(page_rows[i]));
+
+        if (count <= page_size)
+            break;
+
+        const Json::Value &next = page_rows[(Json::ArrayIndex) page_size];
+
+        if (!next.isObject() || !next["id"].isString())
+            throw runtime_error("Invalid response: bad row");
+
+        const Json::Value &next_key = next["key"];
+        const string next_id = next["id"].asString();
+
+        size_t same = 0;
+        while (same < keep && row_is(rows[rows.size() - 1 - same],
+                                     next_key, next_id))
+            same++;
+
+        /* A whole page of them, following on from the last */
+        if (same == keep && next_key == page_startkey &&
+            next_id == page_startkey_docid)
+            skip += same;
+        else
+            skip = same;
+
+        page_startkey = next_key;
+        page_startkey_docid = next_id;
+    }
+}
+
+Json::Value *Database::view_paged(const string &design_doc,
+                                  const string &view_name,
+                                  const vector<Json::Value> &startkeys,
+                                  size_t page_size,
+                                  const map<string,string> &options)
+{
+    if (!startkeys.size() || !page_size)
+        throw invalid_argument("view_paged: no startkeys, or page_size 0");
+
+    const string view_url = make_view_url(design_doc, view_name);
+    vector< unique_ptr<ViewRange> > ranges;
+
+    /* If the caller parses into an arena, so do the workers, each into
+     * their own; the caller's then takes theirs over */
+    Json::Arena *caller_arena = Json::Arena::current();
+
+    for (size_t i = 0; i < startkeys.size(); i++)
+    {
+        const Json::Value *endkey = NULL;
+        if (i + 1 < startkeys.size())
+            endkey = &startkeys[i + 1];
+
+        ranges.push_back(unique_ptr<ViewRange>(
+            new ViewRange(*this, view_url, options, startkeys[i], endkey,
+                          page_size, caller_arena != NULL)));
+    }
+
+    {
+        EZ::ThreadPool pool(ranges.size());
+
+        for (size_t i = 0; i < ranges.size(); i++)
+            pool.submit(ranges[i].get());
+
+        pool.wait();
+    }
+
+    size_t total = 0;
+
+    for (size_t i = 0; i < ranges.size(); i++)
+    {
+        if ((*ranges[i]).error.size())
+            throw runtime_error((*ranges[i]).error);
+
+        total += (*ranges[i]).rows.size();
+    }
+
+    Json::Value *result = new Json::Value(Json::objectValue);
+    unique_ptr<Json::Value> result_destroyer(result);
+
+    Json::Value &rows = (*result)["rows"];
+    rows.resize(total);
+
+    /* The rows' contents stay where the workers parsed them */
+    Json::ArrayIndex index = 0;
+    for (size_t i = 0; i < ranges.size(); i++)
+    {
+        vector<Json::Value> &range_rows = (*ranges[i]).rows;
+
+        for (size_t j = 0; j < range_rows.size(); j++)
+            rows[index++] = std::move(range_rows[j]);
+
+        if (caller_arena)
+            caller_arena->adopt((*ranges[i]).arena);
+    }
+
+    result_destroyer.release();
+    return result;
+}
+
+Json::Value *Database::info()
+{
+    return server.get_json(url);
+}
+
+Json::Value *Database::changes(const map<string,string> &options)
+{
+    string changes_url(url);
+    changes_url.append("_changes");
+
+    if (options.size())
+        changes_url.append(EZ::cURL::query_string(options, true));
+
+    return server.get_json(changes_url, false);
+}
+
+Json::Value *Database::changes(const map<string,string> &options,
+                               const vector<string> &doc_ids)
+{
+    Json::Value body(Json::objectValue);
+    Json::Value &ids = body["doc_ids"];
+    ids = Json::Value(Json::arrayValue);
+
+    for (size_t i = 0; i < doc_ids.size(); i++)
+        ids.append(doc_ids[i]);
+
+    map<string,string> filtered(options);
+    filtered["filter"] = "_doc_ids";
+
+    string changes_url(url);
+    changes_url.append("_changes");
+    changes_url.append(EZ::cURL::query_string(filtered, true));
+
+    Json::FastWriter writer;
+    string response = server.post(changes_url, writer.write(body),
+                                  "application/json");
+
+    Json::Reader reader;
+    Json::Value *root = new Json::Value;
+    unique_ptr<Json::Value> root_destroyer(root);
+    const char *begin = response.data();
+
+    if (!reader.parse(begin, begin + response.size(), *root, false))
+        throw runtime_error("JSON Parsing error");
+
+    root_destroyer.release();
+    return root;
 }
 
 string Database::update_put(const string &design_doc,
@@ -219,7 +826,7 @@ string Database::update_put(const string &design_doc,
 
     try
     {
-        return server.curl.put(update_url, payload);
+        return server.put(update_url, payload);
     }
     catch (EZ::HTTPResponse &e)
     {
@@ -0,0 +1,155 @@
+/* Copyright 2012 (C) Daniel Richman. License: GNU GPL 3; see LICENSE. */
+
+#include "habitat/DocCache.h"
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "habitat/EZ.h"
+
+using namespace std;
+
+namespace habitat {
+
+static void check_docs(const Json::Value &docs)
+{
+    if (!docs.isArray())
+        throw runtime_error("Invalid doc cache: not an array");
+
+    Json::Value::const_iterator it;
+    for (it = docs.begin(); it != docs.end(); it++)
+    {
+        if (!(*it).isObject())
+            throw runtime_error("Invalid doc cache: doc was not an object");
+    }
+}
+
+/* root is thrown away after, so its docs are moved rather than copied */
+static void take_docs(Json::Value &docs, vector<Json::Value> &out)
+{
+    vector<Json::Value> result;
+    result.reserve(docs.size());
+
+    Json::Value::iterator it;
+    for (it = docs.begin(); it != docs.end(); it++)
+        result.push_back(std::move(*it));
+
+    out.swap(result);
+}
+
+bool DocCache::load()
+{
+    struct stat info;
+
+    if (stat(filename.c_str(), &info) != 0 && errno == ENOENT)
+        return false;
+
+    EZ::MappedFile file(filename);
+    Json::Reader reader;
+    Json::Value root;
+
+    if (!reader.parse(file.data(), file.data() + file.length(), root, false))
+        throw runtime_error("Invalid doc cache: " +
+                            reader.getFormattedErrorMessages());
+
+    if (!root.isObject())
+        throw runtime_error("Invalid doc cache: not an object");
+
+    Json::Value &new_flights = root["flights"];
+    Json::Value &new_payloads = root["payloads"];
+
+    check_docs(new_flights);
+    check_docs(new_payloads);
+
+    take_docs(new_flights, flights);
+    take_docs(new_payloads, payloads);
+
+    return true;
+}
+
+static void write_docs(string &out, const char *name,
+                       const vector<Json::Value> &docs)
+{
+    Json::FastWriter writer;
+    vector<Json::Value>::const_iterator it;
+
+    out.append(name);
+    out.push_back('[');
+
+    for (it = docs.begin(); it != docs.end(); it++)
+    {
+        if (it != docs.begin())
+            out.push_back(',');
+        writer.write(*it, out);
+    }
+
+    out.push_back(']');
+}
+
+void DocCache::save() const
+{
+    string out;
+    out.append("{");
+    write_docs(out, "\"flights\":", flights);
+    out.append(",");
+    write_docs(out, "\"payloads\":", payloads);
+    out.append("}\n");
+
+    const string temp_filename = filename + ".tmp";
+    int fd = open(temp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        throw runtime_error("Failed to open " + temp_filename + ": " +
+                            strerror(errno));
+
+    const char *data = out.data();
+    size_t remaining = out.length();
+
+    while (remaining)
+    {
+        ssize_t written = write(fd, data, remaining);
+
+        if (written == -1 && errno == EINTR)
+            continue;
+
+        if (written == -1)
+        {
+            const string error = strerror(errno);
+            close(fd);
+            unlink(temp_filename.c_str());
+            throw runtime_error("Failed to write " + temp_filename + ": " +
+                                error);
+        }
+
+        data += written;
+        remaining -= written;
+    }
+
+    /* The data must be on disk before the rename is */
+    int synced = fsync(fd);
+    int closed = close(fd);
+
+    if (synced != 0 || closed != 0)
+    {
+        const string error = strerror(errno);
+        unlink(temp_filename.c_str());
+        throw runtime_error("Failed to write " + temp_filename + ": " +
+                            error);
+    }
+
+    if (rename(temp_filename.c_str(), filename.c_str()) != 0)
+    {
+        const string error = strerror(errno);
+        unlink(temp_filename.c_str());
+        throw runtime_error("Failed to rename " + temp_filename + ": " +
+                            error);
+    }
+}
+
+} /* namespace habitat */
@@ -5,8 +5,21 @@
 #include <pthread.h>
 #include <string>
 #include <memory>
+#include <map>
+#include <vector>
+#include <atomic>
 #include <stdexcept>
 #include <sstream>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -30,12 +43,151 @@ public:
     ~ThreadAttr();
 };
 
-Mutex::Mutex()
+/* The counts for one name. Updated without a lock, so that profiling
+ * doesn't add contention of its own. */
+class LockCounters
+{
+public:
+    const string name;
+    atomic<unsigned long> acquisitions, contentions;
+    atomic<unsigned long long> wait_ns, max_wait_ns, hold_ns, max_hold_ns;
+
+    LockCounters(const string &n) : name(n) { reset(); };
+    void reset();
+    void waited(unsigned long long ns);
+    void held(unsigned long long ns);
+};
+
+static atomic<bool> profiling(false);
+
+/* A bare pthread mutex, since it guards the mutexes' own setup. The
+ * registry and its counters are never freed, since mutexes may be
+ * destroyed by other static destructors. */
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static map<string,LockCounters *> *registry = NULL;
+
+static LockCounters *named_counters(const char *name)
+{
+    if (name == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&registry_mutex);
+
+    if (registry == NULL)
+        registry = new map<string,LockCounters *>;
+
+    LockCounters *&counters = (*registry)[name];
+    if (counters == NULL)
+        counters = new LockCounters(name);
+
+    pthread_mutex_unlock(&registry_mutex);
+    return counters;
+}
+
+static unsigned long long monotonic_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static unsigned long long ns_since(const struct timespec &then)
+{
+    return monotonic_ns() - (then.tv_sec * 1000000000ULL + then.tv_nsec);
+}
+
+static void raise_max(atomic<unsigned long long> &max,
+                      unsigned long long value)
+{
+    unsigned long long old = max.load(memory_order_relaxed);
+
+    while (value > old &&
+           !max.compare_exchange_weak(old, value, memory_order_relaxed))
+        ;
+}
+
+void LockCounters::reset()
+{
+    acquisitions = 0;
+    contentions = 0;
+    wait_ns = 0;
+    max_wait_ns = 0;
+    hold_ns = 0;
+    max_hold_ns = 0;
+}
+
+void LockCounters::waited(unsigned long long ns)
+{
+    contentions.fetch_add(1, memory_order_relaxed);
+    wait_ns.fetch_add(ns, memory_order_relaxed);
+    raise_max(max_wait_ns, ns);
+}
+
+void LockCounters::held(unsigned long long ns)
+{
+    hold_ns.fetch_add(ns, memory_order_relaxed);
+    raise_max(max_hold_ns, ns);
+}
+
+void lock_profiling(bool enable)
+{
+    profiling.store(enable);
+}
+
+vector<LockStats> lock_stats()
+{
+    vector<LockStats> result;
+
+    pthread_mutex_lock(&registry_mutex);
+
+    if (registry != NULL)
+    {
+        map<string,LockCounters *>::const_iterator it;
+        for (it = registry->begin(); it != registry->end(); it++)
+        {
+            const LockCounters &c = *((*it).second);
+            LockStats stats;
+
+            stats.name = c.name;
+            stats.acquisitions = c.acquisitions.load();
+            stats.contentions = c.contentions.load();
+            stats.wait_seconds = c.wait_ns.load() / 1e9;
+            stats.max_wait_seconds = c.max_wait_ns.load() / 1e9;
+            stats.hold_seconds = c.hold_ns.load() / 1e9;
+            stats.max_hold_seconds = c.max_hold_ns.load() / 1e9;
+
+            result.push_back(stats);
+        }
+    }
+
+    pthread_mutex_unlock(&registry_mutex);
+    return result;
+}
+
+void reset_lock_stats()
+{
+    pthread_mutex_lock(&registry_mutex);
+
+    if (registry != NULL)
+    {
+        map<string,LockCounters *>::iterator it;
+        for (it = registry->begin(); it != registry->end(); it++)
+            (*it).second->reset();
+    }
+
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+Mutex::Mutex(const char *name) : Mutex(name, true) {}
+
+Mutex::Mutex(const char *name, bool recursive)
+    : counters(named_counters(name)), depth(0)
 {
     MutexAttr attr;
     int result;
 
-    result = pthread_mutexattr_settype(&attr.attr, PTHREAD_MUTEX_RECURSIVE);
+    result = pthread_mutexattr_settype(&attr.attr,
+            recursive ? PTHREAD_MUTEX_RECURSIVE : PTHREAD_MUTEX_NORMAL);
 
     if (result != 0)
         throw runtime_error("Failed to set mutex type");
@@ -51,17 +203,40 @@ Mutex::~Mutex()
     pthread_mutex_destroy(&mutex);
 }
 
-MutexLock::MutexLock(Mutex &_m) : m(_m)
+MutexLock::MutexLock(Mutex &_m)
+    : m(_m),
+      profiled(m.counters != NULL && profiling.load(memory_order_relaxed))
 {
-    pthread_mutex_lock(&(m.mutex));
+    if (!profiled)
+    {
+        pthread_mutex_lock(&(m.mutex));
+        return;
+    }
+
+    if (pthread_mutex_trylock(&(m.mutex)) != 0)
+    {
+        const unsigned long long start = monotonic_ns();
+        pthread_mutex_lock(&(m.mutex));
+        m.counters->waited(monotonic_ns() - start);
+    }
+
+    /* Locking a recursive mutex again isn't another acquisition */
+    if (m.depth++ == 0)
+    {
+        m.counters->acquisitions.fetch_add(1, memory_order_relaxed);
+        clock_gettime(CLOCK_MONOTONIC, &(m.acquired));
+    }
 }
 
 MutexLock::~MutexLock()
 {
+    if (profiled && --m.depth == 0)
+        m.counters->held(ns_since(m.acquired));
+
     pthread_mutex_unlock(&(m.mutex));
 }
 
-ConditionVariable::ConditionVariable() : Mutex()
+ConditionVariable::ConditionVariable(const char *name) : Mutex(name)
 {
     int result = pthread_cond_init(&condvar, NULL);
 
@@ -74,14 +249,38 @@ ConditionVariable::~ConditionVariable()
     pthread_cond_destroy(&condvar);
 }
 
+/* Waiting releases the mutex, so while profiling the hold is split. depth
+ * and acquired belong to whoever holds the mutex, which meanwhile is
+ * someone else: depth must be 0 so that their locks are counted, and both
+ * are ours again once we have it back. */
 void ConditionVariable::wait()
 {
+    const unsigned int our_depth = depth;
+
+    if (our_depth)
+        counters->held(ns_since(acquired));
+
+    depth = 0;
     pthread_cond_wait(&condvar, &mutex);
+    depth = our_depth;
+
+    if (our_depth)
+        clock_gettime(CLOCK_MONOTONIC, &acquired);
 }
 
 void ConditionVariable::timedwait(const struct timespec *abstime)
 {
+    const unsigned int our_depth = depth;
+
+    if (our_depth)
+        counters->held(ns_since(acquired));
+
+    depth = 0;
     pthread_cond_timedwait(&condvar, &mutex, abstime);
+    depth = our_depth;
+
+    if (our_depth)
+        clock_gettime(CLOCK_MONOTONIC, &acquired);
 }
 
 void ConditionVariable::signal()
@@ -181,6 +380,188 @@ void *SimpleThread::join()
     return exit_arg;
 }
 
+ThreadPool::ThreadPool(size_t threads)
+    : queued(0), outstanding(0), next_queue(0), stopping(false)
+{
+    if (!threads)
+        throw invalid_argument("ThreadPool needs at least one thread");
+
+    for (size_t i = 0; i < threads; i++)
+        queues.push_back(new WorkerQueue());
+
+    for (size_t i = 0; i < threads; i++)
+    {
+        workers.push_back(new Worker(*this, i));
+        workers.back()->start();
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    wait();
+
+    {
+        MutexLock lock(condvar);
+        stopping = true;
+        condvar.broadcast();
+    }
+
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i]->join();
+        delete workers[i];
+    }
+
+    for (size_t i = 0; i < queues.size(); i++)
+        delete queues[i];
+}
+
+void ThreadPool::submit(Task *task)
+{
+    size_t index;
+
+    {
+        MutexLock lock(condvar);
+        index = next_queue++ % queues.size();
+        outstanding++;
+    }
+
+    {
+        MutexLock lock(queues[index]->mutex);
+        queues[index]->tasks.push_back(task);
+    }
+
+    /* broadcast, since wait() shares the condvar with the workers */
+    MutexLock lock(condvar);
+    queued++;
+    condvar.broadcast();
+}
+
+void ThreadPool::wait()
+{
+    MutexLock lock(condvar);
+
+    while (outstanding)
+        condvar.wait();
+}
+
+Task *ThreadPool::take(size_t index)
+{
+    Task *task = NULL;
+
+    /* Own queue first, oldest task: newest first would be kinder to the
+     * cache, but would let a task that keeps resubmitting itself starve
+     * the rest of the queue */
+    {
+        WorkerQueue &own = *queues[index];
+        MutexLock lock(own.mutex);
+
+        if (own.tasks.size())
+        {
+            task = own.tasks.front();
+            own.tasks.pop_front();
+        }
+    }
+
+    /* ... then steal the oldest task from the others */
+    for (size_t i = 1; !task && i < queues.size(); i++)
+    {
+        WorkerQueue &other = *queues[(index + i) % queues.size()];
+        MutexLock lock(other.mutex);
+
+        if (other.tasks.size())
+        {
+            task = other.tasks.front();
+            other.tasks.pop_front();
+        }
+    }
+
+    return task;
+}
+
+void ThreadPool::work(size_t index)
+{
+    for (;;)
+    {
+        {
+            MutexLock lock(condvar);
+
+            while (!queued && !stopping)
+                condvar.wait();
+
+            if (!queued && stopping)
+                break;
+
+            /* Claim one of the queued tasks; take() will find it (or
+             * another one, if it was stolen in the mean time). */
+            queued--;
+        }
+
+        Task *task = NULL;
+        while (!task)
+            task = take(index);
+
+        task->run();
+
+        MutexLock lock(condvar);
+        outstanding--;
+
+        if (!outstanding)
+            condvar.broadcast();
+    }
+}
+
+void *ThreadPool::Worker::run()
+{
+    pool.work(index);
+    return NULL;
+}
+
+MappedFile::MappedFile(const string &filename)
+    : fd(-1), mapping(MAP_FAILED), mapped_length(0)
+{
+    struct stat info;
+
+    try
+    {
+        fd = open(filename.c_str(), O_RDONLY);
+        if (fd == -1)
+            throw runtime_error("Failed to open " + filename + ": " +
+                                strerror(errno));
+
+        if (fstat(fd, &info) != 0)
+            throw runtime_error("Failed to stat " + filename + ": " +
+                                strerror(errno));
+
+        /* mmap refuses zero lengths */
+        if (!info.st_size)
+            return;
+
+        mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED)
+            throw runtime_error("Failed to map " + filename + ": " +
+                                strerror(errno));
+
+        mapped_length = info.st_size;
+
+        /* Only a hint, so ignore failure */
+        madvise(mapping, mapped_length, MADV_SEQUENTIAL);
+    }
+    catch (...)
+    {
+        if (fd != -1)
+            close(fd);
+        throw;
+    }
+}
+
+MappedFile::~MappedFile()
+{
+    if (mapping != MAP_FAILED)
+        munmap(mapping, mapped_length);
+    close(fd);
+}
+
 static string http_response_string(long r, string u)
 {
     stringstream ss;
@@ -272,7 +653,65 @@ string cURL::get(const string &url)
     return cURL::perform(url);
 }
 
-string cURL::post(const string &url, const string &data)
+/* Picks the ETag out of the response's headers */
+static size_t etag_header_func(char *data, size_t size, size_t nmemb,
+                               void *userdata)
+{
+    static const char name[] = "etag:";
+    const size_t name_length = sizeof(name) - 1;
+    size_t length = size * nmemb;
+    string *etag = static_cast<string *>(userdata);
+
+    if (length > name_length && strncasecmp(data, name, name_length) == 0)
+    {
+        size_t start = name_length, end = length;
+
+        while (start < end && isspace((unsigned char) data[start]))
+            start++;
+        while (end > start && isspace((unsigned char) data[end - 1]))
+            end--;
+
+        etag->assign(data + start, end - start);
+    }
+
+    return length;
+}
+
+bool cURL::get(const string &url, string &etag, string &response)
+{
+    MutexLock lock(mutex);
+
+    reset();
+
+    cURLslist headers;
+    string if_none_match;
+
+    if (etag.size())
+    {
+        if_none_match = "If-None-Match: " + etag;
+        headers.append(if_none_match.c_str());
+        setopt(CURLOPT_HTTPHEADER, headers.get());
+    }
+
+    string new_etag, new_response;
+    setopt(CURLOPT_HEADERFUNCTION, etag_header_func);
+    setopt(CURLOPT_HEADERDATA, &new_etag);
+
+    long response_code = cURL::perform(url, new_response);
+
+    if (etag.size() && response_code == 304)
+        return false;
+
+    if (response_code < 200 || response_code > 299)
+        throw HTTPResponse(response_code, url);
+
+    etag.swap(new_etag);
+    response.swap(new_response);
+    return true;
+}
+
+string cURL::post(const string &url, const string &data,
+                  const string &content_type)
 {
     MutexLock lock(mutex);
 
@@ -282,6 +721,13 @@ string cURL::post(const string &url, const string &data)
     cURLslist headers;
     headers.append("Expect:");
 
+    string content_type_header;
+    if (content_type.size())
+    {
+        content_type_header = "Content-Type: " + content_type;
+        headers.append(content_type_header.c_str());
+    }
+
     setopt(CURLOPT_POSTFIELDS, data.c_str());
     setopt(CURLOPT_POSTFIELDSIZE, data.length());
     setopt(CURLOPT_HTTPHEADER, headers.get());
@@ -352,7 +798,17 @@ static size_t write_func(char *data, size_t size, size_t nmemb, void *userdata)
 string cURL::perform(const string &url)
 {
     string response;
+    long response_code = cURL::perform(url, response);
 
+    if (response_code < 200 || response_code > 299)
+        throw HTTPResponse(response_code, url);
+
+    return response;
+}
+
+/* Returns the response code, whatever it is */
+long cURL::perform(const string &url, string &response)
+{
     setopt(CURLOPT_NOSIGNAL, 1);
     setopt(CURLOPT_URL, url.c_str());
     setopt(CURLOPT_WRITEFUNCTION, write_func);
@@ -368,10 +824,7 @@ string cURL::perform(const string &url)
     if (result != CURLE_OK)
         throw cURLError(result, "curl_easy_getinfo");
 
-    if (response_code < 200 || response_code > 299)
-        throw HTTPResponse(response_code, url);
-
-    return response;
+    return response_code;
 }
 
 } /* namespace EZ */
@@ -2,6 +2,9 @@
 
 #include "habitat/Extractor.h"
 #include <vector>
+#include <string>
+#include <memory>
+#include <utility>
 #include "habitat/EZ.h"
 
 namespace habitat {
@@ -34,16 +37,65 @@ void ExtractorManager::push(char b, enum push_flags flags)
         (*it)->push(b, flags);
 }
 
-void ExtractorManager::payload(const Json::Value *set)
+void ExtractorManager::payload(shared_ptr<const Json::Value> set)
+{
+    atomic_store(&current_payload, std::move(set));
+}
+
+shared_ptr<const Json::Value> ExtractorManager::payload()
+{
+    return atomic_load(&current_payload);
+}
+
+void ExtractorManager::payloads(shared_ptr<const PayloadRegistry> set)
+{
+    atomic_store(&current_payloads, std::move(set));
+}
+
+shared_ptr<const PayloadRegistry> ExtractorManager::payloads()
+{
+    return atomic_load(&current_payloads);
+}
+
+void ExtractorManager::output(int flags)
 {
     EZ::MutexLock lock(mutex);
-    current_payload = set;
+    outputs = flags;
 }
 
-const Json::Value *ExtractorManager::payload()
+int ExtractorManager::output()
 {
     EZ::MutexLock lock(mutex);
-    return current_payload;
+    return outputs;
+}
+
+void ExtractorManager::status_code(enum extractor_status code,
+                                   const char *detail)
+{
+    switch (code)
+    {
+        case UKHAS_START_DELIMITER:
+            status("UKHAS Extractor: found start delimiter");
+            break;
+        case UKHAS_EXTRACTED:
+            status("UKHAS Extractor: extracted string");
+            break;
+        case UKHAS_GIVING_UP:
+            status("UKHAS Extractor: giving up");
+            break;
+        case UKHAS_GIVING_UP_SILENCE:
+            status("UKHAS Extractor: giving up (silence)");
+            break;
+        case UKHAS_CRUDE_PARSE_FAILED:
+            status("UKHAS Extractor: crude parse failed: " + string(detail));
+            break;
+        case UKHAS_FULL_PARSE_FAILED:
+            status("UKHAS Extractor: full parse failed:");
+            break;
+        case UKHAS_FULL_PARSE_ERROR:
+            status("UKHAS Extractor: " + string(detail));
+            break;
+    }
 }
 
 } /* namespace habitat */
@@ -0,0 +1,200 @@
+/* Copyright 2012 (C) Daniel Richman. License: GNU GPL 3; see LICENSE. */
+
+#include "habitat/MultiChannelExtractor.h"
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include "habitat/EZ.h"
+
+using namespace std;
+
+namespace habitat {
+
+ExtractorChannel::ExtractorChannel(MultiChannelExtractorManager &p, int i)
+    : ExtractorManager(p.uthr), parent(p), index(i), scheduled(false)
+{
+    add(extractor);
+}
+
+void ExtractorChannel::enqueue(const Event &e)
+{
+    EZ::MutexLock lock(pending_mutex);
+
+    pending.push_back(e);
+
+    /* A channel is in the pool at most once, so only one thread processes
+     * its bytes at any time, and they are processed in order. */
+    if (!scheduled)
+    {
+        scheduled = true;
+        parent.pool.submit(this);
+    }
+}
+
+void ExtractorChannel::apply(const Event &e)
+{
+    if (e.type == Event::SKIPPED)
+        ExtractorManager::skipped(e.skipped);
+    else
+        ExtractorManager::push(e.b, e.flags);
+}
+
+void ExtractorChannel::run()
+{
+    {
+        EZ::MutexLock lock(pending_mutex);
+        working.swap(pending);
+    }
+
+    vector<Event>::const_iterator it;
+    for (it = working.begin(); it != working.end(); it++)
+    {
+        /* Nothing may escape into the pool's thread, which would terminate
+         * the process */
+        try
+        {
+            try
+            {
+                apply(*it);
+            }
+            catch (exception &e)
+            {
+                const string what(e.what());
+                status("MultiChannelExtractor: caught exception: " + what);
+            }
+            catch (...)
+            {
+                status("MultiChannelExtractor: caught unknown exception");
+            }
+        }
+        catch (...)
+        {
+            /* status() threw too; there's no one left to tell */
+        }
+    }
+
+    /* clear() keeps the capacity, so the two buffers stop allocating */
+    working.clear();
+
+    EZ::MutexLock lock(pending_mutex);
+
+    /* Go to the back of the queue rather than hogging this thread; the
+     * pool runs tasks oldest first, so the other channels get a turn */
+    if (pending.size())
+        parent.pool.submit(this);
+    else
+        scheduled = false;
+}
+
+void ExtractorChannel::status(const string &msg)
+{
+    parent.status(index, msg);
+}
+
+void ExtractorChannel::data(const Json::Value &d)
+{
+    parent.data(index, d);
+}
+
+void ExtractorChannel::record(const TelemetryRecord &r)
+{
+    parent.record(index, r);
+}
+
+MultiChannelExtractorManager::MultiChannelExtractorManager(
+        UploaderThread &u, int channels, int threads)
+    : pool(threads), uthr(u)
+{
+    if (channels <= 0)
+        throw invalid_argument("Need at least one channel");
+
+    for (int i = 0; i < channels; i++)
+        channel_list.push_back(new ExtractorChannel(*this, i));
+}
+
+MultiChannelExtractorManager::~MultiChannelExtractorManager()
+{
+    pool.wait();
+
+    vector<ExtractorChannel *>::iterator it;
+    for (it = channel_list.begin(); it != channel_list.end(); it++)
+        delete *it;
+}
+
+ExtractorChannel &MultiChannelExtractorManager::channel(int index)
+{
+    if (index < 0 || index >= channels())
+        throw out_of_range("No such channel");
+
+    return *(channel_list[index]);
+}
+
+void MultiChannelExtractorManager::skipped(int index, int n)
+{
+    if (n <= 0)
+        return;
+
+    ExtractorChannel::Event e;
+    e.type = ExtractorChannel::Event::SKIPPED;
+    e.b = '\0';
+    e.flags = PUSH_NONE;
+    e.skipped = n;
+    channel(index).enqueue(e);
+}
+
+void MultiChannelExtractorManager::push(int index, char b,
+                                        enum push_flags flags)
+{
+    ExtractorChannel::Event e;
+    e.type = ExtractorChannel::Event::PUSH;
+    e.b = b;
+    e.flags = flags;
+    e.skipped = 0;
+    channel(index).enqueue(e);
+}
+
+void MultiChannelExtractorManager::push(int index, const char *data,
+                                        size_t length, enum push_flags flags)
+{
+    ExtractorChannel &c = channel(index);
+    EZ::MutexLock lock(c.pending_mutex);
+
+    for (size_t i = 0; i < length; i++)
+    {
+        ExtractorChannel::Event e;
+        e.type = ExtractorChannel::Event::PUSH;
+        e.b = data[i];
+        e.flags = flags;
+        e.skipped = 0;
+        c.enqueue(e);
+    }
+}
+
+void MultiChannelExtractorManager::flush()
+{
+    pool.wait();
+}
+
+void MultiChannelExtractorManager::payload(shared_ptr<const Json::Value> set)
+{
+    vector<ExtractorChannel *>::iterator it;
+    for (it = channel_list.begin(); it != channel_list.end(); it++)
+        (*it)->payload(set);
+}
+
+void MultiChannelExtractorManager::payloads(
+        shared_ptr<const PayloadRegistry> set)
+{
+    vector<ExtractorChannel *>::iterator it;
+    for (it = channel_list.begin(); it != channel_list.end(); it++)
+        (*it)->payloads(set);
+}
+
+void MultiChannelExtractorManager::output(int flags)
+{
+    vector<ExtractorChannel *>::iterator it;
+    for (it = channel_list.begin(); it != channel_list.end(); it++)
+        (*it)->output(flags);
+}
+
+} /* namespace habitat */
@@ -0,0 +1,82 @@
+/* Copyright 2012 (C) Daniel Richman. License: GNU GPL 3; see LICENSE. */
+
+#include "habitat/PayloadRegistry.h"
+#include <string>
+#include <vector>
+#include <map>
+#include "jsoncpp.h"
+
+using namespace std;
+
+namespace habitat {
+
+PayloadRegistry::PayloadRegistry(
+        const vector<Json::Value> &payload_configurations)
+{
+    add(payload_configurations);
+}
+
+void PayloadRegistry::add(const Json::Value &payload_configuration)
+{
+    if (!payload_configuration.isObject())
+        return;
+
+    /* deque::push_back does not invalidate references to existing
+     * elements, so pointers already in the index stay valid. */
+    docs.push_back(payload_configuration);
+
+    const Json::Value &sentences = docs.back()["sentences"];
+    if (!sentences.isArray())
+        return;
+
+    map<string, vector<const Json::Value *> > added;
+
+    for (Json::Value::const_iterator it = sentences.begin();
+         it != sentences.end(); it++)
+    {
+        const Json::Value &sentence = *it;
+
+        if (!sentence.isObject() || !sentence["callsign"].isString())
+            continue;
+
+        added[sentence["callsign"].asString()].push_back(&sentence);
+    }
+
+    /* Newer docs take precedence over older ones */
+    map<string, vector<const Json::Value *> >::const_iterator it;
+    for (it = added.begin(); it != added.end(); it++)
+    {
+        vector<const Json::Value *> &candidates = index[(*it).first];
+        candidates.insert(candidates.begin(),
+                          (*it).second.begin(), (*it).second.end());
+    }
+}
+
+void PayloadRegistry::add(const vector<Json::Value> &payload_configurations)
+{
+    vector<Json::Value>::const_iterator it;
+
+    for (it = payload_configurations.begin();
+         it != payload_configurations.end(); it++)
+        add(*it);
+}
+
+void PayloadRegistry::clear()
+{
+    index.clear();
+    docs.clear();
+}
+
+const vector<const Json::Value *> *
+    PayloadRegistry::find(const string &callsign) const
+{
+    map<string, vector<const Json::Value *> >::const_iterator it;
+    it = index.find(callsign);
+
+    if (it == index.end())
+        return NULL;
+    else
+        return &((*it).second);
+}
+
+} /* namespace habitat */
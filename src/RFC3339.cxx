@@ -1,6 +1,7 @@
 /* Copyright 2012 (C) Daniel Richman. License: GNU GPL 3; see LICENSE. */
 
 #include "habitat/RFC3339.h"
+#include "habitat/Clock.h"
 
 #include <string>
 #include <sstream>
@@ -45,89 +46,6 @@ bool validate_rfc3339(const string &rfc3339)
     return true;
 }
 
-/* Class to be used when extracting from an istream that consumes a single
- * delimiter character */
-class Delim
-{
-    char expect;
-
-public:
-    Delim(char _e) : expect(_e) {};
-    ~Delim() {};
-    void extract(istream &in);
-};
-
-/* Delim can't be a reference here because in its intended use it is
- * constructed on the spot like this ... >> Delim('-') >> ... and therefore
- * it does not have an address */
-istream & operator>>(istream &in, Delim delim)
-{
-    delim.extract(in);
-    return in;
-}
-
-void Delim::extract(istream &in)
-{
-    if (!in.good() || in.get() != expect)
-        in.setstate(ios_base::badbit);
-}
-
-/* Extracts an integer of particular length, containing the digits 0-9 only */
-class StrictInt
-{
-    size_t length;
-    int &target;
-    bool check_range;
-    int min, max;
-
-public:
-    StrictInt(size_t _l, int &_t)
-        : length(_l), target(_t), check_range(false), min(0), max(0) {};
-    StrictInt(size_t _l, int &_t, int _min, int _max)
-        : length(_l), target(_t), check_range(true), min(_min), max(_max) {};
-    ~StrictInt() {};
-    void extract(istream &in);
-};
-
-istream & operator>>(istream &in, StrictInt tgt)
-{
-    tgt.extract(in);
-    return in;
-}
-
-void StrictInt::extract(istream &in)
-{
-    if (!in.good())
-    {
-        in.setstate(ios_base::badbit);
-        return;
-    }
-
-    /* len(str(2**32)) == 10 */
-    if (length >= 11)
-    {
-        in.setstate(ios_base::badbit);
-        return;
-    }
-
-    char temp[16];
-
-    in.read(temp, length);
-    temp[length] = 0;
-
-    if (in.fail() || strlen(temp) != length)
-        return;
-
-    istringstream temp_ss(temp);
-    temp_ss >> target;
-
-    if (temp_ss.fail() || temp_ss.peek() != EOF)
-        in.setstate(ios_base::badbit);
-
-    if (check_range && (target < min || target > max))
-        in.setstate(ios_base::badbit);
-}
-
 static int mdays[] = {0, 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
 static int mydays[] = {0, 0, 31, 59, 90, 120, 151, 181, 212,
                        243, 273, 304, 334};
@@ -206,20 +124,83 @@ static struct tm my_gmtime(long long int timestamp)
     return tm;
 }
 
+/* isspace() in the "C" locale */
+static bool is_space(char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+/* Parses a field of exactly length characters as an int, accepting what
+ * "istringstream(field) >> target" followed by a check for EOF would:
+ * leading whitespace, an optional sign, then digits up to the end. */
+static bool strict_int(const char *field, size_t length, int &target)
+{
+    int value = 0;
+    size_t i;
+
+    /* Fast path: nothing but digits, as in every sane timestamp */
+    for (i = 0; i < length && is_digit(field[i]); i++)
+        value = value * 10 + (field[i] - '0');
+
+    if (i == length)
+    {
+        target = value;
+        return true;
+    }
+
+    i = 0;
+    while (i < length && is_space(field[i]))
+        i++;
+
+    bool negative = false;
+    if (i < length && (field[i] == '+' || field[i] == '-'))
+    {
+        negative = (field[i] == '-');
+        i++;
+    }
+
+    if (i == length)
+        return false;
+
+    for (value = 0; i < length; i++)
+    {
+        if (!is_digit(field[i]))
+            return false;
+        value = value * 10 + (field[i] - '0');
+    }
+
+    target = negative ? -value : value;
+    return true;
+}
+
+static bool strict_int(const char *field, size_t length, int &target,
+                       int min, int max)
+{
+    return strict_int(field, length, target) &&
+           target >= min && target <= max;
+}
+
+/* YYYY-MM-DDTHH:MM:SS is at fixed offsets, followed by an optional
+ * fraction and then Z or [+-]HH:MM */
 long long int rfc3339_to_timestamp(const string &rfc3339)
 {
-    istringstream temp(rfc3339);
+    const char *s = rfc3339.data();
+    const size_t length = rfc3339.length();
 
     int year, month, mday, hour, min, sec;
 
-    temp >> StrictInt(4, year) >> Delim('-')
-        >> StrictInt(2, month, 1, 12) >> Delim('-')
-        >> StrictInt(2, mday, 1, 31) >> Delim('T')
-        >> StrictInt(2, hour, 0, 23) >> Delim(':')
-        >> StrictInt(2, min, 0, 59) >> Delim(':')
-        >> StrictInt(2, sec, 0, 59);
-
-    if (temp.fail() || temp.eof() || temp.tellg() != 19)
+    if (length < 20 ||
+        !strict_int(s, 4, year) || s[4] != '-' ||
+        !strict_int(s + 5, 2, month, 1, 12) || s[7] != '-' ||
+        !strict_int(s + 8, 2, mday, 1, 31) || s[10] != 'T' ||
+        !strict_int(s + 11, 2, hour, 0, 23) || s[13] != ':' ||
+        !strict_int(s + 14, 2, min, 0, 59) || s[16] != ':' ||
+        !strict_int(s + 17, 2, sec, 0, 59))
         throw InvalidFormat();
 
     bool leap_year = (year % 4 == 0 && (year % 100 != 0 || year % 400 == 0));
@@ -231,16 +212,21 @@ long long int rfc3339_to_timestamp(const string &rfc3339)
     if (mday > this_mdays)
         throw InvalidFormat();
 
-    if (temp.peek() == '.')
+    size_t pos = 19;
+
+    if (s[pos] == '.')
     {
         /* discard seconds part */
         do
-            temp.get();
-        while (temp.good() && temp.peek() >= '0' && temp.peek() <= '9');
+            pos++;
+        while (pos < length && is_digit(s[pos]));
     }
 
+    if (pos == length)
+        throw InvalidFormat();
+
     int offset = 0;
-    int offset_first_char = temp.get();
+    char offset_first_char = s[pos++];
 
     if (offset_first_char == 'Z')
     {
@@ -249,12 +235,14 @@ long long int rfc3339_to_timestamp(const string &rfc3339)
     else if (offset_first_char == '+' || offset_first_char == '-')
     {
         int offset_hours, offset_minutes;
-        temp >> StrictInt(2, offset_hours, 0, 23) >> Delim(':')
-            >> StrictInt(2, offset_minutes, 0, 59);
 
-        if (temp.fail())
+        if (length - pos < 5 ||
+            !strict_int(s + pos, 2, offset_hours, 0, 23) ||
+            s[pos + 2] != ':' ||
+            !strict_int(s + pos + 3, 2, offset_minutes, 0, 59))
             throw InvalidFormat();
 
+        pos += 5;
         offset = offset_hours * 3600 + offset_minutes * 60;
 
         if (offset_first_char == '-')
@@ -265,7 +253,7 @@ long long int rfc3339_to_timestamp(const string &rfc3339)
         throw InvalidFormat();
     }
 
-    if (temp.peek() != EOF)
+    if (pos != length)
         throw InvalidFormat();
 
     return my_timegm(year, month, mday, hour, min, sec) - offset;
@@ -335,14 +323,148 @@ string timestamp_to_rfc3339_localoffset(long long int timestamp)
     return ret;
 }
 
+/* Rounds towards negative infinity, unlike / */
+static long long int floor_div(long long int a, long long int b)
+{
+    long long int q = a / b;
+    if ((a % b) && ((a < 0) != (b < 0)))
+        q--;
+    return q;
+}
+
+/* Days since 1970-01-01 to a proleptic Gregorian date; see Howard
+ * Hinnant's "chrono-Compatible Low-Level Date Algorithms" */
+static void civil_from_days(long long int days, long long int &year,
+                            int &month, int &mday)
+{
+    days += 719468;
+    long long int era = floor_div(days, 146097);
+    long long int doe = days - era * 146097;
+    long long int yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    long long int doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    long long int mp = (5 * doy + 2) / 153;
+
+    mday = doy - (153 * mp + 2) / 5 + 1;
+    month = mp < 10 ? mp + 3 : mp - 9;
+    year = yoe + era * 400 + (month <= 2);
+}
+
+static char *format_digits(char *target, int value, int digits)
+{
+    for (int i = digits - 1; i >= 0; i--)
+    {
+        target[i] = '0' + value % 10;
+        value /= 10;
+    }
+
+    return target + digits;
+}
+
+size_t LocalOffsetFormatter::format(long long int timestamp, char *buffer)
+{
+    if (have_last && timestamp == last_timestamp)
+    {
+        memcpy(buffer, last, last_length + 1);
+        return last_length;
+    }
+
+    /* last is about to be overwritten */
+    have_last = false;
+
+    long long int minute = floor_div(timestamp, 60);
+
+    if (!have_offset || minute != offset_minute)
+    {
+        /* As in timestamp_to_rfc3339_localoffset */
+        struct tm tm = my_localtime(timestamp);
+        struct tm gm_tm = my_gmtime(timestamp);
+        int new_offset = my_timegm(tm) - my_timegm(gm_tm);
+
+        if (abs(new_offset) % 60 != 0)
+            throw runtime_error("Your local offset is not a whole minute");
+
+        offset = new_offset;
+        offset_minute = minute;
+        have_offset = true;
+    }
+
+    long long int local = timestamp + offset;
+    long long int days = floor_div(local, 86400);
+    int seconds = local - days * 86400;
+
+    long long int year;
+    int month, mday;
+    civil_from_days(days, year, month, mday);
+
+    string fallback;
+    const char *result;
+    size_t length;
+
+    if (year < 0 || year > 9999)
+    {
+        /* setw(4) doesn't truncate or handle signs like below */
+        fallback = timestamp_to_rfc3339_localoffset(timestamp);
+        result = fallback.c_str();
+        length = fallback.length();
+
+        if (length >= BUFFER_SIZE)
+            throw out_of_range("timestamp too large to format");
+    }
+    else
+    {
+        char *pos = last;
+        int offset_minutes = abs(offset) / 60;
+
+        pos = format_digits(pos, year, 4);
+        *(pos++) = '-';
+        pos = format_digits(pos, month, 2);
+        *(pos++) = '-';
+        pos = format_digits(pos, mday, 2);
+        *(pos++) = 'T';
+        pos = format_digits(pos, seconds / 3600, 2);
+        *(pos++) = ':';
+        pos = format_digits(pos, (seconds / 60) % 60, 2);
+        *(pos++) = ':';
+        pos = format_digits(pos, seconds % 60, 2);
+        *(pos++) = (offset < 0 ? '-' : '+');
+        pos = format_digits(pos, offset_minutes / 60, 2);
+        *(pos++) = ':';
+        pos = format_digits(pos, offset_minutes % 60, 2);
+        *pos = '\0';
+
+        result = last;
+        length = pos - last;
+
+#ifndef NDEBUG
+        if (rfc3339_to_timestamp(last) != timestamp)
+            throw runtime_error("reparse sanity check failed");
+#endif
+    }
+
+    if (result != last)
+        memcpy(last, result, length + 1);
+
+    last_timestamp = timestamp;
+    last_length = length;
+    have_last = true;
+
+    memcpy(buffer, last, length + 1);
+    return length;
+}
+
+size_t LocalOffsetFormatter::format_now(char *buffer)
+{
+    return format(Clock::now(), buffer);
+}
+
 string now_to_rfc3339_utcoffset()
 {
-    return timestamp_to_rfc3339_utcoffset(time(NULL));
+    return timestamp_to_rfc3339_utcoffset(Clock::now());
 }
 
 string now_to_rfc3339_localoffset()
 {
-    return timestamp_to_rfc3339_localoffset(time(NULL));
+    return timestamp_to_rfc3339_localoffset(Clock::now());
 }
 
 } /* namespace RFC3339 */
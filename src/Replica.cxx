@@ -0,0 +1,483 @@
+/* Copyright 2012 (C) Daniel Richman. License: GNU GPL 3; see LICENSE. */
+
+#include "habitat/Replica.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <sstream>
+#include "habitat/RFC3339.h"
+#include "habitat/Clock.h"
+
+using namespace std;
+
+namespace habitat {
+
+static const Json::InternedKey key_id("_id");
+static const Json::InternedKey key_type("type");
+static const Json::InternedKey key_rows("rows");
+static const Json::InternedKey key_key("key");
+static const Json::InternedKey key_doc("doc");
+static const Json::InternedKey key_approved("approved");
+static const Json::InternedKey key_start("start");
+static const Json::InternedKey key_end("end");
+static const Json::InternedKey key_payloads("payloads");
+static const Json::InternedKey key_payload_docs("_payload_docs");
+static const Json::InternedKey key_name("name");
+static const Json::InternedKey key_time_created("time_created");
+static const Json::InternedKey key_update_seq("update_seq");
+static const Json::InternedKey key_results("results");
+static const Json::InternedKey key_change_id("id");
+static const Json::InternedKey key_deleted("deleted");
+static const Json::InternedKey key_last_seq("last_seq");
+
+/* seqs are integers before CouchDB 2 and opaque strings after */
+static string seq_string(const Json::Value &seq)
+{
+    if (seq.isString())
+        return seq.asString();
+
+    if (!seq.isIntegral())
+        throw runtime_error("Invalid response: bad seq");
+
+    Json::Value copy(seq);
+    return CouchDB::Database::json_query_value(copy);
+}
+
+static bool has_type(const Json::Value &doc, const char *type)
+{
+    const Json::Value &value = doc[key_type];
+    return value.isString() && strcmp(value.asCString(), type) == 0;
+}
+
+static const Json::Value &view_rows(const Json::Value &response)
+{
+    if (!response.isObject())
+        throw runtime_error("Invalid response: was not an object");
+
+    const Json::Value &rows = response[key_rows];
+
+    if (!rows.isArray())
+        throw runtime_error("Invalid response: rows was not an array");
+
+    return rows;
+}
+
+/* Called with the mutex held. doc is null if it was deleted. */
+void Replica::apply(const string &id, const Json::Value &doc)
+{
+    flight_docs.erase(id);
+    payload_docs.erase(id);
+
+    if (!doc.isObject())
+        return;
+
+    if (has_type(doc, "flight"))
+        flight_docs[id] = doc;
+    else if (has_type(doc, "payload_configuration"))
+        payload_docs[id] = doc;
+}
+
+void Replica::bootstrap()
+{
+    /* Noted first, so that nothing changed while the views download is
+     * missed; the first update() applies any such changes again, which is
+     * harmless. */
+    unique_ptr<Json::Value> info(database.info());
+
+    if (!info->isObject())
+        throw runtime_error("Invalid response: was not an object");
+
+    string new_since = seq_string((*info)[key_update_seq]);
+    map<string,Json::Value> new_flights, new_payloads;
+
+    /* As in Uploader::flights(), the responses are parsed into an arena
+     * and the docs we keep copied out of it */
+    {
+        map<string,string> options;
+        options["include_docs"] = "true";
+
+        Json::Arena response_arena;
+        Json::Value *response;
+
+        {
+            Json::Arena::Scope arena_scope(&response_arena);
+            response = database.view("payload_configuration",
+                                     "name_time_created", options);
+        }
+
+        unique_ptr<Json::Value> response_destroyer(response);
+        const Json::Value &rows = view_rows(*response);
+        Json::Value::const_iterator it;
+
+        for (it = rows.begin(); it != rows.end(); it++)
+        {
+            if (!(*it).isObject())
+                throw runtime_error("Invalid response: row was not an object");
+
+            const Json::Value &doc = (*it)[key_doc];
+
+            if (doc.isObject() && doc[key_id].isString())
+                new_payloads[doc[key_id].asString()] = doc;
+        }
+    }
+
+    {
+        map<string,string> options;
+        Json::Value startkey(Json::arrayValue);
+#ifdef JSON_HAS_INT64
+        startkey.append((Json::Int64) Clock::now());
+#else
+        startkey.append((Json::Int) Clock::now());
+#endif
+
+        options["include_docs"] = "true";
+        options["startkey"] = CouchDB::Database::json_query_value(startkey);
+
+        Json::Arena response_arena;
+        Json::Value *response;
+
+        {
+            Json::Arena::Scope arena_scope(&response_arena);
+            response = database.view("flight", "end_start_including_payloads",
+                                     options, false);
+        }
+
+        unique_ptr<Json::Value> response_destroyer(response);
+        const Json::Value &rows = view_rows(*response);
+        Json::Value::const_iterator it;
+
+        for (it = rows.begin(); it != rows.end(); it++)
+        {
+            const Json::Value &row = *it;
+            if (!row.isObject())
+                throw runtime_error("Invalid response: row was not an object");
+
+            const Json::Value &key = row[key_key], &doc = row[key_doc];
+
+            if (!key.isArray() || key.size() != 4 || !key[3u].isIntegral())
+                throw runtime_error("Invalid response: bad key in row");
+
+            /* The payload_configuration rows; we have all of those */
+            if (key[3u].asBool())
+                continue;
+
+            if (!doc.isObject() || !doc[key_id].isString())
+                throw runtime_error("Invalid response: bad doc in row");
+
+            new_flights[doc[key_id].asString()] = doc;
+        }
+    }
+
+    EZ::MutexLock update_lock(update_mutex);
+    EZ::MutexLock lock(mutex);
+
+    flight_docs.swap(new_flights);
+    payload_docs.swap(new_payloads);
+    flights_since = payloads_since = held_since = new_since;
+    bootstrapped = true;
+}
+
+static string count_string(size_t count)
+{
+    ostringstream temp;
+    temp << count;
+    return temp.str();
+}
+
+/* Appends the feed's changes from since on to out, fetching a page at a
+ * time, and returns the seq to carry on from. A deleted doc's is null. */
+string Replica::fetch_changes(map<string,string> options, const string &since,
+                              const vector<string> *doc_ids, Changes &out)
+{
+    string page_since(since);
+    options["limit"] = count_string(page_size);
+
+    for (;;)
+    {
+        options["since"] = page_since;
+
+        /* As in bootstrap(); the docs are copied out of the arena */
+        Json::Arena response_arena;
+        Json::Value *response;
+
+        {
+            Json::Arena::Scope arena_scope(&response_arena);
+
+            if (doc_ids)
+                response = database.changes(options, *doc_ids);
+            else
+                response = database.changes(options);
+        }
+
+        unique_ptr<Json::Value> response_destroyer(response);
+
+        if (!response->isObject())
+            throw runtime_error("Invalid response: was not an object");
+
+        const Json::Value &results = (*response)[key_results];
+        Json::Value::const_iterator it;
+
+        if (!results.isArray())
+            throw runtime_error("Invalid response: results was not an array");
+
+        for (it = results.begin(); it != results.end(); it++)
+        {
+            const Json::Value &change = *it;
+
+            if (!change.isObject() || !change[key_change_id].isString())
+                throw runtime_error("Invalid response: bad change");
+
+            const Json::Value &deleted = change[key_deleted];
+            const string id = change[key_change_id].asString();
+
+            if (deleted.isBool() && deleted.asBool())
+                out.push_back(make_pair(id, Json::Value::null));
+            else
+                out.push_back(make_pair(id, change[key_doc]));
+        }
+
+        const string last_seq = seq_string((*response)[key_last_seq]);
+
+        /* A short page is the last */
+        if (results.size() < page_size || last_seq == page_since)
+            return last_seq;
+
+        page_since = last_seq;
+    }
+}
+
+size_t Replica::update()
+{
+    EZ::MutexLock update_lock(update_mutex);
+
+    if (!bootstrapped)
+        throw runtime_error("Replica has not been bootstrapped");
+
+    map<string,string> options;
+    options["include_docs"] = "true";
+    options["filter"] = "_view";
+
+    /* Nothing is applied until every feed has been fetched, so that a
+     * failure leaves the replica (and the sinces) as they were */
+    Changes view_changes, held_changes;
+
+    options["view"] = "flight/end_start_including_payloads";
+    string new_flights_since = fetch_changes(options, flights_since, NULL,
+                                             view_changes);
+
+    options["view"] = "payload_configuration/name_time_created";
+    string new_payloads_since = fetch_changes(options, payloads_since, NULL,
+                                              view_changes);
+
+    /* Including those just found, since they may have changed again and
+     * left their view since the _view feeds were fetched */
+    vector<string> held;
+
+    {
+        EZ::MutexLock lock(mutex);
+        map<string,Json::Value>::const_iterator it;
+
+        for (it = flight_docs.begin(); it != flight_docs.end(); it++)
+            held.push_back((*it).first);
+        for (it = payload_docs.begin(); it != payload_docs.end(); it++)
+            held.push_back((*it).first);
+    }
+
+    for (size_t i = 0; i < view_changes.size(); i++)
+        held.push_back(view_changes[i].first);
+
+    sort(held.begin(), held.end());
+    held.erase(unique(held.begin(), held.end()), held.end());
+
+    string new_held_since(held_since);
+
+    if (held.size())
+    {
+        options.erase("view");
+        new_held_since = fetch_changes(options, held_since, &held,
+                                       held_changes);
+    }
+
+    /* In the order fetched, so that the newest version of a doc wins */
+    {
+        EZ::MutexLock lock(mutex);
+        Changes::const_iterator it;
+
+        for (it = view_changes.begin(); it != view_changes.end(); it++)
+            apply((*it).first, (*it).second);
+        for (it = held_changes.begin(); it != held_changes.end(); it++)
+            apply((*it).first, (*it).second);
+    }
+
+    flights_since = new_flights_since;
+    payloads_since = new_payloads_since;
+    held_since = new_held_since;
+
+    return view_changes.size() + held_changes.size();
+}
+
+/* The order of the flight view: [end, start, _id] */
+struct FlightRef
+{
+    long long int end, start;
+    const string *id;
+    const Json::Value *doc;
+
+    bool operator<(const FlightRef &other) const
+    {
+        if (end != other.end)
+            return end < other.end;
+        if (start != other.start)
+            return start < other.start;
+        return *id < *other.id;
+    }
+};
+
+/* The order of the payload_configuration view: [name, time_created] */
+struct PayloadRef
+{
+    string name;
+    long long int time_created;
+    const string *id;
+    const Json::Value *doc;
+
+    bool operator<(const PayloadRef &other) const
+    {
+        if (name != other.name)
+            return name < other.name;
+        if (time_created != other.time_created)
+            return time_created < other.time_created;
+        return *id < *other.id;
+    }
+};
+
+static long long int doc_timestamp(const Json::Value &value)
+{
+    if (!value.isString())
+        throw RFC3339::InvalidFormat();
+
+    return RFC3339::rfc3339_to_timestamp(value.asString());
+}
+
+vector<Json::Value> *Replica::flights(long long int now)
+{
+    EZ::MutexLock lock(mutex);
+
+    vector<FlightRef> refs;
+    map<string,Json::Value>::const_iterator it;
+
+    for (it = flight_docs.begin(); it != flight_docs.end(); it++)
+    {
+        const Json::Value &doc = (*it).second;
+        const Json::Value &approved = doc[key_approved];
+        FlightRef ref;
+
+        /* The view only has approved flights that haven't ended */
+        if (!approved.isBool() || !approved.asBool())
+            continue;
+
+        try
+        {
+            ref.end = doc_timestamp(doc[key_end]);
+            ref.start = doc_timestamp(doc[key_start]);
+        }
+        catch (RFC3339::InvalidFormat &e)
+        {
+            continue;
+        }
+
+        if (ref.end < now)
+            continue;
+
+        ref.id = &((*it).first);
+        ref.doc = &doc;
+        refs.push_back(ref);
+    }
+
+    sort(refs.begin(), refs.end());
+
+    vector<Json::Value> *result = new vector<Json::Value>;
+    unique_ptr< vector<Json::Value> > result_destroyer(result);
+    result->reserve(refs.size());
+
+    vector<FlightRef>::const_iterator ref;
+    for (ref = refs.begin(); ref != refs.end(); ref++)
+    {
+        result->push_back(*((*ref).doc));
+
+        Json::Value &doc = result->back();
+        Json::Value &payload_docs_list = doc[key_payload_docs];
+        payload_docs_list = Json::Value(Json::arrayValue);
+
+        const Json::Value &ids = doc[key_payloads];
+        if (!ids.isArray())
+            continue;
+
+        /* Like the view, skip payloads that don't exist */
+        Json::Value::const_iterator id;
+        for (id = ids.begin(); id != ids.end(); id++)
+        {
+            if (!(*id).isString())
+                continue;
+
+            map<string,Json::Value>::const_iterator payload =
+                payload_docs.find((*id).asString());
+
+            if (payload != payload_docs.end())
+                payload_docs_list.append((*payload).second);
+        }
+    }
+
+    result_destroyer.release();
+    return result;
+}
+
+vector<Json::Value> *Replica::payloads()
+{
+    EZ::MutexLock lock(mutex);
+
+    vector<PayloadRef> refs;
+    refs.reserve(payload_docs.size());
+
+    map<string,Json::Value>::const_iterator it;
+    for (it = payload_docs.begin(); it != payload_docs.end(); it++)
+    {
+        const Json::Value &doc = (*it).second;
+        const Json::Value &name = doc[key_name];
+        PayloadRef ref;
+
+        ref.name = name.isString() ? name.asString() : "";
+
+        try
+        {
+            ref.time_created = doc_timestamp(doc[key_time_created]);
+        }
+        catch (RFC3339::InvalidFormat &e)
+        {
+            ref.time_created = 0;
+        }
+
+        ref.id = &((*it).first);
+        ref.doc = &doc;
+        refs.push_back(ref);
+    }
+
+    sort(refs.begin(), refs.end());
+
+    vector<Json::Value> *result = new vector<Json::Value>;
+    unique_ptr< vector<Json::Value> > result_destroyer(result);
+    result->reserve(refs.size());
+
+    vector<PayloadRef>::const_iterator ref;
+    for (ref = refs.begin(); ref != refs.end(); ref++)
+        result->push_back(*((*ref).doc));
+
+    result_destroyer.release();
+    return result;
+}
+
+} /* namespace habitat */
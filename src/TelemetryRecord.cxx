@@ -0,0 +1,170 @@
+/* Copyright 2012 (C) Daniel Richman. License: GNU GPL 3; see LICENSE. */
+
+#include "habitat/TelemetryRecord.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <limits>
+#include <stdio.h>
+#include "jsoncpp.h"
+
+using namespace std;
+
+namespace habitat {
+
+static const Json::InternedKey key_sentence("_sentence");
+static const Json::InternedKey key_protocol("_protocol");
+static const Json::InternedKey key_parsed("_parsed");
+static const Json::InternedKey key_payload("payload");
+static const Json::InternedKey key_basic("_basic");
+
+/* Formats a converted ddmm value as a string, with a precision based on
+ * the length of the original */
+static string format_ddmmmm(const StringRef &value, double dd)
+{
+    size_t first = 0;
+    while (first < value.length && (value.data[first] == '0' ||
+           value.data[first] == '+' || value.data[first] == '-'))
+        first++;
+
+    /* Mirrors value.length() - value.find_first_not_of("0+-") - 2 being
+     * given to ostream::precision; negative precisions mean 6. */
+    long precision = long(value.length) - long(first) - 2;
+    if (first == value.length)
+        precision = long(value.length) + 1 - 2;
+    if (precision < 0)
+        precision = 6;
+
+    char temp[64];
+    snprintf(temp, sizeof(temp), "%.*g", int(precision), dd);
+
+    /* snprintf respects LC_NUMERIC, whereas ostream didn't */
+    for (char *c = temp; *c; c++)
+        if (*c == ',')
+            *c = '.';
+
+    return string(temp);
+}
+
+Json::Value TelemetryRecord::json() const
+{
+    Json::Value data(Json::objectValue);
+    data[key_sentence] = sentence.str();
+
+    if (state == TELEMETRY_UNPARSED)
+        return data;
+
+    data[key_protocol] = "UKHAS";
+    data[key_parsed] = true;
+    data[key_payload] = callsign.str();
+
+    if (state == TELEMETRY_BASIC)
+    {
+        data[key_basic] = true;
+        return data;
+    }
+
+    /* Later fields overwrite earlier ones with the same name */
+    for (size_t i = 0; i < field_count; i++)
+    {
+        const TelemetryField &field = fields[i];
+
+        if (field.type == FIELD_EMPTY)
+            continue;
+
+        /* Field names repeat in every record, so share one copy of each
+         * (unless the table is full, when the Value copies the name) */
+        const char *interned = Json::internKey(field.name);
+        Json::Value &value = interned ? data[Json::StaticString(interned)]
+                                      : data[field.name];
+
+        switch (field.type)
+        {
+            case FIELD_EMPTY:
+                break;
+            case FIELD_STRING:
+                value = field.text.str();
+                break;
+            case FIELD_NUMERIC:
+                value = field.value;
+                break;
+            case FIELD_COORDINATE:
+                value = format_ddmmmm(field.text, field.value);
+                break;
+        }
+    }
+
+    return data;
+}
+
+template <typename T>
+static void set_cell(vector<T> &column, size_t rows, const T &value,
+                     const T &padding)
+{
+    /* Already set by an earlier field of the same name in this record? */
+    if (column.size() == rows)
+    {
+        column.back() = value;
+    }
+    else
+    {
+        column.resize(rows - 1, padding);
+        column.push_back(value);
+    }
+}
+
+void TelemetryBatch::add(const TelemetryRecord &record)
+{
+    const double nan = numeric_limits<double>::quiet_NaN();
+
+    rows++;
+    callsign_column.push_back(record.callsign.str());
+
+    if (record.state == TELEMETRY_PARSED)
+    {
+        for (size_t i = 0; i < record.field_count; i++)
+        {
+            const TelemetryField &field = record.fields[i];
+
+            switch (field.type)
+            {
+                case FIELD_EMPTY:
+                    break;
+                case FIELD_STRING:
+                    set_cell(string_columns[field.name], rows,
+                             field.text.str(), string());
+                    break;
+                case FIELD_NUMERIC:
+                case FIELD_COORDINATE:
+                    set_cell(numeric_columns[field.name], rows,
+                             field.value, nan);
+                    break;
+            }
+        }
+    }
+
+    pad();
+}
+
+void TelemetryBatch::pad()
+{
+    const double nan = numeric_limits<double>::quiet_NaN();
+
+    map<string, vector<double> >::iterator n;
+    for (n = numeric_columns.begin(); n != numeric_columns.end(); n++)
+        (*n).second.resize(rows, nan);
+
+    map<string, vector<string> >::iterator s;
+    for (s = string_columns.begin(); s != string_columns.end(); s++)
+        (*s).second.resize(rows);
+}
+
+void TelemetryBatch::clear()
+{
+    rows = 0;
+    callsign_column.clear();
+    numeric_columns.clear();
+    string_columns.clear();
+}
+
+} /* namespace habitat */
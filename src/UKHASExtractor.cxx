@@ -8,17 +8,58 @@
 #include <cmath>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include "jsoncpp.h"
 
 using namespace std;
 
 namespace habitat {
 
+/* The payload configuration member names we look up. Interned, so that
+ * configurations parsed afterwards share them and lookups compare
+ * pointers; see Json::InternedKey. */
+static const Json::InternedKey key_sentences("sentences");
+static const Json::InternedKey key_callsign("callsign");
+static const Json::InternedKey key_checksum("checksum");
+static const Json::InternedKey key_fields("fields");
+static const Json::InternedKey key_name("name");
+static const Json::InternedKey key_sensor("sensor");
+static const Json::InternedKey key_format("format");
+static const Json::InternedKey key_filters("filters");
+static const Json::InternedKey key_post("post");
+static const Json::InternedKey key_type("type");
+static const Json::InternedKey key_filter("filter");
+static const Json::InternedKey key_source("source");
+static const Json::InternedKey key_destination("destination");
+static const Json::InternedKey key_factor("factor");
+static const Json::InternedKey key_offset("offset");
+static const Json::InternedKey key_round("round");
+
+void UKHASSentence::clear()
+{
+    raw = StringRef();
+    crude_error = NULL;
+    checksum = CHECKSUM_NONE;
+    callsign = StringRef();
+    configured = false;
+    config = NULL;
+    field_count = 0;
+    derived_count = 0;
+    error_count = 0;
+}
+
+void UKHASSentence::error(const char *e)
+{
+    if (error_count < MAX_ERRORS)
+        errors[error_count] = e;
+
+    error_count++;
+}
+
 void UKHASExtractor::reset_buffer()
 {
-    buffer.resize(0);
-    buffer.clear();
-    buffer.reserve(256);
+    /* buffer is a fixed size array, so this never (re)allocates */
+    buffer_length = 0;
 }
 
 void UKHASExtractor::skipped(int n)
@@ -31,7 +72,7 @@ void UKHASExtractor::skipped(int n)
          * ~1.5s at 300baud) */
         if (skipped_count > 50)
         {
-            mgr->status("UKHAS Extractor: giving up (silence)");
+            mgr->status_code(UKHAS_GIVING_UP_SILENCE);
             reset_buffer();
             extracting = false;
         }
@@ -46,36 +87,27 @@ void UKHASExtractor::push(char b, enum push_flags flags)
     {
         /* Start delimiter: "$$" */
         reset_buffer();
-        buffer.push_back(last);
-        buffer.push_back(b);
+        buffer[buffer_length++] = last;
+        buffer[buffer_length++] = b;
 
         garbage_count = 0;
         skipped_count = 0;
         extracting = true;
 
-        mgr->status("UKHAS Extractor: found start delimiter");
+        mgr->status_code(UKHAS_START_DELIMITER);
     }
     else if (extracting && b == '\n')
     {
         /* End delimiter: "\n" */
-        buffer.push_back(b);
-        mgr->uthr.payload_telemetry(buffer);
+        buffer[buffer_length++] = b;
 
-        mgr->status("UKHAS Extractor: extracted string");
+        /* assign() reuses sentence's storage once it is large enough */
+        sentence.assign(buffer, buffer_length);
+        mgr->upload(sentence);
 
-        try
-        {
-            mgr->data(crude_parse());
-        }
-        catch (runtime_error &e)
-        {
-            mgr->status("UKHAS Extractor: crude parse failed: " +
-                        string(e.what()));
+        mgr->status_code(UKHAS_EXTRACTED);
 
-            Json::Value bare(Json::objectValue);
-            bare["_sentence"] = buffer;
-            mgr->data(bare);
-        }
+        report(parse(buffer, buffer_length).record());
 
         reset_buffer();
         extracting = false;
@@ -86,15 +118,15 @@ void UKHASExtractor::push(char b, enum push_flags flags)
         if ((flags & PUSH_BAUDOT_HACK) && b == '#')
             b = '*';
 
-        buffer.push_back(b);
+        buffer[buffer_length++] = b;
 
         if (b < 0x20 || b > 0x7E)
             garbage_count++;
 
         /* Sane limits to avoid uploading tonnes of garbage */
-        if (buffer.length() > 1000 || garbage_count > 32)
+        if (buffer_length > MAX_LENGTH || garbage_count > 32)
         {
-            mgr->status("UKHAS Extractor: giving up");
+            mgr->status_code(UKHAS_GIVING_UP);
 
             reset_buffer();
             extracting = false;
@@ -104,31 +136,48 @@ void UKHASExtractor::push(char b, enum push_flags flags)
     last = b;
 }
 
-static void inplace_toupper(char &c)
+static bool string_equal(const Json::Value &value, const char *expect)
 {
-    if (c >= 'a' && c <= 'z')
-        c -= 32;
+    return value.isString() && strcmp(value.asCString(), expect) == 0;
+}
+
+static char hexchar(int n)
+{
+    if (n < 10)
+        return '0' + n;
+    else
+        return 'A' + n - 10;
+}
+
+/* Writes digits uppercase hex digits and a terminating null to target */
+static void format_hex(char *target, uint16_t value, int digits)
+{
+    for (int i = digits - 1; i >= 0; i--)
+    {
+        target[i] = hexchar(value & 0x0F);
+        value >>= 4;
+    }
+
+    target[digits] = '\0';
 }
 
-static string checksum_xor(const string &s)
+static uint16_t checksum_xor(const StringRef &s)
 {
     uint8_t checksum = 0;
-    for (string::const_iterator it = s.begin(); it != s.end(); it++)
-        checksum ^= (*it);
+    for (size_t i = 0; i < s.length; i++)
+        checksum ^= s.data[i];
 
-    char temp[3];
-    snprintf(temp, sizeof(temp), "%.02X", checksum);
-    return string(temp);
+    return checksum;
 }
 
-static string checksum_crc16_ccitt(const string &s)
+static uint16_t checksum_crc16_ccitt(const StringRef &s)
 {
     /* From avr-libc docs: Modified BSD (GPL, BSD, DFSG compatible) */
     uint16_t crc = 0xFFFF;
 
-    for (string::const_iterator it = s.begin(); it != s.end(); it++)
+    for (size_t n = 0; n < s.length; n++)
     {
-        crc = crc ^ ((uint16_t (*it)) << 8);
+        crc = crc ^ ((uint16_t (s.data[n])) << 8);
 
         for (int i = 0; i < 8; i++)
         {
@@ -138,252 +187,401 @@ static string checksum_crc16_ccitt(const string &s)
         }
     }
 
-    char temp[5];
-    snprintf(temp, sizeof(temp), "%.04X", crc);
-    return string(temp);
+    return crc;
 }
 
-static vector<string> split(const string &input, const char c)
+static const char *checksum_name(enum telemetry_checksum checksum)
 {
-    vector<string> parts;
-    size_t pos = 0, lastpos = 0;
-
-    do
+    switch (checksum)
     {
-        /* pos returns npos? substr will grab to end of string. */
-        pos = input.find_first_of(c, lastpos);
+        case CHECKSUM_XOR:
+            return "xor";
+        case CHECKSUM_CRC16_CCITT:
+            return "crc16-ccitt";
+        default:
+            return "";
+    }
+}
 
-        if (pos == string::npos)
-            parts.push_back(input.substr(lastpos));
-        else
-            parts.push_back(input.substr(lastpos, pos - lastpos));
+/* Case insensitive comparison of the checksum in the sentence against the
+ * (uppercase) expected value */
+static bool checksum_equal(const StringRef &given, const char *expect)
+{
+    for (size_t i = 0; i < given.length; i++)
+    {
+        char c = given.data[i];
+        if (c >= 'a' && c <= 'z')
+            c -= 32;
 
-        lastpos = pos + 1;
+        if (c != expect[i])
+            return false;
     }
-    while (pos != string::npos);
 
-    return parts;
+    return true;
 }
 
-static void split_string(const string &buffer, string *data, string *checksum)
+/* Splits the sentence into data and checksum, and checks the latter.
+ * Returns an error message or NULL. */
+static const char *examine_sentence(UKHASSentence &s, StringRef *data)
 {
-    if (buffer.substr(0, 2) != "$$")
-        throw runtime_error("String does not begin with $$");
+    const StringRef &raw = s.raw;
+
+    if (raw.length < 2 || raw.data[0] != '$' || raw.data[1] != '$')
+        return "String does not begin with $$";
+
+    if (raw.data[raw.length - 1] != '\n')
+        return "String does not end with '\\n'";
 
-    if (buffer[buffer.length() - 1] != '\n')
-        throw runtime_error("String does not end with '\\n'");
+    size_t pos = raw.length;
+    while (pos > 0 && raw.data[pos - 1] != '*')
+        pos--;
 
-    size_t pos = buffer.find_last_of('*');
-    if (pos == string::npos)
-        throw runtime_error("No checksum");
+    if (pos == 0)
+        return "No checksum";
+
+    pos--;
 
     size_t check_start = pos + 1;
-    size_t check_end = buffer.length() - 1;
+    size_t check_end = raw.length - 1;
     size_t check_length = check_end - check_start;
 
     if (check_length != 2 && check_length != 4)
-        throw runtime_error("Invalid checksum length");
+        return "Invalid checksum length";
 
     size_t data_start = 2;
     size_t data_length = pos - data_start;
 
-    *data = buffer.substr(data_start, data_length);
-    *checksum = buffer.substr(check_start, check_length);
-}
+    *data = StringRef(raw.data + data_start, data_length);
+    StringRef given(raw.data + check_start, check_length);
 
-static string examine_checksum(const string &data, const string &checksum_o)
-{
-    string checksum = checksum_o;
-    for_each(checksum.begin(), checksum.end(), inplace_toupper);
-
-    string expect, name;
+    /* Warning: cpp_connector only supports xor and crc16-ccitt, which
+     * conveninently are different lengths, so this works. */
+    char expect[5];
 
-    if (checksum.length() == 2)
+    if (check_length == 2)
     {
-        expect = checksum_xor(data);
-        name = "xor";
+        format_hex(expect, checksum_xor(*data), 2);
+        s.checksum = CHECKSUM_XOR;
     }
-    else if (checksum.length() == 4)
+    else
     {
-        expect = checksum_crc16_ccitt(data);
-        name = "crc16-ccitt";
+        format_hex(expect, checksum_crc16_ccitt(*data), 4);
+        s.checksum = CHECKSUM_CRC16_CCITT;
     }
-    else
+
+    if (!checksum_equal(given, expect))
     {
-        throw runtime_error("Invalid checksum length");
+        static const char prefix[] = "Invalid checksum: expected ";
+        memcpy(s.crude_error_buffer, prefix, sizeof(prefix) - 1);
+        strcpy(s.crude_error_buffer + sizeof(prefix) - 1, expect);
+        s.checksum = CHECKSUM_NONE;
+        return s.crude_error_buffer;
     }
 
-    if (expect != checksum)
-        throw runtime_error("Invalid checksum: expected " + expect);
+    return NULL;
+}
+
+static void split_fields(UKHASSentence &s, const StringRef &data)
+{
+    const char *end = data.data + data.length;
+    const char *token = data.data;
+    bool first = true;
+
+    for (;;)
+    {
+        const char *pos = token;
+        while (pos != end && *pos != ',')
+            pos++;
+
+        StringRef part(token, pos - token);
+
+        if (first)
+            s.callsign = part;
+        else if (s.field_count < UKHASSentence::MAX_FIELDS)
+            s.fields[s.field_count++].text = part;
+        else
+            s.field_count++;
+
+        first = false;
 
-    return name;
+        if (pos == end)
+            break;
+
+        token = pos + 1;
+    }
 }
 
 static bool is_ddmmmm_field(const Json::Value &field)
 {
-    if (field["sensor"] != "stdtelem.coordinate")
+    if (!string_equal(field[key_sensor], "stdtelem.coordinate"))
         return false;
 
-    if (!field["format"].isString())
+    if (!field[key_format].isString())
         return false;
 
-    string format = field["format"].asString();
+    const char *format = field[key_format].asCString();
 
     /* does it match d+m+\.m+ ? */
 
-    size_t pos;
+    const char *pos = format;
 
-    pos = format.find_first_not_of('d');
-    if (pos == string::npos || format[pos] != 'm')
+    while (*pos == 'd')
+        pos++;
+    if (pos == format || *pos != 'm')
         return false;
 
-    pos = format.find_first_not_of('m', pos);
-    if (pos == string::npos || format[pos] != '.')
+    while (*pos == 'm')
+        pos++;
+    if (*pos != '.')
         return false;
 
     pos++;
 
-    pos = format.find_first_not_of('m', pos);
-    if (pos != string::npos)
+    while (*pos == 'm')
+        pos++;
+    if (*pos != '\0')
+        return false;
+
+    return true;
+}
+
+static const double exact_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+    1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+    1e21, 1e22
+};
+
+/* Parses the common [+-]digits[.digits] case without allocating. Both the
+ * digits (at most 15 significant) and the power of ten are exactly
+ * representable, so the single division is correctly rounded and matches
+ * what strtod (and therefore istream >> double) would produce. */
+static bool parse_double_fast(const StringRef &value, double &result)
+{
+    const char *pos = value.data, *end = value.data + value.length;
+    bool negative = false;
+
+    if (pos != end && (*pos == '+' || *pos == '-'))
+    {
+        negative = (*pos == '-');
+        pos++;
+    }
+
+    uint64_t mantissa = 0;
+    int digits = 0, significant = 0, decimals = 0;
+    bool point = false;
+
+    for (; pos != end; pos++)
+    {
+        if (*pos >= '0' && *pos <= '9')
+        {
+            if (mantissa || *pos != '0')
+                significant++;
+            mantissa = mantissa * 10 + (*pos - '0');
+            digits++;
+            if (point)
+                decimals++;
+
+            if (significant > 15 || decimals > 22)
+                return false;
+        }
+        else if (*pos == '.' && !point)
+        {
+            point = true;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    if (!digits)
         return false;
 
+    result = double(mantissa) / exact_powers_of_ten[decimals];
+    if (negative)
+        result = -result;
+
     return true;
 }
 
-static string convert_ddmmmm(const string &value)
+/* Behaves like istream >> double; if whole is set, the entire value must
+ * be consumed. */
+static bool parse_double(const StringRef &value, bool whole, double &result)
 {
-    size_t split = value.find('.');
-    if (split == string::npos || split <= 2)
-        throw runtime_error("invalid '.' pos when converting ddmm");
+    if (parse_double_fast(value, result))
+        return true;
 
-    string left = value.substr(0, split - 2);
-    string right = value.substr(split - 2);
+    /* Exponents, long mantissas, trailing garbage: rare, so allocating is
+     * acceptable here */
+    istringstream is(value.str());
+    is >> result;
+
+    if (is.fail() || (whole && is.peek() != EOF))
+        return false;
+
+    return true;
+}
+
+static const char *convert_ddmmmm(const StringRef &value, double &result)
+{
+    const char *dot = static_cast<const char *>(
+            memchr(value.data, '.', value.length));
+
+    if (!dot || dot - value.data <= 2)
+        return "invalid '.' pos when converting ddmm";
+
+    size_t split = (dot - value.data) - 2;
+
+    StringRef left(value.data, split);
+    StringRef right(value.data + split, value.length - split);
 
-    istringstream lis(left), ris(right);
     double left_val, right_val;
-    lis >> left_val;
-    ris >> right_val;
 
-    if (lis.fail() || ris.fail() || lis.peek() != EOF || ris.peek() != EOF)
-        throw runtime_error("couldn't parse left or right parts (ddmm)");
+    if (!parse_double(left, true, left_val) ||
+        !parse_double(right, true, right_val))
+        return "couldn't parse left or right parts (ddmm)";
 
     if (right_val >= 60 || right_val < 0)
-        throw runtime_error("invalid right part (ddmm)");
+        return "invalid right part (ddmm)";
 
-    if (value.find('-') != string::npos)
+    if (memchr(value.data, '-', value.length))
         right_val *= -1;
-    double dd = left_val + (right_val / 60);
-    
-    ostringstream os;
-    os.precision(value.length() - value.find_first_not_of("0+-") - 2);
-    os << dd;
-    return os.str();
-}
 
-static bool is_numeric_field(const Json::Value &field)
-{
-    return field["sensor"] == "base.ascii_int" ||
-            field["sensor"] == "base.ascii_float";
+    result = left_val + (right_val / 60);
+    return NULL;
 }
 
-static double convert_numeric(const string &value)
+static bool is_numeric_field(const Json::Value &field)
 {
-    istringstream is(value);
-    double val;
-    is >> val;
-    if (is.fail())
-        throw runtime_error("couldn't parse numeric value");
-    return val;
+    return string_equal(field[key_sensor], "base.ascii_int") ||
+           string_equal(field[key_sensor], "base.ascii_float");
 }
 
-static void extract_fields(Json::Value &data, const Json::Value &fields,
-                           const vector<string> &parts)
+static const char *extract_fields(UKHASSentence &s, const Json::Value &fields)
 {
-    vector<string>::const_iterator part = parts.begin() + 1;
-    Json::Value::const_iterator field = fields.begin();
+    Json::Value::const_iterator field_config = fields.begin();
 
-    while (field != fields.end() && part != parts.end())
+    for (size_t i = 0; i < s.field_count; i++, field_config++)
     {
-        if (!(*field).isObject())
-            throw runtime_error("Invalid configuration (field not an object)");
+        TelemetryField &field = s.fields[i];
+
+        if (!(*field_config).isObject())
+            return "Invalid configuration (field not an object)";
 
-        const string key = (*field)["name"].asString();
-        const string value = (*part);
+        const Json::Value &name = (*field_config)[key_name];
+        if (name.isNull() || (name.isString() && !name.asCString()[0]))
+            return "Invalid configuration (empty field name)";
+        if (!name.isString())
+            return "Invalid configuration (field name not a string)";
 
-        if (!key.length())
-            throw runtime_error("Invalid configuration (empty field name)");
+        field.name = name.asCString();
 
-        if (value.length())
+        if (!field.text.length)
         {
-            if (is_ddmmmm_field(*field))
-                data[key] = convert_ddmmmm(value);
-            else if (is_numeric_field(*field))
-                data[key] = convert_numeric(value);
-            else
-                data[key] = value;
+            field.type = FIELD_EMPTY;
+        }
+        else if (is_ddmmmm_field(*field_config))
+        {
+            field.type = FIELD_COORDINATE;
+            const char *error = convert_ddmmmm(field.text, field.value);
+            if (error)
+                return error;
+        }
+        else if (is_numeric_field(*field_config))
+        {
+            field.type = FIELD_NUMERIC;
+            if (!parse_double(field.text, false, field.value))
+                return "couldn't parse numeric value";
+        }
+        else
+        {
+            field.type = FIELD_STRING;
         }
-
-        field++;
-        part++;
     }
+
+    return NULL;
 }
 
-static void numeric_scale(Json::Value &data, const Json::Value &config)
+/* Finds the value that would be at data[name] if it is numeric. Later
+ * fields (including the results of post filters) overwrite earlier ones,
+ * so search backwards. */
+static bool numeric_value(const UKHASSentence &s, const char *name,
+                          double &value)
 {
-    const string source = config["source"].asString();
-    string destination = source;
-
-    if (!config["destination"].isNull())
+    for (size_t i = s.field_count + s.derived_count; i > 0; i--)
     {
-        if (!config["destination"].isString())
-            throw runtime_error("Invalid (numeric scale) configuration "
-                                "(non string destination)");
-        destination = config["destination"].asString();
+        const TelemetryField &field = s.fields[i - 1];
+
+        if (field.type == FIELD_EMPTY || strcmp(field.name, name) != 0)
+            continue;
+
+        value = field.value;
+        return field.type == FIELD_NUMERIC;
     }
 
-    if (destination == "payload" ||
-            (destination.size() && destination[0] == '_'))
-        throw runtime_error("Invalid (numeric scale) configuration "
-                            "(forbidden destination)");
+    /* The _sentence, _protocol, ... keys are not numeric either */
+    return false;
+}
+
+static const char *numeric_scale(UKHASSentence &s, const Json::Value &config)
+{
+    const Json::Value &source = config[key_source];
+    const Json::Value &destination_v = config[key_destination];
+
+    if (!destination_v.isNull() && !destination_v.isString())
+        return "Invalid (numeric scale) configuration "
+               "(non string destination)";
+
+    if (!source.isString())
+        return "Invalid (numeric scale) configuration "
+               "(non string source)";
+
+    const char *destination = source.asCString();
+    if (!destination_v.isNull())
+        destination = destination_v.asCString();
 
-    if (!data[source].isNumeric())
-        throw runtime_error("Attempted to apply numeric scale to "
-                            "(non numeric source value)");
-    if (!config["factor"].isNumeric())
-        throw runtime_error("Invalid (numeric scale) configuration "
-                            "(non numeric factor)");
-    if (!config["source"].isString())
-        throw runtime_error("Invalid (numeric scale) configuration "
-                            "(non string source)");
+    if (strcmp(destination, "payload") == 0 || destination[0] == '_')
+        return "Invalid (numeric scale) configuration "
+               "(forbidden destination)";
 
-    double value = data[source].asDouble();
-    double factor = config["factor"].asDouble();
+    double value;
+
+    if (!numeric_value(s, source.asCString(), value))
+        return "Attempted to apply numeric scale to "
+               "(non numeric source value)";
+    if (!config[key_factor].isNumeric())
+        return "Invalid (numeric scale) configuration "
+               "(non numeric factor)";
+
+    double factor = config[key_factor].asDouble();
 
     value *= factor;
 
-    if (!config["offset"].isNull())
-    {
-        if (!config["offset"].isNumeric())
-            throw runtime_error("Invalid (numeric scale) configuration "
-                                "(non numeric offset)");
+    const Json::Value &offset = config[key_offset];
 
-        double offset = config["offset"].asDouble();
+    if (!offset.isNull())
+    {
+        if (!offset.isNumeric())
+            return "Invalid (numeric scale) configuration "
+                   "(non numeric offset)";
 
-        value += offset;
+        value += offset.asDouble();
     }
 
-    if (!config["round"].isNull())
+    const Json::Value &round_v = config[key_round];
+
+    if (!round_v.isNull())
     {
-        if (!config["round"].isNumeric())
-            throw runtime_error("Invalid (numeric scale) configuration "
-                                "(non numeric round)");
+        if (!round_v.isNumeric())
+            return "Invalid (numeric scale) configuration "
+                   "(non numeric round)";
 
-        double round_d = config["round"].asDouble();
+        double round_d = round_v.asDouble();
         int round_i = int(round_d);
 
         if (fabs(double(round_i) - round_d) > 0.001)
-            throw runtime_error("Invalid (numeric scale) configuration "
-                                "(non integral round)");
+            return "Invalid (numeric scale) configuration "
+                   "(non integral round)";
 
         if (value != 0)
         {
@@ -393,124 +591,217 @@ static void numeric_scale(Json::Value &data, const Json::Value &config)
         }
     }
 
-    data[destination] = value;
+    if (s.derived_count == UKHASSentence::MAX_DERIVED)
+        return "Invalid configuration (too many post filters)";
+
+    TelemetryField &result = s.fields[s.field_count + s.derived_count];
+    result.name = destination;
+    result.type = FIELD_NUMERIC;
+    result.value = value;
+    result.text = StringRef();
+    s.derived_count++;
+
+    return NULL;
 }
 
-static void post_filters(Json::Value &data, const Json::Value &sentence)
+static const char *post_filters(UKHASSentence &s, const Json::Value &sentence)
 {
-    if (!sentence["filters"].isObject())
-        return;
+    s.derived_count = 0;
+
+    const Json::Value &filters = sentence[key_filters];
+
+    if (!filters.isObject())
+        return NULL;
 
-    const Json::Value post_filters = sentence["filters"]["post"];
+    const Json::Value &post_filters = filters[key_post];
 
     if (!post_filters.isArray())
-        return;
+        return NULL;
 
     for (Json::Value::const_iterator it = post_filters.begin();
          it != post_filters.end(); it++)
     {
-        if ((*it)["type"] == "normal" &&
-            (*it)["filter"] == "common.numeric_scale")
-            numeric_scale(data, *it);
+        if (!(*it).isObject())
+            return "Invalid configuration (filter not an object)";
+
+        if (string_equal((*it)[key_type], "normal") &&
+            string_equal((*it)[key_filter], "common.numeric_scale"))
+        {
+            const char *error = numeric_scale(s, *it);
+            if (error)
+                return error;
+        }
     }
-}
 
-static void cook_basic(Json::Value &basic, const string &buffer,
-                       const string &callsign)
-{
-    basic["_sentence"] = buffer;
-    basic["_protocol"] = "UKHAS";
-    basic["_parsed"] = true;
-    basic["payload"] = callsign;
+    return NULL;
 }
 
-static void attempt_settings(Json::Value &data, const Json::Value &sentence,
-                             const string &checksum_name,
-                             const vector<string> &parts)
+/* Returns NULL if sentence could be used to parse s, otherwise the reason
+ * why not. Mismatches are expected when there are several candidate
+ * sentences, so they are not exceptions. */
+static const char *check_settings(const UKHASSentence &s,
+                                  const Json::Value &sentence)
 {
-    if (!sentence.isObject() || !sentence["callsign"].isString() ||
-        !sentence["fields"].isArray() || !sentence["fields"].size())
-        throw runtime_error("Invalid configuration "
-                                "(missing callsign or fields)");
+    if (!sentence.isObject() || !sentence[key_callsign].isString() ||
+        !sentence[key_fields].isArray() || !sentence[key_fields].size())
+        return "Invalid configuration (missing callsign or fields)";
 
-    if (sentence["callsign"] != parts[0])
-        throw runtime_error("Incorrect callsign");
+    if (s.callsign != sentence[key_callsign].asCString())
+        return "Incorrect callsign";
 
-    if (sentence["checksum"] != checksum_name)
-        throw runtime_error("Wrong checksum type");
+    if (!string_equal(sentence[key_checksum], checksum_name(s.checksum)))
+        return "Wrong checksum type";
 
-    const Json::Value &fields = sentence["fields"];
+    if (sentence[key_fields].size() != s.field_count)
+        return "Incorrect number of fields";
 
-    if (fields.size() != (parts.size() - 1))
-        throw runtime_error("Incorrect number of fields");
+    if (s.field_count > UKHASSentence::MAX_FIELDS)
+        return "Too many fields";
 
-    extract_fields(data, fields, parts);
-    post_filters(data, sentence);
+    return NULL;
 }
 
-/* crude_parse is based on the parse() method of
+static bool attempt_settings(UKHASSentence &s, const Json::Value &sentence)
+{
+    const char *error = check_settings(s, sentence);
+
+    /* Having matched, failures are due to bad values or configuration */
+    if (!error)
+        error = extract_fields(s, sentence[key_fields]);
+    if (!error)
+        error = post_filters(s, sentence);
+
+    if (error)
+    {
+        s.error(error);
+        return false;
+    }
+
+    s.config = &sentence;
+    return true;
+}
+
+/* parse and TelemetryRecord::json are based on the parse() method of
  * habitat.parser_modules.ukhas_parser.UKHASParser */
-Json::Value UKHASExtractor::crude_parse()
+const UKHASSentence &UKHASExtractor::parse(const char *line, size_t length)
 {
-    const Json::Value *settings_ptr = mgr->payload();
+    UKHASSentence &s = parsed;
+    s.clear();
+    s.raw = StringRef(line, length);
 
-    if (!settings_ptr)
-        settings_ptr = &(Json::Value::null);
-    else if (!settings_ptr->isObject())
-        throw runtime_error("Invalid configuration: "
-                "settings is not an object");
+    settings = mgr->payload();
+    registry = mgr->payloads();
 
-    const Json::Value &settings = *settings_ptr;
+    if (settings && !settings->isObject())
+    {
+        s.crude_error = "Invalid configuration: settings is not an object";
+        return s;
+    }
 
-    string data, checksum;
-    split_string(buffer, &data, &checksum);
+    StringRef data;
+    s.crude_error = examine_sentence(s, &data);
+    if (s.crude_error)
+        return s;
 
-    /* Warning: cpp_connector only supports xor and crc16-ccitt, which
-     * conveninently are different lengths, so this works. */
-    string checksum_name = examine_checksum(data, checksum);
-    vector<string> parts = split(data, ',');
-    if (!parts.size() || !parts[0].size())
-        throw runtime_error("Empty callsign");
+    split_fields(s, data);
+    if (!s.callsign.length)
+    {
+        s.crude_error = "Empty callsign";
+        return s;
+    }
 
-    Json::Value basic(Json::objectValue);
-    cook_basic(basic, buffer, parts[0]);
-    const Json::Value &sentences = settings["sentences"];
+    const vector<const Json::Value *> *candidates = NULL;
+    if (registry)
+    {
+        /* assign() reuses callsign_key's storage */
+        callsign_key.assign(s.callsign.data, s.callsign.length);
+        candidates = registry->find(callsign_key);
+    }
 
-    if (!sentences.isNull())
+    if (candidates)
     {
-        if (!sentences.isArray())
-            throw runtime_error("Invalid configuration: "
-                    "sentences is not an array");
+        s.configured = true;
 
-        /* Silence errors, and only log them if all attempts fail */
-        vector<string> errors;
+        vector<const Json::Value *>::const_iterator it;
+        for (it = candidates->begin(); it != candidates->end(); it++)
+        {
+            if (attempt_settings(s, *(*it)))
+                break;
+        }
+    }
+    else if (settings && !(*settings)[key_sentences].isNull())
+    {
+        const Json::Value &sentences = (*settings)[key_sentences];
 
-        for (Json::Value::const_iterator it = sentences.begin();
-             it != sentences.end(); it++)
+        if (!sentences.isArray())
         {
-            try
-            {
-                Json::Value data(basic);
-                attempt_settings(data, (*it), checksum_name, parts);
-                return data;
-            }
-            catch (runtime_error &e)
-            {
-                errors.push_back(e.what());
-            }
+            s.crude_error = "Invalid configuration: "
+                            "sentences is not an array";
+            return s;
         }
 
-        /* Couldn't parse using any of the settings... */
-        mgr->status("UKHAS Extractor: full parse failed:");
-        for (vector<string>::const_iterator it = errors.begin();
-             it != errors.end(); it++)
+        s.configured = true;
+
+        Json::Value::const_iterator it;
+        for (it = sentences.begin(); it != sentences.end(); it++)
         {
-            mgr->status("UKHAS Extractor: " + (*it));
+            if (attempt_settings(s, *it))
+                break;
         }
     }
 
-    basic["_basic"] = true;
-    return basic;
+    return s;
+}
+
+TelemetryRecord UKHASSentence::record() const
+{
+    TelemetryRecord r;
+    r.sentence = raw;
+
+    if (crude_error)
+        return r;
+
+    r.state = TELEMETRY_BASIC;
+    r.callsign = callsign;
+    r.checksum = checksum;
+
+    if (config)
+    {
+        r.state = TELEMETRY_PARSED;
+        r.field_count = field_count + derived_count;
+        r.fields = fields;
+    }
+
+    return r;
+}
+
+void UKHASExtractor::report(const TelemetryRecord &record)
+{
+    const UKHASSentence &s = parsed;
+
+    if (s.crude_error)
+    {
+        mgr->status_code(UKHAS_CRUDE_PARSE_FAILED, s.crude_error);
+    }
+    else if (!s.config && s.configured)
+    {
+        /* Couldn't parse using any of the settings... */
+        mgr->status_code(UKHAS_FULL_PARSE_FAILED);
+
+        size_t n = s.error_count;
+        if (n > UKHASSentence::MAX_ERRORS)
+            n = UKHASSentence::MAX_ERRORS;
+
+        for (size_t i = 0; i < n; i++)
+            mgr->status_code(UKHAS_FULL_PARSE_ERROR, s.errors[i]);
+    }
+
+    int outputs = mgr->output();
+
+    if (outputs & OUTPUT_RECORDS)
+        mgr->record(record);
+    if (outputs & OUTPUT_JSON)
+        mgr->data(record.json());
 }
 
 } /* namespace habitat */
@@ -3,6 +3,7 @@
 #include "habitat/Uploader.h"
 #include <string>
 #include <vector>
+#include <set>
 #include <memory>
 #include <sstream>
 #include <stdexcept>
@@ -12,18 +13,120 @@
 #include "habitat/CouchDB.h"
 #include "habitat/EZ.h"
 #include "habitat/RFC3339.h"
+#include "habitat/Clock.h"
 
 using namespace std;
 
 namespace habitat {
 
+/* The member names of the docs we build and the views we read. Interned,
+ * so that the docs share one copy of each and lookups compare pointers. */
+static const Json::InternedKey key_id("_id");
+static const Json::InternedKey key_data("data");
+static const Json::InternedKey key_raw("_raw");
+static const Json::InternedKey key_receivers("receivers");
+static const Json::InternedKey key_time_created("time_created");
+static const Json::InternedKey key_time_uploaded("time_uploaded");
+static const Json::InternedKey
+    key_latest_listener_information("latest_listener_information");
+static const Json::InternedKey
+    key_latest_listener_telemetry("latest_listener_telemetry");
+static const Json::InternedKey key_callsign("callsign");
+static const Json::InternedKey key_type("type");
+static const Json::InternedKey key_rows("rows");
+static const Json::InternedKey key_key("key");
+static const Json::InternedKey key_doc("doc");
+static const Json::InternedKey key_payload_docs("_payload_docs");
+static const Json::InternedKey key_sentences("sentences");
+static const Json::InternedKey key_row_id("id");
+
+/* Appends "name": to a body that is being written by hand */
+static void append_name(string &out, const char *name)
+{
+    Json::valueToQuotedString(name, out);
+    out += ':';
+}
+
+static void append_time(string &out, const char *buffer, size_t length)
+{
+    /* RFC3339 times never need escaping */
+    out += '"';
+    out.append(buffer, length);
+    out += '"';
+}
+
 Uploader::Uploader(const string &callsign, const string &couch_uri,
                    const string &couch_db, int max_merge_attempts)
-    : callsign(callsign), server(couch_uri), database(server, couch_db),
-      max_merge_attempts(max_merge_attempts)
+    : mutex("habitat::Uploader"),
+      callsign(callsign), couch_uri(couch_uri), couch_db(couch_db),
+      server(new CouchDB::Server(couch_uri)),
+      database(new CouchDB::Database(*server, couch_db)),
+      max_merge_attempts(max_merge_attempts), flights_page_size(0)
 {
     if (!callsign.length())
         throw invalid_argument("Callsign of zero length");
+
+    set_receiver_prefix();
+}
+
+void Uploader::set_receiver_prefix()
+{
+    receiver_prefix.clear();
+    append_name(receiver_prefix, key_receivers);
+    receiver_prefix += '{';
+    append_name(receiver_prefix, callsign.c_str());
+    receiver_prefix += '{';
+}
+
+void Uploader::reconfigure(const string &new_callsign,
+                           const string &new_couch_uri,
+                           const string &new_couch_db,
+                           int new_max_merge_attempts)
+{
+    EZ::MutexLock lock(mutex);
+
+    if (!new_callsign.length())
+        throw invalid_argument("Callsign of zero length");
+
+    const bool same_server = new_couch_uri == couch_uri;
+    const bool same_database = same_server && new_couch_db == couch_db;
+
+    /* Make anything new first, so that a bad setting changes nothing */
+    unique_ptr<CouchDB::Server> new_server;
+    unique_ptr<CouchDB::Database> new_database;
+
+    if (!same_server)
+        new_server.reset(new CouchDB::Server(new_couch_uri));
+
+    if (!same_database)
+    {
+        CouchDB::Server &s = same_server ? *server : *new_server;
+        new_database.reset(new CouchDB::Database(s, new_couch_db));
+    }
+
+    /* The replica refers to database, and database to server */
+    if (!same_database)
+    {
+        replica.reset();
+        database = std::move(new_database);
+    }
+
+    if (!same_server)
+        server = std::move(new_server);
+
+    /* The listener docs are in the old database, about the old callsign */
+    if (!same_database || new_callsign != callsign)
+    {
+        latest_listener_information.clear();
+        latest_listener_telemetry.clear();
+        update_listener_members();
+    }
+
+    callsign = new_callsign;
+    couch_uri = new_couch_uri;
+    couch_db = new_couch_db;
+    max_merge_attempts = new_max_merge_attempts;
+    set_receiver_prefix();
 }
 
 static char hexchar(int n)
@@ -90,11 +193,49 @@ static string base64(const string &data)
     return data_b64;
 }
 
-static void set_time(Json::Value &thing, long long int time_created)
+/* Declare before any Values using arena, so that they are gone by the time
+ * it is reset */
+class ArenaReset
+{
+    Json::Arena &arena;
+
+public:
+    ArenaReset(Json::Arena &a) : arena(a) {};
+    ~ArenaReset() { arena.reset(); };
+};
+
+/* Called with the mutex held, which protects time_formatter */
+void Uploader::set_time(Json::Value &thing, long long int time_created)
+{
+    char buffer[RFC3339::LocalOffsetFormatter::BUFFER_SIZE];
+
+    time_formatter.format_now(buffer);
+    thing[key_time_uploaded] = buffer;
+    time_formatter.format(time_created, buffer);
+    thing[key_time_created] = buffer;
+}
+
+/* Called with the mutex held. The ids, with a comma after each, to go
+ * straight into add_listener bodies. */
+void Uploader::update_listener_members()
 {
-    thing["time_uploaded"] = RFC3339::now_to_rfc3339_localoffset();
-    thing["time_created"] =
-        RFC3339::timestamp_to_rfc3339_localoffset(time_created);
+    listener_members.clear();
+
+    if (latest_listener_information.length())
+    {
+        append_name(listener_members, key_latest_listener_information);
+        Json::valueToQuotedString(latest_listener_information.c_str(),
+                                  listener_members);
+        listener_members += ',';
+    }
+
+    if (latest_listener_telemetry.length())
+    {
+        append_name(listener_members, key_latest_listener_telemetry);
+        Json::valueToQuotedString(latest_listener_telemetry.c_str(),
+                                  listener_members);
+        listener_members += ',';
+    }
 }
 
 string Uploader::payload_telemetry(const string &data,
@@ -106,20 +247,6 @@ string Uploader::payload_telemetry(const string &data,
     if (!data.length())
         throw runtime_error("Can't upload string of zero length");
 
-    string data_b64 = base64(data);
-    string doc_id = sha256hex(data_b64);
-
-    if (time_created == -1)
-        time_created = time(NULL);
-
-    Json::Value doc;
-    doc["data"] = Json::Value(Json::objectValue);
-    doc["data"]["_raw"] = data_b64;
-    doc["receivers"] = Json::Value(Json::objectValue);
-    doc["receivers"][callsign] = Json::Value(Json::objectValue);
-
-    Json::Value &receiver_info = doc["receivers"][callsign];
-
     if (metadata.isObject())
     {
         if (metadata.isMember("time_created") ||
@@ -129,29 +256,72 @@ string Uploader::payload_telemetry(const string &data,
         {
             throw invalid_argument("found forbidden key in metadata");
         }
-
-        /* This copies metadata. */
-        receiver_info = metadata;
     }
     else if (!metadata.isNull())
     {
         throw invalid_argument("metadata must be an object/dict or null");
     }
 
-    if (latest_listener_information.length())
-        receiver_info["latest_listener_information"] =
-            latest_listener_information;
+    string data_b64 = base64(data);
+    string doc_id = sha256hex(data_b64);
 
-    if (latest_listener_telemetry.length())
-        receiver_info["latest_listener_telemetry"] = latest_listener_telemetry;
+    if (time_created == -1)
+        time_created = Clock::now();
+
+    /*
+     * Rather than building a doc and writing all of it for every attempt,
+     * write everything up to time_uploaded once:
+     * {"data":{"_raw":...},"receivers":{CALLSIGN:{metadata...,
+     *  latest_listener_...,"time_created":...,"time_uploaded":
+     * and then put each attempt's time_uploaded and the closing braces on
+     * the end.
+     */
+    body.clear();
+    body += '{';
+    append_name(body, key_data);
+    body += '{';
+    append_name(body, key_raw);
+    Json::valueToQuotedString(data_b64.c_str(), body);
+    body += "},";
+    body += receiver_prefix;
+
+    if (metadata.isObject())
+    {
+        Json::FastWriter writer;
+        Json::Value::const_iterator it;
+
+        for (it = metadata.begin(); it != metadata.end(); it++)
+        {
+            append_name(body, it.memberName());
+            writer.write(*it, body);
+            body += ',';
+        }
+    }
+
+    body += listener_members;
+
+    char buffer[RFC3339::LocalOffsetFormatter::BUFFER_SIZE];
+    size_t length;
+
+    length = time_formatter.format(time_created, buffer);
+    append_name(body, key_time_created);
+    append_time(body, buffer, length);
+    body += ',';
+    append_name(body, key_time_uploaded);
+
+    const size_t time_uploaded_at = body.size();
 
     for (int attempts = 0; attempts < max_merge_attempts; attempts++)
     {
         try
         {
-            set_time(receiver_info, time_created);
-            database.update_put("payload_telemetry", "add_listener", doc_id,
-                                doc);
+            body.resize(time_uploaded_at);
+            length = time_formatter.format_now(buffer);
+            append_time(body, buffer, length);
+            body += "}}}";
+
+            database->update_put("payload_telemetry", "add_listener", doc_id,
+                                body);
             return doc_id;
         }
         catch (CouchDB::Conflict &e)
@@ -173,8 +343,11 @@ string Uploader::payload_telemetry(const string &data,
 string Uploader::listener_doc(const char *type, const Json::Value &data,
                               long long int time_created)
 {
+    ArenaReset arena_reset(arena);
+    Json::Arena::Scope arena_scope(&arena);
+
     if (time_created == -1)
-        time_created = time(NULL);
+        time_created = Clock::now();
 
     if (!data.isObject())
         throw invalid_argument("data must be an object/dict");
@@ -183,16 +356,16 @@ string Uploader::listener_doc(const char *type, const Json::Value &data,
         throw invalid_argument("forbidden key in data");
 
     Json::Value copied_data(data);
-    copied_data["callsign"] = callsign;
+    copied_data[key_callsign] = callsign;
 
     Json::Value doc(Json::objectValue);
-    doc["data"] = copied_data;
-    doc["type"] = type;
+    doc[key_data] = copied_data;
+    doc[key_type] = type;
 
     set_time(doc, time_created);
-    database.save_doc(doc);
+    database->save_doc(doc);
 
-    return doc["_id"].asString();
+    return doc[key_id].asString();
 }
 
 string Uploader::listener_telemetry(const Json::Value &data,
@@ -202,6 +375,7 @@ string Uploader::listener_telemetry(const Json::Value &data,
 
     latest_listener_telemetry =
         listener_doc("listener_telemetry", data, time_created);
+    update_listener_members();
     return latest_listener_telemetry;
 }
 
@@ -212,34 +386,109 @@ string Uploader::listener_information(const Json::Value &data,
 
     latest_listener_information =
         listener_doc("listener_information", data, time_created);
+    update_listener_members();
     return latest_listener_information;
 }
 
-vector<Json::Value> *Uploader::flights()
+void Uploader::warm_up()
 {
-    map<string,string> options;
+    server->warm_up();
+}
+
+void Uploader::replicate()
+{
+    unique_ptr<Replica> new_replica(new Replica(*database));
+    new_replica->bootstrap();
+    replica = std::move(new_replica);
+}
+
+void Uploader::page_flights(size_t page_size,
+                            const vector<long long int> &end_splits)
+{
+    for (size_t i = 0; i < end_splits.size(); i++)
+    {
+        if (end_splits[i] <= 0 || (i && end_splits[i] <= end_splits[i - 1]))
+            throw invalid_argument("end_splits must be positive, ascending");
+    }
+
+    EZ::MutexLock lock(mutex);
+    flights_page_size = page_size;
+    flights_end_splits = end_splits;
+}
 
-    Json::Value startkey(Json::arrayValue);
+static Json::Value end_key(long long int end)
+{
+    Json::Value key(Json::arrayValue);
 #ifdef JSON_HAS_INT64
-    startkey.append((Json::Int64) time(NULL));
+    key.append((Json::Int64) end);
 #else
-    startkey.append((Json::Int) time(NULL));
+    key.append((Json::Int) end);
 #endif
+    return key;
+}
 
+vector<Json::Value> *Uploader::flights()
+{
+    if (replica)
+    {
+        replica->update();
+        return replica->flights(Clock::now());
+    }
+
+    size_t page_size;
+    vector<long long int> end_splits;
+
+    {
+        EZ::MutexLock lock(mutex);
+        page_size = flights_page_size;
+        end_splits = flights_end_splits;
+    }
+
+    const long long int now = Clock::now();
+    map<string,string> options;
     options["include_docs"] = "true";
-    options["startkey"] = CouchDB::Database::json_query_value(startkey);
 
-    Json::Value *response =
-        database.view("flight", "end_start_including_payloads", options);
-    auto_ptr<Json::Value> response_destroyer(response);
+    vector<Json::Value> startkeys;
+    startkeys.push_back(end_key(now));
+
+    if (!page_size)
+        options["startkey"] =
+            CouchDB::Database::json_query_value(startkeys[0]);
+
+    /* A flight's payload_configuration rows have its end time in their
+     * keys too, so are never split from it */
+    for (size_t i = 0; i < end_splits.size(); i++)
+        startkeys.push_back(end_key(now + end_splits[i]));
+
+    /* Parse the (large) response into an arena, rather than freeing it
+     * node by node; the results are copied out of it onto the heap. Not the
+     * member arena, since the mutex isn't held. (view_paged()'s threads
+     * parse their pages into arenas of their own, which this one adopts.) */
+    Json::Arena response_arena;
+    Json::Value *response;
+
+    {
+        Json::Arena::Scope arena_scope(&response_arena);
+
+        if (page_size)
+            response = database->view_paged("flight",
+                                            "end_start_including_payloads",
+                                            startkeys, page_size, options);
+        else
+            response = database->view("flight",
+                                      "end_start_including_payloads",
+                                      options, false);
+    }
+
+    unique_ptr<Json::Value> response_destroyer(response);
 
     vector<Json::Value> *result = new vector<Json::Value>;
-    auto_ptr< vector<Json::Value> > result_destroyer(result);
+    unique_ptr< vector<Json::Value> > result_destroyer(result);
 
     if (!response->isObject())
         throw runtime_error("Invalid response: was not an object");
 
-    const Json::Value &rows = (*response)["rows"];
+    const Json::Value &rows = (*response)[key_rows];
     Json::Value::const_iterator it;
 
     if (!rows.isArray())
@@ -254,7 +503,7 @@ vector<Json::Value> *Uploader::flights()
         if (!row.isObject())
             throw runtime_error("Invalid response: row was not an object");
 
-        const Json::Value &key = row["key"], &doc = row["doc"];
+        const Json::Value &key = row[key_key], &doc = row[key_doc];
 
         bool doc_ok = doc.isObject() && doc.size();
         bool key_ok = key.isArray() && key.size() == 4 && key[3u].isIntegral();
@@ -273,11 +522,14 @@ vector<Json::Value> *Uploader::flights()
             /* copies the doc */
 
             Json::Value &doc_copy = result->back();
-            doc_copy["_payload_docs"] = Json::Value(Json::arrayValue);
-            current_pcfg_list = &(doc_copy["_payload_docs"]);
+            doc_copy[key_payload_docs] = Json::Value(Json::arrayValue);
+            current_pcfg_list = &(doc_copy[key_payload_docs]);
         }
         else
         {
+            if (!current_pcfg_list)
+                throw runtime_error("Invalid response: payload row first");
+
             if (doc_ok)
                 current_pcfg_list->append(doc);
         }
@@ -290,20 +542,34 @@ vector<Json::Value> *Uploader::flights()
 
 vector<Json::Value> *Uploader::payloads()
 {
+    if (replica)
+    {
+        replica->update();
+        return replica->payloads();
+    }
+
     map<string,string> options;
     options["include_docs"] = "true";
 
-    Json::Value *response =
-        database.view("payload_configuration", "name_time_created", options);
-    auto_ptr<Json::Value> response_destroyer(response);
+    /* As in flights() */
+    Json::Arena response_arena;
+    Json::Value *response;
+
+    {
+        Json::Arena::Scope arena_scope(&response_arena);
+        response = database->view("payload_configuration",
+                                 "name_time_created", options);
+    }
+
+    unique_ptr<Json::Value> response_destroyer(response);
 
     vector<Json::Value> *result = new vector<Json::Value>;
-    auto_ptr< vector<Json::Value> > result_destroyer(result);
+    unique_ptr< vector<Json::Value> > result_destroyer(result);
 
     if (!response->isObject())
         throw runtime_error("Invalid response: was not an object");
 
-    const Json::Value &rows = (*response)["rows"];
+    const Json::Value &rows = (*response)[key_rows];
     Json::Value::const_iterator it;
 
     if (!rows.isArray())
@@ -315,11 +581,127 @@ vector<Json::Value> *Uploader::payloads()
     {
         if (!(*it).isObject())
             throw runtime_error("Invalid response: doc was not an object");
-        result->push_back((*it)["doc"]);
+        result->push_back((*it)[key_doc]);
     }
 
     result_destroyer.release();
     return result;
 }
 
+static bool has_callsign(const Json::Value &doc, const set<string> &callsigns)
+{
+    const Json::Value &sentences = doc[key_sentences];
+
+    if (!sentences.isArray())
+        return false;
+
+    Json::Value::const_iterator it;
+    for (it = sentences.begin(); it != sentences.end(); it++)
+    {
+        if (!(*it).isObject())
+            continue;
+
+        const Json::Value &callsign = (*it)[key_callsign];
+        if (callsign.isString() && callsigns.count(callsign.asString()))
+            return true;
+    }
+
+    return false;
+}
+
+/* Replaces the doc in cache with doc's _id, or appends doc */
+static void cache_doc(vector<Json::Value> &cache, Json::Value &doc)
+{
+    const Json::Value &id = doc[key_id];
+    vector<Json::Value>::iterator it;
+
+    for (it = cache.begin(); it != cache.end(); it++)
+    {
+        if ((*it)[key_id] == id)
+        {
+            *it = std::move(doc);
+            return;
+        }
+    }
+
+    cache.push_back(std::move(doc));
+}
+
+void Uploader::payloads(const vector<string> &callsigns,
+                        vector<Json::Value> &cache)
+{
+    if (replica)
+    {
+        set<string> wanted(callsigns.begin(), callsigns.end());
+
+        replica->update();
+        unique_ptr< vector<Json::Value> > all(replica->payloads());
+
+        vector<Json::Value>::iterator it;
+        for (it = all->begin(); it != all->end(); it++)
+        {
+            if (has_callsign(*it, wanted))
+                cache_doc(cache, *it);
+        }
+
+        return;
+    }
+
+    /* Ids in the order first seen; a doc may have several sentences */
+    vector<string> ids;
+    set<string> seen;
+
+    for (size_t i = 0; i < callsigns.size(); i++)
+    {
+        /* Keys are [callsign, time_created, sentence index]; {} sorts
+         * after anything */
+        Json::Value startkey(Json::arrayValue), endkey(Json::arrayValue);
+        startkey.append(callsigns[i]);
+        endkey.append(callsigns[i]);
+        endkey.append(Json::Value(Json::objectValue));
+
+        map<string,string> options;
+        options["startkey"] = CouchDB::Database::json_query_value(startkey);
+        options["endkey"] = CouchDB::Database::json_query_value(endkey);
+
+        unique_ptr<Json::Value> response(
+            database->view("payload_configuration",
+                           "callsign_time_created_index", options));
+
+        if (!response->isObject())
+            throw runtime_error("Invalid response: was not an object");
+
+        const Json::Value &rows = (*response)[key_rows];
+        Json::Value::const_iterator it;
+
+        if (!rows.isArray())
+            throw runtime_error("Invalid response: rows was not an array");
+
+        for (it = rows.begin(); it != rows.end(); it++)
+        {
+            if (!(*it).isObject() || !(*it)[key_row_id].isString())
+                throw runtime_error("Invalid response: bad row");
+
+            const string id = (*it)[key_row_id].asString();
+
+            if (seen.insert(id).second)
+                ids.push_back(id);
+        }
+    }
+
+    if (!ids.size())
+        return;
+
+    /* Parsed onto the heap, so that the docs can be moved into cache */
+    unique_ptr<Json::Value> docs(database->get_docs(ids));
+
+    for (Json::ArrayIndex i = 0; i < docs->size(); i++)
+    {
+        Json::Value &doc = (*docs)[i];
+
+        if (doc.isObject())
+            cache_doc(cache, doc);
+    }
+}
+
 } /* namespace habitat */
@@ -3,26 +3,179 @@
 #include "habitat/UploaderThread.h"
 #include <stdexcept>
 #include <sstream>
+#include <algorithm>
+#include <new>
+#include <deque>
+#include <atomic>
+#include <ctime>
 
 namespace habitat {
 
+/* Big enough for any of our actions */
+static size_t largest_action()
+{
+    const size_t sizes[] = {
+        sizeof(UploaderSettings), sizeof(UploaderReset),
+        sizeof(UploaderPayloadTelemetry), sizeof(UploaderListenerTelemetry),
+        sizeof(UploaderListenerInfo), sizeof(UploaderFlights),
+        sizeof(UploaderPayloads), sizeof(UploaderCallsignPayloads),
+        sizeof(UploaderReplicate), sizeof(UploaderPageFlights),
+        sizeof(UploaderCache), sizeof(UploaderShutdown)
+    };
+
+    size_t size = 0;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(size_t); i++)
+        size = max(size, sizes[i]);
+    return size;
+}
+
+/* Free slots, each slot_size bytes, kept as a linked list. At most
+ * max_free are kept, so that a burst doesn't hold on to memory forever. */
+class ActionPool
+{
+    struct Slot
+    {
+        Slot *next;
+    };
+
+    EZ::FastMutex mutex;
+    Slot *free_slots;
+    size_t free_count;
+
+public:
+    enum { max_free = 64 };
+    const size_t slot_size;
+
+    ActionPool()
+        : mutex("habitat::ActionPool"), free_slots(NULL), free_count(0),
+          slot_size(max(largest_action(), sizeof(Slot))) {};
+
+    void *take();
+    void give(void *memory);
+};
+
+void *ActionPool::take()
+{
+    {
+        EZ::MutexLock lock(mutex);
+
+        if (free_slots)
+        {
+            Slot *slot = free_slots;
+            free_slots = slot->next;
+            free_count--;
+            return slot;
+        }
+    }
+
+    return ::operator new(slot_size);
+}
+
+void ActionPool::give(void *memory)
+{
+    {
+        EZ::MutexLock lock(mutex);
+
+        if (free_count < max_free)
+        {
+            Slot *slot = static_cast<Slot *>(memory);
+            slot->next = free_slots;
+            free_slots = slot;
+            free_count++;
+            return;
+        }
+    }
+
+    ::operator delete(memory);
+}
+
+/* Never destroyed, since actions may be freed by other static destructors */
+static ActionPool &action_pool()
+{
+    static ActionPool *pool = new ActionPool();
+    return *pool;
+}
+
+void *UploaderAction::operator new(size_t size)
+{
+    ActionPool &pool = action_pool();
+
+    /* A subclass from elsewhere might not fit */
+    if (size > pool.slot_size)
+        return ::operator new(size);
+
+    return pool.take();
+}
+
+void UploaderAction::operator delete(void *action, size_t size)
+{
+    if (!action)
+        return;
+
+    ActionPool &pool = action_pool();
+
+    if (size > pool.slot_size)
+        ::operator delete(action);
+    else
+        pool.give(action);
+}
+
 void UploaderAction::check(habitat::Uploader *u)
 {
     if (u == NULL)
         throw NotInitialisedError();
 }
 
+static double monotonic_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
 void UploaderSettings::apply(UploaderThread &uthr)
 {
-    uthr.uploader.reset(new habitat::Uploader(
-        callsign, couch_uri, couch_db, max_merge_attempts));
-    uthr.initialised();
+    if (in_place && uthr.uploader.get())
+        uthr.uploader->reconfigure(callsign, couch_uri, couch_db,
+                                   max_merge_attempts);
+    else
+        uthr.uploader.reset(new habitat::Uploader(
+            callsign, couch_uri, couch_db, max_merge_attempts));
+
+    if (warm_up != WARM_UP_NONE)
+    {
+        const double start = monotonic_seconds();
+
+        try
+        {
+            if (warm_up & WARM_UP_CONNECTION)
+                uthr.uploader->warm_up();
+            if (warm_up & WARM_UP_PAYLOADS)
+                uthr.fetch_payloads();
+
+            UploaderEvent event(UploaderEvent::WARMED_UP);
+            event.seconds = monotonic_seconds() - start;
+            uthr.emit(std::move(event));
+        }
+        catch (runtime_error &e)
+        {
+            const string what(e.what());
+            uthr.emit(UploaderEvent(UploaderEvent::WARNING,
+                                    "Warming up failed: " + what));
+        }
+    }
+
+    uthr.emit(UploaderEvent(UploaderEvent::INITIALISED));
+
+    if (uthr.doc_cache.get())
+        uthr.refresh_cache();
 }
 
 string UploaderSettings::describe()
 {
     stringstream ss(stringstream::out);
-    ss << "Uploader('" << callsign << "', '" << couch_uri << "', '"
+    ss << (in_place ? "Uploader.reconfigure('" : "Uploader('")
+       << callsign << "', '" << couch_uri << "', '"
        << couch_db << "', " << max_merge_attempts << ")";
     return ss.str();
 }
@@ -30,7 +183,7 @@ string UploaderSettings::describe()
 void UploaderReset::apply(UploaderThread &uthr)
 {
     uthr.uploader.reset();
-    uthr.reset_done();
+    uthr.emit(UploaderEvent(UploaderEvent::RESET_DONE));
 }
 
 string UploaderReset::describe()
@@ -45,7 +198,8 @@ void UploaderPayloadTelemetry::apply(UploaderThread &uthr)
     string result;
     result = uthr.uploader->payload_telemetry(data, metadata, time_created);
 
-    uthr.saved_id("payload_telemetry", result);
+    uthr.emit(UploaderEvent(UploaderEvent::SAVED_ID, "payload_telemetry",
+                            result));
 }
 
 string UploaderPayloadTelemetry::describe()
@@ -63,7 +217,8 @@ void UploaderListenerTelemetry::apply(UploaderThread &uthr)
 {
     check(uthr.uploader.get());
     string result = uthr.uploader->listener_telemetry(data, time_created);
-    uthr.saved_id("listener_telemetry", result);
+    uthr.emit(UploaderEvent(UploaderEvent::SAVED_ID, "listener_telemetry",
+                            result));
 }
 
 string UploaderListenerTelemetry::describe()
@@ -81,7 +236,8 @@ void UploaderListenerInfo::apply(UploaderThread &uthr)
 {
     check(uthr.uploader.get());
     string result = uthr.uploader->listener_information(data, time_created);
-    uthr.saved_id("listener_information", result);
+    uthr.emit(UploaderEvent(UploaderEvent::SAVED_ID, "listener_information",
+                            result));
 }
 
 string UploaderListenerInfo::describe()
@@ -98,9 +254,7 @@ string UploaderListenerInfo::describe()
 void UploaderFlights::apply(UploaderThread &uthr)
 {
     check(uthr.uploader.get());
-    auto_ptr< vector<Json::Value> > flights;
-    flights.reset(uthr.uploader->flights());
-    uthr.got_flights(*flights);
+    uthr.fetch_flights();
 }
 
 string UploaderFlights::describe()
@@ -111,9 +265,7 @@ string UploaderFlights::describe()
 void UploaderPayloads::apply(UploaderThread &uthr)
 {
     check(uthr.uploader.get());
-    auto_ptr< vector<Json::Value> > payloads;
-    payloads.reset(uthr.uploader->payloads());
-    uthr.got_payloads(*payloads);
+    uthr.fetch_payloads();
 }
 
 string UploaderPayloads::describe()
@@ -121,6 +273,95 @@ string UploaderPayloads::describe()
     return "Uploader.payloads()";
 }
 
+void UploaderCallsignPayloads::apply(UploaderThread &uthr)
+{
+    check(uthr.uploader.get());
+    uthr.uploader->payloads(callsigns, uthr.callsign_payloads);
+    uthr.emit_docs(UploaderEvent::GOT_PAYLOADS, uthr.callsign_payloads, true);
+}
+
+string UploaderCallsignPayloads::describe()
+{
+    stringstream ss(stringstream::out);
+    ss << "Uploader.payloads([";
+
+    for (size_t i = 0; i < callsigns.size(); i++)
+    {
+        if (i)
+            ss << ", ";
+        ss << "'" << callsigns[i] << "'";
+    }
+
+    ss << "])";
+    return ss.str();
+}
+
+void UploaderReplicate::apply(UploaderThread &uthr)
+{
+    check(uthr.uploader.get());
+    uthr.uploader->replicate();
+    uthr.emit(UploaderEvent(UploaderEvent::REPLICATED));
+}
+
+string UploaderReplicate::describe()
+{
+    return "Uploader.replicate()";
+}
+
+void UploaderPageFlights::apply(UploaderThread &uthr)
+{
+    check(uthr.uploader.get());
+    uthr.uploader->page_flights(page_size, end_splits);
+}
+
+string UploaderPageFlights::describe()
+{
+    stringstream ss(stringstream::out);
+    ss << "Uploader.page_flights(" << page_size << ", [";
+
+    for (size_t i = 0; i < end_splits.size(); i++)
+    {
+        if (i)
+            ss << ", ";
+        ss << end_splits[i];
+    }
+
+    ss << "])";
+    return ss.str();
+}
+
+void UploaderCache::apply(UploaderThread &uthr)
+{
+    uthr.doc_cache.reset(new DocCache(filename));
+    uthr.flights_stale = uthr.payloads_stale = true;
+
+    try
+    {
+        if (uthr.doc_cache->load())
+        {
+            uthr.emit_docs(UploaderEvent::GOT_FLIGHTS,
+                           uthr.doc_cache->flights, true);
+            uthr.emit_docs(UploaderEvent::GOT_PAYLOADS,
+                           uthr.doc_cache->payloads, true);
+        }
+    }
+    catch (runtime_error &e)
+    {
+        /* It will be replaced by the refresh */
+        const string what(e.what());
+        uthr.emit(UploaderEvent(UploaderEvent::WARNING,
+                                "Ignoring doc cache: " + what));
+    }
+
+    if (uthr.uploader.get())
+        uthr.refresh_cache();
+}
+
+string UploaderCache::describe()
+{
+    return "DocCache('" + filename + "')";
+}
+
 void UploaderShutdown::apply(UploaderThread &uthr)
 {
     throw this;
@@ -131,7 +372,122 @@ string UploaderShutdown::describe()
     return "Shutdown";
 }
 
-UploaderThread::UploaderThread() : queued_shutdown(false) {}
+/* Carries events from the uploader thread (the only producer) to whichever
+ * thread calls the hooks (the only consumer) */
+class UploaderThread::Dispatcher : public EZ::SimpleThread
+{
+    enum { ring_size = 256 };
+
+    UploaderThread &uthr;
+    EZ::RingBuffer<UploaderEvent> ring;
+    /* Events that didn't fit in the ring go here, in order, rather than
+     * have the uploader thread wait; while there are any, new events are
+     * added here too. overflowing is only changed with overflow_mutex. */
+    EZ::FastMutex overflow_mutex;
+    deque<UploaderEvent> overflow;
+    atomic<bool> overflowing;
+    /* With own_thread, it waits on this when there is nothing to do */
+    EZ::ConditionVariable wake;
+    atomic<bool> sleeping;
+    bool stopped;
+
+public:
+    const bool own_thread;
+
+    Dispatcher(UploaderThread &u, bool ot)
+        : uthr(u), ring(ring_size),
+          overflow_mutex("habitat::UploaderThread::overflow"),
+          overflowing(false), sleeping(false),
+          stopped(false), own_thread(ot) {};
+    ~Dispatcher() { stop(); };
+
+    void push(UploaderEvent &&event);
+    bool pop(UploaderEvent &event);
+    void *run();
+    /* With own_thread, delivers what's left and waits for the thread */
+    void stop();
+};
+
+void UploaderThread::Dispatcher::push(UploaderEvent &&event)
+{
+    if (overflowing.load() || !ring.put(std::move(event)))
+    {
+        EZ::MutexLock lock(overflow_mutex);
+        overflow.push_back(std::move(event));
+        overflowing.store(true);
+    }
+
+    /* The dispatching thread sets sleeping before it last checks for
+     * events, so either it sees this one or we see that it's asleep */
+    if (sleeping.load())
+    {
+        EZ::MutexLock lock(wake);
+        wake.signal();
+    }
+}
+
+bool UploaderThread::Dispatcher::pop(UploaderEvent &event)
+{
+    /* Everything in the ring is older than anything in overflow */
+    if (ring.get(event))
+        return true;
+
+    if (!overflowing.load())
+        return false;
+
+    EZ::MutexLock lock(overflow_mutex);
+
+    event = std::move(overflow.front());
+    overflow.pop_front();
+
+    if (!overflow.size())
+        overflowing.store(false);
+
+    return true;
+}
+
+void *UploaderThread::Dispatcher::run()
+{
+    UploaderEvent event;
+
+    for (;;)
+    {
+        if (!pop(event))
+        {
+            EZ::MutexLock lock(wake);
+            sleeping.store(true);
+
+            if (!pop(event))
+            {
+                wake.wait();
+                sleeping.store(false);
+                continue;
+            }
+
+            sleeping.store(false);
+        }
+
+        if (event.hook == UploaderEvent::STOP)
+            break;
+
+        uthr.deliver(event);
+    }
+
+    return NULL;
+}
+
+void UploaderThread::Dispatcher::stop()
+{
+    if (!own_thread || stopped)
+        return;
+
+    push(UploaderEvent(UploaderEvent::STOP));
+    join();
+    stopped = true;
+}
+
+UploaderThread::UploaderThread()
+    : flights_stale(false), payloads_stale(false), queued_shutdown(false) {}
 
 UploaderThread::~UploaderThread()
 {
@@ -145,18 +501,143 @@ UploaderThread::~UploaderThread()
 
 void UploaderThread::queue_action(UploaderAction *action)
 {
-    auto_ptr<UploaderAction> destroyer(action);
+    unique_ptr<UploaderAction> owned(action);
 
     log("Queuing " + action->describe());
-    queue.put(action);
-    destroyer.release();
+    queue.put(std::move(owned));
+}
+
+void UploaderThread::emit(UploaderEvent &&event)
+{
+    if (dispatcher.get())
+        dispatcher->push(std::move(event));
+    else
+        deliver(event);
+}
+
+void UploaderThread::emit_docs(UploaderEvent::Hook hook,
+                               vector<Json::Value> &docs, bool keep)
+{
+    if (!dispatcher.get())
+    {
+        if (hook == UploaderEvent::GOT_FLIGHTS)
+            got_flights(docs);
+        else
+            got_payloads(docs);
+        return;
+    }
+
+    UploaderEvent event(hook);
+
+    if (keep)
+        event.docs = docs;
+    else
+        event.docs.swap(docs);
+
+    dispatcher->push(std::move(event));
+}
+
+void UploaderThread::deliver(UploaderEvent &event)
+{
+    switch (event.hook)
+    {
+        case UploaderEvent::LOG:
+            log(event.text);
+            break;
+        case UploaderEvent::WARNING:
+            warning(event.text);
+            break;
+        case UploaderEvent::SAVED_ID:
+            saved_id(event.text, event.detail);
+            break;
+        case UploaderEvent::INITIALISED:
+            initialised();
+            break;
+        case UploaderEvent::WARMED_UP:
+            warmed_up(event.seconds);
+            break;
+        case UploaderEvent::RESET_DONE:
+            reset_done();
+            break;
+        case UploaderEvent::REPLICATED:
+            replicated();
+            break;
+        case UploaderEvent::NOT_INITIALISED:
+            caught_exception(NotInitialisedError());
+            break;
+        case UploaderEvent::RUNTIME_ERROR:
+            caught_exception(runtime_error(event.text));
+            break;
+        case UploaderEvent::INVALID_ARGUMENT:
+            caught_exception(invalid_argument(event.text));
+            break;
+        case UploaderEvent::GOT_FLIGHTS:
+            got_flights(event.docs);
+            break;
+        case UploaderEvent::GOT_PAYLOADS:
+            got_payloads(event.docs);
+            break;
+        default:
+            break;
+    }
+}
+
+void UploaderThread::fetch_flights()
+{
+    unique_ptr< vector<Json::Value> > flights;
+    flights.reset(uploader->flights());
+    emit_docs(UploaderEvent::GOT_FLIGHTS, *flights, doc_cache.get() != NULL);
+
+    if (doc_cache.get())
+    {
+        doc_cache->flights.swap(*flights);
+        doc_cache->save();
+        flights_stale = false;
+    }
+}
+
+void UploaderThread::fetch_payloads()
+{
+    unique_ptr< vector<Json::Value> > payloads;
+    payloads.reset(uploader->payloads());
+    emit_docs(UploaderEvent::GOT_PAYLOADS, *payloads,
+              doc_cache.get() != NULL);
+
+    if (doc_cache.get())
+    {
+        doc_cache->payloads.swap(*payloads);
+        doc_cache->save();
+        payloads_stale = false;
+    }
+}
+
+/* Fetches whichever halves of the cache are still stale */
+void UploaderThread::refresh_cache()
+{
+    if (flights_stale)
+        fetch_flights();
+    if (payloads_stale)
+        fetch_payloads();
 }
 
 void UploaderThread::settings(const string &callsign, const string &couch_uri,
-                              const string &couch_db, int max_merge_attempts)
+                              const string &couch_db, int max_merge_attempts,
+                              int warm_up)
+{
+    queue_action(
+        new UploaderSettings(callsign, couch_uri, couch_db, max_merge_attempts,
+                             warm_up, false)
+    );
+}
+
+void UploaderThread::reconfigure(const string &callsign,
+                                 const string &couch_uri,
+                                 const string &couch_db,
+                                 int max_merge_attempts, int warm_up)
 {
     queue_action(
-        new UploaderSettings(callsign, couch_uri, couch_db, max_merge_attempts)
+        new UploaderSettings(callsign, couch_uri, couch_db, max_merge_attempts,
+                             warm_up, true)
     );
 }
 
@@ -165,23 +646,23 @@ void UploaderThread::reset()
     queue_action(new UploaderReset());
 }
 
-void UploaderThread::payload_telemetry(const string &data,
-                                       const Json::Value &metadata,
+void UploaderThread::payload_telemetry(string data, Json::Value metadata,
                                        int time_created)
 {
-    queue_action(new UploaderPayloadTelemetry(data, metadata, time_created));
+    queue_action(new UploaderPayloadTelemetry(std::move(data),
+                                              std::move(metadata),
+                                              time_created));
 }
 
-void UploaderThread::listener_telemetry(const Json::Value &data,
-                                        int time_created)
+void UploaderThread::listener_telemetry(Json::Value data, int time_created)
 {
-    queue_action(new UploaderListenerTelemetry(data, time_created));
+    queue_action(new UploaderListenerTelemetry(std::move(data),
+                                               time_created));
 }
 
-void UploaderThread::listener_information(const Json::Value &data,
-                                          int time_created)
+void UploaderThread::listener_information(Json::Value data, int time_created)
 {
-    queue_action(new UploaderListenerInfo(data, time_created));
+    queue_action(new UploaderListenerInfo(std::move(data), time_created));
 }
 
 void UploaderThread::flights()
@@ -194,6 +675,27 @@ void UploaderThread::payloads()
     queue_action(new UploaderPayloads());
 }
 
+void UploaderThread::payloads(const vector<string> &callsigns)
+{
+    queue_action(new UploaderCallsignPayloads(callsigns));
+}
+
+void UploaderThread::replicate()
+{
+    queue_action(new UploaderReplicate());
+}
+
+void UploaderThread::page_flights(size_t page_size,
+                                  const vector<long long int> &end_splits)
+{
+    queue_action(new UploaderPageFlights(page_size, end_splits));
+}
+
+void UploaderThread::cache(const string &filename)
+{
+    queue_action(new UploaderCache(filename));
+}
+
 void UploaderThread::shutdown()
 {
     /* Borrow the SimpleThread mutex to make queued_shutdown access safe */
@@ -206,15 +708,44 @@ void UploaderThread::shutdown()
     }
 }
 
+void UploaderThread::dispatch_callbacks(bool own_thread)
+{
+    if (dispatcher.get())
+        throw runtime_error("dispatch_callbacks() has already been called");
+
+    dispatcher.reset(new Dispatcher(*this, own_thread));
+
+    if (own_thread)
+        dispatcher->start();
+}
+
+size_t UploaderThread::dispatch()
+{
+    if (!dispatcher.get() || dispatcher->own_thread)
+        return 0;
+
+    UploaderEvent event;
+    size_t count = 0;
+
+    while (dispatcher->pop(event))
+    {
+        deliver(event);
+        count++;
+    }
+
+    return count;
+}
+
 void *UploaderThread::run()
 {
-    log("Started");
+    emit(UploaderEvent(UploaderEvent::LOG, "Started"));
 
     for (;;)
     {
-        auto_ptr<UploaderAction> action(queue.get());
+        unique_ptr<UploaderAction> action(queue.get());
 
-        log("Running " + action->describe());
+        emit(UploaderEvent(UploaderEvent::LOG,
+                           "Running " + action->describe()));
 
         try
         {
@@ -226,22 +757,35 @@ void *UploaderThread::run()
         }
         catch (NotInitialisedError &e)
         {
-            caught_exception(e);
+            if (dispatcher.get())
+                emit(UploaderEvent(UploaderEvent::NOT_INITIALISED));
+            else
+                caught_exception(e);
             continue;
         }
         catch (runtime_error &e)
         {
-            caught_exception(e);
+            if (dispatcher.get())
+                emit(UploaderEvent(UploaderEvent::RUNTIME_ERROR, e.what()));
+            else
+                caught_exception(e);
             continue;
         }
         catch (invalid_argument &e)
         {
-            caught_exception(e);
+            if (dispatcher.get())
+                emit(UploaderEvent(UploaderEvent::INVALID_ARGUMENT,
+                                   e.what()));
+            else
+                caught_exception(e);
             continue;
         }
     }
 
-    log("Shutting down");
+    emit(UploaderEvent(UploaderEvent::LOG, "Shutting down"));
+
+    if (dispatcher.get())
+        dispatcher->stop();
 
     return NULL;
 }
@@ -261,11 +805,23 @@ void UploaderThread::initialised()
     log("Initialised Uploader");
 }
 
+void UploaderThread::warmed_up(double seconds)
+{
+    stringstream ss(stringstream::out);
+    ss << "Warmed up in " << seconds << "s";
+    log(ss.str());
+}
+
 void UploaderThread::reset_done()
 {
     log("Settings reset");
 }
 
+void UploaderThread::replicated()
+{
+    log("Replica bootstrapped");
+}
+
 void UploaderThread::caught_exception(const NotInitialisedError &error)
 {
     const string what(error.what());
@@ -0,0 +1,110 @@
+import os
+import json
+import random
+import tempfile
+import subprocess
+
+def crc16_ccitt(data):
+    crc = 0xFFFF
+    for c in data:
+        crc ^= ord(c) << 8
+        for i in range(8):
+            if crc & 0x8000:
+                crc = ((crc << 1) ^ 0x1021) & 0xFFFF
+            else:
+                crc = (crc << 1) & 0xFFFF
+    return "{0:04X}".format(crc)
+
+payload_doc = {
+    "sentences": [ {
+        "callsign": "TESTING",
+        "checksum": "crc16-ccitt",
+        "fields": [
+            {"name": "count", "sensor": "base.ascii_int"},
+            {"name": "text"},
+            {"name": "altitude", "sensor": "base.ascii_float"},
+        ],
+    } ]
+}
+
+def sentence(n):
+    data = "TESTING,{0},hello,{1}.5".format(n, n * 3)
+    return "$$" + data + "*" + crc16_ccitt(data)
+
+def make_capture(count):
+    """A capture with noise, CRLF and CR line endings, broken sentences,
+    over long lines and sentences split by stray '$$'"""
+    rand = random.Random(1234)
+    parts = []
+
+    for n in range(count):
+        choice = rand.randint(0, 9)
+        if choice == 0:
+            parts.append("noise" * rand.randint(1, 30))
+        elif choice == 1:
+            parts.append("$$" + "x" * 1100)
+        elif choice == 2:
+            parts.append("$$TESTING,bad,checksum*0000\r\n")
+        elif choice == 3:
+            parts.append("$$garbage ")
+        elif choice == 4:
+            parts.append("$$" + "\x01" * 40 + "\n")
+
+        parts.append(sentence(n))
+        parts.append(rand.choice(["\n", "\r\n", "\r", "\n\n"]))
+
+    # Unterminated, so it should never be extracted
+    parts.append("$$TESTING,unterminated")
+    return "".join(parts)
+
+class TestCaptureExtractor:
+    def setup(self):
+        fd, self.capture = tempfile.mkstemp()
+        os.write(fd, make_capture(300))
+        os.close(fd)
+
+        fd, self.payload = tempfile.mkstemp()
+        os.write(fd, json.dumps(payload_doc))
+        os.close(fd)
+
+    def teardown(self):
+        os.unlink(self.capture)
+        os.unlink(self.payload)
+
+    def run(self, *args):
+        p = subprocess.Popen(("tests/capture", ) + args,
+                             stdout=subprocess.PIPE)
+        output = p.stdout.read()
+        assert p.wait() == 0
+        return [json.loads(line) for line in output.splitlines()]
+
+    def check(self, *args):
+        expect = self.run("serial", self.capture, self.payload)
+        assert len([l for l in expect if l[0] == "upload"]) > 300
+        assert len([l for l in expect if l[0] == "record"]) > 300
+
+        for threads, chunk_size in [(1, 1 << 20), (4, 1), (4, 37), (3, 500),
+                                    (8, 4096)]:
+            output = self.run("parallel", self.capture, str(threads),
+                              str(chunk_size), self.payload)
+            assert output == expect
+
+    def test_matches_serial(self):
+        self.check()
+
+    def test_records(self):
+        output = self.run("parallel", self.capture, "4", "100",
+                          self.payload)
+        records = [l[1] for l in output if l[0] == "record"]
+        parsed = [r for r in records if r.get("_parsed") and "count" in r]
+        assert [r["count"] for r in parsed] == range(300)
+        assert all(r["_callsign"] == "TESTING" for r in parsed)
+        assert all(r["text"] == "hello" for r in parsed)
+
+    def test_unconfigured(self):
+        expect = self.run("serial", self.capture)
+        assert self.run("parallel", self.capture, "4", "64") == expect
+
+    def test_empty(self):
+        open(self.capture, "w").close()
+        assert self.run("parallel", self.capture, "4", "64") == []
@@ -0,0 +1,138 @@
+/* Copyright 2012 (C) Daniel Richman. License: GNU GPL 3; see LICENSE. */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <stdexcept>
+#include <cstdlib>
+
+#include "jsoncpp.h"
+#include "habitat/UploaderThread.h"
+#include "habitat/Extractor.h"
+#include "habitat/UKHASExtractor.h"
+#include "habitat/CaptureExtractor.h"
+
+using namespace std;
+
+/*
+ * Usage: capture serial <file> [payload.json]
+ *        capture parallel <file> <threads> <chunk_size> [payload.json]
+ *
+ * Writes one JSON array per callback, so that the output of pushing the
+ * file byte by byte can be compared with CaptureExtractor's.
+ */
+
+static void write(const char *type, const Json::Value &value)
+{
+    Json::Value root(Json::arrayValue);
+    root.append(type);
+    root.append(value);
+
+    Json::FastWriter writer;
+    cout << writer.write(root);
+}
+
+static void write_record(const habitat::TelemetryRecord &r)
+{
+    Json::Value root(r.json());
+    root["_callsign"] = r.callsign.str();
+    write("record", root);
+}
+
+class TestUploaderThread : public habitat::UploaderThread
+{
+public:
+    void log(const string &message) {};
+};
+
+class SerialManager : public habitat::ExtractorManager
+{
+public:
+    SerialManager(habitat::UploaderThread &u)
+        : habitat::ExtractorManager(u) {};
+
+    void upload(const string &sentence) { write("upload", sentence); };
+    void status(const string &msg) { write("status", msg); };
+    void data(const Json::Value &d) { write("data", d); };
+    void record(const habitat::TelemetryRecord &r) { write_record(r); };
+};
+
+class TestCaptureExtractor : public habitat::CaptureExtractor
+{
+public:
+    TestCaptureExtractor(habitat::UploaderThread &u, int threads,
+                         size_t chunk_size)
+        : habitat::CaptureExtractor(u, threads, chunk_size) {};
+
+    void upload(string sentence) { write("upload", sentence); };
+    void status(const string &msg) { write("status", msg); };
+    void data(const Json::Value &d) { write("data", d); };
+    void record(const habitat::TelemetryRecord &r) { write_record(r); };
+};
+
+static void load_payload(const char *filename, Json::Value &payload)
+{
+    ifstream file(filename);
+    Json::Reader reader;
+
+    if (!reader.parse(file, payload, false))
+        throw runtime_error("JSON parsing failed");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+        throw runtime_error("Invalid arguments");
+
+    const string mode = argv[1];
+    const int outputs = habitat::OUTPUT_JSON | habitat::OUTPUT_RECORDS;
+
+    TestUploaderThread thread;
+    thread.start();
+
+    Json::Value payload;
+
+    if (mode == "serial")
+    {
+        if (argc > 3)
+            load_payload(argv[3], payload);
+
+        ifstream file(argv[2], ios::in | ios::binary);
+        stringstream capture;
+        capture << file.rdbuf();
+        const string data = capture.str();
+
+        SerialManager manager(thread);
+        habitat::UKHASExtractor extractor;
+        manager.add(extractor);
+        manager.output(outputs);
+        if (argc > 3)
+            manager.payload(&payload);
+
+        for (size_t i = 0; i < data.length(); i++)
+            manager.push(data[i]);
+    }
+    else if (mode == "parallel" && argc >= 5)
+    {
+        if (argc > 5)
+            load_payload(argv[5], payload);
+
+        TestCaptureExtractor extractor(thread, atoi(argv[3]),
+                                       atoi(argv[4]));
+        extractor.output(outputs);
+        if (argc > 5)
+            extractor.payload(&payload);
+
+        extractor.extract(string(argv[2]));
+    }
+    else
+    {
+        throw runtime_error("Invalid arguments");
+    }
+
+    thread.shutdown();
+    thread.join();
+
+    return 0;
+}
@@ -0,0 +1,51 @@
+import subprocess
+import json
+
+class Proxy:
+    def __init__(self):
+        self.p = subprocess.Popen("tests/couchdb", stdin=subprocess.PIPE,
+                                  stdout=subprocess.PIPE)
+
+    def __getattr__(self, name):
+        def call(*args):
+            self.p.stdin.write(json.dumps([name] + list(args)))
+            self.p.stdin.write("\n")
+            response, value = json.loads(self.p.stdout.readline())
+            if response != "return":
+                raise Exception(value)
+            return value
+        return call
+
+    def close(self):
+        self.p.stdin.close()
+        assert self.p.wait() == 0
+
+class TestViewPaged:
+    def setup(self):
+        self.proxy = Proxy()
+
+    def teardown(self):
+        self.proxy.close()
+
+    def check(self, page_size, end_splits, requests=None):
+        result = self.proxy.compare_flights(300, page_size, end_splits)
+        assert result["equal"]
+        assert result["flights"] == 300
+        if requests is not None:
+            assert result["requests"] == requests
+
+    def test_one_page(self):
+        self.check(100000, [], requests=1)
+
+    def test_pages(self):
+        # Small pages often end among a flight's payload rows, and pages of
+        # one row are sometimes nothing but
+        for page_size in [1, 2, 3, 7, 100]:
+            self.check(page_size, [])
+
+    def test_ranges(self):
+        # Flights end a minute apart; 3600 is exactly the end of one, and
+        # the last range is empty
+        self.check(100000, [3600], requests=2)
+        self.check(7, [60, 3600, 86400])
+        self.check(1, [600, 1200, 1800, 2400, 30 * 86400])
@@ -0,0 +1,683 @@
+/* Copyright 2012 (C) Daniel Richman. License: GNU GPL 3; see LICENSE. */
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "jsoncpp.h"
+#include "habitat/EZ.h"
+#include "habitat/Uploader.h"
+#include "habitat/Clock.h"
+
+using namespace std;
+
+/*
+ * Tests and benchmarks for CouchDB::Database::view_paged, against a
+ * stand-in for the flight view: generated rows, served from memory on
+ * localhost by a tiny HTTP/1.1 server that understands the view options
+ * that paging uses.
+ *
+ * Usage: couchdb             (reads commands, like the other test binaries)
+ *        couchdb benchmark
+ */
+
+void handle_command(const Json::Value &command);
+void benchmark();
+
+static EZ::cURLGlobal cgl;
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "benchmark") == 0)
+    {
+        benchmark();
+        return 0;
+    }
+
+    for (;;)
+    {
+        string line;
+        getline(cin, line);
+
+        if (!line.length())
+            break;
+
+        Json::Reader reader;
+        Json::Value command;
+
+        if (!reader.parse(line, command, false))
+            throw runtime_error("JSON parsing failed");
+
+        if (!command.isArray() || !command[0u].isString())
+            throw runtime_error("Invalid JSON input");
+
+        handle_command(command);
+    }
+
+    return 0;
+}
+
+void reply(const Json::Value &arg1, const Json::Value &arg2)
+{
+    Json::Value response(Json::arrayValue);
+    response.append(arg1);
+    response.append(arg2);
+    Json::FastWriter writer;
+    cout << writer.write(response);
+    cout.flush();
+}
+
+static Json::Value parse(const string &text)
+{
+    Json::Reader reader;
+    Json::Value root;
+
+    if (!reader.parse(text, root, false))
+        throw runtime_error("JSON parsing failed");
+
+    return root;
+}
+
+static string write(const Json::Value &value)
+{
+    Json::FastWriter writer;
+    string text = writer.write(value);
+    text.erase(text.length() - 1);
+    return text;
+}
+
+/* CouchDB's collation, for what our keys contain */
+static int type_rank(const Json::Value &value)
+{
+    if (value.isNull())
+        return 0;
+    if (value.isBool())
+        return 1;
+    if (value.isNumeric())
+        return 2;
+    if (value.isString())
+        return 3;
+    if (value.isArray())
+        return 4;
+    return 5;
+}
+
+static int view_collate(const Json::Value &a, const Json::Value &b)
+{
+    int rank_a = type_rank(a), rank_b = type_rank(b);
+
+    if (rank_a != rank_b)
+        return rank_a < rank_b ? -1 : 1;
+
+    switch (rank_a)
+    {
+        case 1:
+            return int(a.asBool()) - int(b.asBool());
+
+        case 2:
+            if (a.asDouble() != b.asDouble())
+                return a.asDouble() < b.asDouble() ? -1 : 1;
+            return 0;
+
+        case 3:
+            return strcmp(a.asCString(), b.asCString());
+
+        case 4:
+            for (Json::ArrayIndex i = 0; i < a.size() && i < b.size(); i++)
+            {
+                int c = view_collate(a[i], b[i]);
+                if (c)
+                    return c;
+            }
+
+            if (a.size() != b.size())
+                return a.size() < b.size() ? -1 : 1;
+            return 0;
+
+        default:
+            return 0;
+    }
+}
+
+static string percent_decode(const string &s)
+{
+    string result;
+
+    for (size_t i = 0; i < s.length(); i++)
+    {
+        if (s[i] == '%' && i + 2 < s.length())
+        {
+            result.push_back((char) strtol(s.substr(i + 1, 2).c_str(),
+                                           NULL, 16));
+            i += 2;
+        }
+        else
+        {
+            result.push_back(s[i]);
+        }
+    }
+
+    return result;
+}
+
+static map<string,string> query_options(const string &target)
+{
+    map<string,string> options;
+    size_t position = target.find('?');
+
+    while (position != string::npos)
+    {
+        size_t next = target.find('&', position + 1);
+        string pair = target.substr(position + 1, next - position - 1);
+        size_t equals = pair.find('=');
+
+        if (equals != string::npos)
+            options[percent_decode(pair.substr(0, equals))] =
+                percent_decode(pair.substr(equals + 1));
+
+        position = next;
+    }
+
+    return options;
+}
+
+/*
+ * The rows of end_start_including_payloads, in view order: each flight is
+ * followed by a row for each of its payloads, with the flight's key but
+ * for the final 1, and the flight's id. Flights end a minute apart.
+ */
+class StandInView
+{
+    struct Row
+    {
+        Json::Value key;
+        string id;
+        string text;
+    };
+
+    vector<Row> rows;
+    int listener;
+    EZ::Mutex mutex;
+    size_t request_count;
+
+    size_t lower_bound(const Json::Value &key, const string &docid) const;
+    string respond(const string &target);
+    void serve(int fd);
+
+    static void *accept_main(void *arg);
+    static void *connection_main(void *arg);
+
+public:
+    const long long int now;
+    int port;
+    useconds_t latency;
+
+    StandInView(int flights, long long int now);
+    void start();
+    size_t requests();
+};
+
+/* xorshift, so that every run generates the same view */
+static unsigned long long next_random(unsigned long long &state)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static Json::Value payload_doc(int i)
+{
+    ostringstream s;
+    s << "{\"_id\": \"pcfg_" << i << "\", "
+      << "\"type\": \"payload_configuration\", "
+      << "\"name\": \"Payload " << i << "\", "
+      << "\"time_created\": \"2012-08-08T21:30:36+01:00\", "
+      << "\"sentences\": [{\"protocol\": \"UKHAS\", "
+      << "\"callsign\": \"PAYLOAD" << i << "\", "
+      << "\"checksum\": \"crc16-ccitt\", \"fields\": ["
+      << "{\"name\": \"sentence_id\", \"sensor\": \"base.ascii_int\"}, "
+      << "{\"name\": \"time\", \"sensor\": \"stdtelem.time\"}, "
+      << "{\"name\": \"latitude\", \"sensor\": \"stdtelem.coordinate\", "
+      << "\"format\": \"dd.dddd\"}, "
+      << "{\"name\": \"longitude\", \"sensor\": \"stdtelem.coordinate\", "
+      << "\"format\": \"dd.dddd\"}, "
+      << "{\"name\": \"altitude\", \"sensor\": \"base.ascii_int\"}"
+      << "]}]}";
+    return parse(s.str());
+}
+
+StandInView::StandInView(int flights, long long int now)
+    : listener(-1), request_count(0), now(now), port(0), latency(0)
+{
+    unsigned long long state = 88172645463325252ULL;
+    vector<Json::Value> payloads;
+
+    for (int i = 0; i < 200; i++)
+        payloads.push_back(payload_doc(i));
+
+    for (int i = 0; i < flights; i++)
+    {
+        ostringstream id;
+        id << "flight_" << i;
+
+        Json::Value doc(Json::objectValue);
+        doc["_id"] = id.str();
+        doc["type"] = "flight";
+        doc["approved"] = true;
+        doc["name"] = "Flight " + id.str();
+        doc["start"] = (Json::Int) (now + 60 * i);
+        doc["end"] = (Json::Int) (now + 60 * (i + 1));
+        doc["launch"]["timezone"] = "Europe/London";
+        doc["launch"]["location"]["latitude"] = 52.2135;
+        doc["launch"]["location"]["longitude"] = 0.0964;
+        doc["payloads"] = Json::Value(Json::arrayValue);
+
+        /* Up to five payloads, so that pages often end among them */
+        int count = next_random(state) % 6;
+        for (int j = 0; j < count; j++)
+        {
+            ostringstream payload_id;
+            payload_id << "pcfg_" << next_random(state) % 200;
+            doc["payloads"].append(payload_id.str());
+        }
+
+        Json::Value key(Json::arrayValue);
+        key.append(doc["end"]);
+        key.append(doc["start"]);
+        key.append(id.str());
+        key.append(0);
+
+        Json::Value row(Json::objectValue);
+        row["id"] = id.str();
+        row["key"] = key;
+        row["value"] = Json::Value::null;
+        row["doc"] = doc;
+
+        rows.push_back(Row());
+        rows.back().key = key;
+        rows.back().id = id.str();
+        rows.back().text = write(row);
+
+        key[3u] = 1;
+
+        for (int j = 0; j < count; j++)
+        {
+            const string payload_id = doc["payloads"][j].asString();
+            const int payload = atoi(payload_id.c_str() + 5);
+
+            row["key"] = key;
+            row["value"] = Json::Value(Json::objectValue);
+            row["value"]["_id"] = payload_id;
+            row["doc"] = payloads[payload];
+
+            rows.push_back(Row());
+            rows.back().key = key;
+            rows.back().id = id.str();
+            rows.back().text = write(row);
+        }
+    }
+}
+
+void StandInView::start()
+{
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener == -1)
+        throw runtime_error("socket failed");
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+
+    socklen_t length = sizeof(address);
+
+    if (bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+        listen(listener, 16) != 0 ||
+        getsockname(listener, (struct sockaddr *) &address, &length) != 0)
+        throw runtime_error("bind failed");
+
+    port = ntohs(address.sin_port);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, accept_main, this) != 0)
+        throw runtime_error("pthread_create failed");
+    pthread_detach(thread);
+}
+
+size_t StandInView::requests()
+{
+    EZ::MutexLock lock(mutex);
+    return request_count;
+}
+
+struct Connection
+{
+    StandInView *view;
+    int fd;
+};
+
+void *StandInView::accept_main(void *arg)
+{
+    StandInView *view = static_cast<StandInView *>(arg);
+
+    for (;;)
+    {
+        int fd = accept(view->listener, NULL, NULL);
+        if (fd == -1)
+            continue;
+
+        /* Responses are written in one go, so don't wait to coalesce */
+        int nodelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        Connection *connection = new Connection;
+        connection->view = view;
+        connection->fd = fd;
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, connection_main, connection) != 0)
+        {
+            close(fd);
+            delete connection;
+            continue;
+        }
+
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+void *StandInView::connection_main(void *arg)
+{
+    unique_ptr<Connection> connection(static_cast<Connection *>(arg));
+    connection->view->serve(connection->fd);
+    close(connection->fd);
+    return NULL;
+}
+
+/* Keep-alive: requests are answered until the client hangs up */
+void StandInView::serve(int fd)
+{
+    string buffer;
+
+    for (;;)
+    {
+        size_t header_end;
+
+        while ((header_end = buffer.find("\r\n\r\n")) == string::npos)
+        {
+            char chunk[4096];
+            ssize_t got = recv(fd, chunk, sizeof(chunk), 0);
+
+            if (got == -1 && errno == EINTR)
+                continue;
+            if (got <= 0)
+                return;
+
+            buffer.append(chunk, got);
+        }
+
+        /* "GET target HTTP/1.1" */
+        size_t target_start = buffer.find(' ') + 1;
+        size_t target_end = buffer.find(' ', target_start);
+        const string target =
+            buffer.substr(target_start, target_end - target_start);
+        buffer.erase(0, header_end + 4);
+
+        if (latency)
+            usleep(latency);
+
+        const string body = respond(target);
+        ostringstream response;
+        response << "HTTP/1.1 200 OK\r\n"
+                 << "Content-Type: application/json\r\n"
+                 << "Content-Length: " << body.length() << "\r\n\r\n"
+                 << body;
+
+        const string text = response.str();
+        const char *data = text.data();
+        size_t remaining = text.length();
+
+        while (remaining)
+        {
+            ssize_t sent = send(fd, data, remaining, MSG_NOSIGNAL);
+
+            if (sent == -1 && errno == EINTR)
+                continue;
+            if (sent <= 0)
+                return;
+
+            data += sent;
+            remaining -= sent;
+        }
+    }
+}
+
+/* The first row at or after (key, docid) */
+size_t StandInView::lower_bound(const Json::Value &key,
+                                const string &docid) const
+{
+    size_t low = 0, high = rows.size();
+
+    while (low < high)
+    {
+        size_t middle = (low + high) / 2;
+        int c = view_collate(rows[middle].key, key);
+
+        if (c < 0 || (c == 0 && rows[middle].id < docid))
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+string StandInView::respond(const string &target)
+{
+    {
+        EZ::MutexLock lock(mutex);
+        request_count++;
+    }
+
+    map<string,string> options = query_options(target);
+    size_t first = 0, limit = rows.size();
+    bool has_endkey = options.count("endkey");
+    bool inclusive_end = options["inclusive_end"] != "false";
+    Json::Value endkey;
+
+    if (options.count("startkey"))
+        first = lower_bound(parse(options["startkey"]),
+                            options["startkey_docid"]);
+    if (options.count("skip"))
+        first += strtoul(options["skip"].c_str(), NULL, 10);
+    if (options.count("limit"))
+        limit = strtoul(options["limit"].c_str(), NULL, 10);
+    if (has_endkey)
+        endkey = parse(options["endkey"]);
+
+    ostringstream body;
+    body << "{\"total_rows\":" << rows.size() << ",\"offset\":" << first
+         << ",\"rows\":[";
+
+    size_t count = 0;
+
+    for (size_t i = first; i < rows.size() && count < limit; i++, count++)
+    {
+        if (has_endkey)
+        {
+            int c = view_collate(rows[i].key, endkey);
+            if (c > 0 || (c == 0 && !inclusive_end))
+                break;
+        }
+
+        if (count)
+            body << ",";
+        body << rows[i].text;
+    }
+
+    body << "]}";
+    return body.str();
+}
+
+static double seconds()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static string server_url(const StandInView &view)
+{
+    ostringstream url;
+    url << "http://127.0.0.1:" << view.port;
+    return url.str();
+}
+
+static vector<Json::Value> *fetch_flights(StandInView &view,
+                                          size_t page_size,
+                                          const vector<long long int> &splits)
+{
+    habitat::Uploader uploader("STANDIN", server_url(view), "habitat");
+    uploader.page_flights(page_size, splits);
+    return uploader.flights();
+}
+
+static vector<long long int> end_splits(const Json::Value &value)
+{
+    vector<long long int> splits;
+
+    for (Json::ArrayIndex i = 0; i < value.size(); i++)
+        splits.push_back(value[i].asInt());
+
+    return splits;
+}
+
+/* Fetches the flights in one request and paged, and compares them */
+static Json::Value compare_flights(int flights, size_t page_size,
+                                   const vector<long long int> &splits)
+{
+    const long long int now = 1300000000;
+    Clock::Simulated clock(now);
+    Clock::set_source(&clock);
+
+    StandInView view(flights, now);
+    view.start();
+
+    unique_ptr< vector<Json::Value> > single(
+        fetch_flights(view, 0, vector<long long int>()));
+    size_t single_requests = view.requests();
+    unique_ptr< vector<Json::Value> > paged(
+        fetch_flights(view, page_size, splits));
+
+    Clock::set_source(NULL);
+
+    Json::Value result(Json::objectValue);
+    result["flights"] = (Json::UInt) paged->size();
+    result["equal"] = (*single == *paged);
+    result["requests"] = (Json::UInt) (view.requests() - single_requests);
+    return result;
+}
+
+void handle_command(const Json::Value &command)
+{
+    try
+    {
+        string command_name = command[0u].asString();
+
+        if (command_name == "compare_flights")
+            reply("return", compare_flights(command[1u].asInt(),
+                                            command[2u].asUInt(),
+                                            end_splits(command[3u])));
+        else
+            throw runtime_error("invalid command name");
+    }
+    catch (exception &e)
+    {
+        reply("error", e.what());
+    }
+}
+
+static void benchmark_flights(StandInView &view, size_t page_size,
+                              const vector<long long int> &splits)
+{
+    const int iterations = 5;
+    size_t total = 0;
+    size_t requests = view.requests();
+
+    double start = seconds();
+
+    for (int i = 0; i < iterations; i++)
+    {
+        unique_ptr< vector<Json::Value> > flights(
+            fetch_flights(view, page_size, splits));
+        total += flights->size();
+    }
+
+    double elapsed = seconds() - start;
+
+    cout << "flights, latency " << view.latency / 1000 << " ms, ";
+
+    if (page_size)
+        cout << "pages of " << page_size << ", " << splits.size() + 1
+             << " ranges";
+    else
+        cout << "one request";
+
+    cout << ": " << (elapsed * 1e3 / iterations) << " ms ("
+         << (view.requests() - requests) / iterations << " requests, "
+         << total / iterations << " flights)" << endl;
+}
+
+void benchmark()
+{
+    const long long int now = 1300000000;
+    Clock::Simulated clock(now);
+    Clock::set_source(&clock);
+
+    /* A fortnight of flights, ending a minute apart */
+    StandInView view(20000, now);
+    view.start();
+
+    vector<long long int> none, days;
+    days.push_back(86400);
+    days.push_back(3 * 86400);
+    days.push_back(7 * 86400);
+
+    vector<long long int> eighths;
+    for (int i = 1; i < 8; i++)
+        eighths.push_back(i * 20000 * 60 / 8);
+
+    const useconds_t latencies[] = {0, 20000};
+
+    for (size_t i = 0; i < sizeof(latencies) / sizeof(latencies[0]); i++)
+    {
+        view.latency = latencies[i];
+
+        benchmark_flights(view, 0, none);
+        benchmark_flights(view, 5000, none);
+        benchmark_flights(view, 5000, days);
+        benchmark_flights(view, 5000, eighths);
+        benchmark_flights(view, 20000, eighths);
+    }
+
+    Clock::set_source(NULL);
+}
@@ -107,6 +107,18 @@ class Proxy:
     def set_current_payload(self, value):
         self._write(["set_current_payload", value])
 
+    def count_allocations(self, string):
+        self._write(["count_allocations", string])
+
+    def output(self, flags):
+        self._write(["output", flags])
+
+    def dump_batch(self):
+        self._write(["dump_batch"])
+
+    def set_payloads(self, value):
+        self._write(["set_payloads", value])
+
     def check(self, match):
         obj = self._read()
         assert len(obj) >= len(match)
@@ -126,6 +138,12 @@ class Proxy:
     def check_data(self, data=None):
         self._check_type("data", data)
 
+    def check_record(self, data=None):
+        self._check_type("record", data)
+
+    def check_batch(self, data=None):
+        self._check_type("batch", data)
+
     def check_upload(self, data=None):
         self._check_type("upload", data)
 
@@ -422,3 +440,156 @@ class TestUKHASExtractor:
                               "_protocol": "UKHAS", "payload": "TESTING",
                               "a": 206, "b": 0.00482123, "b2": 0.00000482,
                               "b3": 0.00482123 * 5, "c": 48})
+
+    registry_flight_docs = [
+        {"sentences": [
+            {"callsign": "FIRST", "checksum": "crc16-ccitt",
+             "fields": [{"name": "fa"}, {"name": "fb"}]}
+        ]},
+        {"sentences": [
+            {"callsign": "SECOND", "checksum": "crc16-ccitt",
+             "fields": [{"name": "fa"}, {"name": "fb"}]},
+            {"callsign": "SECOND", "checksum": "crc16-ccitt",
+             "fields": [{"name": "fc", "sensor": "base.ascii_int"}]}
+        ]}
+    ]
+
+    def test_payload_registry(self):
+        self.extr.set_payloads(self.registry_flight_docs)
+
+        string = "$$FIRST,hello,world*A08E\n"
+        self.extr.push(string)
+        self.extr.check_status("start delim")
+        self.extr.check_upload(string)
+        self.extr.check_status("extracted")
+        self.extr.check_data({"_sentence": string, "_parsed": True,
+                              "_protocol": "UKHAS", "payload": "FIRST",
+                              "fa": "hello", "fb": "world"})
+
+        string = "$$SECOND,42*7B48\n"
+        self.extr.push(string)
+        self.extr.check_status("start delim")
+        self.extr.check_upload(string)
+        self.extr.check_status("extracted")
+        self.extr.check_data({"_sentence": string, "_parsed": True,
+                              "_protocol": "UKHAS", "payload": "SECOND",
+                              "fc": 42})
+
+        # callsign not in the registry, no current payload
+        self.check_noconfig("$$mypayload,has,a,valid,checksum*1018\n",
+                            "mypayload")
+
+    def test_payload_registry_falls_back(self):
+        self.extr.set_payloads(self.registry_flight_docs)
+        self.extr.set_current_payload(self.crude_parse_flight_doc)
+        string = "$$TESTING,value_a,value_b,value_c,123,453.24*CC76\n"
+        self.extr.push(string)
+        self.extr.check_status("start delim")
+        self.extr.check_upload(string)
+        self.extr.check_status("extracted")
+        self.extr.check_data({"_sentence": string, "_parsed": True,
+                              "_protocol": "UKHAS", "payload": "TESTING",
+                              "field_a": "value_a", "field_b": "value_b",
+                              "field_c": "value_c", "int_d": 123,
+                              "float_e": 453.24})
+
+    def check_allocation_free(self, string):
+        self.extr.count_allocations(string)
+        self.extr.check_upload(string)
+        self.extr.check(["allocations", {"push": 0, "parse": 0}])
+
+    def test_allocation_free_noconfig(self):
+        self.check_allocation_free("$$mypayload,has,a,valid,checksum*1a\n")
+
+    def test_allocation_free_config(self):
+        self.extr.set_current_payload(self.crude_parse_flight_doc)
+        self.check_allocation_free(
+                "$$TESTING,value_a,value_b,value_c,123,453.24*CC76\n")
+
+        self.extr.set_current_payload(self.ddmmmmmm_flight_doc)
+        self.check_allocation_free("$$TESTING,0024.124583,5116.5271,"
+                                   "-0016.5271,-5116.5271,whatever*F390\n")
+
+        self.extr.set_current_payload(self.numeric_scale_flight_doc)
+        self.check_allocation_free("$$TESTING,100.123,0.00482123,48*60A4\n")
+
+    def test_allocation_free_registry(self):
+        self.extr.set_payloads(self.registry_flight_docs)
+        self.check_allocation_free("$$SECOND,42*7B48\n")
+        self.check_allocation_free("$$TESTING,a,b,c*1A\n")
+
+    def test_records(self):
+        self.extr.output(3)
+        self.extr.set_current_payload(self.numeric_scale_flight_doc)
+        string = "$$TESTING,100.123,0.00482123,48*60A4\n"
+        self.extr.push(string)
+        self.extr.check_status("start delim")
+        self.extr.check_upload(string)
+        self.extr.check_status("extracted")
+        self.extr.check_record({"state": "parsed", "sentence": string,
+                                "callsign": "TESTING",
+                                "checksum": "crc16-ccitt",
+                                "fields": [["a", "numeric", 100.123],
+                                           ["b", "numeric", 0.00482123],
+                                           ["c", "numeric", 48],
+                                           ["a", "numeric", 206],
+                                           ["b2", "numeric", 0.00000482],
+                                           ["b3", "numeric",
+                                            0.00482123 * 5]]})
+        self.extr.check_data()
+
+        string = "$$TESTING,a,b,c*45\n"
+        self.extr.push(string)
+        self.extr.check_status("start delim")
+        self.extr.check_upload(string)
+        self.extr.check_status("extracted")
+        self.extr.check_status("invalid checksum")
+        self.extr.check_record({"state": "unparsed", "sentence": string,
+                                "callsign": "", "checksum": "none",
+                                "fields": []})
+        self.extr.check_data({"_sentence": string})
+
+    def test_records_only(self):
+        self.extr.output(2)
+        self.extr.set_current_payload(self.ddmmmmmm_flight_doc)
+        string = "$$TESTING,0024.124583,5116.5271,-0016.5271,-5116.5271," \
+                 "whatever*F390\n"
+        self.extr.push(string)
+        self.extr.check_status("start delim")
+        self.extr.check_upload(string)
+        self.extr.check_status("extracted")
+        self.extr.check_record({"state": "parsed", "sentence": string,
+                                "callsign": "TESTING",
+                                "checksum": "crc16-ccitt",
+                                "fields": [["lat_a", "string", "0024.124583"],
+                                           ["lat_b", "coordinate",
+                                            51 + 16.5271 / 60],
+                                           ["lat_a_neg", "coordinate",
+                                            -16.5271 / 60],
+                                           ["lat_b_neg", "coordinate",
+                                            -51 - 16.5271 / 60],
+                                           ["field_b", "string",
+                                            "whatever"]]})
+        self.extr.check_quiet()
+
+        # including the final \n, since no JSON is built
+        self.check_allocation_free(string)
+
+    def test_batch(self):
+        self.extr.output(2)
+        self.extr.set_payloads(self.registry_flight_docs)
+
+        for string in ["$$SECOND,42*7B48\n", "$$FIRST,hello,world*A08E\n",
+                       "$$mypayload,has,a,valid,checksum*1018\n"]:
+            self.extr.push(string)
+            self.extr.check_status("start delim")
+            self.extr.check_upload(string)
+            self.extr.check_status("extracted")
+            self.extr.check_record()
+
+        self.extr.dump_batch()
+        self.extr.check_batch({"rows": 3,
+                               "callsigns": ["SECOND", "FIRST", "mypayload"],
+                               "numeric": {"fc": [42, None, None]},
+                               "strings": {"fa": ["", "hello", ""],
+                                           "fb": ["", "world", ""]}})
@@ -3,13 +3,107 @@
 #include <iostream>
 #include <stdexcept>
 #include <memory>
+#include <new>
+#include <cstdlib>
 
 #include "jsoncpp.h"
 #include "habitat/Extractor.h"
 #include "habitat/UKHASExtractor.h"
+#include "habitat/PayloadRegistry.h"
 
 using namespace std;
 
+/* Counts heap allocations so that the tests can check that the extraction
+ * path doesn't make any */
+static bool counting = false;
+static long allocations = 0;
+
+void *operator new(size_t size)
+{
+    if (counting)
+        allocations++;
+
+    void *p = malloc(size ? size : 1);
+    if (!p)
+        throw bad_alloc();
+    return p;
+}
+
+/* Not inlined, so that GCC doesn't see free() given memory from new */
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+static Json::Value record_to_json(const habitat::TelemetryRecord &r)
+{
+    static const char *states[] = {"unparsed", "basic", "parsed"};
+    static const char *checksums[] = {"none", "xor", "crc16-ccitt"};
+    static const char *types[] = {"empty", "string", "numeric", "coordinate"};
+
+    Json::Value root(Json::objectValue);
+    root["state"] = states[r.state];
+    root["sentence"] = r.sentence.str();
+    root["callsign"] = r.callsign.str();
+    root["checksum"] = checksums[r.checksum];
+    root["fields"] = Json::Value(Json::arrayValue);
+
+    for (size_t i = 0; i < r.field_count; i++)
+    {
+        const habitat::TelemetryField &field = r.fields[i];
+        Json::Value f(Json::arrayValue);
+        f.append(field.name);
+        f.append(types[field.type]);
+
+        if (field.type == habitat::FIELD_STRING)
+            f.append(field.text.str());
+        else if (field.type != habitat::FIELD_EMPTY)
+            f.append(field.value);
+
+        root["fields"].append(f);
+    }
+
+    return root;
+}
+
+static Json::Value batch_to_json(const habitat::TelemetryBatch &batch)
+{
+    Json::Value root(Json::objectValue);
+    root["rows"] = Json::Value::UInt(batch.size());
+    root["callsigns"] = Json::Value(Json::arrayValue);
+    root["numeric"] = Json::Value(Json::objectValue);
+    root["strings"] = Json::Value(Json::objectValue);
+
+    for (size_t i = 0; i < batch.size(); i++)
+        root["callsigns"].append(batch.callsigns()[i]);
+
+    map<string, vector<double> >::const_iterator n;
+    for (n = batch.numeric().begin(); n != batch.numeric().end(); n++)
+    {
+        Json::Value &column = root["numeric"][(*n).first];
+        column = Json::Value(Json::arrayValue);
+
+        /* NaN isn't valid JSON */
+        for (size_t i = 0; i < (*n).second.size(); i++)
+            if ((*n).second[i] == (*n).second[i])
+                column.append((*n).second[i]);
+            else
+                column.append(Json::Value::null);
+    }
+
+    map<string, vector<string> >::const_iterator s;
+    for (s = batch.strings().begin(); s != batch.strings().end(); s++)
+    {
+        Json::Value &column = root["strings"][(*s).first];
+        column = Json::Value(Json::arrayValue);
+
+        for (size_t i = 0; i < (*s).second.size(); i++)
+            column.append((*s).second[i]);
+    }
+
+    return root;
+}
+
 class JsonIOExtractorManager : public habitat::ExtractorManager
 {
     void write(const string &name, const Json::Value &arg)
@@ -23,23 +117,45 @@ class JsonIOExtractorManager : public habitat::ExtractorManager
     };
 
 public:
+    bool quiet;
+    habitat::TelemetryBatch batch;
+
     JsonIOExtractorManager(habitat::UploaderThread &u)
-        : habitat::ExtractorManager(u) {};
+        : habitat::ExtractorManager(u), quiet(false) {};
+    void status_code(enum habitat::extractor_status code, const char *detail)
+    {
+        if (!quiet)
+            habitat::ExtractorManager::status_code(code, detail);
+    };
     void status(const string &msg) { write("status", msg); };
-    void data(const Json::Value &d) { write("data", d); };
+    void data(const Json::Value &d) { if (!quiet) write("data", d); };
+    void record(const habitat::TelemetryRecord &r)
+    {
+        if (quiet)
+            return;
+
+        batch.add(r);
+        write("record", record_to_json(r));
+    };
+    void allocations(long push, long parse)
+    {
+        Json::Value counts(Json::objectValue);
+        counts["push"] = Json::Value::Int(push);
+        counts["parse"] = Json::Value::Int(parse);
+        write("allocations", counts);
+    };
+    void dump_batch() { write("batch", batch_to_json(batch)); };
 };
 
 void handle_command(const Json::Value &command,
                     JsonIOExtractorManager &manager,
-                    habitat::UKHASExtractor &extractor,
-                    auto_ptr<Json::Value> &current_payload);
+                    habitat::UKHASExtractor &extractor);
 
 int main(int argc, char **argv)
 {
     habitat::UploaderThread thread;
     JsonIOExtractorManager manager(thread);
     habitat::UKHASExtractor extractor;
-    auto_ptr<Json::Value> current_payload;
 
     for (;;)
     {
@@ -58,14 +174,13 @@ int main(int argc, char **argv)
         if (!command.isArray() || !command[0u].isString())
             throw runtime_error("Invalid JSON input");
 
-        handle_command(command, manager, extractor, current_payload);
+        handle_command(command, manager, extractor);
     }
 }
 
 void handle_command(const Json::Value &command,
                     JsonIOExtractorManager &manager,
-                    habitat::UKHASExtractor &extractor,
-                    auto_ptr<Json::Value> &current_payload)
+                    habitat::UKHASExtractor &extractor)
 {
     string command_name = command[0u].asString();
     const Json::Value &arg = command[1u];
@@ -101,8 +216,68 @@ void handle_command(const Json::Value &command,
     }
     else if (command_name == "set_current_payload")
     {
-        current_payload.reset(new Json::Value(arg));
-        manager.payload(current_payload.get());
+        manager.payload(make_shared<const Json::Value>(arg));
+    }
+    else if (command_name == "set_payloads")
+    {
+        if (!arg.isArray())
+            throw runtime_error("Invalid JSON input");
+
+        vector<Json::Value> docs;
+        for (Json::Value::const_iterator it = arg.begin();
+             it != arg.end(); it++)
+            docs.push_back(*it);
+
+        manager.payloads(make_shared<const habitat::PayloadRegistry>(docs));
+    }
+    else if (command_name == "output")
+    {
+        if (!arg.isInt())
+            throw runtime_error("Invalid JSON input");
+
+        manager.output(arg.asInt());
+    }
+    else if (command_name == "dump_batch")
+    {
+        manager.dump_batch();
+    }
+    else if (command_name == "count_allocations")
+    {
+        if (!arg.isString() || !arg.asString().length())
+            throw runtime_error("Invalid JSON input");
+
+        const string sentence = arg.asString();
+        size_t length = sentence.length();
+
+        /* Once to warm up buffers, quietly apart from the upload */
+        manager.quiet = true;
+        for (size_t i = 0; i < length; i++)
+            manager.push(sentence[i]);
+        manager.quiet = false;
+
+        /* Stop short of the '\n' if it would build the JSON output */
+        size_t stop = length;
+        if (manager.output() & habitat::OUTPUT_JSON)
+            stop--;
+
+        manager.quiet = true;
+        manager.uthr.quiet = true;
+        allocations = 0;
+        counting = true;
+        for (size_t i = 0; i < stop; i++)
+            manager.push(sentence[i]);
+        counting = false;
+        manager.uthr.quiet = false;
+        manager.quiet = false;
+        long push = allocations;
+
+        allocations = 0;
+        counting = true;
+        extractor.parse(sentence.data(), length);
+        counting = false;
+        long parse = allocations;
+
+        manager.allocations(push, parse);
     }
     else
     {
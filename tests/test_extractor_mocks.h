@@ -5,6 +5,7 @@
 #define HABITAT_EZ_H
 
 #include <assert.h>
+#include <stddef.h>
 
 namespace EZ {
 
@@ -17,7 +18,7 @@ protected:
     friend class MutexLock;
 
 public:
-    Mutex() : lock_count(0) {};
+    Mutex(const char *name=NULL) : lock_count(0) {};
     ~Mutex() {};
 };
 
@@ -45,10 +46,17 @@ namespace habitat {
 class UploaderThread
 {
 public:
+    bool quiet;
+
+    UploaderThread() : quiet(false) {};
+
     void payload_telemetry(const std::string &data,
                            const Json::Value &metadata=Json::Value::null,
                            int time_created=-1)
     {
+        if (quiet)
+            return;
+
         Json::Value root(Json::arrayValue);
         root.append("upload");
         root.append(data);
@@ -0,0 +1,217 @@
+import subprocess
+import json
+
+class Proxy:
+    def __init__(self):
+        self.p = subprocess.Popen("tests/json", stdin=subprocess.PIPE,
+                                  stdout=subprocess.PIPE)
+
+    def __getattr__(self, name):
+        def call(*args):
+            self.p.stdin.write(json.dumps([name] + list(args)))
+            self.p.stdin.write("\n")
+            response, value = json.loads(self.p.stdout.readline())
+            if response != "return":
+                raise Exception(value)
+            return value
+        return call
+
+    def close(self):
+        self.p.stdin.close()
+        assert self.p.wait() == 0
+
+docs = [
+    {"a": 1, "b": [1, 2, {"c": "string"}], "d": None, "e": True},
+    {"_id": "x" * 5000, "nested": [[[[{"deep": "er"}]]]]},
+    {"rows": [{"key": [i, "k" * i], "value": i * 0.5} for i in range(200)]},
+]
+
+class TestArena:
+    def setup(self):
+        self.proxy = Proxy()
+
+    def teardown(self):
+        self.proxy.close()
+
+    def test_roundtrip(self):
+        for doc in docs:
+            result = self.proxy.arena_roundtrip(json.dumps(doc))
+            expect = dict(doc, added={"by": "arena"})
+            assert json.loads(result["written"]) == expect
+            assert json.loads(result["copied"]) == expect
+            assert result["used"] > 0
+
+class TestReader:
+    def setup(self):
+        self.proxy = Proxy()
+
+    def teardown(self):
+        self.proxy.close()
+
+    def check(self, text):
+        assert self.proxy.reader_parse(text) == json.loads(text)
+
+    def check_fails(self, text):
+        try:
+            self.proxy.reader_parse(text)
+        except Exception, e:
+            assert str(e) == "JSON parsing failed"
+        else:
+            raise AssertionError("parsed " + repr(text))
+
+    def test_docs(self):
+        for doc in docs:
+            self.check(json.dumps(doc))
+            self.check(json.dumps(doc, indent=4))
+
+    def test_strings(self):
+        for length in range(40):
+            for position in range(length):
+                for escape in ['\\"', '\\\\', '\\/', '\\n', '\\u00e9',
+                               '\\ud83d\\ude00', '\xc3\xa9']:
+                    s = "a" * position + escape + "b" * (length - position)
+                    self.check('["' + s + '", "' + s + '"]')
+                    self.check('{"' + s + '": "x"}')
+            self.check('"' + "c" * length + '"')
+
+    def test_whitespace(self):
+        spaces = " \t\r\n"
+        for length in range(40):
+            ws = "".join(spaces[i % 4] for i in range(length))
+            self.check(ws + "[" + ws + "1" + ws + "," + ws + '"s"' + ws +
+                       "]" + ws)
+            self.check("{" + ws + '"k"' + ws + ":" + ws + "null" + ws + "}")
+
+    def test_errors(self):
+        for length in range(40):
+            self.check_fails('["' + "d" * length)
+            self.check_fails('["' + "d" * length + "\\")
+            self.check_fails('["' + "d" * length + '\\"')
+            self.check_fails('["' + "d" * length + '\\q"]')
+            self.check_fails("[" + " " * length)
+
+class TestMove:
+    def setup(self):
+        self.proxy = Proxy()
+
+    def teardown(self):
+        self.proxy.close()
+
+    def test_move(self):
+        for doc in docs + ["string", 1, None]:
+            if isinstance(doc, list):
+                members = doc
+            elif isinstance(doc, dict):
+                members = [doc[key] for key in sorted(doc)]
+            else:
+                members = []
+
+            result = self.proxy.move_values(doc)
+            assert result == {"left_null": True, "value": doc,
+                              "members": members}
+
+class TestWriter:
+    def setup(self):
+        self.proxy = Proxy()
+
+    def teardown(self):
+        self.proxy.close()
+
+    def test_appending(self):
+        extra = [{"quote\"d": "\\\n\t\x01", "empty": {}, "list": []},
+                 "top level", 1.5, -3, None, False]
+        result = self.proxy.write_appending(docs + extra)
+        assert json.loads(result) == docs + extra
+
+class TestDoubles:
+    def setup(self):
+        self.proxy = Proxy()
+
+    def teardown(self):
+        self.proxy.close()
+
+    def test_format(self):
+        expect = [
+            (0.0, "0.0"), (-0.0, "-0.0"), (1.0, "1.0"), (-2.0, "-2.0"),
+            (0.1, "0.1"), (0.1 + 0.2, "0.30000000000000004"),
+            (52.123456, "52.123456"), (-1.5, "-1.5"), (123456.0, "123456.0"),
+            (1e15, "1000000000000000.0"), (1e16, "1e+16"),
+            (1.5e300, "1.5e+300"), (0.0001, "0.0001"), (1e-05, "1e-05"),
+            (5e-324, "5e-324"), (1.7976931348623157e308,
+                                "1.7976931348623157e+308"),
+            (2.2250738585072014e-308, "2.2250738585072014e-308"),
+        ]
+        for value, text in expect:
+            assert self.proxy.format_double(value) == text
+
+    def test_shortest(self):
+        def digits(text):
+            mantissa = text.split("e")[0].replace("-", "").replace(".", "")
+            return mantissa.strip("0")
+
+        for value in [1.0 / 3, 2.0 / 3, 3.14159, 1e22, 9007199254740993.0,
+                      123.456e-100, 0.000123, 0.1 + 0.7, 51.0 + 1e-15]:
+            text = self.proxy.format_double(value)
+            assert float(text) == value
+            assert digits(text) == digits(repr(value)), (text, repr(value))
+
+    def test_roundtrip(self):
+        for seed in [1, 2, 3]:
+            result = self.proxy.double_roundtrip(20000, seed * 2654435761)
+            assert result["mismatched"] == 0, result
+            assert result["longer"] < result["checked"] / 100, result
+
+class TestMembers:
+    def setup(self):
+        self.proxy = Proxy()
+
+    def teardown(self):
+        self.proxy.close()
+
+    def test_operations(self):
+        import random
+        rng = random.Random(4)
+        ops = []
+        expect_object = {}
+        expect_array = []
+        for i in range(2000):
+            key = "k%d" % rng.randrange(100)
+            choice = rng.randrange(5)
+            if choice == 0:
+                ops.append(["remove", key])
+                expect_object.pop(key, None)
+            elif choice == 1:
+                ops.append(["append", i])
+                expect_array.append(i)
+            elif choice == 2 and expect_array:
+                index = rng.randrange(len(expect_array) + 5)
+                ops.append(["set_index", index, {"i": i}])
+                expect_array += [None] * (index + 1 - len(expect_array))
+                expect_array[index] = {"i": i}
+            elif choice == 3 and i % 50 == 0:
+                size = rng.randrange(len(expect_array) + 1)
+                ops.append(["resize", size])
+                expect_array = expect_array[:size]
+            else:
+                ops.append(["set", key, [i, key]])
+                expect_object[key] = [i, key]
+
+        result = self.proxy.member_operations(ops)
+        assert result["object"] == expect_object
+        assert result["array"] == expect_array
+        assert result["names"] == sorted(expect_object.keys())
+        assert result["values"] == [expect_object[k]
+                                    for k in sorted(expect_object.keys())]
+        assert result["equal"]
+
+    def test_stable_references(self):
+        result = self.proxy.stable_references(500)
+        assert result == {"member": True, "element": True,
+                          "after_remove": True, "size": 2}
+
+    def test_interned(self):
+        doc = {"_id": 1, "time_created": 2, "rare": 3, "nested": {"_id": 4}}
+        result = self.proxy.interned_keys(json.dumps(doc),
+                                          ["_id", "time_created", "nested"])
+        assert result == {"_id": True, "time_created": True, "rare": False,
+                          "nested": True, "handle": "set with a handle"}
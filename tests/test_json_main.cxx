@@ -0,0 +1,582 @@
+/* Copyright 2012 (C) Daniel Richman. License: GNU GPL 3; see LICENSE. */
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/time.h>
+
+#include "jsoncpp.h"
+
+using namespace std;
+
+/*
+ * Tests and benchmarks for our changes to the bundled jsoncpp.
+ *
+ * Usage: json             (reads commands, like the other test binaries)
+ *        json benchmark
+ */
+
+void handle_command(const Json::Value &command);
+void benchmark();
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "benchmark") == 0)
+    {
+        benchmark();
+        return 0;
+    }
+
+    for (;;)
+    {
+        string line;
+        getline(cin, line);
+
+        if (!line.length())
+            break;
+
+        Json::Reader reader;
+        Json::Value command;
+
+        if (!reader.parse(line, command, false))
+            throw runtime_error("JSON parsing failed");
+
+        if (!command.isArray() || !command[0u].isString())
+            throw runtime_error("Invalid JSON input");
+
+        handle_command(command);
+    }
+
+    return 0;
+}
+
+void reply(const Json::Value &arg1, const Json::Value &arg2)
+{
+    Json::Value response(Json::arrayValue);
+    response.append(arg1);
+    response.append(arg2);
+    Json::FastWriter writer;
+    cout << writer.write(response);
+    cout.flush();
+}
+
+static Json::Value parse(const string &text)
+{
+    Json::Reader reader;
+    Json::Value root;
+
+    if (!reader.parse(text, root, false))
+        throw runtime_error("JSON parsing failed");
+
+    return root;
+}
+
+/* Parses, modifies and serialises text using an arena, and copies the
+ * result out of the arena before resetting it */
+static Json::Value arena_roundtrip(const string &text)
+{
+    Json::Arena arena(256);
+    Json::Value result(Json::objectValue);
+    Json::Value copy;
+
+    for (int i = 0; i < 3; i++)
+    {
+        {
+            Json::Arena::Scope scope(&arena);
+            Json::Value doc = parse(text);
+            doc["added"]["by"] = "arena";
+
+            Json::FastWriter writer;
+
+            {
+                Json::Arena::Scope heap(NULL);
+                result["written"] = writer.write(doc);
+                copy = doc;
+            }
+        }
+
+        result["used"] = (Json::UInt) arena.used();
+        arena.reset();
+    }
+
+    Json::FastWriter writer;
+    result["copied"] = writer.write(copy);
+    return result;
+}
+
+/* Parses text from a copy of it at each alignment, followed by bytes that
+ * would change the result if the reader looked past the end, and checks
+ * that every parse agrees with parsing the string itself. */
+static Json::Value reader_parse(const string &text)
+{
+    Json::Reader reader;
+    Json::Value expect;
+    const bool expect_ok = reader.parse(text, expect, false);
+
+    Json::FastWriter writer;
+    const string expect_text = writer.write(expect);
+    const char junk[] = "\"\\ \t\"\\\"\r\n \"\\\\\"   ";
+
+    for (size_t offset = 0; offset < 16; offset++)
+    {
+        string buffer(offset, ' ');
+        buffer.append(text);
+        buffer.append(junk);
+
+        Json::Value root;
+        const char *begin = buffer.data() + offset;
+        bool ok = reader.parse(begin, begin + text.size(), root, false);
+
+        if (ok != expect_ok)
+            throw runtime_error("In place parse succeeded differently");
+        if (root != expect || writer.write(root) != expect_text)
+            throw runtime_error("In place parse differs");
+    }
+
+    if (!expect_ok)
+        throw runtime_error("JSON parsing failed");
+
+    return expect;
+}
+
+/* Applies ops to an object and an array, and reports the results as the
+ * member names and values seen by iterating over them */
+static Json::Value member_operations(const Json::Value &ops)
+{
+    Json::Value object(Json::objectValue), array(Json::arrayValue);
+
+    for (Json::ArrayIndex i = 0; i < ops.size(); i++)
+    {
+        const Json::Value &op = ops[i];
+        const string name = op[0u].asString();
+
+        if (name == "set")
+            object[op[1u].asString()] = op[2u];
+        else if (name == "remove")
+            object.removeMember(op[1u].asString());
+        else if (name == "append")
+            array.append(op[1u]);
+        else if (name == "set_index")
+            array[op[1u].asUInt()] = op[2u];
+        else if (name == "resize")
+            array.resize(op[1u].asUInt());
+        else
+            throw runtime_error("unknown op");
+    }
+
+    Json::Value result(Json::objectValue);
+    Json::Value names(Json::arrayValue), values(Json::arrayValue);
+
+    const Json::Value &members = object;
+    for (Json::Value::const_iterator it = members.begin();
+         it != members.end(); it++)
+    {
+        names.append(it.memberName());
+        values.append(*it);
+    }
+
+    Json::Value copy(object);
+
+    result["names"] = names;
+    result["values"] = values;
+    result["object"] = object;
+    result["array"] = array;
+    result["equal"] = copy == object && Json::Value(array) == array;
+    return result;
+}
+
+/* Holds references to a member and an element while count others are
+ * added around them and then removed, and reports whether they survived */
+static Json::Value stable_references(Json::ArrayIndex count)
+{
+    Json::Value object(Json::objectValue), array(Json::arrayValue);
+    Json::Value &member = object["m"];
+    Json::Value &element = array[count];
+    member = "member";
+    element = "element";
+
+    for (Json::ArrayIndex i = 0; i < count; i++)
+    {
+        char name[16];
+        snprintf(name, sizeof(name), "%c%u", i % 2 ? 'a' : 'z', i);
+        object[name] = i;
+        array[i] = i;
+        array.append(i);
+    }
+
+    Json::Value result(Json::objectValue);
+    result["member"] = &object["m"] == &member && member == "member";
+    result["element"] = &array[count] == &element && element == "element";
+
+    for (Json::ArrayIndex i = 0; i < count; i++)
+    {
+        char name[16];
+        snprintf(name, sizeof(name), "%c%u", i % 2 ? 'a' : 'z', i);
+        object.removeMember(name);
+    }
+    object["n"] = "after";
+
+    result["after_remove"] = &object["m"] == &member && member == "member";
+    result["size"] = object.size();
+    return result;
+}
+
+/* Interns names, then parses text, and reports which of its members
+ * share the interned copy of their name */
+static Json::Value interned_keys(const string &text, const Json::Value &names)
+{
+    for (Json::ArrayIndex i = 0; i < names.size(); i++)
+        Json::internKey(names[i].asCString());
+
+    Json::Value doc = parse(text);
+    const Json::Value &members = doc;
+    Json::Value result(Json::objectValue);
+
+    for (Json::Value::const_iterator it = members.begin();
+         it != members.end(); it++)
+    {
+        const char *name = it.memberName();
+        result[name] = name == Json::findInternedKey(name);
+    }
+
+    /* Lookups with a handle work whether or not the name was interned */
+    Json::InternedKey key_handle("handle");
+    doc[key_handle] = "set with a handle";
+    result["handle"] = doc["handle"];
+    return result;
+}
+
+/* Moves doc through construction and assignment, and moves its members
+ * out through an assigned (not copy constructed) iterator */
+static Json::Value move_values(const Json::Value &doc)
+{
+    Json::Value container(doc);
+    Json::Value members(Json::arrayValue);
+    Json::Value::iterator it;
+
+    for (it = container.begin(); it != container.end(); it++)
+        members.append(std::move(*it));
+
+    Json::Value original(doc);
+    Json::Value moved(std::move(original));
+    Json::Value assigned(Json::arrayValue);
+    assigned.append("replaced");
+    assigned = std::move(moved);
+
+    Json::Value result(Json::objectValue);
+    result["left_null"] = original.isNull() && moved.isNull();
+    result["value"] = assigned;
+    result["members"] = members;
+    return result;
+}
+
+/* Writes each of docs into one reused buffer, and checks that every one
+ * comes out as write() would have written it */
+static string write_appending(const Json::Value &docs)
+{
+    Json::FastWriter writer;
+    string out("[");
+
+    for (Json::ArrayIndex i = 0; i < docs.size(); i++)
+    {
+        const size_t start = out.size();
+        writer.write(docs[i], out);
+
+        string expect = writer.write(docs[i]);
+        expect.erase(expect.size() - 1);
+
+        if (out.compare(start, string::npos, expect) != 0)
+            throw runtime_error("Appended document differs");
+
+        out += i + 1 < docs.size() ? "," : "]";
+    }
+
+    return out;
+}
+
+static string format_double(double value)
+{
+    char buffer[Json::doubleToCharsBufferSize];
+    return string(buffer, Json::valueToChars(value, buffer));
+}
+
+static unsigned long long xorshift(unsigned long long &state)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+/* The fewest significant digits that read back as value */
+static int shortest_digits(double value)
+{
+    char buffer[32];
+
+    for (int precision = 1; precision < 17; precision++)
+    {
+        snprintf(buffer, sizeof(buffer), "%.*e", precision - 1, value);
+        if (strtod(buffer, NULL) == value)
+            return precision;
+    }
+
+    return 17;
+}
+
+static int significant_digits(const string &text)
+{
+    string digits;
+
+    for (size_t i = 0; i < text.size() && text[i] != 'e'; i++)
+        if (text[i] >= '0' && text[i] <= '9')
+            digits += text[i];
+
+    size_t first = digits.find_first_not_of('0');
+    if (first == string::npos)
+        return 1;
+
+    return digits.find_last_not_of('0') - first + 1;
+}
+
+/* Formats count random doubles (half arbitrary bit patterns, half
+ * coordinates with a few decimal places), and checks that each reads
+ * back exactly, with Json::Reader and with strtod */
+static Json::Value double_roundtrip(int count, unsigned long long seed)
+{
+    Json::Value result(Json::objectValue);
+    int mismatched = 0, longer = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        double value;
+        unsigned long long bits = xorshift(seed);
+
+        if (i % 2)
+        {
+            memcpy(&value, &bits, sizeof(value));
+            if (value != value || value - value != 0)
+                continue;
+        }
+        else
+        {
+            char text[32];
+            snprintf(text, sizeof(text), "%d.%0*d", int(bits % 360) - 180,
+                     int(bits >> 40) % 6 + 1, int((bits >> 16) % 1000000));
+            value = strtod(text, NULL);
+        }
+
+        string text = format_double(value);
+
+        Json::Reader reader;
+        Json::Value parsed;
+        bool ok = reader.parse("[" + text + "]", parsed, false);
+
+        double back = ok ? parsed[0u].asDouble() : 0;
+        double back_strtod = strtod(text.c_str(), NULL);
+
+        if (!ok || !parsed[0u].isDouble() ||
+            memcmp(&value, &back, sizeof(value)) != 0 ||
+            memcmp(&value, &back_strtod, sizeof(value)) != 0)
+        {
+            mismatched++;
+            if (!result.isMember("first_mismatch"))
+                result["first_mismatch"] = text;
+        }
+
+        if (significant_digits(text) > shortest_digits(value))
+            longer++;
+    }
+
+    result["checked"] = count;
+    result["mismatched"] = mismatched;
+    result["longer"] = longer;
+    return result;
+}
+
+void handle_command(const Json::Value &command)
+{
+    string command_name = command[0u].asString();
+
+    try
+    {
+        if (command_name == "arena_roundtrip")
+            reply("return", arena_roundtrip(command[1u].asString()));
+        else if (command_name == "reader_parse")
+            reply("return", reader_parse(command[1u].asString()));
+        else if (command_name == "member_operations")
+            reply("return", member_operations(command[1u]));
+        else if (command_name == "stable_references")
+            reply("return", stable_references(command[1u].asUInt()));
+        else if (command_name == "interned_keys")
+            reply("return", interned_keys(command[1u].asString(),
+                                          command[2u]));
+        else if (command_name == "move_values")
+            reply("return", move_values(command[1u]));
+        else if (command_name == "write_appending")
+            reply("return", write_appending(command[1u]));
+        else if (command_name == "format_double")
+            reply("return", format_double(command[1u].asDouble()));
+        else if (command_name == "double_roundtrip")
+            reply("return", double_roundtrip(command[1u].asInt(),
+                                             command[2u].asLargestUInt()));
+        else
+            throw runtime_error("Command not found");
+    }
+    catch (exception &e)
+    {
+        reply("exception", e.what());
+    }
+}
+
+static double seconds()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Something like the response to the flights view */
+static string flights_response(int rows)
+{
+    ostringstream s;
+    s << "{\"total_rows\": " << rows << ", \"offset\": 0, \"rows\": [";
+
+    for (int i = 0; i < rows; i++)
+    {
+        if (i)
+            s << ",";
+
+        s << "{\"id\": \"" << hex << i * 7919 << dec << "\", "
+          << "\"key\": [1344457836, 1344544236, \"flight\", " << i << "], "
+          << "\"value\": null, \"doc\": {"
+          << "\"_id\": \"" << hex << i * 7919 << dec << "\", "
+          << "\"type\": \"payload_configuration\", "
+          << "\"name\": \"Payload " << i << "\", "
+          << "\"time_created\": \"2012-08-08T21:30:36+01:00\", "
+          << "\"sentences\": [{\"protocol\": \"UKHAS\", "
+          << "\"callsign\": \"PAYLOAD" << i << "\", "
+          << "\"checksum\": \"crc16-ccitt\", \"fields\": ["
+          << "{\"name\": \"sentence_id\", \"sensor\": \"base.ascii_int\"}, "
+          << "{\"name\": \"time\", \"sensor\": \"stdtelem.time\"}, "
+          << "{\"name\": \"latitude\", \"sensor\": \"stdtelem.coordinate\", "
+          << "\"format\": \"dd.dddd\"}, "
+          << "{\"name\": \"longitude\", \"sensor\": \"stdtelem.coordinate\", "
+          << "\"format\": \"dd.dddd\"}, "
+          << "{\"name\": \"altitude\", \"sensor\": \"base.ascii_int\"}"
+          << "]}]}}";
+    }
+
+    s << "]}";
+    return s.str();
+}
+
+static void benchmark_parse(const string &text, bool use_arena)
+{
+    const int iterations = 20;
+    Json::Arena arena;
+    size_t members = 0;
+
+    double start = seconds();
+
+    for (int i = 0; i < iterations; i++)
+    {
+        Json::Arena::Scope scope(use_arena ? &arena : NULL);
+
+        {
+            Json::Value doc = parse(text);
+            members += doc["rows"].size();
+        }
+
+        arena.reset();
+    }
+
+    double elapsed = seconds() - start;
+
+    cout << "parse and free flights (" << text.length() << " bytes), "
+         << (use_arena ? "arena" : "heap") << ": "
+         << (elapsed * 1e3 / iterations) << " ms"
+         << " (" << members << ")" << endl;
+}
+
+static void benchmark_build(bool use_arena)
+{
+    const int iterations = 200000;
+    Json::Arena arena;
+    size_t total = 0;
+
+    double start = seconds();
+
+    for (int i = 0; i < iterations; i++)
+    {
+        Json::Arena::Scope scope(use_arena ? &arena : NULL);
+
+        {
+            Json::Value doc;
+            doc["data"] = Json::Value(Json::objectValue);
+            doc["data"]["_raw"] = "JCRURVNUSU5HLDEyMywxMjozNDo1Niw1MS4xMjM0";
+            doc["receivers"] = Json::Value(Json::objectValue);
+
+            Json::Value &info = doc["receivers"]["M0RND"];
+            info["time_created"] = "2012-08-08T21:30:36+01:00";
+            info["time_uploaded"] = "2012-08-08T21:30:37+01:00";
+            info["latest_listener_information"] = "0123456789abcdef";
+            info["latest_listener_telemetry"] = "fedcba9876543210";
+
+            total += doc.size();
+        }
+
+        arena.reset();
+    }
+
+    double elapsed = seconds() - start;
+
+    cout << "build payload_telemetry doc, "
+         << (use_arena ? "arena" : "heap") << ": "
+         << (elapsed * 1e9 / iterations) << " ns"
+         << " (" << total << ")" << endl;
+}
+
+/* Coordinates and altitudes, like the numbers crude_parse produces */
+static void benchmark_format(bool use_printf)
+{
+    const int iterations = 1000000;
+    unsigned long long state = 88172645463325252ULL;
+    size_t total = 0;
+    char buffer[Json::doubleToCharsBufferSize];
+
+    double start = seconds();
+
+    for (int i = 0; i < iterations; i++)
+    {
+        double value = int(xorshift(state) % 36000000) / 100000.0 - 180;
+
+        /* What valueToString used to do, less its zero trimming */
+        if (use_printf)
+            total += snprintf(buffer, sizeof(buffer), "%#.16g", value);
+        else
+            total += Json::valueToChars(value, buffer) - buffer;
+    }
+
+    double elapsed = seconds() - start;
+
+    cout << "format double, " << (use_printf ? "printf" : "valueToChars")
+         << ": " << (elapsed * 1e9 / iterations) << " ns"
+         << " (" << total << ")" << endl;
+}
+
+void benchmark()
+{
+    string flights = flights_response(5000);
+
+    benchmark_parse(flights, false);
+    benchmark_parse(flights, true);
+    benchmark_build(false);
+    benchmark_build(true);
+    benchmark_format(true);
+    benchmark_format(false);
+}
@@ -0,0 +1,191 @@
+import subprocess
+import json
+
+
+class EqualIfIn:
+    def __init__(self, test):
+        self.test = test
+    def __eq__(self, rhs):
+        return isinstance(rhs, basestring) and self.test.lower() in rhs.lower()
+    def __repr__(self):
+        return "<EqIn " + repr(self.test) + ">"
+
+class Proxy:
+    def __init__(self, command, channels, threads):
+        self.p = subprocess.Popen(command, stdin=subprocess.PIPE,
+                                  stdout=subprocess.PIPE)
+        self._write(["init", channels, threads])
+
+    def _write(self, command):
+        self.p.stdin.write(json.dumps(command))
+        self.p.stdin.write("\n")
+
+    def push(self, channel, data):
+        self._write(["push", channel, data])
+
+    def skipped(self, channel, num):
+        self._write(["skipped", channel, num])
+
+    def set_current_payload(self, value):
+        self._write(["set_current_payload", value])
+
+    def flush(self):
+        """Returns everything output since the last flush"""
+        self._write(["flush"])
+
+        lines = []
+        while True:
+            line = self.p.stdout.readline()
+            assert line and line.endswith("\n")
+            obj = json.loads(line)
+            if obj == ["flushed"]:
+                return lines
+            lines.append(obj)
+
+    def close(self):
+        self.p.stdin.close()
+        assert self.p.stdout.read() == ""
+        assert self.p.wait() == 0
+
+def xor(string):
+    checksum = 0
+    for c in string:
+        checksum ^= ord(c)
+    return "{0:02X}".format(checksum)
+
+def sentence(channel, n):
+    data = "CH{0},{1},some,more,fields".format(channel, n)
+    return "$${0}*{1}\n".format(data, xor(data))
+
+class TestMultiChannelExtractorManager:
+    channels = 16
+    sentences = 20
+
+    def setup(self):
+        self.mgr = Proxy("tests/multichannel", self.channels, 4)
+
+    def teardown(self):
+        self.mgr.close()
+
+    def per_channel(self, lines, kind):
+        result = [[] for i in range(self.channels)]
+        for line in lines:
+            if line[0] == kind:
+                result[line[1]].append(line[2])
+        return result
+
+    def test_ordering(self):
+        # Interleave channels a few bytes at a time
+        pending = [''.join(sentence(c, n) for n in range(self.sentences))
+                   for c in range(self.channels)]
+
+        while any(pending):
+            for c in range(self.channels):
+                self.mgr.push(c, pending[c][:7])
+                pending[c] = pending[c][7:]
+
+        lines = self.mgr.flush()
+
+        data = self.per_channel(lines, "data")
+        for c in range(self.channels):
+            expect = [sentence(c, n) for n in range(self.sentences)]
+            assert [d["_sentence"] for d in data[c]] == expect
+            assert all(d["payload"] == "CH{0}".format(c) for d in data[c])
+
+        uploads = [line[1] for line in lines if line[0] == "upload"]
+        assert len(uploads) == self.channels * self.sentences
+        assert sorted(uploads) == sorted(sentence(c, n)
+                                         for c in range(self.channels)
+                                         for n in range(self.sentences))
+
+    def test_channels_independent(self):
+        self.mgr.push(0, "$$CH0,half")
+        self.mgr.push(1, sentence(1, 0))
+        lines = self.mgr.flush()
+        assert self.per_channel(lines, "data")[1] == \
+                [{"_sentence": sentence(1, 0), "_parsed": True,
+                  "_basic": True, "_protocol": "UKHAS", "payload": "CH1"}]
+        assert self.per_channel(lines, "data")[0] == []
+
+        self.mgr.skipped(0, 51)
+        lines = self.mgr.flush()
+        assert self.per_channel(lines, "status")[0] == \
+                [EqualIfIn("giving up")]
+
+    def test_skipped_nothing(self):
+        s = sentence(2, 0)
+        self.mgr.push(2, s[:10])
+        self.mgr.skipped(2, 0)
+        self.mgr.push(2, s[10:])
+        lines = self.mgr.flush()
+        assert [d["_sentence"] for d in self.per_channel(lines, "data")[2]] \
+                == [s]
+
+    def test_exception_reported(self):
+        data = "THROW,1"
+        self.mgr.push(3, "$${0}*{1}\n".format(data, xor(data)))
+        self.mgr.push(3, sentence(3, 1))
+        lines = self.mgr.flush()
+        assert EqualIfIn("caught exception: upload failed") in \
+                self.per_channel(lines, "status")[3]
+        assert [d["_sentence"] for d in self.per_channel(lines, "data")[3]] \
+                == [sentence(3, 1)]
+
+    def test_busy_channel_does_not_starve(self):
+        # One pool thread, kept busy by channel 0 well after channel 1's
+        # only sentence arrives
+        self.mgr.close()
+        self.mgr = Proxy("tests/multichannel", self.channels, 1)
+
+        per_push = 15
+        batches = 100
+        for i in range(batches):
+            self.mgr.push(0, ''.join(sentence(0, i * per_push + n)
+                                     for n in range(per_push)))
+        self.mgr.push(1, sentence(1, 0))
+        for i in range(batches, 2 * batches):
+            self.mgr.push(0, ''.join(sentence(0, i * per_push + n)
+                                     for n in range(per_push)))
+
+        lines = [line for line in self.mgr.flush() if line[0] == "data"]
+        channels = [line[1] for line in lines]
+        assert channels.count(0) == 2 * batches * per_push
+        assert channels.count(1) == 1
+
+        # Channel 1 waits for the batch channel 0 was working on, not for
+        # everything channel 0 was sent after it
+        after = len(channels) - channels.index(1) - 1
+        assert after >= batches * per_push / 2
+
+    # The harness reads commands a line of 1024 bytes at a time, which is
+    # too short for a config naming every channel
+    config_channels = 4
+
+    def payload_config(self, names):
+        return {"sentences": [{"callsign": "CH{0}".format(c),
+                               "checksum": "xor",
+                               "fields": [{"name": n} for n in names]}
+                              for c in range(self.config_channels)]}
+
+    def test_payload_swapped_while_running(self):
+        configs = [self.payload_config(["n", "a", "b", "c"]),
+                   self.payload_config(["n", "x", "y", "z"])]
+
+        # Each replaces the last while the channels may still be using it
+        for n in range(self.sentences):
+            self.mgr.set_current_payload(configs[n % 2])
+            for c in range(self.config_channels):
+                self.mgr.push(c, sentence(c, n))
+
+        data = self.per_channel(self.mgr.flush(), "data")
+        for c in range(self.config_channels):
+            assert [d["n"] for d in data[c]] == \
+                    [str(n) for n in range(self.sentences)]
+            for d in data[c]:
+                assert (d.get("a"), d.get("x")) in \
+                        [("some", None), (None, "some")]
+
+        self.mgr.set_current_payload(configs[1])
+        self.mgr.push(3, sentence(3, 0))
+        data = self.per_channel(self.mgr.flush(), "data")
+        assert data[3][0]["x"] == "some" and "a" not in data[3][0]
@@ -0,0 +1,131 @@
+/* Copyright 2012 (C) Daniel Richman. License: GNU GPL 3; see LICENSE. */
+
+#include <iostream>
+#include <stdexcept>
+#include <memory>
+
+#include "jsoncpp.h"
+#include "habitat/EZ.h"
+#include "habitat/UploaderThread.h"
+#include "habitat/MultiChannelExtractor.h"
+
+using namespace std;
+
+static EZ::Mutex cout_lock;
+
+static void write(const Json::Value &a, const Json::Value &b,
+                  const Json::Value &c=Json::Value::null)
+{
+    Json::Value root(Json::arrayValue);
+    root.append(a);
+
+    if (!b.isNull())
+        root.append(b);
+    if (!c.isNull())
+        root.append(c);
+
+    Json::FastWriter writer;
+
+    EZ::MutexLock lock(cout_lock);
+    cout << writer.write(root);
+    cout.flush();
+}
+
+/* Reports uploads directly, rather than queuing them; sentences from
+ * "THROW" fail, as if the UploaderThread had thrown */
+class TestUploaderThread : public habitat::UploaderThread
+{
+public:
+    void payload_telemetry(string data, Json::Value metadata,
+                           int time_created)
+    {
+        if (data.compare(0, 7, "$$THROW") == 0)
+            throw runtime_error("upload failed");
+        write("upload", data);
+    };
+    void log(const string &message) {};
+};
+
+class JsonIOMultiChannelManager
+    : public habitat::MultiChannelExtractorManager
+{
+public:
+    JsonIOMultiChannelManager(habitat::UploaderThread &u, int channels,
+                              int threads)
+        : habitat::MultiChannelExtractorManager(u, channels, threads) {};
+    ~JsonIOMultiChannelManager() { flush(); };
+
+    void status(int channel, const string &msg)
+        { write("status", channel, msg); };
+    void data(int channel, const Json::Value &d)
+        { write("data", channel, d); };
+};
+
+int main(int argc, char **argv)
+{
+    /* Reading cin would otherwise flush cout first, and wait for a worker
+     * that is blocked writing output nobody reads until the next flush */
+    cin.tie(NULL);
+
+    TestUploaderThread thread;
+    thread.start();
+
+    unique_ptr<JsonIOMultiChannelManager> manager;
+
+    for (;;)
+    {
+        char line[1024];
+        cin.getline(line, 1024);
+
+        if (line[0] == '\0')
+            break;
+
+        Json::Reader reader;
+        Json::Value command;
+
+        if (!reader.parse(line, command, false))
+            throw runtime_error("JSON parsing failed");
+
+        if (!command.isArray() || !command[0u].isString())
+            throw runtime_error("Invalid JSON input");
+
+        string command_name = command[0u].asString();
+        const Json::Value &arg = command[1u];
+        const Json::Value &arg2 = command[2u];
+
+        if (command_name == "init")
+        {
+            manager.reset(new JsonIOMultiChannelManager(thread, arg.asInt(),
+                                                        arg2.asInt()));
+        }
+        else if (command_name == "push")
+        {
+            const string data = arg2.asString();
+            manager->push(arg.asInt(), data.data(), data.length());
+        }
+        else if (command_name == "skipped")
+        {
+            manager->skipped(arg.asInt(), arg2.asInt());
+        }
+        else if (command_name == "set_current_payload")
+        {
+            /* The channels free the old one once they're done with it */
+            manager->payload(make_shared<const Json::Value>(arg));
+        }
+        else if (command_name == "flush")
+        {
+            manager->flush();
+            write("flushed", Json::Value::null);
+        }
+        else
+        {
+            throw runtime_error("Invalid JSON input");
+        }
+    }
+
+    manager.reset();
+    thread.shutdown();
+    thread.join();
+
+    return 0;
+}
@@ -59,7 +59,10 @@ class ProxyFunctionModule(object):
                   "timestamp_to_rfc3339_utcoffset",
                   "timestamp_to_rfc3339_localoffset",
                   "now_to_rfc3339_utcoffset",
-                  "now_to_rfc3339_localoffset"]:
+                  "now_to_rfc3339_localoffset",
+                  "fuzz_rfc3339_to_timestamp",
+                  "compare_localoffset_formatter",
+                  "simulate_clock"]:
             setattr(self, n, ProxyFunction(self.p, n))
 
     def close(self, quiet=False):
@@ -182,6 +185,30 @@ class TestRFC3339toTimestamp(object):
         assert self.func("1996-12-20T00:39:57.004Z") == 851042397
 
 
+class TestRFC3339toTimestampFuzz(object):
+    # Compares the fixed position parser with the istream based one it
+    # replaced, on mutations of valid timestamps.
+    def setup(self):
+        self.mod = ProxyFunctionModule("tests/rfc3339")
+        self.fuzz = self.mod.fuzz_rfc3339_to_timestamp
+
+    def teardown(self):
+        self.mod.close()
+
+    def test_matches_reference(self):
+        for seed in range(4):
+            result = self.fuzz(seed, 50000)
+            assert result["mismatches"] == []
+            assert result["accepted"] > 1000
+
+    def test_lenient_fields(self):
+        # Quirks of the original, via istream >> int, that are preserved
+        assert self.mod.rfc3339_to_timestamp("1970-01-01T00:00:00.Z") == 0
+        assert self.mod.rfc3339_to_timestamp("1970-01-01T 1:00:00Z") == 3600
+        assert self.mod.rfc3339_to_timestamp("1970-01-01T+1:00:00Z") == 3600
+        assert self.mod.rfc3339_to_timestamp("1970-01-01T00:00:00+-0:00") == 0
+
+
 class TestTimestampToRFC3339UTCOffset(object):
     def setup(self):
         self.mod = ProxyFunctionModule("tests/rfc3339")
@@ -231,6 +258,11 @@ class TestTimestampToRFC3339UTCOffset(object):
         d = int(time.time()) - self.mod.rfc3339_to_timestamp(s)
         assert d == 0 or d == 1
 
+    def test_simulated_clock(self):
+        self.mod.simulate_clock(1344457836, 2)
+        assert self.mod.now_to_rfc3339_utcoffset() == "2012-08-08T20:30:36Z"
+        assert self.mod.now_to_rfc3339_utcoffset() == "2012-08-08T20:30:38Z"
+
 
 class TestTimestampToRFC3339LocalOffsetLondon(object):
     def setup(self):
@@ -264,6 +296,12 @@ class TestTimestampToRFC3339LocalOffsetLondon(object):
         assert self.func(1351382400) == "2012-10-28T01:00:00+01:00"
         assert self.func(1351386000) == "2012-10-28T01:00:00+00:00"
 
+    def test_formatter(self):
+        compare = self.mod.compare_localoffset_formatter
+        assert compare(1332637199 - 5000, 7, 2000) == []
+        assert compare(1351382400 - 5000, 13, 2000) == []
+        assert compare(-7728, 3600 * 24 * 3, 2000) == []
+
     def test_now(self):
         s = self.mod.now_to_rfc3339_localoffset()
         w = self.mod.rfc3339_to_timestamp(s)
@@ -305,6 +343,12 @@ class TestTimestampToRFC3339LocalOffsetNewYork(object):
         assert self.func(1352005200) == "2012-11-04T01:00:00-04:00"
         assert self.func(1352008800) == "2012-11-04T01:00:00-05:00"
 
+    def test_formatter(self):
+        compare = self.mod.compare_localoffset_formatter
+        assert compare(1331449199 - 5000, 7, 2000) == []
+        assert compare(1352005200 - 5000, 13, 2000) == []
+        assert compare(-4128, 3600 * 24 * 3, 2000) == []
+
     def test_now(self):
         s = self.mod.now_to_rfc3339_localoffset()
         w = self.mod.rfc3339_to_timestamp(s)
@@ -3,18 +3,30 @@
 #include <iostream>
 #include <stdexcept>
 #include <ctime>
+#include <cstring>
+#include <memory>
+#include <sys/time.h>
 
 #include "jsoncpp.h"
 #include "habitat/RFC3339.h"
+#include "habitat/Clock.h"
+#include "tests/test_rfc3339_reference.h"
 
 using namespace std;
 
 void handle_command(const Json::Value &command);
+void benchmark();
 
 int main(int argc, char **argv)
 {
     tzset();
 
+    if (argc > 1 && strcmp(argv[1], "benchmark") == 0)
+    {
+        benchmark();
+        return 0;
+    }
+
     for (;;)
     {
         char line[1024];
@@ -45,14 +57,250 @@ void reply(const Json::Value &arg1, const Json::Value &arg2)
     cout << writer.write(response);
 }
 
+/* A small deterministic generator, so that failures are reproducible */
+class Random
+{
+    unsigned long long state;
+
+public:
+    Random(unsigned long long seed) : state(seed * 2 + 1) {};
+
+    unsigned int next(unsigned int n)
+    {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (state >> 33) % n;
+    };
+};
+
+/* Characters that are significant to the parser, or nearly so */
+static const char fuzz_chars[] = "0123456789-+:TZ. \t\n\v\f\rtz,/x";
+
+static string fuzz_string(Random &random)
+{
+    static const char *seeds[] = {
+        "1994-03-14T17:00:00Z", "2011-06-23T17:12:00+05:21",
+        "1992-03-14T17:04:00-01:42", "2012-02-29T12:42:21Z",
+        "1996-12-19T16:39:57.1234-08:00", "2100-02-28T00:00:00.Z",
+        "0000-01-01T00:00:00+23:59", "9999-12-31T23:59:59-00:00"
+    };
+    const size_t num_seeds = sizeof(seeds) / sizeof(seeds[0]);
+
+    string s = seeds[random.next(num_seeds)];
+    unsigned int mutations = random.next(4);
+
+    for (unsigned int i = 0; i < mutations; i++)
+    {
+        size_t pos = random.next(s.length() + 1);
+        char c = fuzz_chars[random.next(sizeof(fuzz_chars) - 1)];
+
+        /* Occasionally, any (non-null) byte */
+        if (random.next(8) == 0)
+            c = 1 + random.next(255);
+
+        switch (random.next(4))
+        {
+            case 0:
+                if (pos < s.length())
+                    s[pos] = c;
+                break;
+            case 1:
+                s.insert(pos, 1, c);
+                break;
+            case 2:
+                if (pos < s.length())
+                    s.erase(pos, 1);
+                break;
+            case 3:
+                s.erase(pos);
+                break;
+        }
+    }
+
+    return s;
+}
+
+static bool parse(long long int (*function)(const string &),
+                  const string &s, long long int &result)
+{
+    try
+    {
+        result = function(s);
+        return true;
+    }
+    catch (RFC3339::InvalidFormat &e)
+    {
+        return false;
+    }
+}
+
+/* Compares rfc3339_to_timestamp with the original implementation on
+ * mutations of valid timestamps */
+static Json::Value fuzz(int seed, int iterations)
+{
+    Random random(seed);
+    Json::Value mismatches(Json::arrayValue);
+    int accepted = 0;
+
+    for (int i = 0; i < iterations; i++)
+    {
+        string s = fuzz_string(random);
+        long long int a = 0, b = 0;
+        bool a_ok = parse(RFC3339::rfc3339_to_timestamp, s, a);
+        bool b_ok = parse(RFC3339Reference::rfc3339_to_timestamp, s, b);
+
+        if (a_ok)
+            accepted++;
+
+        if ((a_ok != b_ok || a != b) && mismatches.size() < 10)
+            mismatches.append(s);
+    }
+
+    Json::Value result(Json::objectValue);
+    result["accepted"] = accepted;
+    result["mismatches"] = mismatches;
+    return result;
+}
+
+/* Formats count timestamps from start, step apart (each twice, and with
+ * some jumps back), with a single LocalOffsetFormatter, comparing it with
+ * timestamp_to_rfc3339_localoffset */
+static Json::Value compare_localoffset_formatter(long long int start,
+                                                 long long int step,
+                                                 int count)
+{
+    RFC3339::LocalOffsetFormatter formatter;
+    Json::Value mismatches(Json::arrayValue);
+    Random random(count);
+
+    for (int i = 0; i < count * 3; i++)
+    {
+        long long int timestamp = start + (i / 2) * step;
+
+        if (i % 3 == 2)
+            timestamp -= random.next(7200);
+
+        char buffer[RFC3339::LocalOffsetFormatter::BUFFER_SIZE];
+        size_t length = formatter.format(timestamp, buffer);
+        string expect = RFC3339::timestamp_to_rfc3339_localoffset(timestamp);
+
+        if ((expect != buffer || length != expect.length()) &&
+            mismatches.size() < 10)
+        {
+            Json::Value mismatch(Json::arrayValue);
+            mismatch.append((Json::Int) timestamp);
+            mismatch.append(buffer);
+            mismatch.append(expect);
+            mismatches.append(mismatch);
+        }
+    }
+
+    return mismatches;
+}
+
+static double seconds()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void benchmark_parser(const char *name,
+                             long long int (*function)(const string &))
+{
+    const string timestamps[] = {
+        "2012-08-08T21:30:36+01:00", "1996-12-19T16:39:57.1234-08:00",
+        "1994-03-14T17:00:00Z"
+    };
+    const int iterations = 1000000;
+    long long int total = 0;
+
+    double start = seconds();
+
+    for (int i = 0; i < iterations; i++)
+    {
+        long long int result;
+        if (parse(function, timestamps[i % 3], result))
+            total += result;
+    }
+
+    double elapsed = seconds() - start;
+
+    cout << name << ": " << (elapsed * 1e9 / iterations) << " ns/call"
+         << " (" << total << ")" << endl;
+}
+
+static void benchmark_formatter()
+{
+    const int iterations = 1000000;
+    const long long int start = 1344457836;
+    size_t total = 0;
+
+    double t = seconds();
+
+    for (int i = 0; i < iterations; i++)
+        total += RFC3339::timestamp_to_rfc3339_localoffset(start + i / 4)
+                    .length();
+
+    double elapsed = seconds() - t;
+    cout << "timestamp_to_rfc3339_localoffset: "
+         << (elapsed * 1e9 / iterations) << " ns/call" << endl;
+
+    RFC3339::LocalOffsetFormatter formatter;
+    char buffer[RFC3339::LocalOffsetFormatter::BUFFER_SIZE];
+
+    t = seconds();
+
+    for (int i = 0; i < iterations; i++)
+        total += formatter.format(start + i / 4, buffer);
+
+    elapsed = seconds() - t;
+    cout << "LocalOffsetFormatter::format: "
+         << (elapsed * 1e9 / iterations) << " ns/call"
+         << " (" << total << ")" << endl;
+}
+
+void benchmark()
+{
+    benchmark_formatter();
+    benchmark_parser("rfc3339_to_timestamp",
+                     RFC3339::rfc3339_to_timestamp);
+    benchmark_parser("reference rfc3339_to_timestamp",
+                     RFC3339Reference::rfc3339_to_timestamp);
+}
+
 void handle_command(const Json::Value &command)
 {
     string command_name = command[0u].asString();
     string string_arg;
     long long int int_arg = 0;
 
-    if (command_name == "validate_rfc3339" ||
-        command_name == "rfc3339_to_timestamp")
+    if (command_name == "fuzz_rfc3339_to_timestamp")
+    {
+        reply("return", fuzz(command[1u].asInt(), command[2u].asInt()));
+        return;
+    }
+    else if (command_name == "simulate_clock")
+    {
+        static unique_ptr<Clock::Simulated> clock;
+        clock.reset(new Clock::Simulated(command[1u].asInt(),
+                                         command[2u].asInt()));
+        Clock::set_source(clock.get());
+        reply("return", Json::Value::null);
+        return;
+    }
+    else if (command_name == "compare_localoffset_formatter")
+    {
+#ifdef JSON_HAS_INT64
+        long long int start = command[1u].asLargestInt();
+#else
+        long long int start = command[1u].asInt();
+#endif
+        reply("return", compare_localoffset_formatter(start,
+                    command[2u].asInt(), command[3u].asInt()));
+        return;
+    }
+    else if (command_name == "validate_rfc3339" ||
+             command_name == "rfc3339_to_timestamp")
     {
         string_arg = command[1u].asString();
     }
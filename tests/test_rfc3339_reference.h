@@ -0,0 +1,16 @@
+/* Copyright 2012 (C) Daniel Richman. License: GNU GPL 3; see LICENSE. */
+
+#ifndef HABITAT_TEST_RFC3339_REFERENCE_H
+#define HABITAT_TEST_RFC3339_REFERENCE_H
+
+#include <string>
+
+using namespace std;
+
+namespace RFC3339Reference {
+
+long long int rfc3339_to_timestamp(const string &rfc3339);
+
+} /* namespace RFC3339Reference */
+
+#endif /* HABITAT_TEST_RFC3339_REFERENCE_H */
@@ -2,6 +2,7 @@
 
 import subprocess
 import os
+import shutil
 import errno
 import fcntl
 import tempfile
@@ -56,10 +57,13 @@ class Proxy:
         self.closed = False
         self.blocking = True
 
+        if isinstance(command, basestring):
+            command = [command]
+
         if with_valgrind:
             self.xmlfile = tempfile.NamedTemporaryFile("a+b")
-            args = ("valgrind", "--quiet", "--xml=yes",
-                    "--xml-file=" + self.xmlfile.name, command)
+            args = ["valgrind", "--quiet", "--xml=yes",
+                    "--xml-file=" + self.xmlfile.name] + command
             self.p = subprocess.Popen(args, stdin=subprocess.PIPE,
                                       stdout=subprocess.PIPE)
         else:
@@ -72,15 +76,15 @@ class Proxy:
         self.re_init(callsign, couch_uri, couch_db, max_merge_attempts=None)
 
     def re_init(self, callsign, couch_uri=None, couch_db=None,
-                max_merge_attempts=None):
+                max_merge_attempts=None, warm_up=None):
         init_args = ["init", callsign]
 
-        for a in [couch_uri, couch_db, max_merge_attempts]:
+        for a in [couch_uri, couch_db, max_merge_attempts, warm_up]:
             if a is None:
                 break
             init_args.append(a)
 
-        self._proxy(init_args)
+        return self._proxy(init_args)
 
     def _write(self, command):
         s = json.dumps(command)
@@ -177,9 +181,32 @@ class Proxy:
     def payloads(self):
         return self._proxy(["payloads"])
 
+    def callsign_payloads(self, callsigns):
+        return self._proxy(["callsign_payloads", callsigns])
+
+    def replicate(self):
+        return self._proxy(["replicate"])
+
+    def page_flights(self, page_size, end_splits):
+        return self._proxy(["page_flights", page_size, end_splits])
+
+    def cache(self, filename):
+        self._write(["cache", filename])
+
+    def reconfigure(self, callsign, couch_uri, couch_db,
+                    max_merge_attempts):
+        return self._proxy(["reconfigure", callsign, couch_uri, couch_db,
+                            max_merge_attempts])
+
     def reset(self):
         return self._proxy(["reset"])
 
+    def lock_profiling(self, enable):
+        return self._proxy(["lock_profiling", enable])
+
+    def lock_stats(self):
+        return self._proxy(["lock_stats"])
+
 temp_port = 55205
 
 def next_temp_port():
@@ -294,6 +321,11 @@ class MockHTTPHandler(BaseHTTPServer.BaseHTTPRequestHandler):
         else:
             body = None
 
+        if "if_none_match" in e:
+            self.compare(e["if_none_match"],
+                         self.headers.getheader('if-none-match'),
+                         "if_none_match")
+
         if "body_json" in e:
             self.compare(e["body_json"], json.loads(body), "body_json")
         else:
@@ -315,6 +347,8 @@ class MockHTTPHandler(BaseHTTPServer.BaseHTTPRequestHandler):
             self.server.advance_time(e["advance_time_after"])
 
         self.send_response(code)
+        if "etag" in e:
+            self.send_header("ETag", e["etag"])
         self.send_header("Content-Length", str(len(content)))
         self.end_headers()
         self.wfile.write(content)
@@ -573,6 +607,47 @@ class TestCPPConnector:
         self.uploader.payload_telemetry(self.ptlm_string, self.ptlm_metadata)
         self.couchdb.check()
 
+    def test_reconfigure_keeps_state(self):
+        self.add_sample_listener_docs()
+
+        # Only max_merge_attempts changes, so the listener docs still apply
+        self.uploader.reconfigure("PROXYCALL", self.couchdb.url, "habitat", 5)
+
+        doc_ish = self.make_ptlm_doc_ish(
+            latest_listener_telemetry=self.sample_telemetry_doc_id,
+            latest_listener_information=self.sample_info_doc_id
+        )
+
+        self.expect_add_listener_update(self.ptlm_doc_id, doc_ish)
+        self.couchdb.run()
+        self.uploader.payload_telemetry(self.ptlm_string, self.ptlm_metadata)
+        self.couchdb.check()
+
+        # A new callsign: the UUIDs fetched earlier are still used (no
+        # _uuids request), but PROXYCALL's listener docs aren't
+        self.uploader.reconfigure("NEWCALL", self.couchdb.url, "habitat", 20)
+
+        telemetry_data = {"latitude": 1.0, "longitude": 2.0}
+        telemetry_doc = {
+            "_id": self.pop_uuid(),
+            "data": dict(telemetry_data, callsign="NEWCALL"),
+            "type": "listener_telemetry",
+            "time_created": self.callbacks.fake_rfc3339(0),
+            "time_uploaded": self.callbacks.fake_rfc3339(0)
+        }
+
+        doc_ish = self.make_ptlm_doc_ish(
+            latest_listener_telemetry=telemetry_doc["_id"])
+        doc_ish["receivers"]["NEWCALL"] = doc_ish["receivers"]["PROXYCALL"]
+        del doc_ish["receivers"]["PROXYCALL"]
+
+        self.expect_save_doc(telemetry_doc)
+        self.expect_add_listener_update(self.ptlm_doc_id, doc_ish)
+        self.couchdb.run()
+        self.uploader.listener_telemetry(telemetry_data)
+        self.uploader.payload_telemetry(self.ptlm_string, self.ptlm_metadata)
+        self.couchdb.check()
+
     def test_ptlm_retries_conflicts(self):
         doc_ish = self.make_ptlm_doc_ish()
 
@@ -623,6 +698,72 @@ class TestCPPConnector:
 
         self.couchdb.check()
 
+    def ptlm_expect_error(self, name, what):
+        try:
+            self.uploader.payload_telemetry(self.ptlm_string,
+                                            self.ptlm_metadata)
+        except ProxyException, e:
+            assert e.name == name and e.what.startswith(what), str(e)
+        else:
+            raise AssertionError("Did not raise " + what)
+
+    def test_circuit_breaker(self):
+        for i in xrange(5):
+            self.expect_add_listener_update(
+                self.ptlm_doc_id, self.make_ptlm_doc_ish(),
+                code=500, respond_json={"error": "down"}
+            )
+
+        self.couchdb.run()
+        for i in xrange(5):
+            self.ptlm_expect_error("runtime_error", "EZ::HTTPResponse")
+        self.couchdb.check()
+
+        # Open: fails without a request, until the cooldown is up
+        self.couchdb.run()  # expect nothing.
+        self.ptlm_expect_error("runtime_error", "CouchDB::CircuitOpen")
+        self.callbacks.advance_time(29)
+        self.ptlm_expect_error("runtime_error", "CouchDB::CircuitOpen")
+        self.couchdb.check()
+
+        # A failed probe opens it for another cooldown
+        self.callbacks.advance_time(1)
+        self.expect_add_listener_update(
+            self.ptlm_doc_id, self.make_ptlm_doc_ish(30, 30),
+            code=500, respond_json={"error": "down"}
+        )
+        self.couchdb.run()
+        self.ptlm_expect_error("runtime_error", "EZ::HTTPResponse")
+        self.ptlm_expect_error("runtime_error", "CouchDB::CircuitOpen")
+        self.couchdb.check()
+
+        # A successful one closes it
+        self.callbacks.advance_time(30)
+        for i in xrange(2):
+            self.expect_add_listener_update(
+                self.ptlm_doc_id, self.make_ptlm_doc_ish(60, 60))
+        self.couchdb.run()
+        self.uploader.payload_telemetry(self.ptlm_string, self.ptlm_metadata)
+        self.uploader.payload_telemetry(self.ptlm_string, self.ptlm_metadata)
+        self.couchdb.check()
+
+    def test_lock_stats(self):
+        self.uploader.lock_profiling(True)
+
+        self.expect_add_listener_update(self.ptlm_doc_id,
+                                        self.make_ptlm_doc_ish())
+        self.couchdb.run()
+        self.uploader.payload_telemetry(self.ptlm_string, self.ptlm_metadata)
+        self.couchdb.check()
+
+        stats = self.uploader.lock_stats()
+        self.uploader.lock_profiling(False)
+
+        uploader = stats["habitat::Uploader"]
+        assert uploader["acquisitions"] >= 1
+        assert uploader["hold_seconds"] > 0
+        assert stats["CouchDB::CircuitBreaker"]["acquisitions"] >= 2
+
     def add_mock_conflicts(self, n):
         doc_ish = self.make_ptlm_doc_ish()
 
@@ -679,7 +820,7 @@ class TestCPPConnector:
         }
         views.payload_telemetry.add_listener_update(None, req)
 
-    def test_flights(self):
+    def make_flights_view(self, count):
         rows = []
         expect_result = []
         pcfgs = []
@@ -689,7 +830,7 @@ class TestCPPConnector:
                           "type": "payload_configuration", "i": i})
         for i in xrange(20):
             pcfgs.append({"_id": "nonexistant_{0}".format(i)})
-        for i in xrange(100):
+        for i in xrange(count):
             payloads = random.sample(pcfgs, random.randint(1, 5))
             f_id = "flight_{0}".format(i)
             doc = {"_id": f_id, "type": "flight", "i": i,
@@ -717,6 +858,11 @@ class TestCPPConnector:
             doc["_payload_docs"] = expect_payloads
             expect_result.append(doc)
 
+        return rows, expect_result
+
+    def test_flights(self):
+        rows, expect_result = self.make_flights_view(100)
+
         fake_view_response = \
                 {"total_rows": len(rows), "offset": 0, "rows": rows}
 
@@ -735,6 +881,81 @@ class TestCPPConnector:
         result = self.uploader.flights()
         assert result == expect_result
 
+    def test_flights_not_cached(self):
+        rows, expect_result = self.make_flights_view(10)
+
+        fake_view_response = \
+                {"total_rows": len(rows), "offset": 0, "rows": rows}
+
+        self.callbacks.advance_time(1925)
+        view_time = self.callbacks.fake_timestamp(1925)
+        view_path = "_design/flight/_view/end_start_including_payloads"
+        options = "include_docs=true&startkey=[{0}]".format(view_time)
+
+        # The same URL twice, but the response is too big to keep
+        for i in xrange(2):
+            self.couchdb.expect_request(
+                path=self.db_path + view_path + "?" + options,
+                if_none_match=None, code=200, etag='"1"',
+                respond_json=copy.deepcopy(fake_view_response)
+            )
+        self.couchdb.run()
+
+        assert self.uploader.flights() == expect_result
+        assert self.uploader.flights() == expect_result
+
+    def test_flights_paged(self):
+        page_size = 3
+        rows, expect_result = self.make_flights_view(20)
+
+        self.uploader.page_flights(page_size, [])
+
+        self.callbacks.advance_time(1925)
+        view_time = self.callbacks.fake_timestamp(1925)
+        view_path = "_design/flight/_view/end_start_including_payloads"
+
+        def row_id(row):
+            return (row["key"], row["id"])
+
+        # Each page starts at the first row the last didn't keep, skipping
+        # the rows before it with the same (key, id)
+        start = 0
+        startkey = [view_time]
+        startkey_docid = None
+        skip = 0
+
+        while True:
+            options = "include_docs=true&limit={0}".format(page_size + 1)
+            if skip:
+                options += "&skip={0}".format(skip)
+            options += "&startkey=" + json.dumps(startkey,
+                                                 separators=(",", ":"))
+            if startkey_docid:
+                options += "&startkey_docid=" + startkey_docid
+
+            page = rows[start:start + page_size + 1]
+            self.couchdb.expect_request(
+                path=self.db_path + view_path + "?" + options,
+                code=200,
+                respond_json={"total_rows": len(rows), "offset": start,
+                              "rows": copy.deepcopy(page)}
+            )
+
+            if len(page) <= page_size:
+                break
+
+            start += page_size
+            startkey, startkey_docid = row_id(rows[start])
+            skip = 0
+            while skip < start and \
+                    row_id(rows[start - skip - 1]) == row_id(rows[start]):
+                skip += 1
+
+        self.couchdb.run()
+
+        result = self.uploader.flights()
+        assert result == expect_result
+
     def test_payloads(self):
         payloads = [{"_id": "pcfg_{0}".format(i), "a flight": i}
                   for i in xrange(100)]
@@ -756,6 +977,293 @@ class TestCPPConnector:
         result = self.uploader.payloads()
         assert result == payloads
 
+    def expect_callsign_payloads(self, callsign_ids, docs):
+        view_path = "_design/payload_configuration/_view/" \
+                    "callsign_time_created_index"
+
+        for callsign, ids in callsign_ids:
+            rows = [{"id": doc_id, "key": [callsign, 1300000000 + i, 0],
+                     "value": None} for i, doc_id in enumerate(ids)]
+            options = 'endkey=["{0}",{{}}]&startkey=["{0}"]' \
+                        .format(callsign)
+
+            self.couchdb.expect_request(
+                path=self.db_path + view_path + "?" + options,
+                code=200,
+                respond_json={"total_rows": 1000, "offset": 0,
+                              "rows": rows}
+            )
+
+        rows = []
+        keys = []
+        for doc_id, doc in docs:
+            keys.append(doc_id)
+            if doc is None:
+                rows.append({"key": doc_id, "error": "not_found"})
+            else:
+                rows.append({"id": doc_id, "key": doc_id,
+                             "value": {"rev": "1-abc"}, "doc": doc})
+
+        self.couchdb.expect_request(
+            method="POST",
+            path=self.db_path + "_all_docs?include_docs=true",
+            body_json={"keys": keys},
+            validate_body_json=False,
+            code=200,
+            respond_json={"total_rows": 1000, "offset": 0, "rows": rows}
+        )
+
+    def test_callsign_payloads(self):
+        def pcfg(i, *callsigns, **extra):
+            doc = {"_id": "pcfg_{0}".format(i),
+                   "type": "payload_configuration",
+                   "sentences": [{"callsign": c} for c in callsigns]}
+            doc.update(extra)
+            return doc
+
+        # pcfg_2 has a sentence for each callsign, but is fetched once;
+        # pcfg_gone is in the view but no longer exists
+        first = [pcfg(1, "ALPHA"), pcfg(2, "ALPHA", "BETA"), pcfg(3, "BETA")]
+        self.expect_callsign_payloads(
+            [("ALPHA", ["pcfg_1", "pcfg_2"]),
+             ("BETA", ["pcfg_2", "pcfg_3", "pcfg_gone"])],
+            [("pcfg_1", first[0]), ("pcfg_2", first[1]),
+             ("pcfg_3", first[2]), ("pcfg_gone", None)])
+        self.couchdb.run()
+
+        assert self.uploader.callsign_payloads(["ALPHA", "BETA"]) == first
+        self.couchdb.check()
+
+        # The cache is filled in place: pcfg_2 is replaced where it was,
+        # pcfg_4 appended, and the others left alone
+        new_2 = pcfg(2, "ALPHA", "BETA", changed=True)
+        new_4 = pcfg(4, "ALPHA")
+        self.expect_callsign_payloads(
+            [("ALPHA", ["pcfg_2", "pcfg_4"])],
+            [("pcfg_2", new_2), ("pcfg_4", new_4)])
+        self.couchdb.run()
+
+        result = self.uploader.callsign_payloads(["ALPHA"])
+        assert result == [first[0], new_2, first[2], new_4]
+        self.couchdb.check()
+
+        # Nothing matches: no docs to get
+        self.expect_callsign_payloads([("GAMMA", [])], [])
+        self.couchdb.expect_queue.pop()
+        self.couchdb.run()
+
+        result = self.uploader.callsign_payloads(["GAMMA"])
+        assert result == [first[0], new_2, first[2], new_4]
+        self.couchdb.check()
+
+    def test_revalidates_cached_responses(self):
+        view_path = "_design/payload_configuration/_view/name_time_created"
+        path = self.db_path + view_path + "?include_docs=true"
+
+        def response(docs):
+            rows = [{"id": doc["_id"], "key": None, "value": None,
+                     "doc": doc} for doc in docs]
+            return {"total_rows": len(rows), "offset": 0, "rows": rows}
+
+        old = [{"_id": "pcfg_{0}".format(i), "i": i} for i in xrange(10)]
+        new = old + [{"_id": "pcfg_new"}]
+
+        self.couchdb.expect_request(path=path, if_none_match=None,
+                                    code=200, etag='"1"',
+                                    respond_json=response(old))
+        self.couchdb.expect_request(path=path, if_none_match='"1"',
+                                    code=304, respond="")
+        self.couchdb.expect_request(path=path, if_none_match='"1"',
+                                    code=200, etag='"2"',
+                                    respond_json=response(new))
+        self.couchdb.expect_request(path=path, if_none_match='"2"',
+                                    code=304, respond="")
+        self.couchdb.run()
+
+        assert self.uploader.payloads() == old
+        assert self.uploader.payloads() == old
+        assert self.uploader.payloads() == new
+        assert self.uploader.payloads() == new
+
+    def test_replica(self):
+        def pcfg(i, name, time_created):
+            return {"_id": "pcfg_{0}".format(i),
+                    "type": "payload_configuration", "name": name,
+                    "time_created": self.callbacks.fake_rfc3339(time_created)}
+
+        def flight(i, start, end, payloads, approved=True):
+            return {"_id": "flight_{0}".format(i), "type": "flight",
+                    "approved": approved,
+                    "start": self.callbacks.fake_rfc3339(start),
+                    "end": self.callbacks.fake_rfc3339(end),
+                    "payloads": ["pcfg_{0}".format(p) for p in payloads]}
+
+        def with_payloads(doc, pcfgs):
+            doc = copy.deepcopy(doc)
+            doc["_payload_docs"] = pcfgs
+            return doc
+
+        pcfgs = [pcfg(0, "b", 10), pcfg(1, "a", 20), pcfg(2, "a", 5)]
+        flights = [flight(0, 1000, 2000, [0]), flight(1, 900, 3000, [1, 9])]
+
+        flight_rows = []
+        for f in flights:
+            key = [f["end"], f["start"], f["_id"]]
+            flight_rows.append({"id": f["_id"], "key": key + [0],
+                                "value": None, "doc": f})
+            for p_id in f["payloads"]:
+                p = [p for p in pcfgs if p["_id"] == p_id]
+                flight_rows.append({"id": f["_id"], "key": key + [1],
+                                    "value": {"_id": p_id},
+                                    "doc": p[0] if p else None})
+
+        pcfg_rows = [{"id": p["_id"], "key": None, "value": None, "doc": p}
+                     for p in pcfgs]
+
+        self.callbacks.advance_time(1925)
+        view_time = self.callbacks.fake_timestamp(1925)
+
+        self.couchdb.expect_request(
+            path=self.db_path, code=200,
+            respond_json={"db_name": "habitat", "update_seq": 7}
+        )
+        self.couchdb.expect_request(
+            path=self.db_path +
+                "_design/payload_configuration/_view/name_time_created" +
+                "?include_docs=true",
+            code=200,
+            respond_json={"total_rows": 3, "offset": 0, "rows": pcfg_rows}
+        )
+        self.couchdb.expect_request(
+            path=self.db_path +
+                "_design/flight/_view/end_start_including_payloads" +
+                "?include_docs=true&startkey=[{0}]".format(view_time),
+            code=200,
+            respond_json={"total_rows": len(flight_rows), "offset": 0,
+                          "rows": flight_rows}
+        )
+        self.couchdb.run()
+        self.uploader.replicate()
+        self.couchdb.check()
+
+        # A new payload (referenced by flight 1, now edited); flight 0
+        # deleted. Telemetry and unapproved flights are filtered out by the
+        # server, and deletions only come down the feed of the docs we have
+        new_pcfg = pcfg(9, "c", 0)
+        new_flight_1 = flight(1, 900, 2500, [9, 1])
+        changes_path = self.db_path + "_changes?"
+
+        def feed(changes, last_seq):
+            return {"results": changes, "last_seq": last_seq}
+
+        self.couchdb.expect_request(
+            path=changes_path + "filter=_view&include_docs=true&limit=100" +
+                 "&since=7&view=flight/end_start_including_payloads",
+            code=200,
+            respond_json=feed([{"seq": 9, "id": "flight_1",
+                                "doc": new_flight_1}], 12)
+        )
+        self.couchdb.expect_request(
+            path=changes_path + "filter=_view&include_docs=true&limit=100" +
+                 "&since=7&view=payload_configuration/name_time_created",
+            code=200,
+            respond_json=feed([{"seq": 8, "id": "pcfg_9", "doc": new_pcfg}],
+                              12)
+        )
+        self.couchdb.expect_request(
+            method="POST",
+            path=changes_path + "filter=_doc_ids&include_docs=true" +
+                 "&limit=100&since=7",
+            body_json={"doc_ids": ["flight_0", "flight_1", "pcfg_0",
+                                   "pcfg_1", "pcfg_2", "pcfg_9"]},
+            validate_body_json=False,
+            code=200,
+            respond_json=feed([
+                {"seq": 8, "id": "pcfg_9", "doc": new_pcfg},
+                {"seq": 9, "id": "flight_1", "doc": new_flight_1},
+                {"seq": 10, "id": "flight_0", "deleted": True,
+                 "doc": {"_id": "flight_0", "_deleted": True}}
+            ], 12)
+        )
+        self.couchdb.run()
+        result = self.uploader.flights()
+        self.couchdb.check()
+
+        assert result == [with_payloads(new_flight_1, [new_pcfg, pcfgs[1]])]
+
+        # More new payloads than fit in a page
+        more_pcfgs = [pcfg(100 + i, "d", i) for i in xrange(101)]
+        more_changes = [{"seq": 13 + i, "id": p["_id"], "doc": p}
+                        for i, p in enumerate(more_pcfgs)]
+
+        self.couchdb.expect_request(
+            path=changes_path + "filter=_view&include_docs=true&limit=100" +
+                 "&since=12&view=flight/end_start_including_payloads",
+            code=200, respond_json=feed([], 113)
+        )
+        self.couchdb.expect_request(
+            path=changes_path + "filter=_view&include_docs=true&limit=100" +
+                 "&since=12&view=payload_configuration/name_time_created",
+            code=200, respond_json=feed(more_changes[:100], 112)
+        )
+        self.couchdb.expect_request(
+            path=changes_path + "filter=_view&include_docs=true&limit=100" +
+                 "&since=112&view=payload_configuration/name_time_created",
+            code=200, respond_json=feed(more_changes[100:], 113)
+        )
+        held = ["flight_1", "pcfg_0", "pcfg_1", "pcfg_2", "pcfg_9"]
+        held += [p["_id"] for p in more_pcfgs]
+        self.couchdb.expect_request(
+            method="POST",
+            path=changes_path + "filter=_doc_ids&include_docs=true" +
+                 "&limit=100&since=12",
+            body_json={"doc_ids": sorted(held)},
+            validate_body_json=False,
+            code=200, respond_json=feed(more_changes[:100], 112)
+        )
+        self.couchdb.expect_request(
+            method="POST",
+            path=changes_path + "filter=_doc_ids&include_docs=true" +
+                 "&limit=100&since=112",
+            body_json={"doc_ids": sorted(held)},
+            validate_body_json=False,
+            code=200, respond_json=feed(more_changes[100:], 113)
+        )
+        self.couchdb.run()
+        result = self.uploader.payloads()
+        self.couchdb.check()
+
+        assert result == [pcfgs[2], pcfgs[1], pcfgs[0], new_pcfg] + more_pcfgs
+
+        # An approved flight edited out of the view only shows up in the
+        # feed of the docs we have
+        self.couchdb.expect_request(
+            path=changes_path + "filter=_view&include_docs=true&limit=100" +
+                 "&since=113&view=flight/end_start_including_payloads",
+            code=200, respond_json=feed([], 114)
+        )
+        self.couchdb.expect_request(
+            path=changes_path + "filter=_view&include_docs=true&limit=100" +
+                 "&since=113&view=payload_configuration/name_time_created",
+            code=200, respond_json=feed([], 114)
+        )
+        self.couchdb.expect_request(
+            method="POST",
+            path=changes_path + "filter=_doc_ids&include_docs=true" +
+                 "&limit=100&since=113",
+            body_json={"doc_ids": sorted(held)},
+            validate_body_json=False,
+            code=200,
+            respond_json=feed([{"seq": 114, "id": "flight_1",
+                                "doc": flight(1, 900, 2500, [9, 1],
+                                              approved=False)}], 114)
+        )
+        self.couchdb.run()
+        result = self.uploader.flights()
+        self.couchdb.check()
+
+        assert result == []
+
 class TestCPPConnectorThreaded(TestCPPConnector):
     command = "tests/cpp_connector_threaded"
 
@@ -860,3 +1368,209 @@ class TestCPPConnectorThreaded(TestCPPConnector):
             raise AssertionError("not initialised was not thrown")
 
         self.couchdb.check()
+
+    def test_warm_up(self):
+        WARM_UP_CONNECTION = 0x01
+        WARM_UP_PAYLOADS = 0x02
+
+        payloads = [{"_id": "pcfg_{0}".format(i)} for i in xrange(3)]
+        rows = [{"id": doc["_id"], "key": None, "value": None, "doc": doc}
+                for doc in payloads]
+
+        self.expect_uuid_request()
+        self.couchdb.expect_request(
+            path=self.db_path +
+                "_design/payload_configuration/_view/name_time_created" +
+                "?include_docs=true",
+            code=200,
+            respond_json={"total_rows": 3, "offset": 0, "rows": rows}
+        )
+        self.couchdb.run()
+
+        # got_payloads, then initialised
+        result = self.uploader.re_init("PROXYCALL", self.couchdb.url,
+                                       "habitat", 20,
+                                       WARM_UP_CONNECTION | WARM_UP_PAYLOADS)
+        assert result == payloads
+        assert self.uploader.complete() is None
+        self.couchdb.check()
+
+        # The first listener doc uses a prefetched UUID
+        doc = {
+            "_id": self.pop_uuid(),
+            "time_created": self.callbacks.fake_rfc3339(0),
+            "time_uploaded": self.callbacks.fake_rfc3339(0),
+            "data": {"callsign": "PROXYCALL", "latitude": 1.0,
+                     "longitude": 2.0},
+            "type": "listener_telemetry"
+        }
+        self.expect_save_doc(doc)
+        self.couchdb.run()
+
+        doc_id = self.uploader.listener_telemetry({"latitude": 1.0,
+                                                   "longitude": 2.0})
+        assert doc_id == doc["_id"]
+        self.couchdb.check()
+
+    def test_doc_cache(self):
+        directory = tempfile.mkdtemp()
+        filename = os.path.join(directory, "docs")
+
+        try:
+            self.check_doc_cache(filename)
+        finally:
+            shutil.rmtree(directory)
+
+    def check_doc_cache(self, filename):
+        pcfg = {"_id": "pcfg_0", "type": "payload_configuration"}
+        flight = {"_id": "flight_0", "type": "flight",
+                  "payloads": ["pcfg_0"]}
+        key = ["end", "start", "flight_0"]
+        flight_rows = [{"id": "flight_0", "key": key + [0], "value": None,
+                        "doc": flight},
+                       {"id": "flight_0", "key": key + [1],
+                        "value": {"_id": "pcfg_0"}, "doc": pcfg}]
+        pcfg_rows = [{"id": "pcfg_0", "key": None, "value": None,
+                      "doc": pcfg}]
+
+        flights_path = self.db_path + \
+                "_design/flight/_view/end_start_including_payloads" + \
+                "?include_docs=true&startkey=[{0}]".format(
+                        self.callbacks.fake_timestamp(0))
+        payloads_path = self.db_path + \
+                "_design/payload_configuration/_view/name_time_created" + \
+                "?include_docs=true"
+
+        expect_flights = [dict(flight, _payload_docs=[pcfg])]
+        expect_payloads = [pcfg]
+
+        # No file yet: nothing to load, so just fetch them and save
+        self.couchdb.expect_request(path=flights_path, code=200,
+                respond_json={"rows": copy.deepcopy(flight_rows)})
+        self.couchdb.expect_request(path=payloads_path, code=200,
+                respond_json={"rows": copy.deepcopy(pcfg_rows)})
+        self.couchdb.run()
+
+        self.uploader.cache(filename)
+        assert self.uploader.complete() == expect_flights
+        assert self.uploader.complete() == expect_payloads
+        self.couchdb.check()
+
+        assert os.path.exists(filename)
+
+        # Restart, and load it before settings() with the database down
+        self.uploader.close()
+        self.uploader = Proxy(self.command, "PROXYCALL", self.couchdb.url,
+                              callbacks=self.callbacks)
+        self.uploader.reset()
+
+        self.couchdb.run()  # expect nothing.
+        self.uploader.cache(filename)
+        assert self.uploader.complete() == expect_flights
+        assert self.uploader.complete() == expect_payloads
+        self.couchdb.check()
+
+        # The refresh follows settings()
+        self.couchdb.expect_request(path=flights_path, code=500)
+        self.couchdb.run()
+
+        self.uploader.re_init("PROXYCALL", self.couchdb.url)
+
+        try:
+            self.uploader.complete()
+        except ProxyException as e:
+            assert "500" in str(e)
+        else:
+            raise AssertionError("refresh did not happen")
+
+        self.couchdb.check()
+
+    def test_doc_cache_warm_up(self):
+        directory = tempfile.mkdtemp()
+        filename = os.path.join(directory, "docs")
+
+        try:
+            self.check_doc_cache_warm_up(filename)
+        finally:
+            shutil.rmtree(directory)
+
+    def check_doc_cache_warm_up(self, filename):
+        WARM_UP_PAYLOADS = 0x02
+
+        pcfg = {"_id": "pcfg_0", "type": "payload_configuration"}
+        flight = {"_id": "flight_0", "type": "flight", "payloads": []}
+        flight_rows = [{"id": "flight_0", "key": ["end", "start", "flight_0",
+                        0], "value": None, "doc": flight}]
+        pcfg_rows = [{"id": "pcfg_0", "key": None, "value": None,
+                      "doc": pcfg}]
+
+        flights_path = self.db_path + \
+                "_design/flight/_view/end_start_including_payloads" + \
+                "?include_docs=true&startkey=[{0}]".format(
+                        self.callbacks.fake_timestamp(0))
+        payloads_path = self.db_path + \
+                "_design/payload_configuration/_view/name_time_created" + \
+                "?include_docs=true"
+
+        expect_flights = [dict(flight, _payload_docs=[])]
+
+        self.uploader.reset()
+        self.couchdb.run()  # expect nothing: there's no uploader yet
+        self.uploader.cache(filename)
+        self.couchdb.check()
+
+        # Warming up fetches the payloads, so the refresh that follows only
+        # fetches the flights. Every request after that is for the flights,
+        # so a second payloads request would fail (and leave the last for
+        # the flights() that reports the failure).
+        self.couchdb.expect_request(path=payloads_path, code=200,
+                respond_json={"rows": copy.deepcopy(pcfg_rows)})
+        for i in xrange(4):
+            self.couchdb.expect_request(path=flights_path, code=200,
+                    respond_json={"rows": copy.deepcopy(flight_rows)})
+        self.couchdb.run()
+
+        result = self.uploader.re_init("PROXYCALL", self.couchdb.url,
+                                       "habitat", 20, WARM_UP_PAYLOADS)
+        assert result == [pcfg]
+        assert self.uploader.complete() is None
+        assert self.uploader.complete() == expect_flights
+        for i in xrange(3):
+            assert self.uploader.flights() == expect_flights
+        self.couchdb.check()
+
+        # Queued behind saving the cache, so the file is left alone after
+        self.uploader.reset()
+
+    def test_lock_stats_count_puts_to_waiting_queue(self):
+        # The uploader thread waits in the queue's get() while these are
+        # put, which must still count as acquisitions
+        self.uploader.lock_profiling(True)
+
+        puts = 50
+        for i in xrange(puts - 1):
+            self.uploader.page_flights(0, [])
+
+        rows, expect_result = self.make_flights_view(1)
+        view_path = "_design/flight/_view/end_start_including_payloads"
+        options = "include_docs=true&startkey=[{0}]".format(
+                self.callbacks.fake_timestamp(0))
+        self.couchdb.expect_request(
+            path=self.db_path + view_path + "?" + options,
+            code=200,
+            respond_json={"total_rows": 1, "offset": 0, "rows": rows}
+        )
+        self.couchdb.run()
+
+        # Synchronous, so every put has been got
+        assert self.uploader.flights() == expect_result
+        self.couchdb.check()
+
+        stats = self.uploader.lock_stats()
+        self.uploader.lock_profiling(False)
+
+        assert stats["EZ::Queue"]["acquisitions"] >= 2 * puts
+
+class TestCPPConnectorDispatched(TestCPPConnectorThreaded):
+    # The same, with the hooks called via UploaderThread::dispatch_callbacks
+    command = ["tests/cpp_connector_threaded", "dispatch"]
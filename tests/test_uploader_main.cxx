@@ -7,6 +7,7 @@
 
 #include "habitat/EZ.h"
 #include "habitat/Uploader.h"
+#include "habitat/Clock.h"
 
 #ifdef THREADED
 #include "habitat/UploaderThread.h"
@@ -50,6 +51,8 @@ class TestUploaderThread : public habitat::UploaderThread
 
     void reset_done() { report_result("return"); };
 
+    void replicated() { report_result("return"); };
+
     void caught_exception(const habitat::NotInitialisedError &error)
         { report_result("error", "NotInitialisedError"); }
 
@@ -79,12 +82,25 @@ static r_string proxy_listener_telemetry(TestSubject *u, Json::Value command);
 static r_string proxy_payload_telemetry(TestSubject *u, Json::Value command);
 static r_json proxy_flights(TestSubject *u);
 static r_json proxy_payloads(TestSubject *u);
+static r_json proxy_callsign_payloads(TestSubject *u, Json::Value command);
+static void proxy_reconfigure(TestSubject *u, Json::Value command);
+static void proxy_page_flights(TestSubject *u, Json::Value command);
+static Json::Value lock_stats_json();
 
 static EZ::cURLGlobal cgl;
 static EZ::Mutex cout_lock;
 static SafeValue<bool> enable_callbacks(false);
 static SafeValue<int> last_time(1300000000);
 
+/* Time comes from the Python side when callbacks are enabled */
+class ProxyClock : public Clock::Source
+{
+public:
+    long long int now();
+};
+
+static ProxyClock proxy_clock;
+
 #ifdef THREADED
 static EZ::Queue<Json::Value> callback_responses;
 #endif
@@ -92,7 +108,8 @@ static EZ::Queue<Json::Value> callback_responses;
 #ifndef THREADED
 int main(int argc, char **argv)
 {
-    auto_ptr<habitat::Uploader> u;
+    unique_ptr<habitat::Uploader> u;
+    Clock::set_source(&proxy_clock);
 
     for (;;)
     {
@@ -136,6 +153,18 @@ int main(int argc, char **argv)
                 return_value = proxy_flights(u.get());
             else if (command_name == "payloads")
                 return_value = proxy_payloads(u.get());
+            else if (command_name == "callsign_payloads")
+                return_value = proxy_callsign_payloads(u.get(), command);
+            else if (command_name == "replicate")
+                u->replicate();
+            else if (command_name == "reconfigure")
+                proxy_reconfigure(u.get(), command);
+            else if (command_name == "page_flights")
+                proxy_page_flights(u.get(), command);
+            else if (command_name == "lock_profiling")
+                EZ::lock_profiling(command[1u].asBool());
+            else if (command_name == "lock_stats")
+                return_value = lock_stats_json();
             else
                 throw runtime_error("invalid command name");
 
@@ -168,8 +197,13 @@ int main(int argc, char **argv)
 #else /* defined THREADED */
 int main(int argc, char **argv)
 {
+    Clock::set_source(&proxy_clock);
     enable_callbacks.set(true);
     TestSubject thread;
+
+    if (argc > 1 && string(argv[1]) == "dispatch")
+        thread.dispatch_callbacks(true);
+
     thread.start();
 
     for (;;)
@@ -208,6 +242,27 @@ int main(int argc, char **argv)
             proxy_flights(&thread);
         else if (command_name == "payloads")
             proxy_payloads(&thread);
+        else if (command_name == "callsign_payloads")
+            proxy_callsign_payloads(&thread, command);
+        else if (command_name == "replicate")
+            thread.replicate();
+        else if (command_name == "reconfigure")
+            proxy_reconfigure(&thread, command);
+        else if (command_name == "page_flights")
+        {
+            /* Only queued: any error comes later, via caught_exception */
+            proxy_page_flights(&thread, command);
+            report_result("return");
+        }
+        else if (command_name == "cache")
+            thread.cache(command[1u].asString());
+        else if (command_name == "lock_profiling")
+        {
+            EZ::lock_profiling(command[1u].asBool());
+            report_result("return");
+        }
+        else if (command_name == "lock_stats")
+            report_result("return", lock_stats_json());
         else if (command_name == "return")
             callback_responses.put(command);
     }
@@ -219,9 +274,9 @@ int main(int argc, char **argv)
 }
 #endif
 
-time_t time(time_t *t) throw()
+long long int ProxyClock::now()
 {
-    time_t value;
+    int value;
 
     if (!enable_callbacks.get())
     {
@@ -238,10 +293,6 @@ time_t time(time_t *t) throw()
     }
 
     last_time.set(value);
-
-    if (t)
-        *t = value;
-
     return value;
 }
 
@@ -286,10 +337,13 @@ static void proxy_constructor(TestSubject *u, Json::Value command)
     const Json::Value &couch_uri = command[2u];
     const Json::Value &couch_db = command[3u];
     const Json::Value &max_merge_attempts = command[4u];
+    const Json::Value &warm_up = command[5u];
 
     /* .isString is checked when .asString is used. */
     if (!max_merge_attempts.isNull() && !max_merge_attempts.isInt())
         throw invalid_argument("max_merge_attempts");
+    if (!warm_up.isNull() && !warm_up.isInt())
+        throw invalid_argument("warm_up");
 
 #ifndef THREADED
 #define construct_it(...) do { return new TestSubject(__VA_ARGS__); } while (0)
@@ -311,11 +365,21 @@ static void proxy_constructor(TestSubject *u, Json::Value command)
         construct_it(callsign.asString(), couch_uri.asString(),
                      couch_db.asString());
     }
-    else
+    else if (warm_up.isNull())
     {
         construct_it(callsign.asString(), couch_uri.asString(),
                      couch_db.asString(), max_merge_attempts.asInt());
     }
+    else
+    {
+#ifndef THREADED
+        throw invalid_argument("warm_up is only for UploaderThread");
+#else
+        construct_it(callsign.asString(), couch_uri.asString(),
+                     couch_db.asString(), max_merge_attempts.asInt(),
+                     warm_up.asInt());
+#endif
+    }
 
 #undef construct_it
 }
@@ -327,6 +391,22 @@ static void proxy_reset(TestSubject *u)
 }
 #endif
 
+static void proxy_reconfigure(TestSubject *u, Json::Value command)
+{
+    u->reconfigure(command[1u].asString(), command[2u].asString(),
+                   command[3u].asString(), command[4u].asInt());
+}
+
+static void proxy_page_flights(TestSubject *u, Json::Value command)
+{
+    vector<long long int> end_splits;
+
+    for (Json::ArrayIndex i = 0; i < command[2u].size(); i++)
+        end_splits.push_back(command[2u][i].asInt());
+
+    u->page_flights(command[1u].asUInt(), end_splits);
+}
+
 static r_string proxy_listener_information(TestSubject *u, Json::Value command)
 {
     const Json::Value &data = command[1u];
@@ -363,20 +443,54 @@ static r_string proxy_payload_telemetry(TestSubject *u, Json::Value command)
         return u->payload_telemetry(data.asString(), metadata, tc.asInt());
 }
 
+static vector<string> callsigns_vector(const Json::Value &callsigns)
+{
+    vector<string> result;
+    for (Json::ArrayIndex i = 0; i < callsigns.size(); i++)
+        result.push_back(callsigns[i].asString());
+    return result;
+}
+
+static Json::Value lock_stats_json()
+{
+    vector<EZ::LockStats> stats = EZ::lock_stats();
+    Json::Value result(Json::objectValue);
+
+    for (size_t i = 0; i < stats.size(); i++)
+    {
+        Json::Value &lock = result[stats[i].name];
+        lock["acquisitions"] = (Json::UInt) stats[i].acquisitions;
+        lock["contentions"] = (Json::UInt) stats[i].contentions;
+        lock["wait_seconds"] = stats[i].wait_seconds;
+        lock["hold_seconds"] = stats[i].hold_seconds;
+    }
+
+    return result;
+}
+
 #ifndef THREADED
 static r_json proxy_flights(TestSubject *u)
 {
     vector<Json::Value> *result = u->flights();
-    auto_ptr< vector<Json::Value> > destroyer(result);
+    unique_ptr< vector<Json::Value> > destroyer(result);
     return vector_to_json(*result);
 }
 
 static r_json proxy_payloads(TestSubject *u)
 {
     vector<Json::Value> *result = u->payloads();
-    auto_ptr< vector<Json::Value> > destroyer(result);
+    unique_ptr< vector<Json::Value> > destroyer(result);
     return vector_to_json(*result);
 }
+
+/* Kept between calls, as UploaderThread keeps its own */
+static vector<Json::Value> callsign_payloads_cache;
+
+static r_json proxy_callsign_payloads(TestSubject *u, Json::Value command)
+{
+    u->payloads(callsigns_vector(command[1u]), callsign_payloads_cache);
+    return vector_to_json(callsign_payloads_cache);
+}
 #else /* defined THREADED */
 static r_json proxy_flights(TestSubject *u)
 {
@@ -387,6 +501,11 @@ static r_json proxy_payloads(TestSubject *u)
 {
     u->payloads();
 }
+
+static r_json proxy_callsign_payloads(TestSubject *u, Json::Value command)
+{
+    u->payloads(callsigns_vector(command[1u]));
+}
 #endif
 
 static Json::Value vector_to_json(const vector<Json::Value> &vect)